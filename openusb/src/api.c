@@ -11,6 +11,8 @@
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
 #include "usbi.h"
 
 #define USB_EP_TYPE_MASK 0x03
@@ -29,11 +31,11 @@ void openusb_coldplug_callbacks_done(openusb_handle_t handle)
 		return;
 	}
 
-	pthread_mutex_lock(&hdl->lock);
+	usbi_mutex_lock(&hdl->lock, USBI_LOCK_HANDLE);
 	while (!hdl->coldplug_complete)
-		pthread_cond_wait(&hdl->coldplug_cv, &hdl->lock);
+		usbi_cond_wait(&hdl->coldplug_cv, &hdl->lock);
 	hdl->coldplug_complete = 0;
-	pthread_mutex_unlock(&hdl->lock);
+	usbi_mutex_unlock(&hdl->lock);
 }
 
 int32_t openusb_set_configuration(openusb_dev_handle_t dev, uint8_t cfg)
@@ -70,9 +72,9 @@ int32_t openusb_get_configuration(openusb_dev_handle_t dev, uint8_t *cfg)
 	if (!hdev)
 		return OPENUSB_UNKNOWN_DEVICE;
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	ret = hdev->idev->ops->get_configuration(hdev, cfg);
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return (ret);
 }
@@ -96,7 +98,7 @@ int32_t openusb_claim_interface(openusb_dev_handle_t dev, uint8_t ifc,
 		return OPENUSB_BADARG;
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	/* check if this is a valid interface */
 	if ((ifc>= USBI_MAXINTERFACES) ||
 	    (ifc >= hdev->idev->desc.configs[hdev->idev->cur_config_index].
@@ -105,19 +107,19 @@ int32_t openusb_claim_interface(openusb_dev_handle_t dev, uint8_t ifc,
 		usbi_debug(hdev->lib_hdl, 1, "interface %d not valid",
 			ifc);
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return (OPENUSB_BADARG);
 	}
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	ret = hdev->idev->ops->claim_interface(hdev, ifc, flags);
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	if(ret == 0) {
 		hdev->claimed_ifs[ifc].clm= USBI_IFC_CLAIMED;
 		hdev->claimed_ifs[ifc].altsetting = 0; /*set to default 0 */
 	}
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 	return ret;
 }
 
@@ -138,10 +140,10 @@ int32_t openusb_release_interface(openusb_dev_handle_t dev, uint8_t ifc)
 		return OPENUSB_BADARG;
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	/* backends do NOT grab this lock again */
 	ret = hdev->idev->ops->release_interface(hdev, ifc);
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return (ret);
 }
@@ -160,12 +162,12 @@ int32_t openusb_is_interface_claimed(openusb_dev_handle_t dev, uint8_t ifc)
 		return OPENUSB_BADARG;
 	}
 	
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	if (hdev->claimed_ifs[ifc].clm == USBI_IFC_CLAIMED) {
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return 1;
 	} else {
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return 0;
 	}
 }
@@ -186,16 +188,16 @@ int32_t openusb_set_altsetting(openusb_dev_handle_t dev, uint8_t ifc,
 		return OPENUSB_BADARG;
 	}
 	
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	idev = hdev->idev;
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 	
 	/* refresh descriptors */
 	if (usbi_fetch_and_parse_descriptors(hdev) != 0) {
 		return OPENUSB_PARSE_ERROR;
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 
 	if (idev->cur_config_index < 0) {
@@ -214,20 +216,20 @@ int32_t openusb_set_altsetting(openusb_dev_handle_t dev, uint8_t ifc,
 		/* alternate counts from 0 */
 		usbi_debug(hdev->lib_hdl, 1,
 			"invalid interface(%d) or alt(%d)", ifc, alt);
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 
 		return OPENUSB_BADARG;
 	}
 
 	if (alt == hdev->claimed_ifs[ifc].altsetting) {
 		usbi_debug(hdev->lib_hdl, 1, "same alt, no need to change");
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 
 		return (0);
 	}
 
 	ret = hdev->idev->ops->set_altsetting(hdev, ifc, alt);
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return (ret);
 }
@@ -246,15 +248,15 @@ int32_t openusb_get_altsetting(openusb_dev_handle_t dev, uint8_t ifc,
 	if (!hdev)
 		return OPENUSB_UNKNOWN_DEVICE;
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	/* not claimed */
 	if (hdev->claimed_ifs[ifc].clm != USBI_IFC_CLAIMED) {
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return OPENUSB_BADARG;
 	}
 
 	idev = hdev->idev;
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return idev->ops->get_altsetting(hdev, ifc, alt);
 }
@@ -272,10 +274,14 @@ int32_t openusb_reset(openusb_dev_handle_t dev)
 		return OPENUSB_NOT_SUPPORTED;
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	/* maybe not a good idea to hold this lock */
 	ret = hdev->idev->ops->reset(hdev);
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
+
+	/* the device may come back with different strings and descriptors */
+	usbi_flush_string_cache(hdev->idev);
+	usbi_flush_desc_index(hdev->idev);
 
 	return (ret);
 }
@@ -320,7 +326,6 @@ static int32_t usbi_get_config_desc(struct usbi_dev_handle *devh, int cfg, char
 	char *newbuf;
 	int ret;
 	struct usb_config_desc cfg_desc;
-	uint32_t count;
 
 	/* The timeout has been bumped from 100ms to 1000ms to work better with */
 	/* virtual machines and finicky devices... */
@@ -332,8 +337,7 @@ static int32_t usbi_get_config_desc(struct usbi_dev_handle *devh, int cfg, char
 		return ret;
 	}
 
-	openusb_parse_data("bbw", (unsigned char *)buf, 8, &cfg_desc,
-			sizeof(cfg_desc), &count);
+	cfg_desc.wTotalLength = USBI_LE16((uint8_t *)buf + 2);
 
 	newbuf = calloc(cfg_desc.wTotalLength, 1);
 	if (!newbuf) {
@@ -406,7 +410,12 @@ static int32_t check_req_valid(openusb_request_handle_t req,
 	 * check the request for debug purpose.
 	 */
 	if (dev->lib_hdl->debug_level < 5) { 
-		if (openusb_is_interface_claimed(dev->handle, ifc) == 1) {
+		/*
+		 * claimed_ifs changes under dev->lock on claiming and releasing
+		 * only, requests read it without the lock
+		 */
+		if (ifc < USBI_MAXINTERFACES &&
+		    dev->claimed_ifs[ifc].clm == USBI_IFC_CLAIMED) {
 			return 0;
 		} else {
 			usbi_debug(dev->lib_hdl, 1, "interface %d not claimed",
@@ -526,6 +535,7 @@ int32_t openusb_xfer_wait(openusb_request_handle_t req)
 {
 	struct usbi_dev_handle *dev=NULL;
 	int32_t	io_pattern;
+	int32_t ret;
 
 	if(!req) {
 		usbi_debug(NULL, 1, "Invalid request");
@@ -541,6 +551,11 @@ int32_t openusb_xfer_wait(openusb_request_handle_t req)
 		return OPENUSB_INVALID_HANDLE;
 	}
 
+	/* scatter-gather requests are as long as their iovecs */
+	ret = usbi_req_iov_length(req);
+	if (ret != 0)
+		return ret;
+
 	/* Make sure the request is not too large (if the max size is zero then
 	 * there is no maximum size */
 	if (dev->idev->bus->max_xfer_size[req->type] != 0) {
@@ -601,13 +616,11 @@ int32_t openusb_xfer_wait(openusb_request_handle_t req)
 		return OPENUSB_BADARG;
 	}
 
-	pthread_mutex_lock(&dev->lock);
-	pthread_mutex_lock(&dev->idev->bus->lock);
+	usbi_mutex_lock(&dev->idev->bus->lock, USBI_LOCK_BUS);
 
 	io_pattern = dev->idev->bus->ops->io_pattern;
 
-	pthread_mutex_unlock(&dev->idev->bus->lock);
-	pthread_mutex_unlock(&dev->lock);
+	usbi_mutex_unlock(&dev->idev->bus->lock);
 
 	if (io_pattern < PATTERN_ASYNC || io_pattern > PATTERN_BOTH) {
 		return OPENUSB_PLATFORM_FAILURE;
@@ -733,6 +746,52 @@ int32_t openusb_isoc_xfer(openusb_dev_handle_t dev,uint8_t ifc, uint8_t ept,
 	return ret;
 }
 
+/* the packet data starts on a cache line of its own */
+#define USBI_ISOC_DATA_ALIGN	64
+
+int32_t openusb_alloc_isoc_request(uint32_t num_packets, uint32_t packet_size,
+	openusb_isoc_request_t **isoc)
+{
+	openusb_isoc_request_t *r;
+	uint64_t hdr, size;
+	uint8_t *data;
+	uint32_t i;
+
+	if (!isoc || num_packets == 0)
+		return OPENUSB_BADARG;
+
+	hdr = sizeof(*r) + (uint64_t)num_packets * (sizeof(r->pkts.packets[0]) +
+		sizeof(r->isoc_results[0]));
+	hdr = (hdr + USBI_ISOC_DATA_ALIGN - 1) & ~(uint64_t)(USBI_ISOC_DATA_ALIGN - 1);
+	size = hdr + (uint64_t)num_packets * packet_size;
+	if (size > SIZE_MAX)
+		return OPENUSB_NO_RESOURCES;
+
+	r = calloc(1, size);
+	if (!r)
+		return OPENUSB_NO_RESOURCES;
+
+	r->pkts.num_packets = num_packets;
+	r->pkts.packets = (struct openusb_isoc_packet *)(r + 1);
+	r->isoc_results = (openusb_request_result_t *)
+		(r->pkts.packets + num_packets);
+
+	data = (uint8_t *)r + hdr;
+	for (i = 0; i < num_packets; i++) {
+		r->pkts.packets[i].payload = data + (size_t)i * packet_size;
+		r->pkts.packets[i].length = packet_size;
+	}
+
+	*isoc = r;
+
+	return OPENUSB_SUCCESS;
+}
+
+void openusb_free_isoc_request(openusb_isoc_request_t *isoc)
+{
+	free(isoc);
+}
+
 
 int32_t usbi_get_xfer_timeout(openusb_request_handle_t req, 
 	struct usbi_dev_handle *dev)
@@ -760,9 +819,9 @@ int32_t usbi_get_xfer_timeout(openusb_request_handle_t req,
 	}
 
 	if(timeout == 0) {
-		pthread_mutex_lock(&dev->lib_hdl->lock);
+		usbi_mutex_lock(&dev->lib_hdl->lock, USBI_LOCK_HANDLE);
 		timeout = dev->lib_hdl->timeout[req->type];
-		pthread_mutex_unlock(&dev->lib_hdl->lock);
+		usbi_mutex_unlock(&dev->lib_hdl->lock);
 	}
 	return timeout;
 }
@@ -789,6 +848,11 @@ int32_t openusb_xfer_aio(openusb_request_handle_t req)
 		return OPENUSB_BADARG;
 	}
 
+	/* scatter-gather requests are as long as their iovecs */
+	ret = usbi_req_iov_length(req);
+	if (ret != 0)
+		return ret;
+
 	/*
 	 * Make sure the request is not too large (if the max size
 	 * is zero then there is no maximum size
@@ -850,9 +914,7 @@ int32_t openusb_xfer_aio(openusb_request_handle_t req)
 		return OPENUSB_INVALID_HANDLE;
 	}
 
-	pthread_mutex_lock(&dev->lock);
 	timeout = usbi_get_xfer_timeout(req, dev);
-	pthread_mutex_unlock(&dev->lock);
 
 	io = usbi_alloc_io(dev, req, timeout);
 
@@ -871,10 +933,7 @@ int32_t openusb_xfer_aio(openusb_request_handle_t req)
 		usbi_debug(dev->lib_hdl, 1, "async fail: %s",
 			openusb_strerror(ret));
 
-		pthread_mutex_lock(&dev->lock);
-		list_del(&io->list);	
-		pthread_mutex_unlock(&dev->lock);
-
+		/* takes it off the queue too */
 		usbi_free_io(io);
 		return ret;
 	}
@@ -934,13 +993,14 @@ int32_t openusb_wait(uint32_t num_reqs,openusb_request_handle_t *handles,
 	}
 
 waiting:
-	pthread_mutex_lock(&ph->complete_lock);
+	usbi_mutex_lock(&ph->complete_lock, USBI_LOCK_COMPLETE);
 
 	usbi_debug(ph, 4 ,"ph = %p, cv=%p, count = %d, lock=%p",ph,
 		&ph->complete_cv, ph->complete_count,&ph->complete_lock);
 
 	while (ph->complete_count == 0) {
-		pthread_cond_wait(&(ph->complete_cv), &(ph->complete_lock));
+		usbi_wait_events(&ph->complete_cv, &ph->complete_lock,
+			USBI_LOCK_COMPLETE);
 	}
 
 	list_for_each_entry(io, &ph->complete_list, list) {
@@ -969,7 +1029,7 @@ waiting:
 		usbi_debug(ph, 4, "One was completed");
 
 		*handle = io->req;
-		pthread_mutex_unlock(&ph->complete_lock);
+		usbi_mutex_unlock(&ph->complete_lock);
 		usbi_free_io(io);
 		return 0;
 
@@ -984,7 +1044,7 @@ waiting:
 		 */
 		ph->complete_count--; 
 
-		pthread_mutex_unlock(&ph->complete_lock);
+		usbi_mutex_unlock(&ph->complete_lock);
 		goto waiting;
 	}
 }
@@ -1016,15 +1076,14 @@ int32_t openusb_poll(uint32_t num_reqs,openusb_request_handle_t * handles,
 		return OPENUSB_BADARG;
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	/* set on open, doesn't change */
 	ph = hdev->lib_hdl;
-	pthread_mutex_unlock(&hdev->lock);
 
 	if(!ph) {
 		return OPENUSB_BADARG;
 	}
 
-	pthread_mutex_lock(&ph->complete_lock);
+	usbi_mutex_lock(&ph->complete_lock, USBI_LOCK_COMPLETE);
 	list_for_each_entry(io,&ph->complete_list,list) {
 	/* safe */
 		if (io) {
@@ -1060,7 +1119,7 @@ int32_t openusb_poll(uint32_t num_reqs,openusb_request_handle_t * handles,
 		*handle = NULL;
 	}
 
-	pthread_mutex_unlock(&ph->complete_lock);
+	usbi_mutex_unlock(&ph->complete_lock);
 
 	return 0;
 }
@@ -1207,7 +1266,7 @@ static int process_multi_request(void *arg)
 	}
 
 loop:
-	pthread_mutex_lock(&mi_req->lock);
+	usbi_mutex_lock(&mi_req->lock, USBI_LOCK_MULTI);
 
 	if (type == USB_TYPE_BULK) {
 		req_num = mh->req.bulk->num_bufs;
@@ -1229,7 +1288,7 @@ loop:
 		req = calloc(sizeof(struct openusb_request_handle), 1);
 		if (!req) {
 			usbi_debug(hdev->lib_hdl, 1, "No resources");
-			pthread_mutex_unlock(&mi_req->lock);
+			usbi_mutex_unlock(&mi_req->lock);
 			return OPENUSB_NO_RESOURCES;
 		}
 
@@ -1239,7 +1298,7 @@ loop:
 		args = calloc(sizeof(struct usbi_multi_req_args), 1);
 		if (!args) {
 			usbi_debug(hdev->lib_hdl, 1, "No resources");
-			pthread_mutex_unlock(&mi_req->lock);
+			usbi_mutex_unlock(&mi_req->lock);
 			return OPENUSB_NO_RESOURCES;
 		}
 
@@ -1272,7 +1331,7 @@ loop:
 			/* submit all the request buffers */
 			bulk = calloc(sizeof(*bulk), 1);
 			if (!bulk) {
-				pthread_mutex_unlock(&mi_req->lock);
+				usbi_mutex_unlock(&mi_req->lock);
 				return OPENUSB_NO_RESOURCES;
 			}
 
@@ -1286,9 +1345,9 @@ loop:
 			req->req.bulk = bulk;
 
 			/* do not hold this lock for a long time*/
-			pthread_mutex_unlock(&mi_req->lock);
+			usbi_mutex_unlock(&mi_req->lock);
 			openusb_xfer_aio(req);
-			pthread_mutex_lock(&mi_req->lock);
+			usbi_mutex_lock(&mi_req->lock, USBI_LOCK_MULTI);
 
 			m_bulk->rp++; /* move rp forward */
 
@@ -1300,7 +1359,7 @@ loop:
 
 			intr = calloc(sizeof(*intr), 1);
 			if (!intr) {
-				pthread_mutex_unlock(&mi_req->lock);
+				usbi_mutex_unlock(&mi_req->lock);
 				return OPENUSB_NO_RESOURCES;
 			}
 
@@ -1316,13 +1375,13 @@ loop:
 			req->req.intr = intr;
 
 			
-			pthread_mutex_unlock(&mi_req->lock);
+			usbi_mutex_unlock(&mi_req->lock);
 			ret = openusb_xfer_aio(req);
-			pthread_mutex_lock(&mi_req->lock);
+			usbi_mutex_lock(&mi_req->lock, USBI_LOCK_MULTI);
 
 			if (ret != 0) {
 				usbi_debug(hdev->lib_hdl, 1, "intr aio fail");
-				pthread_mutex_unlock(&mi_req->lock);
+				usbi_mutex_unlock(&mi_req->lock);
 				return ret;
 			}
 
@@ -1338,7 +1397,7 @@ loop:
 			isoc = calloc(sizeof(*isoc), 1);
 			if (!isoc) {
 				free(req);
-				pthread_mutex_unlock(&mi_req->lock);
+				usbi_mutex_unlock(&mi_req->lock);
 				return OPENUSB_NO_RESOURCES;
 			}
 
@@ -1349,14 +1408,14 @@ loop:
 
 			req->req.isoc = isoc;
 
-			pthread_mutex_unlock(&mi_req->lock);
+			usbi_mutex_unlock(&mi_req->lock);
 			openusb_xfer_aio(req);
-			pthread_mutex_lock(&mi_req->lock);
+			usbi_mutex_lock(&mi_req->lock, USBI_LOCK_MULTI);
 
 			m_isoc->rp++; /* move rp forward */
 
 		} else {
-			pthread_mutex_unlock(&mi_req->lock);
+			usbi_mutex_unlock(&mi_req->lock);
 			return(OPENUSB_BADARG);
 		}
 	}
@@ -1364,7 +1423,7 @@ loop:
 	mi_req->flag = USBI_MREQ_NO_NEW_BUF; /* clear flag */
 
 	while(mi_req->flag == USBI_MREQ_NO_NEW_BUF) {
-		pthread_cond_wait(&mi_req->cv,&mi_req->lock);
+		usbi_cond_wait(&mi_req->cv,&mi_req->lock);
 	}
 
 	/* this request is stopped. free its resouces and exit this thread */
@@ -1373,21 +1432,21 @@ loop:
 
 		list_for_each_entry_safe(pargs, tmp, &mi_req->req_head, list) {
 			if (pargs) {
-				pthread_mutex_unlock(&mi_req->lock);
+				usbi_mutex_unlock(&mi_req->lock);
 				openusb_abort(pargs->req);
-				pthread_mutex_lock(&mi_req->lock);
+				usbi_mutex_lock(&mi_req->lock, USBI_LOCK_MULTI);
 				free(pargs->req); /*FIXME: should be here ??? */
 				free(pargs);
 			}
 		}
 
-		pthread_mutex_unlock(&mi_req->lock);
+		usbi_mutex_unlock(&mi_req->lock);
 		free(mi_req);
 
 		return (0);
 	}
 
-	pthread_mutex_unlock(&mi_req->lock);
+	usbi_mutex_unlock(&mi_req->lock);
 	goto loop;
 }
 
@@ -1457,9 +1516,9 @@ int32_t openusb_start(openusb_multi_request_handle_t handle)
 	pthread_create(&thread, NULL,(void*) process_multi_request,
 		(void *)mi_req);
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	list_add(&mi_req->list, &hdev->m_head);
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 	
 	usbi_debug(hdev->lib_hdl, 4, "End");
 	return ret;
@@ -1479,7 +1538,7 @@ static int32_t usbi_add_or_stop(openusb_multi_request_handle_t handle, int flag)
 		return OPENUSB_BADARG;
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	mreq = NULL;
 	list_for_each_entry(mreq, &hdev->m_head, list) {
 	/* safe */
@@ -1487,17 +1546,17 @@ static int32_t usbi_add_or_stop(openusb_multi_request_handle_t handle, int flag)
 			break;
 		}
 	}
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	if (!mreq) {
 		/* must call openusb_start first */
 		return OPENUSB_INVALID_HANDLE;
 	}
 
-	pthread_mutex_lock(&mreq->lock);
+	usbi_mutex_lock(&mreq->lock, USBI_LOCK_MULTI);
 	pthread_cond_signal(&mreq->cv);
 	mreq->flag = flag;
-	pthread_mutex_unlock(&mreq->lock);
+	usbi_mutex_unlock(&mreq->lock);
 
 	return 0;
 }
@@ -1519,3 +1578,832 @@ int32_t openusb_stop(openusb_multi_request_handle_t handle)
 {
 	return (usbi_add_or_stop(handle, USBI_MREQ_STOPPED));
 }
+
+/*
+ * Isochronous streams
+ *
+ * Each request of a stream has a slot with its own request handle. The
+ * I/O is submitted straight to the backend and completes through the
+ * internal callback, never on the handle's completion list, so the slot
+ * is resubmitted from the completion itself while the stream's other
+ * requests keep the endpoint busy.
+ */
+struct usbi_isoc_slot {
+	struct openusb_request_handle	req;
+	struct usbi_isoc_stream		*stream;
+	uint32_t			idx;
+};
+
+struct usbi_isoc_stream {
+	struct usbi_dev_handle		*hdev;
+	openusb_isoc_stream_callback_t	cb;
+	void				*arg;
+
+	pthread_mutex_t			lock;	/* stopping, active */
+	pthread_cond_t			cv;	/* signaled as slots retire */
+	int				stopping;
+	uint32_t			active;	/* slots in flight */
+
+	uint32_t			num;
+	struct usbi_isoc_slot		*slots;
+};
+
+static void usbi_stream_complete(struct usbi_io *io, int32_t status);
+
+/* queue the request of a slot, caller holds the stream lock */
+static int32_t usbi_stream_submit(struct usbi_isoc_slot *slot)
+{
+	openusb_isoc_request_t *isoc = slot->req.req.isoc;
+	struct usbi_io *io;
+	int32_t ret;
+
+	memset(isoc->isoc_results, 0,
+		isoc->pkts.num_packets * sizeof(isoc->isoc_results[0]));
+	isoc->isoc_status = 0;
+
+	io = usbi_alloc_io(slot->stream->hdev, &slot->req, 0);
+	if (!io)
+		return OPENUSB_NO_RESOURCES;
+
+	/* not USBI_ASYNC, the completion list never sees it */
+	io->callback = usbi_stream_complete;
+	io->arg = slot;
+
+	ret = usbi_async_submit(io);
+	if (ret != 0)
+		usbi_free_io(io);
+
+	return ret;
+}
+
+/* from usbi_io_complete(), the io isn't touched once this returns */
+static void usbi_stream_complete(struct usbi_io *io, int32_t status)
+{
+	struct usbi_isoc_slot *slot = io->arg;
+	struct usbi_isoc_stream *s = slot->stream;
+	openusb_isoc_request_t *isoc = slot->req.req.isoc;
+	int32_t again;
+
+	again = s->cb(s, slot->idx, isoc, s->arg) == 0;
+
+	/* the first request started the stream, the others follow it */
+	isoc->flags &= ~OPENUSB_ISOC_START_FRAME;
+
+	usbi_mutex_lock(&s->lock, USBI_LOCK_STREAM);
+	if (!again || s->stopping || usbi_stream_submit(slot) != 0) {
+		s->active--;
+		pthread_cond_broadcast(&s->cv);
+	}
+	usbi_mutex_unlock(&s->lock);
+
+	usbi_free_io(io);
+}
+
+int32_t openusb_isoc_stream_start(openusb_dev_handle_t dev, uint8_t ifc,
+	uint8_t ept, openusb_isoc_request_t **isocs, uint32_t num,
+	openusb_isoc_stream_callback_t cb, void *arg,
+	openusb_isoc_stream_t *stream)
+{
+	struct usbi_dev_handle *hdev;
+	struct usbi_isoc_stream *s;
+	struct usbi_isoc_slot *slot;
+	int32_t ret = OPENUSB_SUCCESS;
+	uint32_t i;
+
+	if (!isocs || num < 2 || !cb || !stream)
+		return OPENUSB_BADARG;
+
+	for (i = 0; i < num; i++) {
+		if (!isocs[i] || !isocs[i]->isoc_results ||
+		    !isocs[i]->pkts.num_packets)
+			return OPENUSB_BADARG;
+	}
+
+	hdev = usbi_find_dev_handle(dev);
+	if (!hdev)
+		return OPENUSB_UNKNOWN_DEVICE;
+
+	/* completions have to come back through usbi_io_complete() */
+	if (hdev->idev->bus->ops->io_pattern == PATTERN_SYNC)
+		return OPENUSB_NOT_SUPPORTED;
+
+	s = calloc(sizeof(*s), 1);
+	if (!s)
+		return OPENUSB_NO_RESOURCES;
+
+	s->slots = calloc(num, sizeof(s->slots[0]));
+	if (!s->slots) {
+		free(s);
+		return OPENUSB_NO_RESOURCES;
+	}
+
+	s->hdev = hdev;
+	s->cb = cb;
+	s->arg = arg;
+	s->num = num;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cv, NULL);
+
+	for (i = 0; i < num; i++) {
+		slot = &s->slots[i];
+		slot->stream = s;
+		slot->idx = i;
+		slot->req.dev = dev;
+		slot->req.interface = ifc;
+		slot->req.endpoint = ept;
+		slot->req.type = USB_TYPE_ISOCHRONOUS;
+		slot->req.req.isoc = isocs[i];
+
+		if (i > 0)
+			isocs[i]->flags &= ~OPENUSB_ISOC_START_FRAME;
+	}
+
+	if (check_req_valid(&s->slots[0].req, hdev) < 0) {
+		usbi_debug(hdev->lib_hdl, 1, "Not a valid request");
+		ret = OPENUSB_BADARG;
+	}
+
+	usbi_mutex_lock(&s->lock, USBI_LOCK_STREAM);
+	for (i = 0; ret == OPENUSB_SUCCESS && i < num; i++) {
+		ret = usbi_stream_submit(&s->slots[i]);
+		if (ret == OPENUSB_SUCCESS)
+			s->active++;
+	}
+	usbi_mutex_unlock(&s->lock);
+
+	if (ret != OPENUSB_SUCCESS) {
+		usbi_debug(hdev->lib_hdl, 1, "unable to start stream: %s",
+			openusb_strerror(ret));
+
+		/* takes back what did get queued */
+		openusb_isoc_stream_stop(s);
+		return ret;
+	}
+
+	*stream = s;
+
+	return OPENUSB_SUCCESS;
+}
+
+int32_t openusb_isoc_stream_stop(openusb_isoc_stream_t stream)
+{
+	struct usbi_isoc_stream *s = stream;
+	uint32_t i;
+
+	if (!s)
+		return OPENUSB_BADARG;
+
+	usbi_mutex_lock(&s->lock, USBI_LOCK_STREAM);
+	s->stopping = 1;
+	usbi_mutex_unlock(&s->lock);
+
+	/* nothing is resubmitted from now on, cancel what's queued */
+	for (i = 0; i < s->num; i++)
+		openusb_abort(&s->slots[i].req);
+
+	usbi_mutex_lock(&s->lock, USBI_LOCK_STREAM);
+	while (s->active)
+		usbi_wait_events(&s->cv, &s->lock, USBI_LOCK_STREAM);
+	usbi_mutex_unlock(&s->lock);
+
+	pthread_cond_destroy(&s->cv);
+	pthread_mutex_destroy(&s->lock);
+	free(s->slots);
+	free(s);
+
+	return OPENUSB_SUCCESS;
+}
+
+/*
+ * Buffered bulk OUT channels
+ *
+ * Writes are copied into the buffer being filled, which is sent when it's
+ * full or, Nagle-style, as soon as nothing else is in flight: whatever is
+ * written while a transfer is out goes in the next one, and the window
+ * closes by itself when the endpoint goes idle, without a timer. Buffers
+ * are used in turn and complete through the internal callback, like the
+ * slots of an isochronous stream.
+ */
+#define USBI_BULK_CHAN_SIZE	16384
+#define USBI_BULK_CHAN_BUFS	4
+
+struct usbi_bulk_out_buf {
+	struct openusb_request_handle	req;
+	openusb_bulk_request_t		bulk;	/* length is the fill level */
+	struct usbi_bulk_out		*chan;
+	int				busy;	/* in flight */
+};
+
+struct usbi_bulk_out {
+	struct usbi_dev_handle		*hdev;
+	uint32_t			packet;		/* wMaxPacketSize */
+	uint32_t			buf_size;	/* whole packets */
+	uint32_t			timeout;
+	uint32_t			flags;
+
+	pthread_mutex_t			lock;	/* everything below */
+	pthread_cond_t			cv;	/* signaled as buffers return */
+	uint32_t			fill;	/* buffer being filled */
+	uint32_t			active;	/* buffers in flight */
+	uint32_t			last;	/* length of the last transfer */
+	int32_t				error;	/* first failure, until reported */
+
+	uint32_t			num;
+	struct usbi_bulk_out_buf	*bufs;
+	uint8_t				*data;
+};
+
+static void usbi_bulk_out_complete(struct usbi_io *io, int32_t status);
+
+/*
+ * The transfer size of a bulk channel, whole packets so that only the end
+ * of a message is short and IN transfers can't overflow, and no more than
+ * the backend takes in one request
+ */
+static uint32_t usbi_bulk_chan_size(struct usbi_dev_handle *hdev, uint8_t ifc,
+	uint8_t ept, uint32_t buf_size, uint32_t *packet)
+{
+	uint32_t max;
+
+	*packet = usbi_ep_max_packet(hdev, ifc, ept);
+	if (!*packet)
+		*packet = 512;
+
+	if (!buf_size)
+		buf_size = USBI_BULK_CHAN_SIZE;
+	max = hdev->idev->bus->max_xfer_size[USB_TYPE_BULK];
+	if (max && buf_size > max)
+		buf_size = max;
+	buf_size -= buf_size % *packet;
+
+	return buf_size ? buf_size : *packet;
+}
+
+/* send the buffer being filled and move on to the next, lock held */
+static void usbi_bulk_out_send(struct usbi_bulk_out *c)
+{
+	struct usbi_bulk_out_buf *buf = &c->bufs[c->fill];
+	struct usbi_io *io;
+	int32_t ret = OPENUSB_NO_RESOURCES;
+
+	io = usbi_alloc_io(c->hdev, &buf->req, c->timeout);
+	if (io) {
+		/* not USBI_ASYNC, the completion list never sees it */
+		io->callback = usbi_bulk_out_complete;
+		io->arg = buf;
+
+		ret = usbi_async_submit(io);
+		if (ret != 0)
+			usbi_free_io(io);
+	}
+
+	if (ret != 0) {
+		/* the data is lost, the next call says so */
+		if (!c->error)
+			c->error = ret;
+		buf->bulk.length = 0;
+		return;
+	}
+
+	buf->busy = 1;
+	c->active++;
+	c->last = buf->bulk.length;
+	c->fill = (c->fill + 1) % c->num;
+}
+
+/* from usbi_io_complete(), the io isn't touched once this returns */
+static void usbi_bulk_out_complete(struct usbi_io *io, int32_t status)
+{
+	struct usbi_bulk_out_buf *buf = io->arg;
+	struct usbi_bulk_out *c = buf->chan;
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	if (status != OPENUSB_SUCCESS && !c->error)
+		c->error = status;
+
+	buf->busy = 0;
+	buf->bulk.length = 0;
+	c->active--;
+
+	/* the endpoint went idle, send what was written meanwhile */
+	if (!c->active && c->bufs[c->fill].bulk.length)
+		usbi_bulk_out_send(c);
+
+	pthread_cond_broadcast(&c->cv);
+	usbi_mutex_unlock(&c->lock);
+
+	usbi_free_io(io);
+}
+
+int32_t openusb_bulk_out_open(openusb_dev_handle_t dev, uint8_t ifc,
+	uint8_t ept, uint32_t buf_size, uint32_t num_bufs, uint32_t timeout,
+	uint32_t flags, openusb_bulk_out_t *chan)
+{
+	struct usbi_dev_handle *hdev;
+	struct usbi_bulk_out *c;
+	struct usbi_bulk_out_buf *buf;
+	uint32_t i;
+
+	if (!chan || (ept & USB_ENDPOINT_DIR_MASK))
+		return OPENUSB_BADARG;
+
+	hdev = usbi_find_dev_handle(dev);
+	if (!hdev)
+		return OPENUSB_UNKNOWN_DEVICE;
+
+	/* completions have to come back through usbi_io_complete() */
+	if (hdev->idev->bus->ops->io_pattern == PATTERN_SYNC)
+		return OPENUSB_NOT_SUPPORTED;
+
+	c = calloc(sizeof(*c), 1);
+	if (!c)
+		return OPENUSB_NO_RESOURCES;
+
+	c->hdev = hdev;
+	c->timeout = timeout;
+	c->flags = flags;
+	c->num = num_bufs ? num_bufs : USBI_BULK_CHAN_BUFS;
+	c->buf_size = usbi_bulk_chan_size(hdev, ifc, ept, buf_size, &c->packet);
+
+	c->bufs = calloc(c->num, sizeof(c->bufs[0]));
+	c->data = malloc((size_t)c->num * c->buf_size);
+	if (!c->bufs || !c->data) {
+		free(c->bufs);
+		free(c->data);
+		free(c);
+		return OPENUSB_NO_RESOURCES;
+	}
+
+	for (i = 0; i < c->num; i++) {
+		buf = &c->bufs[i];
+		buf->chan = c;
+		buf->req.dev = dev;
+		buf->req.interface = ifc;
+		buf->req.endpoint = ept;
+		buf->req.type = USB_TYPE_BULK;
+		buf->req.req.bulk = &buf->bulk;
+		buf->bulk.payload = c->data + (size_t)i * c->buf_size;
+		buf->bulk.timeout = timeout;
+	}
+
+	if (check_req_valid(&c->bufs[0].req, hdev) < 0) {
+		usbi_debug(hdev->lib_hdl, 1, "Not a valid request");
+		free(c->bufs);
+		free(c->data);
+		free(c);
+		return OPENUSB_BADARG;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cv, NULL);
+
+	*chan = c;
+
+	return OPENUSB_SUCCESS;
+}
+
+int32_t openusb_bulk_out_write(openusb_bulk_out_t chan, const uint8_t *data,
+	uint32_t len)
+{
+	struct usbi_bulk_out *c = chan;
+	struct usbi_bulk_out_buf *buf;
+	uint32_t n;
+	int32_t ret;
+
+	if (!c || (!data && len))
+		return OPENUSB_BADARG;
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	while (len) {
+		buf = &c->bufs[c->fill];
+
+		/* every buffer is out, wait for the oldest */
+		if (buf->busy) {
+			usbi_wait_events(&c->cv, &c->lock, USBI_LOCK_CHANNEL);
+			continue;
+		}
+
+		n = min(len, c->buf_size - buf->bulk.length);
+		memcpy(buf->bulk.payload + buf->bulk.length, data, n);
+		buf->bulk.length += n;
+		data += n;
+		len -= n;
+
+		if (buf->bulk.length == c->buf_size)
+			usbi_bulk_out_send(c);
+	}
+
+	/* nothing is in flight, there's no reason to wait for more */
+	if (!c->active && c->bufs[c->fill].bulk.length)
+		usbi_bulk_out_send(c);
+
+	ret = c->error;
+	c->error = 0;
+	usbi_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+int32_t openusb_bulk_out_flush(openusb_bulk_out_t chan)
+{
+	struct usbi_bulk_out *c = chan;
+	int32_t ret;
+
+	if (!c)
+		return OPENUSB_BADARG;
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+
+	/* the buffer being filled is never in flight */
+	if (c->bufs[c->fill].bulk.length)
+		usbi_bulk_out_send(c);
+
+	/* an empty buffer makes the zero length packet */
+	if ((c->flags & OPENUSB_BULK_OUT_ZLP) && c->last &&
+	    c->last % c->packet == 0) {
+		while (c->bufs[c->fill].busy)
+			usbi_wait_events(&c->cv, &c->lock, USBI_LOCK_CHANNEL);
+		usbi_bulk_out_send(c);
+	}
+
+	while (c->active)
+		usbi_wait_events(&c->cv, &c->lock, USBI_LOCK_CHANNEL);
+
+	ret = c->error;
+	c->error = 0;
+	usbi_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+int32_t openusb_bulk_out_close(openusb_bulk_out_t chan)
+{
+	struct usbi_bulk_out *c = chan;
+	int32_t ret;
+
+	if (!c)
+		return OPENUSB_BADARG;
+
+	/* nothing is in flight once it returns */
+	ret = openusb_bulk_out_flush(c);
+
+	pthread_cond_destroy(&c->cv);
+	pthread_mutex_destroy(&c->lock);
+	free(c->bufs);
+	free(c->data);
+	free(c);
+
+	return ret;
+}
+
+/*
+ * Read-ahead bulk IN channels
+ *
+ * The buffers form a ring, the multi-request rp/wp model: wp is the next
+ * one to submit and rp the next one to read from. Every buffer without
+ * unread data is in flight, reads copy out of the completed ones and each
+ * buffer emptied is submitted again right away, so the endpoint is only
+ * left idle when the application falls a whole ring behind. Transfers
+ * complete in the order they were submitted.
+ */
+struct usbi_bulk_in_buf {
+	struct openusb_request_handle	req;
+	openusb_bulk_request_t		bulk;
+	struct usbi_bulk_in		*chan;
+	int				busy;	/* in flight */
+	int				ready;	/* completed, not read yet */
+	uint32_t			len;	/* bytes received */
+	uint32_t			pos;	/* bytes read */
+};
+
+struct usbi_bulk_in {
+	struct usbi_dev_handle		*hdev;
+	uint32_t			packet;		/* wMaxPacketSize */
+	uint32_t			buf_size;	/* whole packets */
+	uint32_t			flags;
+
+	pthread_mutex_t			lock;	/* everything below */
+	pthread_cond_t			cv;	/* signaled as buffers complete */
+	uint32_t			rp;	/* next buffer to read */
+	uint32_t			wp;	/* next buffer to submit */
+	uint32_t			active;	/* buffers in flight */
+	uint32_t			level;	/* bytes received, not read */
+	int32_t				error;	/* first failure, until reported */
+	int				stopping;
+
+	uint32_t			num;
+	struct usbi_bulk_in_buf		*bufs;
+	uint8_t				*data;
+};
+
+static void usbi_bulk_in_complete(struct usbi_io *io, int32_t status);
+
+/*
+ * Submit the emptied buffers, in ring order, lock held. After a failure
+ * nothing is submitted until a read has reported it.
+ */
+static void usbi_bulk_in_fill(struct usbi_bulk_in *c)
+{
+	struct usbi_bulk_in_buf *buf;
+	struct usbi_io *io;
+	int32_t ret;
+
+	while (!c->error && !c->stopping) {
+		buf = &c->bufs[c->wp];
+		if (buf->busy || buf->ready)
+			break;
+
+		buf->bulk.length = c->buf_size;
+		memset(&buf->bulk.result, 0, sizeof(buf->bulk.result));
+
+		ret = OPENUSB_NO_RESOURCES;
+		io = usbi_alloc_io(c->hdev, &buf->req, 0);
+		if (io) {
+			/* not USBI_ASYNC, the completion list never sees it */
+			io->callback = usbi_bulk_in_complete;
+			io->arg = buf;
+
+			ret = usbi_async_submit(io);
+			if (ret != 0)
+				usbi_free_io(io);
+		}
+
+		if (ret != 0) {
+			c->error = ret;
+			break;
+		}
+
+		buf->busy = 1;
+		c->active++;
+		c->wp = (c->wp + 1) % c->num;
+	}
+}
+
+/* from usbi_io_complete(), the io isn't touched once this returns */
+static void usbi_bulk_in_complete(struct usbi_io *io, int32_t status)
+{
+	struct usbi_bulk_in_buf *buf = io->arg;
+	struct usbi_bulk_in *c = buf->chan;
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	if (status != OPENUSB_SUCCESS && !c->stopping && !c->error)
+		c->error = status;
+
+	/* whatever did arrive before a failure is still read */
+	buf->busy = 0;
+	buf->ready = 1;
+	buf->len = buf->bulk.result.transferred_bytes;
+	buf->pos = 0;
+	c->level += buf->len;
+	c->active--;
+
+	pthread_cond_broadcast(&c->cv);
+	usbi_mutex_unlock(&c->lock);
+
+	usbi_free_io(io);
+}
+
+/*
+ * Can a read of len bytes go ahead? Without OPENUSB_BULK_IN_MESSAGES, as
+ * soon as there is data. With it, once a transfer ended by a short packet
+ * has completed, or len bytes have, or the ring is full: a message longer
+ * than the ring is read in pieces of a ring each, as nothing more could
+ * arrive before it is emptied.
+ */
+static int usbi_bulk_in_avail(struct usbi_bulk_in *c, uint32_t len)
+{
+	struct usbi_bulk_in_buf *buf;
+	uint32_t i, n = 0;
+
+	for (i = 0; i < c->num; i++) {
+		buf = &c->bufs[(c->rp + i) % c->num];
+		if (!buf->ready)
+			return 0;
+
+		n += buf->len - buf->pos;
+		if (!(c->flags & OPENUSB_BULK_IN_MESSAGES) ? n > 0 :
+		    (n >= len || buf->len < c->buf_size))
+			return 1;
+	}
+
+	return n > 0;
+}
+
+int32_t openusb_bulk_in_open(openusb_dev_handle_t dev, uint8_t ifc,
+	uint8_t ept, uint32_t buf_size, uint32_t num_bufs, uint32_t flags,
+	openusb_bulk_in_t *chan)
+{
+	struct usbi_dev_handle *hdev;
+	struct usbi_bulk_in *c;
+	struct usbi_bulk_in_buf *buf;
+	int32_t ret;
+	uint32_t i;
+
+	if (!chan || !(ept & USB_ENDPOINT_DIR_MASK))
+		return OPENUSB_BADARG;
+
+	hdev = usbi_find_dev_handle(dev);
+	if (!hdev)
+		return OPENUSB_UNKNOWN_DEVICE;
+
+	/* completions have to come back through usbi_io_complete() */
+	if (hdev->idev->bus->ops->io_pattern == PATTERN_SYNC)
+		return OPENUSB_NOT_SUPPORTED;
+
+	c = calloc(sizeof(*c), 1);
+	if (!c)
+		return OPENUSB_NO_RESOURCES;
+
+	c->hdev = hdev;
+	c->flags = flags;
+	c->num = num_bufs ? num_bufs : USBI_BULK_CHAN_BUFS;
+	c->buf_size = usbi_bulk_chan_size(hdev, ifc, ept, buf_size, &c->packet);
+
+	c->bufs = calloc(c->num, sizeof(c->bufs[0]));
+	c->data = malloc((size_t)c->num * c->buf_size);
+	if (!c->bufs || !c->data) {
+		free(c->bufs);
+		free(c->data);
+		free(c);
+		return OPENUSB_NO_RESOURCES;
+	}
+
+	for (i = 0; i < c->num; i++) {
+		buf = &c->bufs[i];
+		buf->chan = c;
+		buf->req.dev = dev;
+		buf->req.interface = ifc;
+		buf->req.endpoint = ept;
+		buf->req.type = USB_TYPE_BULK;
+		buf->req.req.bulk = &buf->bulk;
+		buf->bulk.payload = c->data + (size_t)i * c->buf_size;
+	}
+
+	if (check_req_valid(&c->bufs[0].req, hdev) < 0) {
+		usbi_debug(hdev->lib_hdl, 1, "Not a valid request");
+		free(c->bufs);
+		free(c->data);
+		free(c);
+		return OPENUSB_BADARG;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cv, NULL);
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	usbi_bulk_in_fill(c);
+	ret = c->active ? OPENUSB_SUCCESS : c->error;
+	usbi_mutex_unlock(&c->lock);
+
+	if (ret != OPENUSB_SUCCESS) {
+		usbi_debug(hdev->lib_hdl, 1, "unable to start channel: %s",
+			openusb_strerror(ret));
+		openusb_bulk_in_close(c);
+		return ret;
+	}
+
+	*chan = c;
+
+	return OPENUSB_SUCCESS;
+}
+
+int32_t openusb_bulk_in_read(openusb_bulk_in_t chan, uint8_t *data,
+	uint32_t len, uint32_t timeout, uint32_t *transferred)
+{
+	struct usbi_bulk_in *c = chan;
+	struct usbi_bulk_in_buf *buf;
+	struct timespec ts;
+	uint32_t n = 0, k;
+	int32_t ret = OPENUSB_SUCCESS;
+	int end;
+
+	if (!c || (!data && len) || !transferred)
+		return OPENUSB_BADARG;
+
+	*transferred = 0;
+
+	if (timeout) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			ts.tv_sec++;
+		}
+	}
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	for (;;) {
+		/* in a byte stream empty transfers carry nothing, recycle them */
+		if (!(c->flags & OPENUSB_BULK_IN_MESSAGES)) {
+			while (c->bufs[c->rp].ready && !c->bufs[c->rp].len) {
+				c->bufs[c->rp].ready = 0;
+				c->rp = (c->rp + 1) % c->num;
+			}
+			usbi_bulk_in_fill(c);
+		}
+
+		if (usbi_bulk_in_avail(c, len) || c->error)
+			break;
+
+		if (!timeout) {
+			usbi_wait_events(&c->cv, &c->lock, USBI_LOCK_CHANNEL);
+		} else if (usbi_wait_events_until(&c->cv, &c->lock,
+		    USBI_LOCK_CHANNEL, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	if (!usbi_bulk_in_avail(c, len)) {
+		/* report a failure once the data before it is read, then restart */
+		ret = c->error ? c->error : OPENUSB_IO_TIMEOUT;
+		c->error = 0;
+		usbi_bulk_in_fill(c);
+		usbi_mutex_unlock(&c->lock);
+		return ret;
+	}
+
+	/*
+	 * Copy out of the completed buffers, in order. A transfer shorter than
+	 * the buffer ended with a short packet, with OPENUSB_BULK_IN_MESSAGES
+	 * the read ends there too. Once len is reached only an empty transfer,
+	 * the zero length packet ending the data read, is taken along
+	 */
+	for (;;) {
+		buf = &c->bufs[c->rp];
+		if (!buf->ready || (n == len && buf->pos < buf->len))
+			break;
+
+		k = min(len - n, buf->len - buf->pos);
+		memcpy(data + n, buf->bulk.payload + buf->pos, k);
+		buf->pos += k;
+		c->level -= k;
+		n += k;
+
+		if (buf->pos < buf->len)
+			break;
+
+		end = buf->len < c->buf_size;
+		buf->ready = 0;
+		c->rp = (c->rp + 1) % c->num;
+
+		if ((c->flags & OPENUSB_BULK_IN_MESSAGES) && end)
+			break;
+	}
+
+	/* the emptied buffers go straight back out */
+	usbi_bulk_in_fill(c);
+	usbi_mutex_unlock(&c->lock);
+
+	*transferred = n;
+
+	return ret;
+}
+
+int32_t openusb_bulk_in_level(openusb_bulk_in_t chan, uint32_t *level,
+	uint32_t *size)
+{
+	struct usbi_bulk_in *c = chan;
+
+	if (!c)
+		return OPENUSB_BADARG;
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	if (level)
+		*level = c->level;
+	if (size)
+		*size = c->num * c->buf_size;
+	usbi_mutex_unlock(&c->lock);
+
+	return OPENUSB_SUCCESS;
+}
+
+int32_t openusb_bulk_in_close(openusb_bulk_in_t chan)
+{
+	struct usbi_bulk_in *c = chan;
+	uint32_t i;
+
+	if (!c)
+		return OPENUSB_BADARG;
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	c->stopping = 1;
+	usbi_mutex_unlock(&c->lock);
+
+	/* nothing is submitted from now on, cancel what's in flight */
+	for (i = 0; i < c->num; i++)
+		openusb_abort(&c->bufs[i].req);
+
+	usbi_mutex_lock(&c->lock, USBI_LOCK_CHANNEL);
+	while (c->active)
+		usbi_wait_events(&c->cv, &c->lock, USBI_LOCK_CHANNEL);
+	usbi_mutex_unlock(&c->lock);
+
+	pthread_cond_destroy(&c->cv);
+	pthread_mutex_destroy(&c->lock);
+	free(c->bufs);
+	free(c->data);
+	free(c);
+
+	return OPENUSB_SUCCESS;
+}
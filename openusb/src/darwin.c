@@ -153,7 +153,7 @@ static void darwin_devices_attached (void *ptr, io_iterator_t new_devices) {
       /* old device re-inserted -- this likely can not happen */
       fprintf (stderr, "Old device reinserted\n");
       usbi_debug(NULL, 4, "old device: %d", (int)idev->devid);
-      pthread_mutex_lock(&usbi_handles.lock);
+      usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 
       list_for_each_entry_safe(handle, thdl, &usbi_handles.head, list) {
 	/* every openusb instance should get notification
@@ -163,7 +163,7 @@ static void darwin_devices_attached (void *ptr, io_iterator_t new_devices) {
 	}
       }
 
-      pthread_mutex_unlock(&usbi_handles.lock);
+      usbi_mutex_unlock(&usbi_handles.lock);
     } else {
       ibus = usbi_find_bus_by_num(location >> 24);
 
@@ -198,7 +198,7 @@ static void darwin_devices_detached (void *ptr, io_iterator_t rem_devices) {
     if (idev)
       usbi_remove_device (idev);
 
-    pthread_mutex_unlock(&usbi_devices.lock);
+    usbi_mutex_unlock(&usbi_devices.lock);
 
   }
 }
@@ -722,16 +722,16 @@ int32_t darwin_close(struct usbi_dev_handle *hdev) {
   if (!hdev)
     return OPENUSB_BADARG;
 
-  pthread_mutex_lock(&hdev->lock);
+  usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
   hdev->state = USBI_DEVICE_CLOSING;
-  pthread_mutex_unlock(&hdev->lock);
+  usbi_mutex_unlock(&hdev->lock);
 
   /* make sure the interfaces are released */
   for (i = 0 ; i < USBI_MAXINTERFACES ; i++)
     if (hdev->claimed_ifs[i].clm == USBI_IFC_CLAIMED)
       darwin_release_interface (hdev, i);
 
-  pthread_mutex_lock(&hdev->lock);
+  usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
   if (hdev && hdev->priv && hdev->priv->open) {
     /* delete the device's async event source */
     if (hdev->priv->cfSource) {
@@ -761,7 +761,7 @@ int32_t darwin_close(struct usbi_dev_handle *hdev) {
 		//"libopenusb/darwin.c darwin_close(Release)");
   	}
   }
-  pthread_mutex_unlock(&hdev->lock);
+  usbi_mutex_unlock(&hdev->lock);
 
   /* free our private data */
   if (hdev->priv) {
@@ -1154,9 +1154,12 @@ static void darwin_io_callback (void *refcon, kern_return_t result, void *io_siz
     io->status = USBI_IO_COMPLETED_FAIL;
   }
 	
-  usbi_io_complete (io, status, (size_t)io_size);
-  if (io->priv)
+  /* the request may be freed as soon as it's complete */
+  if (io->priv) {
     free (io->priv);
+    io->priv = NULL;
+  }
+  usbi_io_complete (io, status, (size_t)io_size);
 }
 
 static void darwin_isoc_callback (void *refcon, kern_return_t result, void *io_size) {
@@ -1202,7 +1205,7 @@ static void darwin_isoc_callback (void *refcon, kern_return_t result, void *io_s
     }
   }
 	
-  usbi_io_complete (io, status, (size_t)io_size);
+  /* the request may be freed as soon as it's complete */
   if (io->priv) {
     if (io->priv->isoc_buffer)
       free (io->priv->isoc_buffer);
@@ -1211,6 +1214,7 @@ static void darwin_isoc_callback (void *refcon, kern_return_t result, void *io_s
     free (io->priv);
     io->priv = NULL;
   }
+  usbi_io_complete (io, status, (size_t)io_size);
 }
 
 /*
@@ -1367,7 +1371,7 @@ int32_t darwin_submit_ctrl (struct usbi_dev_handle *hdev, struct usbi_io *io, in
     return OPENUSB_BADARG;
 
   /* lock the io while we set things up */
-  pthread_mutex_lock(&io->lock);
+  usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 
   /* get a pointer to the request */
   ctrl = io->req->req.ctrl;
@@ -1405,7 +1409,7 @@ int32_t darwin_submit_ctrl (struct usbi_dev_handle *hdev, struct usbi_io *io, in
   }
 
   /* unlock the io request */
-  pthread_mutex_unlock (&io->lock);
+  usbi_mutex_unlock(&io->lock);
 	
   if (ret) {
     usbi_debug (hdev->lib_hdl, 1,
@@ -1446,13 +1450,12 @@ int32_t darwin_submit_bulk_intr (struct usbi_dev_handle *hdev, struct usbi_io *i
     return OPENUSB_BADARG;
 
   /* lock the io while we set things up */
-  pthread_mutex_lock(&io->lock);
+  usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 
+  payload = usbi_io_payload(io);
   if (io->req->type == USB_TYPE_BULK) {
-    payload = io->req->req.bulk->payload;
     length = io->req->req.bulk->length;
   } else {
-    payload = io->req->req.intr->payload;
     length = io->req->req.intr->length;
   }		
 
@@ -1531,7 +1534,7 @@ int32_t darwin_submit_bulk_intr (struct usbi_dev_handle *hdev, struct usbi_io *i
 #endif
 
   /* unlock the io request */
-  pthread_mutex_unlock(&io->lock);
+  usbi_mutex_unlock(&io->lock);
 
   if (ret) {
     usbi_debug (hdev->lib_hdl, 1,
@@ -1572,7 +1575,7 @@ int32_t darwin_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io, int
     return OPENUSB_BADARG;
 
   /* lock the io while we set things up */
-  pthread_mutex_lock (&io->lock);
+  usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 
   /* Just for convienience */
   isoc = io->req->req.isoc;
@@ -1592,7 +1595,7 @@ int32_t darwin_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io, int
   
   io->priv->isoc_buffer = (uint8_t *) calloc (totallen, sizeof(uint8_t));
   if (!io->priv->isoc_buffer) {
-    pthread_mutex_unlock (&io->lock);
+    usbi_mutex_unlock(&io->lock);
     return OPENUSB_NO_RESOURCES;
   }
 
@@ -1609,7 +1612,7 @@ int32_t darwin_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io, int
   io->priv->isoc_framelist = (IOUSBIsocFrame*) calloc (isoc->pkts.num_packets, sizeof(IOUSBIsocFrame));
   if (!io->priv->isoc_framelist) {
     free(io->priv->isoc_buffer);
-    pthread_mutex_unlock(&io->lock);
+    usbi_mutex_unlock(&io->lock);
     return OPENUSB_NO_RESOURCES;
   }
 	
@@ -1626,7 +1629,7 @@ int32_t darwin_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io, int
     usbi_debug (hdev->lib_hdl, 1, "failed to get bus frame number: %d", kresult);
     free (io->priv->isoc_buffer);
     free (io->priv->isoc_framelist);
-    pthread_mutex_unlock (&io->lock);
+    usbi_mutex_unlock(&io->lock);
     return (OPENUSB_SYS_FUNC_FAILURE);
   }
 
@@ -1646,7 +1649,7 @@ int32_t darwin_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io, int
   }
 
   /* unlock the io request */
-  pthread_mutex_unlock (&io->lock);
+  usbi_mutex_unlock(&io->lock);
 
   if (kresult) {
     usbi_debug (hdev->lib_hdl, 1,
@@ -21,6 +21,28 @@
 #define USBI_INTERFACE_DESC_SIZE	9
 #define USBI_ENDPOINT_DESC_SIZE		7
 #define USBI_ENDPOINT_AUDIO_DESC_SIZE	9
+#define USBI_DEVICE_QUALIF_DESC_SIZE	10
+#define USBI_IAD_DESC_SIZE		8
+
+/* little endian 16-bit field of a raw descriptor */
+#define USBI_LE16(p)	((uint16_t)((p)[0] | ((p)[1] << 8)))
+
+/*
+ * Fixed layout decoders for the standard descriptors (descriptors.c). They
+ * return OPENUSB_PARSE_ERROR if buflen is too short for the descriptor.
+ */
+int usbi_decode_device_desc(const uint8_t *buf, uint32_t buflen,
+	usb_device_desc_t *desc);
+int usbi_decode_config_desc(const uint8_t *buf, uint32_t buflen,
+	usb_config_desc_t *desc);
+int usbi_decode_interface_desc(const uint8_t *buf, uint32_t buflen,
+	usb_interface_desc_t *desc);
+int usbi_decode_endpoint_desc(const uint8_t *buf, uint32_t buflen,
+	usb_endpoint_desc_t *desc);
+int usbi_decode_iad_desc(const uint8_t *buf, uint32_t buflen,
+	usb_interface_association_desc_t *desc);
+int usbi_decode_qualifier_desc(const uint8_t *buf, uint32_t buflen,
+	usb_device_qualif_desc_t *desc);
 
 struct usbi_endpoint {
   struct usb_endpoint_desc desc;
@@ -55,6 +77,8 @@ struct usbi_config {
 
   char *extra;
   size_t extralen;
+
+  void *arena;		/* one block holding the whole tree above */
 };
 
 struct usbi_raw_desc {
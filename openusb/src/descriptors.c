@@ -119,6 +119,136 @@ int openusb_parse_data(const char *format, uint8_t *source, uint32_t sourcelen,
 	return OPENUSB_SUCCESS;
 }
 
+/*
+ * Decoders for the standard descriptor layouts. They do the same as
+ * openusb_parse_data() with the matching format string, but with the
+ * offsets and byte order known at compile time. openusb_parse_data() stays
+ * around for caller supplied formats.
+ */
+int usbi_decode_device_desc(const uint8_t *buf, uint32_t buflen,
+	usb_device_desc_t *desc)
+{
+	if (!buf || !desc || buflen < USBI_DEVICE_DESC_SIZE)
+		return OPENUSB_PARSE_ERROR;
+
+	desc->bLength = buf[0];
+	desc->bDescriptorType = buf[1];
+	desc->bcdUSB = USBI_LE16(buf + 2);
+	desc->bDeviceClass = buf[4];
+	desc->bDeviceSubClass = buf[5];
+	desc->bDeviceProtocol = buf[6];
+	desc->bMaxPacketSize0 = buf[7];
+	desc->idVendor = USBI_LE16(buf + 8);
+	desc->idProduct = USBI_LE16(buf + 10);
+	desc->bcdDevice = USBI_LE16(buf + 12);
+	desc->iManufacturer = buf[14];
+	desc->iProduct = buf[15];
+	desc->iSerialNumber = buf[16];
+	desc->bNumConfigurations = buf[17];
+
+	return OPENUSB_SUCCESS;
+}
+
+int usbi_decode_config_desc(const uint8_t *buf, uint32_t buflen,
+	usb_config_desc_t *desc)
+{
+	if (!buf || !desc || buflen < USBI_CONFIG_DESC_SIZE)
+		return OPENUSB_PARSE_ERROR;
+
+	desc->bLength = buf[0];
+	desc->bDescriptorType = buf[1];
+	desc->wTotalLength = USBI_LE16(buf + 2);
+	desc->bNumInterfaces = buf[4];
+	desc->bConfigurationValue = buf[5];
+	desc->iConfiguration = buf[6];
+	desc->bmAttributes = buf[7];
+	desc->bMaxPower = buf[8];
+
+	return OPENUSB_SUCCESS;
+}
+
+int usbi_decode_interface_desc(const uint8_t *buf, uint32_t buflen,
+	usb_interface_desc_t *desc)
+{
+	if (!buf || !desc || buflen < USBI_INTERFACE_DESC_SIZE)
+		return OPENUSB_PARSE_ERROR;
+
+	desc->bLength = buf[0];
+	desc->bDescriptorType = buf[1];
+	desc->bInterfaceNumber = buf[2];
+	desc->bAlternateSetting = buf[3];
+	desc->bNumEndpoints = buf[4];
+	desc->bInterfaceClass = buf[5];
+	desc->bInterfaceSubClass = buf[6];
+	desc->bInterfaceProtocol = buf[7];
+	desc->iInterface = buf[8];
+
+	return OPENUSB_SUCCESS;
+}
+
+/* audio class endpoints carry two extra bytes, zeroed for everybody else */
+int usbi_decode_endpoint_desc(const uint8_t *buf, uint32_t buflen,
+	usb_endpoint_desc_t *desc)
+{
+	if (!buf || !desc || buflen < USBI_ENDPOINT_DESC_SIZE)
+		return OPENUSB_PARSE_ERROR;
+
+	desc->bLength = buf[0];
+	desc->bDescriptorType = buf[1];
+	desc->bEndpointAddress = buf[2];
+	desc->bmAttributes = buf[3];
+	desc->wMaxPacketSize = USBI_LE16(buf + 4);
+	desc->bInterval = buf[6];
+
+	if (buf[0] >= USBI_ENDPOINT_AUDIO_DESC_SIZE &&
+		buflen >= USBI_ENDPOINT_AUDIO_DESC_SIZE) {
+		desc->bRefresh = buf[7];
+		desc->bSynchAddress = buf[8];
+	} else {
+		desc->bRefresh = 0;
+		desc->bSynchAddress = 0;
+	}
+
+	return OPENUSB_SUCCESS;
+}
+
+int usbi_decode_iad_desc(const uint8_t *buf, uint32_t buflen,
+	usb_interface_association_desc_t *desc)
+{
+	if (!buf || !desc || buflen < USBI_IAD_DESC_SIZE)
+		return OPENUSB_PARSE_ERROR;
+
+	desc->bLength = buf[0];
+	desc->bDescriptorType = buf[1];
+	desc->bFirstInterface = buf[2];
+	desc->bInterfaceCount = buf[3];
+	desc->bFunctionClass = buf[4];
+	desc->bFunctionSubClass = buf[5];
+	desc->bFunctionProtocol = buf[6];
+	desc->iFunction = buf[7];
+
+	return OPENUSB_SUCCESS;
+}
+
+int usbi_decode_qualifier_desc(const uint8_t *buf, uint32_t buflen,
+	usb_device_qualif_desc_t *desc)
+{
+	if (!buf || !desc || buflen < USBI_DEVICE_QUALIF_DESC_SIZE)
+		return OPENUSB_PARSE_ERROR;
+
+	desc->bLength = buf[0];
+	desc->bDescriptorType = buf[1];
+	desc->bcdUSB = USBI_LE16(buf + 2);
+	desc->bDeviceClass = buf[4];
+	desc->bDeviceSubClass = buf[5];
+	desc->bDeviceProtocol = buf[6];
+	desc->bMaxPacketSize0 = buf[7];
+	desc->bNumConfigurations = buf[8];
+	desc->bReserved = buf[9];
+
+	return OPENUSB_SUCCESS;
+}
+
 /*
  * This code looks surprisingly similar to the code I wrote for the Linux
  * kernel. It's not a coincidence :)
@@ -129,16 +259,92 @@ struct usb_descriptor_header {
   uint8_t bDescriptorType;
 };
 
+/* decode a descriptor header, left alone if there isn't one */
+static inline void usbi_parse_header(const uint8_t *buf, uint32_t buflen,
+	struct usb_descriptor_header *header)
+{
+	if (buflen >= USBI_DESC_HEADER_SIZE) {
+		header->bLength = buf[0];
+		header->bDescriptorType = buf[1];
+	} else {
+		header->bLength = 0;
+		header->bDescriptorType = 0;
+	}
+}
+
+/*
+ * A parsed configuration lives in a single block of memory. Its size is
+ * worked out from the raw descriptors up front and interfaces, altsettings,
+ * endpoints and the extra descriptor blobs are carved out of it in order,
+ * so the whole tree is built with one allocation and released with one
+ * free().
+ */
+struct usbi_arena {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+};
+
+#define USBI_ARENA_ALIGN	sizeof(void *)
+
+static void *usbi_arena_alloc(struct usbi_arena *arena, size_t size)
+{
+	size_t off;
+
+	off = (arena->used + USBI_ARENA_ALIGN - 1) & ~(USBI_ARENA_ALIGN - 1);
+	if (off > arena->size || size > arena->size - off) {
+		usbi_debug(NULL, 1, "configuration arena exhausted");
+		return NULL;
+	}
+
+	arena->used = off + size;
+
+	return arena->base + off;
+}
+
+/*
+ * Upper bound of the memory needed to parse the configuration in buf. Extra
+ * blobs are copies of disjoint parts of buf, so they never need more than
+ * buflen bytes together.
+ */
+static size_t usbi_arena_size(unsigned char *buf, size_t buflen,
+	uint8_t num_interfaces)
+{
+	size_t num_alts = 0, num_eps = 0, size = buflen;
+
+	while (buflen >= USBI_DESC_HEADER_SIZE && buf[0] >= USBI_DESC_HEADER_SIZE &&
+		buf[0] <= buflen) {
+		if (buf[1] == USB_DESC_TYPE_INTERFACE) {
+			num_alts++;
+			if (buflen >= USBI_INTERFACE_DESC_SIZE)
+				num_eps += buf[4] > USBI_MAXENDPOINTS ?
+					USBI_MAXENDPOINTS : buf[4];
+		}
+
+		buflen -= buf[0];
+		buf += buf[0];
+	}
+
+	size += num_interfaces * sizeof(struct usbi_interface) +
+		num_alts * sizeof(struct usbi_altsetting) +
+		num_eps * sizeof(struct usbi_endpoint);
+
+	/* alignment padding, one slot per allocation */
+	size += (2 + num_interfaces + 2 * num_alts + num_eps) *
+		USBI_ARENA_ALIGN;
+
+	return size;
+}
+
 /* FIXME: Audit all of the increments to make sure we skip descriptors
  * correctly on errors
  */
 
 static int usbi_parse_endpoint(struct usbi_endpoint *ep,
-	unsigned char *buf, unsigned int buflen)
+	unsigned char *buf, unsigned int buflen, struct usbi_arena *arena)
 {
 	struct usb_descriptor_header header;
 	int parsed = 0, numskipped = 0;
-	uint32_t count;
 	char *extra;
 	int extra_len;
 
@@ -148,7 +354,7 @@ static int usbi_parse_endpoint(struct usbi_endpoint *ep,
 
 	usbi_debug(NULL, 4, "parse ep buflen = %d, buf = %p", buflen, buf);
 
-	openusb_parse_data("bb", buf, buflen, &header, sizeof(header), &count);
+	usbi_parse_header(buf, buflen, &header);
 
 	/*
 	 * Everything should be fine being passed into here,
@@ -175,13 +381,7 @@ static int usbi_parse_endpoint(struct usbi_endpoint *ep,
 		return parsed;
 	}
 
-	if (header.bLength >= USBI_ENDPOINT_AUDIO_DESC_SIZE)
-		openusb_parse_data("bbbbwbbb", buf, buflen, &ep->desc,
-				sizeof(ep->desc), &count);
-	else if (header.bLength >= USBI_ENDPOINT_DESC_SIZE)
-		openusb_parse_data("bbbbwb", buf, buflen, &ep->desc,
-				sizeof(ep->desc), &count);
-	/* FIXME: Print error if descriptor is wrong size */
+	usbi_decode_endpoint_desc(buf, buflen, &ep->desc);
 
 	/* FIXME: Maybe report about extra unparsed data
 	 * after the descriptor?
@@ -199,10 +399,10 @@ static int usbi_parse_endpoint(struct usbi_endpoint *ep,
 	extra = (char *)buf;	
 	extra_len = 0;
 	while (buflen >= USBI_DESC_HEADER_SIZE) {
-		openusb_parse_data("bb", buf, buflen, &header,
-				sizeof(header), &count);
+		usbi_parse_header(buf, buflen, &header);
 
-		if (header.bLength < USBI_DESC_HEADER_SIZE) {
+		if (header.bLength > buflen ||
+				header.bLength < USBI_DESC_HEADER_SIZE) {
 			usbi_debug(NULL, 1, "invalid descriptor length of %d",
 				header.bLength);
 			return -1;
@@ -233,7 +433,7 @@ static int usbi_parse_endpoint(struct usbi_endpoint *ep,
 	usbi_debug(NULL, 4, "extra len= %d",extra_len);
 
 	if (extra_len) {
-		ep->extra = calloc(extra_len, 1);
+		ep->extra = usbi_arena_alloc(arena, extra_len);
 		if (!ep->extra) {
 			return -1;
 		}
@@ -249,23 +449,32 @@ static int usbi_parse_endpoint(struct usbi_endpoint *ep,
 	return parsed;
 }
 
-static int usbi_get_intf_altno(char *buf, unsigned int buflen)
+/*
+ * count the altsettings of the interface starting at buf, they follow each
+ * other until an interface descriptor with another number shows up
+ */
+static int usbi_get_intf_altno(unsigned char *buf, unsigned int buflen)
 {
-	int fno,altno=1;
-	int len,hlen;
-	char *p;
-	p = buf;
+	int fno, altno = 1;
+	unsigned char *p = buf;
+
+	if (buflen < USBI_INTERFACE_DESC_SIZE)
+		return altno;
 
-	len = hlen = 0;
 	fno = p[2];
-	while(len < buflen) {
-		hlen = p[0];
-		p += hlen;
-		len += hlen;
+	while (buflen >= USBI_DESC_HEADER_SIZE && p[0] >= USBI_DESC_HEADER_SIZE &&
+		p[0] <= buflen) {
+		buflen -= p[0];
+		p += p[0];
 
-		if((p[1] == USB_DESC_TYPE_INTERFACE) && (p[2] == fno)) {
-			altno++;
-		}
+		if (buflen < USBI_INTERFACE_DESC_SIZE ||
+			p[1] != USB_DESC_TYPE_INTERFACE)
+			continue;
+
+		if (p[2] != fno)
+			break;
+
+		altno++;
 	}
 
 	usbi_debug(NULL, 4, "altno = %d", altno);
@@ -275,13 +484,13 @@ static int usbi_get_intf_altno(char *buf, unsigned int buflen)
 }
 
 static int usbi_parse_interface(struct usbi_interface *intf,
-	unsigned char *buf, unsigned int buflen)
+	unsigned char *buf, unsigned int buflen, struct usbi_arena *arena)
 {
 	int i, retval, parsed = 0, numskipped;
 	struct usb_descriptor_header header;
 	uint8_t alt_num;
+	int num_alts;
 	struct usbi_altsetting *as = NULL;
-	uint32_t count;
 	char *extra;
 	int extra_len;
 
@@ -289,17 +498,19 @@ static int usbi_parse_interface(struct usbi_interface *intf,
 		return OPENUSB_PARSE_ERROR;
 	}
 
-	if (buf[1] != USB_DESC_TYPE_INTERFACE) {
+	if (buflen < USBI_DESC_HEADER_SIZE ||
+		buf[1] != USB_DESC_TYPE_INTERFACE) {
 	/* not an interface descriptor,just skip it */
-		usbi_debug(NULL, 4, "skipped type %d",buf[1]);
+		usbi_debug(NULL, 4, "skipped %d bytes", buflen);
 		return buflen;
 	}
 
 	usbi_debug(NULL, 4, "parse alt buflen = %d, buf = %p", buflen, buf);
 
-	alt_num = usbi_get_intf_altno((char *)buf,buflen);
+	num_alts = usbi_get_intf_altno(buf, buflen);
 
-	intf->altsettings = calloc(sizeof(intf->altsettings[0]) * alt_num, 1);
+	intf->altsettings = usbi_arena_alloc(arena,
+		sizeof(intf->altsettings[0]) * num_alts);
 	if (!intf->altsettings) {
 		intf->num_altsettings = 0;
 		usbi_debug(NULL, 1, "couldn't allocated memory"
@@ -310,16 +521,22 @@ static int usbi_parse_interface(struct usbi_interface *intf,
 
 	intf->num_altsettings = 0;
 
-	while (buflen >= USBI_INTERFACE_DESC_SIZE) {
+	while (buflen >= USBI_INTERFACE_DESC_SIZE &&
+		intf->num_altsettings < num_alts) {
 
-		openusb_parse_data("bb", buf, buflen, &header,
-				sizeof(header), &count);
+		usbi_parse_header(buf, buflen, &header);
+
+		if (header.bLength > buflen ||
+			header.bLength < USBI_DESC_HEADER_SIZE) {
+			usbi_debug(NULL, 1, "invalid descriptor length of %d",
+				header.bLength);
+			return -1;
+		}
 
 		as = intf->altsettings + intf->num_altsettings;
 		intf->num_altsettings++;
 
-		openusb_parse_data("bbbbbbbbb", buf, buflen, &as->desc,
-				sizeof(as->desc), &count);
+		usbi_decode_interface_desc(buf, buflen, &as->desc);
 		
 		usbi_debug(NULL, 4, "interface: num = %d, alt = %d, altno=%d",
 			as->desc.bInterfaceNumber,
@@ -338,14 +555,13 @@ static int usbi_parse_interface(struct usbi_interface *intf,
 		while (buflen >= USBI_DESC_HEADER_SIZE) {
 			uint8_t type;
 
-			openusb_parse_data("bb", buf, buflen, &header, 
-				sizeof(header), &count);
+			usbi_parse_header(buf, buflen, &header);
 
-			if (header.bLength < USBI_DESC_HEADER_SIZE) {
+			if (header.bLength > buflen ||
+				header.bLength < USBI_DESC_HEADER_SIZE) {
 				usbi_debug(NULL, 1,
 					"invalid descriptor length of %d", 
 					header.bLength);
-				free(intf->altsettings);
 				return -1;
 			}
 			
@@ -379,10 +595,8 @@ static int usbi_parse_interface(struct usbi_interface *intf,
 		if (extra_len != 0) {
 			usbi_debug(NULL, 4, "extra_len: %d", extra_len);
 
-			as->extra = calloc(extra_len, 1);
+			as->extra = usbi_arena_alloc(arena, extra_len);
 			if (!as->extra) {
-				/* free something */
-				usbi_debug(NULL, 4, "malloc fail");
 				return -1;
 			}
 			memcpy(as->extra, extra, extra_len);
@@ -390,8 +604,7 @@ static int usbi_parse_interface(struct usbi_interface *intf,
 		}
 
 		/* Did we hit an unexpected descriptor? */
-		openusb_parse_data("bb", buf, buflen, &header,
-				sizeof(header), &count);
+		usbi_parse_header(buf, buflen, &header);
 
 		if (buflen >= USBI_DESC_HEADER_SIZE &&
 			(header.bDescriptorType == USB_DESC_TYPE_CONFIG ||
@@ -401,59 +614,35 @@ static int usbi_parse_interface(struct usbi_interface *intf,
 		if (as->desc.bNumEndpoints > USBI_MAXENDPOINTS) {
 			usbi_debug(NULL, 1,
 				"too many endpoints, ignoring rest");
-			free(intf->altsettings);
 			return -1;
 		}
 
 		usbi_debug(NULL, 1, "endpoints:%d", as->desc.bNumEndpoints);
 		
-		as->endpoints = calloc(as->desc.bNumEndpoints *
-			sizeof(struct usbi_endpoint), 1);
+		as->endpoints = usbi_arena_alloc(arena, as->desc.bNumEndpoints *
+			sizeof(struct usbi_endpoint));
 		if (!as->endpoints) {
 			usbi_debug(NULL, 1,
 				"couldn't allocated %d bytes for endpoints",
 				as->desc.bNumEndpoints * 
-				sizeof(struct usb_endpoint_desc));
-
-			for (i = 0; i < intf->num_altsettings; i++) {
-				as = intf->altsettings + intf->num_altsettings;
-				free(as->endpoints);
-			}
-			free(intf->altsettings);
-
+				sizeof(struct usbi_endpoint));
 			return -1;      
 		}
 		as->num_endpoints = as->desc.bNumEndpoints;
 
 		for (i = 0; i < as->num_endpoints; i++) {
-			openusb_parse_data("bb", buf, buflen, &header,
-				sizeof(header), &count);
+			usbi_parse_header(buf, buflen, &header);
 
 			if (header.bLength > buflen) {
 				usbi_debug(NULL, 1, 
 					"ran out of descriptors parsing");
-
-				for (i = 0; i <= intf->num_altsettings; i++) {
-					as = intf->altsettings + 
-						intf->num_altsettings;
-					free(as->endpoints);
-				}
-				free(intf->altsettings);
-
 				return -1;
 			}
 
 			retval = usbi_parse_endpoint(as->endpoints + i, buf,
-					buflen);
+					buflen, arena);
 			if (retval < 0) {
 				usbi_debug(NULL, 1, "parse endpoint error");
-				for (i = 0; i <= intf->num_altsettings; i++) {
-					as = intf->altsettings +
-						intf->num_altsettings;
-					free(as->endpoints);
-				}
-				free(intf->altsettings);
-
 				return retval;
 			}
 
@@ -465,13 +654,15 @@ static int usbi_parse_interface(struct usbi_interface *intf,
 		/* We check to see if it's an alternate to this one */
 		if (buflen != 0)
 		{
-			openusb_parse_data("bb", buf, buflen, &header,
-							   sizeof(header), &count);
+			usbi_parse_header(buf, buflen, &header);
 
-			alt_num = buf[3];
 			if (buflen < USBI_INTERFACE_DESC_SIZE ||
-				header.bDescriptorType != USB_DESC_TYPE_INTERFACE ||
-				!alt_num) {
+				header.bDescriptorType != USB_DESC_TYPE_INTERFACE) {
+				return parsed;
+			}
+
+			alt_num = buf[3];
+			if (!alt_num) {
 				return parsed;
 			}
 		}
@@ -485,8 +676,8 @@ int usbi_parse_configuration(struct usbi_config *cfg, unsigned char *buf,
 	size_t buflen)
 {
 	struct usb_descriptor_header header;
+	struct usbi_arena arena;
 	int i, retval;
-	uint32_t count;
 	char *extra;
 	int extra_len;
 	int numskipped = 0;
@@ -495,31 +686,39 @@ int usbi_parse_configuration(struct usbi_config *cfg, unsigned char *buf,
 		return OPENUSB_PARSE_ERROR;
 	}
 
-	openusb_parse_data("bb", buf, buflen, &header, sizeof(header), &count);
+	usbi_parse_header(buf, buflen, &header);
 
 	/* parse configuration descriptor */
-	openusb_parse_data("bbwbbbbb", buf, buflen, &cfg->desc,
-			sizeof(cfg->desc), &count);
+	if (usbi_decode_config_desc(buf, buflen, &cfg->desc) != OPENUSB_SUCCESS ||
+		header.bLength > buflen) {
+		usbi_debug(NULL, 1, "configuration descriptor too short");
+		return OPENUSB_PARSE_ERROR;
+	}
 
 	if (cfg->desc.bNumInterfaces > USBI_MAXINTERFACES) {
 		usbi_debug(NULL, 1, "too many interfaces, ignoring rest");
 		return -1;
 	}
 
-	cfg->interfaces = calloc(cfg->desc.bNumInterfaces *
-			sizeof(cfg->interfaces[0]), 1);
+	arena.size = usbi_arena_size(buf, buflen, cfg->desc.bNumInterfaces);
+	arena.used = 0;
+	arena.base = calloc(arena.size, 1);
+	if (!arena.base) {
+		usbi_debug(NULL, 1, "couldn't allocated %d bytes for configuration",
+				arena.size);
+		return -1;
+	}
+	cfg->arena = arena.base;
+
+	cfg->interfaces = usbi_arena_alloc(&arena, cfg->desc.bNumInterfaces *
+			sizeof(cfg->interfaces[0]));
 	if (!cfg->interfaces) {
-		usbi_debug(NULL, 1, "couldn't allocated %d bytes for interfaces",
-				cfg->desc.bNumInterfaces *
-				sizeof(cfg->interfaces[0]));
-		return -1;      
+		retval = -1;
+		goto err;
 	}
 
 	cfg->num_interfaces = cfg->desc.bNumInterfaces;
 
-	memset(cfg->interfaces, 0,
-		cfg->num_interfaces * sizeof(cfg->interfaces[0]));
-
 	buf += header.bLength;
 	buflen -= header.bLength;
 
@@ -533,16 +732,15 @@ int usbi_parse_configuration(struct usbi_config *cfg, unsigned char *buf,
 	while (buflen >= USBI_DESC_HEADER_SIZE) {
 		uint8_t type;
 
-		openusb_parse_data("bb", buf, buflen, &header,
-				sizeof(header), &count);
+		usbi_parse_header(buf, buflen, &header);
 
 		if (header.bLength > buflen ||
 				header.bLength < USBI_DESC_HEADER_SIZE) {
 			usbi_debug(NULL, 1,
 					"invalid descriptor length of %d",
 					header.bLength);
-			free(cfg->interfaces);
-			return -1;
+			retval = -1;
+			goto err;
 		}
 
 		type = header.bDescriptorType;
@@ -573,11 +771,10 @@ int usbi_parse_configuration(struct usbi_config *cfg, unsigned char *buf,
 				" endpoint descriptors", numskipped);
 
 	if (extra_len) {
-		cfg->extra = calloc(extra_len, 1);
+		cfg->extra = usbi_arena_alloc(&arena, extra_len);
 		if (cfg->extra == NULL) {
-			/* free something */
-
-			return OPENUSB_PARSE_ERROR;
+			retval = OPENUSB_PARSE_ERROR;
+			goto err;
 		}
 
 		memcpy(cfg->extra, extra, extra_len);
@@ -587,24 +784,37 @@ int usbi_parse_configuration(struct usbi_config *cfg, unsigned char *buf,
 	}
 
 	for (i = 0; (i < cfg->num_interfaces) && (buflen > 0); i++) {
-		retval = usbi_parse_interface(cfg->interfaces + i, buf, buflen);
+		retval = usbi_parse_interface(cfg->interfaces + i, buf, buflen,
+				&arena);
 		if (retval < 0) {
 			usbi_debug(NULL, 4, "parse_interface fail");
-			free(cfg->interfaces);
-			return retval;
+			goto err;
 		}
 
 		buf += retval;
 		buflen -= retval;
 
 	}
+
+	usbi_debug(NULL, 4, "configuration arena: %d of %d bytes used",
+		arena.used, arena.size);
 	
 	return buflen;
+
+err:
+	free(cfg->arena);
+	cfg->arena = NULL;
+	cfg->interfaces = NULL;
+	cfg->num_interfaces = 0;
+	cfg->extra = NULL;
+	cfg->extralen = 0;
+
+	return retval;
 }
 
 void usbi_destroy_configuration(struct usbi_device *dev)
 {
-	int c, i, j, k;
+	int c;
 	
 	if (!dev->desc.configs) {
 		return;
@@ -615,51 +825,12 @@ void usbi_destroy_configuration(struct usbi_device *dev)
 	for (c = 0; c < dev->desc.num_configs; c++) { /*free config */
 		struct usbi_config *cfg = dev->desc.configs + c;
 
-		if (cfg->extra) {
-			free(cfg->extra);
-		}
-
-		
 		if (dev->desc.configs_raw[c].data)
 			free(dev->desc.configs_raw[c].data);
 
-		if (!cfg->interfaces) {
-			continue;
-		}
-
-
-		for (i = 0; i < cfg->num_interfaces; i++) { /* free intf */
-			struct usbi_interface *intf = cfg->interfaces + i;
-
-
-			for (j = 0; j < intf->num_altsettings; j++) { /* free alt */
-				struct usbi_altsetting *as =
-					intf->altsettings + j;
-				int num_ep = as->num_endpoints;
-
-
-				for(k = 0; k < num_ep; k++) { /* free ep */
-					if (as->endpoints[k].extra) {
-						free(as->endpoints[k].extra);
-					}
-				}
-
-				free(as->endpoints);
-
-
-				if (as->extra) {
-					free(as->extra);
-				}
-
-			} /* free alt end */
-
-			if (intf->altsettings)
-				free(intf->altsettings);
-
-		} /* free intf end */
-
-		if (cfg->interfaces)
-			free(cfg->interfaces);
+		/* interfaces, altsettings, endpoints and extras */
+		if (cfg->arena)
+			free(cfg->arena);
 	} /* free config end */
 	
 	free(dev->desc.configs_raw);
@@ -703,11 +874,11 @@ int usbi_fetch_and_parse_descriptors(struct usbi_dev_handle *hdev)
 		return (OPENUSB_PARSE_ERROR);
 	}
 
-	ret = openusb_parse_data("bbwbbbbwwwbbbb", (uint8_t *)devbuf,
-		USBI_DEVICE_DESC_SIZE, &dev->desc.device,
-		sizeof(dev->desc.device), &count);
+	ret = usbi_decode_device_desc((uint8_t *)devbuf, USBI_DEVICE_DESC_SIZE,
+		&dev->desc.device);
+	count = USBI_DEVICE_DESC_SIZE;
 
-	if (ret < 0 || count < USBI_DEVICE_DESC_SIZE) {
+	if (ret < 0) {
 		usbi_debug(NULL, 4, "fail to parse device descr");
 		return OPENUSB_PARSE_ERROR;
 	}
@@ -750,7 +921,6 @@ int usbi_fetch_and_parse_descriptors(struct usbi_dev_handle *hdev)
 
 	for (i = 0; i < dev->desc.num_configs; i++) {
 		unsigned char buf[8];
-		struct usb_config_desc cfg_desc;
 		struct usbi_raw_desc *cfgr = dev->desc.configs_raw + i;
 
 		/*
@@ -772,10 +942,7 @@ int usbi_fetch_and_parse_descriptors(struct usbi_dev_handle *hdev)
 			goto err;
 		}
 
-		openusb_parse_data("bbw", buf, 8, &cfg_desc,
-			sizeof(cfg_desc), &count);
-
-		cfgr->len = cfg_desc.wTotalLength;
+		cfgr->len = USBI_LE16(buf + 2);
 
 		/* FIXME: */
 		/* valgrind is really unhappy with this pointer, and we've seen many */
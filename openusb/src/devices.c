@@ -28,7 +28,7 @@ static openusb_devid_t cur_device_id = 1;
 static void usbi_add_bus(struct usbi_bus *ibus, struct usbi_backend *backend)
 {
 	/* FIXME: Handle busid rollover gracefully? */
-	pthread_mutex_lock(&ibus->lock);
+	usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
 	ibus->busid = cur_bus_id++;
 
 	ibus->ops = backend->ops;
@@ -43,7 +43,7 @@ static void usbi_add_bus(struct usbi_bus *ibus, struct usbi_backend *backend)
 	 *  ibus->lock
 	 *  ibus->devices list
 	 */
-	pthread_mutex_unlock(&ibus->lock);
+	usbi_mutex_unlock(&ibus->lock);
 }
 
 /* implicit access of usbi_buses list, locked by caller */
@@ -51,20 +51,20 @@ void usbi_free_bus(struct usbi_bus *ibus)
 {
 
 	/*FIXME: what about the ibus->devices list */
-	pthread_mutex_lock(&ibus->lock);
+	usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
 	if (ibus->priv) {
 		free(ibus->priv);
 	}
-	pthread_mutex_unlock(&ibus->lock);
+	usbi_mutex_unlock(&ibus->lock);
 
 	free(ibus);
 }
 
 static void usbi_remove_bus(struct usbi_bus *ibus)
 {
-	pthread_mutex_lock(&usbi_buses.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 	list_del(&ibus->list);
-	pthread_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_buses.lock);
 	
 	usbi_free_bus(ibus);
 }
@@ -76,20 +76,20 @@ static struct usbi_bus *usbi_find_bus_by_id(openusb_busid_t busid)
 	/* FIXME: We should probably index the device id in
 	 * a rbtree or something
 	 */
-	pthread_mutex_lock(&usbi_buses.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 	list_for_each_entry(ibus, &usbi_buses.head, list) {
 	/* safe */
 		if (ibus) {
-			pthread_mutex_lock(&ibus->lock);
+			usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
 			if (ibus->busid == busid) {
-				pthread_mutex_unlock(&ibus->lock);
-				pthread_mutex_unlock(&usbi_buses.lock);
+				usbi_mutex_unlock(&ibus->lock);
+				usbi_mutex_unlock(&usbi_buses.lock);
 				return ibus;
 			}
-			pthread_mutex_unlock(&ibus->lock);
+			usbi_mutex_unlock(&ibus->lock);
 		}
 	}
-	pthread_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_buses.lock);
 
 	return NULL;
 }
@@ -102,20 +102,20 @@ struct usbi_bus *usbi_find_bus_by_num(unsigned int busnum)
 	/* FIXME: We should probably index the device id in
 	 * a rbtree or something
 	 */
-	pthread_mutex_lock(&usbi_buses.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 	list_for_each_entry(ibus, &usbi_buses.head, list) {
 	/* safe */
 		if (ibus) {
-			pthread_mutex_lock(&ibus->lock);
+			usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
 			if (ibus->busnum == busnum) {
-				pthread_mutex_unlock(&ibus->lock);
-				pthread_mutex_unlock(&usbi_buses.lock);
+				usbi_mutex_unlock(&ibus->lock);
+				usbi_mutex_unlock(&usbi_buses.lock);
 				return ibus;
 			}
-			pthread_mutex_unlock(&ibus->lock);
+			usbi_mutex_unlock(&ibus->lock);
 		}
 	}
-	pthread_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_buses.lock);
 
 	return NULL;
 }
@@ -142,11 +142,12 @@ static void refresh_bus(struct usbi_backend *backend)
 	 * Now walk through all of the busses we know about and compare against
 	 * this new list. Any duplicates will be removed from the new list.
 	 * If we don't find it in the new list, the bus was removed. Any
-	 * busses still in the new list, are new to us.
+	 * busses still in the new list, are new to us. Busses of the other
+	 * backends aren't this one's to remove.
 	 */
-	pthread_mutex_lock(&usbi_buses.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 	list_for_each_entry_safe(ibus, tibus, &usbi_buses.head, list) {
-		if (ibus) {
+		if (ibus && ibus->ops == backend->ops) {
 			struct usbi_bus *nibus, *tnibus;
 			int found = 0;
 
@@ -157,11 +158,11 @@ static void refresh_bus(struct usbi_backend *backend)
 			 	* bus list.
 			 	*/
 				if (nibus) {
-					pthread_mutex_lock(&ibus->lock);
+					usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
 					if ((ibus->busnum == nibus->busnum) ||
 			    		(strcmp(ibus->sys_path, nibus->sys_path) == 0)){
 		
-						pthread_mutex_unlock(&ibus->lock);
+						usbi_mutex_unlock(&ibus->lock);
 		
 						list_del(&nibus->list);
 		
@@ -169,7 +170,7 @@ static void refresh_bus(struct usbi_backend *backend)
 						found = 1;
 						break;
 					}
-					pthread_mutex_unlock(&ibus->lock);
+					usbi_mutex_unlock(&ibus->lock);
 				}
 			}
 
@@ -189,7 +190,7 @@ static void refresh_bus(struct usbi_backend *backend)
 			usbi_add_bus(ibus, backend);
 		}
 	}
-	pthread_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_buses.lock);
 }
 
 static void usbi_refresh_busses(void)
@@ -206,31 +207,99 @@ static void usbi_refresh_busses(void)
 /*
  * Device code
  */
+
+/* devices by devid, protected by usbi_devices.lock */
+static struct usbi_device *usbi_devids[USBI_DEVID_HASH];
+
+#define USBI_DEVID_BUCKET(devid)	((devid) & (USBI_DEVID_HASH - 1))
+
+/* caller holds usbi_devices.lock */
+struct usbi_device *usbi_lookup_device(openusb_devid_t devid)
+{
+	struct usbi_device *idev;
+
+	for (idev = usbi_devids[USBI_DEVID_BUCKET(devid)]; idev;
+	    idev = idev->devid_next) {
+		if (idev->devid == devid)
+			return idev;
+	}
+
+	return NULL;
+}
+
+/*
+ * Put the device in its hub's port slot. The backend sets parent and pport
+ * before it adds the device. Caller holds usbi_devices.lock.
+ */
+static void usbi_link_child(struct usbi_device *idev)
+{
+	struct usbi_device *parent = idev->parent;
+
+	if (!parent || !parent->children || !idev->pport ||
+	    idev->pport > parent->nports)
+		return;
+
+	if (parent->children[idev->pport - 1] &&
+	    parent->children[idev->pport - 1] != idev)
+		usbi_debug(NULL, 2, "device %d replaces device %d on port %d",
+			idev->devid, parent->children[idev->pport - 1]->devid,
+			idev->pport);
+
+	parent->children[idev->pport - 1] = idev;
+}
+
+/* take the device out of the topology, caller holds usbi_devices.lock */
+static void usbi_unlink_child(struct usbi_device *idev)
+{
+	struct usbi_device *parent = idev->parent;
+	int i;
+
+	if (parent && parent->children && idev->pport &&
+	    idev->pport <= parent->nports &&
+	    parent->children[idev->pport - 1] == idev)
+		parent->children[idev->pport - 1] = NULL;
+
+	/* a hub may go before the devices behind it */
+	for (i = 0; idev->children && i < idev->nports; i++) {
+		if (idev->children[i]) {
+			idev->children[i]->parent = NULL;
+			idev->children[i] = NULL;
+		}
+	}
+}
+
 void usbi_add_device(struct usbi_bus *ibus, struct usbi_device *idev)
 {
 	struct usbi_handle *handle, *thdl;
+	struct usbi_device **bucket;
 
 	/* FIXME: Handle devid rollover gracefully? */
 	idev->devid = cur_device_id++;
 
 	idev->bus = ibus;
-	idev->ops = &ibus->ops->dev;
+	idev->ops = usbi_record_ops(&ibus->ops->dev);
 	
 	/* caller lock this one */
 	list_add(&idev->bus_list, &ibus->devices.head);
 
-	pthread_mutex_lock(&usbi_devices.lock);
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 	list_add(&idev->dev_list, &usbi_devices.head);
-	pthread_mutex_unlock(&usbi_devices.lock);
 
-	pthread_mutex_lock(&usbi_handles.lock);
+	bucket = &usbi_devids[USBI_DEVID_BUCKET(idev->devid)];
+	idev->devid_next = *bucket;
+	*bucket = idev;
+
+	usbi_link_child(idev);
+	usbi_mutex_unlock(&usbi_devices.lock);
+
+	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 	list_for_each_entry_safe(handle, thdl, &usbi_handles.head, list){
 		/* every openusb instance should get notification of this event */
 		if (handle) {
 			usbi_add_event_callback(handle, idev->devid, USB_ATTACH);
 		}
 	}
-	pthread_mutex_unlock(&usbi_handles.lock);
+	usbi_mutex_unlock(&usbi_handles.lock);
 }
 
 void usbi_free_device(struct usbi_device *idev)
@@ -241,6 +310,8 @@ void usbi_free_device(struct usbi_device *idev)
 	}
 
 	usbi_destroy_configuration(idev);
+	usbi_flush_string_cache(idev);
+	usbi_flush_desc_index(idev);
 
 	if (idev->bus->ops->free_device)
 		idev->bus->ops->free_device(idev);
@@ -253,26 +324,37 @@ void usbi_free_device(struct usbi_device *idev)
 void usbi_remove_device(struct usbi_device *idev)
 {
 	struct usbi_handle *handle, *thdl;
+	struct usbi_device **pidev;
 
 	openusb_devid_t devid = idev->devid;
 
-	pthread_mutex_lock(&usbi_buses.lock);
-	pthread_mutex_lock(&usbi_devices.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 	list_del(&idev->bus_list);
 	list_del(&idev->dev_list);
-	pthread_mutex_unlock(&usbi_buses.lock);
-	pthread_mutex_unlock(&usbi_devices.lock);
+
+	for (pidev = &usbi_devids[USBI_DEVID_BUCKET(devid)]; *pidev;
+	    pidev = &(*pidev)->devid_next) {
+		if (*pidev == idev) {
+			*pidev = idev->devid_next;
+			break;
+		}
+	}
+
+	usbi_unlink_child(idev);
+	usbi_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_devices.lock);
 	
 	usbi_free_device(idev);
 
-	pthread_mutex_lock(&usbi_handles.lock);
+	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 	list_for_each_entry_safe(handle, thdl, &usbi_handles.head, list){
 		/*every openusb instance should get notification of this event */
 		if (handle) {
 			usbi_add_event_callback(handle,devid, USB_REMOVE);
 		}
 	}
-	pthread_mutex_unlock(&usbi_handles.lock);
+	usbi_mutex_unlock(&usbi_handles.lock);
 }
 
 /*
@@ -285,7 +367,7 @@ void usbi_rescan_devices(void)
 
 	usbi_refresh_busses();
 
-	pthread_mutex_lock(&usbi_buses.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 
 	/* 
 	 * FIXME:
@@ -301,13 +383,13 @@ void usbi_rescan_devices(void)
 
 	list_for_each_entry_safe(ibus, tbus, &usbi_buses.head, list) {
 		if (ibus && ibus->ops) {
-			pthread_mutex_unlock(&usbi_buses.lock);
+			usbi_mutex_unlock(&usbi_buses.lock);
 			ibus->ops->refresh_devices(ibus);
-			pthread_mutex_lock(&usbi_buses.lock);
+			usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 		}
 	}
 
-	pthread_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_buses.lock);
 }
 
 
@@ -329,7 +411,7 @@ int32_t openusb_get_busid_list(openusb_handle_t handle, openusb_busid_t **busids
 	if (!hdl)
 		return OPENUSB_INVALID_HANDLE;
 
-	pthread_mutex_lock(&usbi_buses.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 
 	list_for_each_entry(ibus, &usbi_buses.head, list) {
 	/* safe */
@@ -337,14 +419,14 @@ int32_t openusb_get_busid_list(openusb_handle_t handle, openusb_busid_t **busids
 	}
 
 	if (*num_busids == 0) {
-		pthread_mutex_unlock(&usbi_buses.lock);
+		usbi_mutex_unlock(&usbi_buses.lock);
 		usbi_debug(hdl, 2, "Null list");
 		return OPENUSB_NULL_LIST;
 	}
 
 	*busids = calloc((*num_busids) * sizeof (openusb_busid_t), 1);
 	if (*busids == NULL) {
-		pthread_mutex_unlock(&usbi_buses.lock);
+		usbi_mutex_unlock(&usbi_buses.lock);
 		usbi_debug(hdl, 2, "No resource");
 		return OPENUSB_NO_RESOURCES;
 	}
@@ -353,14 +435,14 @@ int32_t openusb_get_busid_list(openusb_handle_t handle, openusb_busid_t **busids
 	list_for_each_entry(ibus, &usbi_buses.head, list) {
 	/* safe */
 		if (ibus) {
-			pthread_mutex_lock(&ibus->lock);
+			usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
 			*tmp = ibus->busid;
-			pthread_mutex_unlock(&ibus->lock);
+			usbi_mutex_unlock(&ibus->lock);
 
 			tmp++;
 		}
 	}
-	pthread_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_buses.lock);
 
 	return OPENUSB_SUCCESS;
 }
@@ -373,44 +455,186 @@ void openusb_free_busid_list(openusb_busid_t *busids)
 	free(busids);
 }
 
-/* get the alternate setting count of an interface */
-static int usbi_get_num_altsettings(struct usbi_device *idev,
-	uint8_t *buffer, uint16_t buflen, uint8_t infidx)
+/*
+ * Configuration descriptor index
+ *
+ * Looking up an interface or endpoint descriptor used to walk the raw
+ * configuration from its start, after reading it from the backend again.
+ * Instead each configuration is read once and indexed in a single pass:
+ * the offset of every interface descriptor, and of the endpoint
+ * descriptors that follow it, keyed by interface number and alternate
+ * setting. The index lives on the usbi_device until the device is removed
+ * or reset, and lookups against it are constant time.
+ */
+static pthread_mutex_t usbi_desc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int usbi_alt_index_cmp(const void *a, const void *b)
 {
-	uint8_t num_alt = 0;
-	uint8_t *p = buffer;
+	const struct usbi_alt_index *x = a, *y = b;
 
-	if ((buffer == NULL) || (buflen == 0))
-		return -1;
+	if (x->ifc != y->ifc)
+		return x->ifc - y->ifc;
+	if (x->alt != y->alt)
+		return x->alt - y->alt;
+
+	/* the first of duplicate settings wins, as it did when scanning */
+	return x->offset - y->offset;
+}
 
-	while (buflen >= 3) {
+static void usbi_free_desc_index(struct usbi_desc_index *ix)
+{
+	if (!ix)
+		return;
+
+	free(ix->raw);
+	free(ix->alts);
+	free(ix->ep_offsets);
+	free(ix);
+}
 
-		if ((p[1] == USB_DESC_TYPE_INTERFACE) && (p[2] == infidx)) {
-			num_alt++;
-		} else if ((p[1] == USB_DESC_TYPE_INTERFACE) &&
-			(p[2] > infidx)) {
+/* index a raw configuration descriptor, taking over the buffer */
+static struct usbi_desc_index *usbi_build_desc_index(uint8_t *raw,
+	uint16_t rawlen)
+{
+	struct usbi_desc_index *ix;
+	struct usbi_alt_index *cur = NULL;
+	uint32_t off, num_eps = 0;
+	uint16_t i;
+
+	ix = calloc(sizeof(*ix), 1);
+	if (!ix)
+		return NULL;
+
+	ix->raw = raw;
+	ix->rawlen = rawlen;
+
+	/* room for as many descriptors as could fit */
+	ix->alts = malloc((rawlen / USBI_INTERFACE_DESC_SIZE + 1) *
+		sizeof(ix->alts[0]));
+	ix->ep_offsets = malloc((rawlen / USBI_ENDPOINT_DESC_SIZE + 1) *
+		sizeof(ix->ep_offsets[0]));
+	if (!ix->alts || !ix->ep_offsets) {
+		ix->raw = NULL;
+		usbi_free_desc_index(ix);
+		return NULL;
+	}
+
+	/* a bad bLength ends the index, what follows it can't be found */
+	for (off = 0; off + 2 <= rawlen; off += raw[off]) {
+		if (raw[off] == 0 || off + raw[off] > rawlen)
 			break;
+
+		if (raw[off + 1] == USB_DESC_TYPE_INTERFACE &&
+		    raw[off] >= USBI_INTERFACE_DESC_SIZE) {
+			cur = &ix->alts[ix->num_alts++];
+			cur->ifc = raw[off + 2];
+			cur->alt = raw[off + 3];
+			cur->offset = off;
+			cur->first_ep = num_eps;
+			cur->num_eps = 0;
+		} else if (raw[off + 1] == USB_DESC_TYPE_ENDPOINT &&
+		    raw[off] >= USBI_ENDPOINT_DESC_SIZE && cur) {
+			ix->ep_offsets[num_eps++] = off;
+			cur->num_eps++;
 		}
+	}
 
-		/* make sure bLength is not a bad value */
-		if ((p[0] > 0) && (buflen >= p[0])) {
-			
-			/* reverse sequence of the fllowing two statements
-			 * causes matching failure
-			 */
-			buflen -= p[0];
-			p += p[0];
+	qsort(ix->alts, ix->num_alts, sizeof(ix->alts[0]), usbi_alt_index_cmp);
 
-		} else {
-			return -1;
-		}
+	for (i = ix->num_alts; i > 0; i--) {
+		ix->ifc_first[ix->alts[i - 1].ifc] = i - 1;
+		ix->ifc_num_alts[ix->alts[i - 1].ifc]++;
 	}
 
-	if (num_alt > 0)
-		return num_alt;
-	else
-		return -1;
-			
+	return ix;
+}
+
+/*
+ * Find the index of a configuration, reading and indexing it the first
+ * time. Returns with usbi_desc_lock held on success, the index stays valid
+ * until it is released.
+ */
+static int usbi_lock_desc_index(struct usbi_device *idev, uint8_t cfgidx,
+	struct usbi_desc_index **ixp)
+{
+	struct usbi_desc_index *ix;
+	uint8_t *raw;
+	uint16_t rawlen;
+	int ret;
+
+	if (cfgidx >= USBI_MAXCONFIG)
+		return OPENUSB_BADARG;
+
+	usbi_mutex_lock(&usbi_desc_lock, USBI_LOCK_DESC);
+	if (idev->desc_index[cfgidx]) {
+		*ixp = idev->desc_index[cfgidx];
+		return OPENUSB_SUCCESS;
+	}
+	usbi_mutex_unlock(&usbi_desc_lock);
+
+	if (!idev->ops->get_raw_desc)
+		return OPENUSB_PARSE_ERROR;
+
+	/* not holding the lock while the backend reads the descriptor */
+	ret = idev->ops->get_raw_desc(idev, USB_DESC_TYPE_CONFIG, cfgidx, 0,
+		&raw, &rawlen);
+	if (ret < 0)
+		return ret;
+
+	if (rawlen < USBI_CONFIG_DESC_SIZE) {
+		free(raw);
+		return OPENUSB_PARSE_ERROR;
+	}
+
+	ix = usbi_build_desc_index(raw, rawlen);
+	if (!ix) {
+		free(raw);
+		return OPENUSB_NO_RESOURCES;
+	}
+
+	usbi_mutex_lock(&usbi_desc_lock, USBI_LOCK_DESC);
+	if (idev->desc_index[cfgidx]) {
+		/* somebody else was quicker */
+		usbi_free_desc_index(ix);
+	} else {
+		idev->desc_index[cfgidx] = ix;
+	}
+	*ixp = idev->desc_index[cfgidx];
+
+	return OPENUSB_SUCCESS;
+}
+
+/* an alternate setting of an interface, NULL if there's no such thing */
+static struct usbi_alt_index *usbi_find_alt_index(struct usbi_desc_index *ix,
+	uint8_t ifc, uint8_t alt)
+{
+	struct usbi_alt_index *first = &ix->alts[ix->ifc_first[ifc]];
+	uint8_t i, n = ix->ifc_num_alts[ifc];
+
+	/* settings are normally numbered from 0 without gaps */
+	if (alt < n && first[alt].alt == alt)
+		return &first[alt];
+
+	for (i = 0; i < n; i++) {
+		if (first[i].alt == alt)
+			return &first[i];
+	}
+
+	return NULL;
+}
+
+void usbi_flush_desc_index(struct usbi_device *idev)
+{
+	struct usbi_desc_index *ix[USBI_MAXCONFIG];
+	int i;
+
+	usbi_mutex_lock(&usbi_desc_lock, USBI_LOCK_DESC);
+	memcpy(ix, idev->desc_index, sizeof(ix));
+	memset(idev->desc_index, 0, sizeof(idev->desc_index));
+	usbi_mutex_unlock(&usbi_desc_lock);
+
+	for (i = 0; i < USBI_MAXCONFIG; i++)
+		usbi_free_desc_index(ix[i]);
 }
 
 /*
@@ -425,13 +649,11 @@ static int usbi_get_num_altsettings(struct usbi_device *idev,
 static int usbi_match_class(openusb_handle_t handle, struct usbi_device *idev,
 	int16_t devclass, int16_t subclass, int16_t protocol)
 {
-	uint8_t *buf;
-	uint16_t buflen;
 	usb_device_desc_t dev_desc;
-	usb_config_desc_t cfg_desc;
-	usb_interface_desc_t ifc_desc;
+	struct usbi_desc_index *ix;
+	uint8_t *p;
 	int ret;
-	int c, i, a;
+	int c, a;
 	struct usbi_handle *hdl;
 
 	hdl = usbi_find_handle(handle);
@@ -453,69 +675,34 @@ static int usbi_match_class(openusb_handle_t handle, struct usbi_device *idev,
 
 	if (((devclass == -1) || (devclass == dev_desc.bDeviceClass)) &&
 		((subclass == -1) || (subclass == dev_desc.bDeviceSubClass)) &&
-		((protocol == -1) || (protocol = dev_desc.bDeviceProtocol)))
+		((protocol == -1) || (protocol == dev_desc.bDeviceProtocol)))
 		return 1;
 
 
 	for (c = 0; c < dev_desc.bNumConfigurations; c++) {
 
-		ret = openusb_get_raw_desc(handle, idev->devid,
-			USB_DESC_TYPE_CONFIG, c, 0, &buf, &buflen);
+		ret = usbi_lock_desc_index(idev, c, &ix);
 		if (ret < 0) {
-			usbi_debug(hdl, 2, "get raw config desc index %d "
+			usbi_debug(hdl, 2, "get config desc index %d "
 				"for devid %llu failed (ret = %d)", c,
 				idev->devid, ret);
 			continue;
 		}
-		
-		if ((ret = openusb_parse_config_desc(handle, idev->devid, buf,
-			buflen, c, &cfg_desc)) < 0) {
-			usbi_debug(hdl, 2, "parse config desc index %d "
-				"for devid %d failed (ret = %d)", c,
-				idev->devid, ret);
-			openusb_free_raw_desc(buf);
-			continue;
-		}
-
-		usbi_debug(hdl, 4, "buflen = %d, int#=%d", buflen,
-			cfg_desc.bNumInterfaces);
-
-		for (i = 0; i < cfg_desc.bNumInterfaces; i++) {
-			int num_alt;
 
-			num_alt = usbi_get_num_altsettings(idev, buf,
-				buflen, i);
-			if (num_alt < 0) {
-				usbi_debug(NULL, 1, "altsetting error");
-				continue;
-			}
-
-			for (a = 0; a < num_alt; a++) {
-				if ((ret = openusb_parse_interface_desc(handle,
-					idev->devid, buf, buflen, c, i, a,
-					&ifc_desc)) < 0) {
-					usbi_debug(hdl, 2, "get ifc desc "
-						"%d-%d-%d failed"
-						" (ret = %d (%s))",
-						c, i, a, ret,
-						openusb_strerror(ret));
-					continue;
-				}
+		/* every setting of every interface */
+		for (a = 0; a < ix->num_alts; a++) {
+			p = ix->raw + ix->alts[a].offset;
 
-				if (((devclass == -1) || (devclass ==
-					ifc_desc.bInterfaceClass)) &&
-					((subclass == -1) || (subclass ==
-					ifc_desc.bInterfaceSubClass)) &&
-					((protocol == -1) || (protocol ==
-					ifc_desc.bInterfaceProtocol))) {
+			if (((devclass == -1) || (devclass == p[5])) &&
+				((subclass == -1) || (subclass == p[6])) &&
+				((protocol == -1) || (protocol == p[7]))) {
 
-					openusb_free_raw_desc(buf);
-					return 1;
-				}
+				usbi_mutex_unlock(&usbi_desc_lock);
+				return 1;
 			}
 		}
 
-		openusb_free_raw_desc(buf);
+		usbi_mutex_unlock(&usbi_desc_lock);
 	}
 
 	return 0;
@@ -550,20 +737,20 @@ int32_t openusb_get_devids_by_bus(openusb_handle_t handle, openusb_busid_t busid
 
 	if (busid == 0) {
 		/* get all devids */
-		pthread_mutex_lock(&usbi_devices.lock);
+		usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 		list_for_each_entry(idev, &usbi_devices.head, dev_list) {
 		/* safe */
 			devcnts++;
 		}
 
 		if ( devcnts== 0) {
-			pthread_mutex_unlock(&usbi_devices.lock);
+			usbi_mutex_unlock(&usbi_devices.lock);
 			return OPENUSB_NULL_LIST;
 		}
 
 		*devids = calloc((devcnts) * sizeof (openusb_devid_t), 1);
 		if (*devids == NULL) {
-			pthread_mutex_unlock(&usbi_devices.lock);
+			usbi_mutex_unlock(&usbi_devices.lock);
 			return OPENUSB_NO_RESOURCES;
 		}
 
@@ -578,7 +765,7 @@ int32_t openusb_get_devids_by_bus(openusb_handle_t handle, openusb_busid_t busid
 
 		*num_devids = devcnts;
 
-		pthread_mutex_unlock(&usbi_devices.lock);
+		usbi_mutex_unlock(&usbi_devices.lock);
 
 		return OPENUSB_SUCCESS;
 	}
@@ -587,10 +774,10 @@ int32_t openusb_get_devids_by_bus(openusb_handle_t handle, openusb_busid_t busid
 	if (!ibus)
 		return OPENUSB_UNKNOWN_DEVICE;
 
-	pthread_mutex_lock(&ibus->devices.lock);
+	usbi_mutex_lock(&ibus->devices.lock, USBI_LOCK_BUS);
 
 	if (list_empty(&ibus->devices.head)) {
-		pthread_mutex_unlock(&ibus->devices.lock);
+		usbi_mutex_unlock(&ibus->devices.lock);
 		return OPENUSB_NULL_LIST;
 	}
 
@@ -600,13 +787,13 @@ int32_t openusb_get_devids_by_bus(openusb_handle_t handle, openusb_busid_t busid
 	}
 
 	if (devcnts == 0) {
-		pthread_mutex_unlock(&ibus->devices.lock);
+		usbi_mutex_unlock(&ibus->devices.lock);
 		return OPENUSB_NULL_LIST;
 	}
 
 	*devids = calloc(devcnts * sizeof (openusb_devid_t), 1);
 	if (*devids == NULL) {
-		pthread_mutex_unlock(&ibus->devices.lock);
+		usbi_mutex_unlock(&ibus->devices.lock);
 		return OPENUSB_NO_RESOURCES;
 	}
 
@@ -619,7 +806,7 @@ int32_t openusb_get_devids_by_bus(openusb_handle_t handle, openusb_busid_t busid
 		}
 	}
 	*num_devids = devcnts;
-	pthread_mutex_unlock(&ibus->devices.lock);
+	usbi_mutex_unlock(&ibus->devices.lock);
 
 	return OPENUSB_SUCCESS;
 }
@@ -658,26 +845,26 @@ int32_t openusb_get_devids_by_vendor(openusb_handle_t handle, int32_t vendor,
 		(product > 0xffff))
 		return OPENUSB_BADARG;
 
-	pthread_mutex_lock(&usbi_devices.lock);
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 	list_for_each_entry_safe(idev, tdev, &usbi_devices.head, dev_list) {
 		if (idev) {
 			usb_device_desc_t desc;
 			uint16_t Vendor;
 			uint16_t Product;
 
-			pthread_mutex_unlock(&usbi_devices.lock);
+			usbi_mutex_unlock(&usbi_devices.lock);
 			if ((ret = openusb_parse_device_desc(handle, idev->devid,
 					NULL, 0, &desc)) < 0) {
 
 				usbi_debug(hdl, 2, "get device desc for devid %d "
 						"failed (ret = %d)", idev->devid, ret);
 
-				pthread_mutex_lock(&usbi_devices.lock);
+				usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 
 				continue;
 			}
 
-			pthread_mutex_lock(&usbi_devices.lock);
+			usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 		
 			Vendor = openusb_le16_to_cpu(desc.idVendor);
 			Product = openusb_le16_to_cpu(desc.idProduct);
@@ -691,13 +878,13 @@ int32_t openusb_get_devids_by_vendor(openusb_handle_t handle, int32_t vendor,
 	}
 
 	if (*num_devids == 0) {
-		pthread_mutex_unlock(&usbi_devices.lock);
+		usbi_mutex_unlock(&usbi_devices.lock);
 		return OPENUSB_NULL_LIST;
 	}
 
 	*devids = calloc((*num_devids) * sizeof (openusb_devid_t), 1);
 	if (*devids == NULL) {
-		pthread_mutex_unlock(&usbi_devices.lock);
+		usbi_mutex_unlock(&usbi_devices.lock);
 		return OPENUSB_NO_RESOURCES;
 	}
 
@@ -709,7 +896,7 @@ int32_t openusb_get_devids_by_vendor(openusb_handle_t handle, int32_t vendor,
 			tdevid++;
 		}
 	}
-	pthread_mutex_unlock(&usbi_devices.lock);
+	usbi_mutex_unlock(&usbi_devices.lock);
 
 	return OPENUSB_SUCCESS;
 }
@@ -751,10 +938,10 @@ int32_t openusb_get_devids_by_class(openusb_handle_t handle, int16_t devclass,
 		(subclass > 0xff) || (protocol < -1) || (protocol > 0xff))
 		return OPENUSB_BADARG;
 
-	pthread_mutex_lock(&usbi_devices.lock);
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 	list_for_each_entry_safe(idev, tdev, &usbi_devices.head, dev_list) {
 		if (idev) {
-			pthread_mutex_unlock(&usbi_devices.lock);
+			usbi_mutex_unlock(&usbi_devices.lock);
 
 			if (usbi_match_class(handle, idev, devclass, subclass,
 						protocol)) {
@@ -766,18 +953,18 @@ int32_t openusb_get_devids_by_class(openusb_handle_t handle, int16_t devclass,
 				(*num_devids)++;
 			}
 
-			pthread_mutex_lock(&usbi_devices.lock);
+			usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 		}
 	}
 
 	if (*num_devids == 0) {
-		pthread_mutex_unlock(&usbi_devices.lock);
+		usbi_mutex_unlock(&usbi_devices.lock);
 		return OPENUSB_NULL_LIST;
 	}
 
 	*devids = calloc((*num_devids) * sizeof (openusb_devid_t), 1);
 	if (*devids == NULL) {
-		pthread_mutex_unlock(&usbi_devices.lock);
+		usbi_mutex_unlock(&usbi_devices.lock);
 		return OPENUSB_NO_RESOURCES;
 	}
 
@@ -789,7 +976,7 @@ int32_t openusb_get_devids_by_class(openusb_handle_t handle, int16_t devclass,
 			tdevid++;
 		}
 	}
-	pthread_mutex_unlock(&usbi_devices.lock);
+	usbi_mutex_unlock(&usbi_devices.lock);
 
 	return OPENUSB_SUCCESS;
 }
@@ -802,6 +989,147 @@ void openusb_free_devid_list(openusb_devid_t *devids)
 	free(devids);
 }
 
+/*
+ * Topology
+ *
+ * Every hub keeps the devices on its ports in its children array, so the
+ * device on a port is found without a scan and a whole tree is walked
+ * straight down. The dump lists a tree depth first: a node's subtree is
+ * the descendants nodes that follow it.
+ */
+int32_t openusb_get_child_devid(openusb_handle_t handle,
+	openusb_devid_t hub_devid, uint8_t port, openusb_devid_t *child_devid)
+{
+	struct usbi_device *hub;
+	int32_t ret;
+
+	if (!child_devid)
+		return OPENUSB_BADARG;
+
+	if (!usbi_find_handle(handle))
+		return OPENUSB_INVALID_HANDLE;
+
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
+	hub = usbi_lookup_device(hub_devid);
+	if (!hub) {
+		ret = OPENUSB_UNKNOWN_DEVICE;
+	} else if (port < 1 || port > hub->nports) {
+		ret = OPENUSB_BADARG;
+	} else if (!hub->children || !hub->children[port - 1]) {
+		ret = OPENUSB_NULL_LIST;
+	} else {
+		*child_devid = hub->children[port - 1]->devid;
+		ret = OPENUSB_SUCCESS;
+	}
+	usbi_mutex_unlock(&usbi_devices.lock);
+
+	return ret;
+}
+
+/* nodes in the tree below idev and idev itself */
+static uint32_t usbi_count_topology(struct usbi_device *idev)
+{
+	uint32_t count = 1;
+	int i;
+
+	for (i = 0; idev->children && i < idev->nports; i++) {
+		if (idev->children[i])
+			count += usbi_count_topology(idev->children[i]);
+	}
+
+	return count;
+}
+
+static uint32_t usbi_fill_topology(struct usbi_device *idev,
+	openusb_topology_node_t *nodes, uint32_t n, int32_t parent,
+	uint8_t depth)
+{
+	openusb_topology_node_t *node = &nodes[n];
+	uint32_t next = n + 1;
+	int i;
+
+	node->devid = idev->devid;
+	node->busid = idev->bus->busid;
+	node->pdevid = idev->parent ? idev->parent->devid : 0;
+	node->parent = parent;
+	node->pport = idev->pport;
+	node->nports = idev->nports;
+	node->depth = depth;
+
+	for (i = 0; idev->children && i < idev->nports; i++) {
+		if (idev->children[i])
+			next = usbi_fill_topology(idev->children[i], nodes,
+				next, n, depth + 1);
+	}
+	node->descendants = next - n - 1;
+
+	return next;
+}
+
+int32_t openusb_get_device_topology(openusb_handle_t handle,
+	openusb_devid_t devid, openusb_topology_node_t **nodes, uint32_t *num)
+{
+	struct usbi_device *idev, *root;
+	uint32_t count = 0, n = 0;
+
+	if (!nodes || !num)
+		return OPENUSB_BADARG;
+
+	*nodes = NULL;
+	*num = 0;
+
+	if (!usbi_find_handle(handle))
+		return OPENUSB_INVALID_HANDLE;
+
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
+
+	if (devid) {
+		root = usbi_lookup_device(devid);
+		if (!root) {
+			usbi_mutex_unlock(&usbi_devices.lock);
+			return OPENUSB_UNKNOWN_DEVICE;
+		}
+		count = usbi_count_topology(root);
+	} else {
+		/* every device without a parent starts a tree */
+		root = NULL;
+		list_for_each_entry(idev, &usbi_devices.head, dev_list) {
+			if (!idev->parent)
+				count += usbi_count_topology(idev);
+		}
+	}
+
+	if (count == 0) {
+		usbi_mutex_unlock(&usbi_devices.lock);
+		return OPENUSB_NULL_LIST;
+	}
+
+	*nodes = calloc(count, sizeof(**nodes));
+	if (!*nodes) {
+		usbi_mutex_unlock(&usbi_devices.lock);
+		return OPENUSB_NO_RESOURCES;
+	}
+
+	if (root) {
+		n = usbi_fill_topology(root, *nodes, 0, -1, 0);
+	} else {
+		list_for_each_entry(idev, &usbi_devices.head, dev_list) {
+			if (!idev->parent)
+				n = usbi_fill_topology(idev, *nodes, n, -1, 0);
+		}
+	}
+	usbi_mutex_unlock(&usbi_devices.lock);
+
+	*num = n;
+
+	return OPENUSB_SUCCESS;
+}
+
+void openusb_free_device_topology(openusb_topology_node_t *nodes)
+{
+	free(nodes);
+}
+
 #if 0
 /* return -1, when status != 0 or ret < 0 */
 int usbi_control_msg(openusb_dev_handle_t dev, int requesttype, int request,
@@ -894,7 +1222,6 @@ int32_t openusb_parse_device_desc(openusb_handle_t handle,
 	uint8_t *tmpbuf = NULL;
 	uint16_t tmplen;
 	int ret = OPENUSB_SUCCESS;
-	uint32_t count;
 
 	hdl = usbi_find_handle(handle);
 	if (!hdl)
@@ -918,11 +1245,7 @@ int32_t openusb_parse_device_desc(openusb_handle_t handle,
 		tmplen = buflen;
 	}
 
-	ret = openusb_parse_data("bbwbbbbwwwbbbb", tmpbuf, tmplen, devdesc,
-		sizeof (usb_device_desc_t), &count);
-
-	if ((ret == 0) && (count < USBI_DEVICE_DESC_SIZE))
-		ret = OPENUSB_PARSE_ERROR;
+	ret = usbi_decode_device_desc(tmpbuf, tmplen, devdesc);
 
 	if (buffer == NULL)
 		openusb_free_raw_desc(tmpbuf);
@@ -935,39 +1258,34 @@ int32_t openusb_parse_config_desc(openusb_handle_t handle,
 	uint8_t cfgidx, usb_config_desc_t *cfgdesc)
 {
 	struct usbi_handle *hdl;
-	uint8_t *tmpbuf = NULL;
-	uint16_t tmplen;
-	int ret = OPENUSB_SUCCESS;
-	uint32_t count;
+	struct usbi_device *idev;
+	struct usbi_desc_index *ix;
+	int ret;
 
 	hdl = usbi_find_handle(handle);
 	if (!hdl)
 		return OPENUSB_INVALID_HANDLE;
 
 	if (buffer == NULL) {
-		/* need to get raw desc internally */
-		ret = openusb_get_raw_desc(handle, devid, USB_DESC_TYPE_CONFIG,
-			cfgidx, 0, &tmpbuf, &tmplen);
+		/* openusb's own copy, read once */
+		idev = usbi_find_device_by_id(devid);
+		if (!idev)
+			return OPENUSB_UNKNOWN_DEVICE;
+
+		ret = usbi_lock_desc_index(idev, cfgidx, &ix);
 		if (ret < 0)
 			return ret;
-	} else {
-		if (buflen < USBI_CONFIG_DESC_SIZE)
-			return OPENUSB_BADARG;
 
-		tmpbuf = buffer;
-		tmplen = buflen;
-	}
+		ret = usbi_decode_config_desc(ix->raw, ix->rawlen, cfgdesc);
+		usbi_mutex_unlock(&usbi_desc_lock);
 
-	ret = openusb_parse_data("bbwbbbbb", tmpbuf, tmplen, cfgdesc,
-		sizeof (usb_config_desc_t), &count);
-
-	if ((ret == 0) && (count < USBI_CONFIG_DESC_SIZE))
-		ret = OPENUSB_PARSE_ERROR;
+		return ret;
+	}
 
-	if (buffer == NULL)
-		openusb_free_raw_desc(tmpbuf);
+	if (buflen < USBI_CONFIG_DESC_SIZE)
+		return OPENUSB_BADARG;
 
-	return ret;
+	return usbi_decode_config_desc(buffer, buflen, cfgdesc);
 }
 
 int32_t openusb_parse_interface_desc(openusb_handle_t handle,
@@ -976,42 +1294,50 @@ int32_t openusb_parse_interface_desc(openusb_handle_t handle,
 	usb_interface_desc_t *ifcdesc)
 {
 	struct usbi_handle *hdl;
-	uint8_t *tmpbuf, *sp;
+	struct usbi_device *idev;
+	struct usbi_desc_index *ix;
+	struct usbi_alt_index *ai;
+	uint8_t *sp;
 	uint16_t tmplen;
 	int ret = OPENUSB_PARSE_ERROR;
-	uint32_t count;
 
 	hdl = usbi_find_handle(handle);
 	if (!hdl)
 		return OPENUSB_INVALID_HANDLE;
 
 	if (buffer == NULL) {
-		/* need to get raw desc internally */
-		ret = openusb_get_raw_desc(handle, devid, USB_DESC_TYPE_CONFIG,
-			cfgidx, 0, &tmpbuf, &tmplen);
+		/* look it up in openusb's index of the configuration */
+		idev = usbi_find_device_by_id(devid);
+		if (!idev)
+			return OPENUSB_UNKNOWN_DEVICE;
+
+		ret = usbi_lock_desc_index(idev, cfgidx, &ix);
 		if (ret < 0)
 			return ret;
-	} else {
-		if (buflen < USBI_CONFIG_DESC_SIZE)
-			return OPENUSB_BADARG;
 
-		tmpbuf = buffer;
-		tmplen = buflen;
+		ai = usbi_find_alt_index(ix, ifcidx, alt);
+		if (ai) {
+			ret = usbi_decode_interface_desc(ix->raw + ai->offset,
+				ix->rawlen - ai->offset, ifcdesc);
+		} else {
+			ret = OPENUSB_PARSE_ERROR;
+		}
+		usbi_mutex_unlock(&usbi_desc_lock);
+
+		return ret;
 	}
-	
-	ret = OPENUSB_PARSE_ERROR; /* otherwise, the remaining will return
-				   * success even if it never find a match
-				   * interface
-				   */
-	sp = tmpbuf;
+
+	if (buflen < USBI_CONFIG_DESC_SIZE)
+		return OPENUSB_BADARG;
+
+	/* the caller's buffer is scanned, it may be anything */
+	tmplen = buflen;
+	sp = buffer;
 	while (tmplen > 3) {
 		if ((sp[1] == USB_DESC_TYPE_INTERFACE) &&
 			(sp[2] == ifcidx) &&
 			(sp[3] == alt)) {
-			ret = openusb_parse_data("bbbbbbbbb", sp, tmplen,
-				ifcdesc, sizeof (usb_interface_desc_t), &count);
-			if ((ret == 0) && (count < USBI_INTERFACE_DESC_SIZE))
-				ret = OPENUSB_PARSE_ERROR;
+			ret = usbi_decode_interface_desc(sp, tmplen, ifcdesc);
 			break;
 		}
 
@@ -1024,9 +1350,6 @@ int32_t openusb_parse_interface_desc(openusb_handle_t handle,
 		}
 	}
 
-	if (buffer == NULL)
-		openusb_free_raw_desc(tmpbuf);
-
 	return ret;
 }
 
@@ -1061,35 +1384,56 @@ int32_t openusb_parse_endpoint_desc(openusb_handle_t handle,
 	usb_endpoint_desc_t *eptdesc)
 {
 	struct usbi_handle *hdl;
-	uint8_t *tmpbuf, *sp1, *sp2;
-	uint16_t tmplen;
+	struct usbi_device *idev;
+	struct usbi_desc_index *ix;
+	struct usbi_alt_index *ai;
+	uint8_t *sp1, *sp2;
+	uint16_t tmplen, off;
 	int ret = OPENUSB_PARSE_ERROR;
-	uint32_t count;
 
 	hdl = usbi_find_handle(handle);
 	if (!hdl)
 		return OPENUSB_INVALID_HANDLE;
 
 	if (buffer == NULL) {
-		/* need to get raw desc internally */
-		ret = openusb_get_raw_desc(handle, devid, USB_DESC_TYPE_CONFIG,
-				cfgidx, 0, &tmpbuf, &tmplen);
+		/* look it up in openusb's index of the configuration */
+		idev = usbi_find_device_by_id(devid);
+		if (!idev)
+			return OPENUSB_UNKNOWN_DEVICE;
+
+		ret = usbi_lock_desc_index(idev, cfgidx, &ix);
 		if (ret < 0) {
 			usbi_debug(hdl, 1, "Get raw fail:%s",
 				openusb_strerror(ret));
 			return ret;
 		}
-	} else {
-		if (buflen < USBI_CONFIG_DESC_SIZE) {
-			usbi_debug(hdl, 1, "Invalid buffer length");
-			return OPENUSB_BADARG;
+
+		ai = usbi_find_alt_index(ix, ifcidx, alt);
+		if (!ai) {
+			ret = OPENUSB_PARSE_ERROR;
+		} else if (eptidx >= ix->raw[ai->offset + 4]) {
+			usbi_debug(hdl, 1, "Invalid endpoint:%d",eptidx);
+			ret = OPENUSB_BADARG;
+		} else if (eptidx >= ai->num_eps) {
+			ret = OPENUSB_PARSE_ERROR;
+		} else {
+			off = ix->ep_offsets[ai->first_ep + eptidx];
+			ret = usbi_decode_endpoint_desc(ix->raw + off,
+				ix->rawlen - off, eptdesc);
 		}
+		usbi_mutex_unlock(&usbi_desc_lock);
 
-		tmpbuf = buffer;
-		tmplen = buflen;
+		return ret;
 	}
 
-	sp1 = tmpbuf;
+	if (buflen < USBI_CONFIG_DESC_SIZE) {
+		usbi_debug(hdl, 1, "Invalid buffer length");
+		return OPENUSB_BADARG;
+	}
+
+	/* the caller's buffer is scanned, it may be anything */
+	tmplen = buflen;
+	sp1 = buffer;
 	while (tmplen > 4) {
 		if ((sp1[1] == USB_DESC_TYPE_INTERFACE) &&
 			(sp1[2] == ifcidx) &&
@@ -1111,10 +1455,7 @@ int32_t openusb_parse_endpoint_desc(openusb_handle_t handle,
 			}
 			tmplen -= (sp1 - sp2);
 
-			ret = openusb_parse_data("bbbbwb", sp1, tmplen,
-				eptdesc, sizeof (usb_endpoint_desc_t), &count);
-			if ((ret == 0) && (count < USBI_ENDPOINT_DESC_SIZE))
-				ret = OPENUSB_PARSE_ERROR;
+			ret = usbi_decode_endpoint_desc(sp1, tmplen, eptdesc);
 			break;
 		}
 
@@ -1127,17 +1468,219 @@ int32_t openusb_parse_endpoint_desc(openusb_handle_t handle,
 		}
 	}
 
-	if (buffer == NULL)
-		openusb_free_raw_desc(tmpbuf);
-
 	return ret;
 }
 
 
+/*
+ * String descriptor cache
+ *
+ * String descriptors don't change while a device stays attached, so every
+ * one read by usbi_get_string() is kept on its usbi_device, keyed by index
+ * and LANGID, along with its UTF-8 decoding. The LANGID table (string
+ * descriptor zero) is cached the same way, so language negotiation costs
+ * one transfer per device. The cache is dropped when the device is removed
+ * or reset.
+ */
+static pthread_mutex_t usbi_strings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* decode the UTF-16LE bString of a string descriptor */
+static char *usbi_string_to_utf8(const uint8_t *raw)
+{
+	uint32_t c, c2;
+	char *utf8, *dp;
+	int i, len = raw[0];
+
+	/* 3 bytes per code unit covers surrogate pairs too */
+	utf8 = malloc((len / 2) * 3 + 1);
+	if (!utf8)
+		return NULL;
+
+	dp = utf8;
+	for (i = 2; i + 1 < len; i += 2) {
+		c = USBI_LE16(raw + i);
+
+		if (c >= 0xd800 && c < 0xdc00 && i + 3 < len) {
+			c2 = USBI_LE16(raw + i + 2);
+			if (c2 >= 0xdc00 && c2 < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				i += 2;
+			}
+		}
+		if (c >= 0xd800 && c < 0xe000)
+			c = 0xfffd;	/* unpaired surrogate */
+
+		if (c < 0x80) {
+			*dp++ = c;
+		} else if (c < 0x800) {
+			*dp++ = 0xc0 | (c >> 6);
+			*dp++ = 0x80 | (c & 0x3f);
+		} else if (c < 0x10000) {
+			*dp++ = 0xe0 | (c >> 12);
+			*dp++ = 0x80 | ((c >> 6) & 0x3f);
+			*dp++ = 0x80 | (c & 0x3f);
+		} else {
+			*dp++ = 0xf0 | (c >> 18);
+			*dp++ = 0x80 | ((c >> 12) & 0x3f);
+			*dp++ = 0x80 | ((c >> 6) & 0x3f);
+			*dp++ = 0x80 | (c & 0x3f);
+		}
+	}
+	*dp = 0;
+
+	return utf8;
+}
+
+/* caller holds usbi_strings_lock */
+static struct usbi_string *usbi_find_string(struct usbi_device *idev,
+	uint8_t index, uint16_t langid)
+{
+	struct usbi_string *str;
+
+	for (str = idev->strings; str; str = str->next) {
+		if (str->index == index && str->langid == langid)
+			return str;
+	}
+
+	return NULL;
+}
+
+/* does raw of len bytes hold a complete string descriptor? */
+static int usbi_string_valid(const uint8_t *raw, int len)
+{
+	return (len >= USBI_DESC_HEADER_SIZE && raw[0] >= USBI_DESC_HEADER_SIZE &&
+		raw[0] <= len && raw[1] == USB_DESC_TYPE_STRING);
+}
+
+static void usbi_cache_string(struct usbi_device *idev, uint8_t index,
+	uint16_t langid, const uint8_t *raw)
+{
+	struct usbi_string *str;
+
+	str = calloc(1, sizeof(*str));
+	if (!str)
+		return;
+
+	str->index = index;
+	str->langid = langid;
+	str->raw = malloc(raw[0]);
+	str->utf8 = usbi_string_to_utf8(raw);
+	if (!str->raw || !str->utf8) {
+		free(str->raw);
+		free(str->utf8);
+		free(str);
+		return;
+	}
+	memcpy(str->raw, raw, raw[0]);
+
+	usbi_mutex_lock(&usbi_strings_lock, USBI_LOCK_STRINGS);
+	if (usbi_find_string(idev, index, langid)) {
+		/* somebody else was faster */
+		usbi_mutex_unlock(&usbi_strings_lock);
+		free(str->raw);
+		free(str->utf8);
+		free(str);
+		return;
+	}
+	str->next = idev->strings;
+	idev->strings = str;
+	usbi_mutex_unlock(&usbi_strings_lock);
+}
+
+/* copy a cached descriptor to buf, -1 if it isn't cached */
+static int usbi_lookup_string(struct usbi_device *idev, uint8_t index,
+	uint16_t langid, char *buf, size_t buflen)
+{
+	struct usbi_string *str;
+	int len = -1;
+
+	usbi_mutex_lock(&usbi_strings_lock, USBI_LOCK_STRINGS);
+	str = usbi_find_string(idev, index, langid);
+	if (str) {
+		len = str->raw[0] < buflen ? str->raw[0] : buflen;
+		memcpy(buf, str->raw, len);
+	}
+	usbi_mutex_unlock(&usbi_strings_lock);
+
+	return len;
+}
+
+static int usbi_string_cached(struct usbi_device *idev, uint8_t index,
+	uint16_t langid)
+{
+	int cached;
+
+	usbi_mutex_lock(&usbi_strings_lock, USBI_LOCK_STRINGS);
+	cached = usbi_find_string(idev, index, langid) != NULL;
+	usbi_mutex_unlock(&usbi_strings_lock);
+
+	return cached;
+}
+
+/*
+ * the first LANGID from the cached LANGID table, 0x409 if the device
+ * doesn't list any and -1 if the table hasn't been read yet
+ */
+static int usbi_cached_langid(struct usbi_device *idev)
+{
+	struct usbi_string *str;
+	int langid = -1;
+
+	usbi_mutex_lock(&usbi_strings_lock, USBI_LOCK_STRINGS);
+	str = usbi_find_string(idev, 0, 0);
+	if (str)
+		langid = str->raw[0] >= 4 ? USBI_LE16(str->raw + 2) : 0x409;
+	usbi_mutex_unlock(&usbi_strings_lock);
+
+	return langid;
+}
+
+/* malloc'ed copy of a cached descriptor (utf8 == 0) or its decoding */
+static void *usbi_dup_cached_string(struct usbi_device *idev, uint8_t index,
+	uint16_t langid, int utf8)
+{
+	struct usbi_string *str;
+	void *copy = NULL;
+
+	usbi_mutex_lock(&usbi_strings_lock, USBI_LOCK_STRINGS);
+	str = usbi_find_string(idev, index, langid);
+	if (str) {
+		if (utf8) {
+			copy = strdup(str->utf8);
+		} else {
+			copy = malloc(str->raw[0]);
+			if (copy)
+				memcpy(copy, str->raw, str->raw[0]);
+		}
+	}
+	usbi_mutex_unlock(&usbi_strings_lock);
+
+	return copy;
+}
+
+void usbi_flush_string_cache(struct usbi_device *idev)
+{
+	struct usbi_string *str, *next;
+
+	usbi_mutex_lock(&usbi_strings_lock, USBI_LOCK_STRINGS);
+	str = idev->strings;
+	idev->strings = NULL;
+	usbi_mutex_unlock(&usbi_strings_lock);
+
+	for (; str; str = next) {
+		next = str->next;
+		free(str->raw);
+		free(str->utf8);
+		free(str);
+	}
+}
+
 int usbi_get_string(openusb_dev_handle_t dev, int index, int langid, char *buf,
     size_t buflen)
 {
 	openusb_ctrl_request_t ctrl;
+	struct usbi_dev_handle *hdev;
+	int ret;
 	
 	/* if index == 0, then the caller wants to get STRING descript Zero
 	 * for LANGIDs
@@ -1149,6 +1692,17 @@ int usbi_get_string(openusb_dev_handle_t dev, int index, int langid, char *buf,
 		return OPENUSB_BADARG;
 	}
 
+	hdev = usbi_find_dev_handle(dev);
+	if (hdev) {
+		ret = usbi_lookup_string(hdev->idev, index, langid, buf,
+			buflen);
+		if (ret >= 0) {
+			usbi_debug(NULL, 4, "usbi_get_string(): index=%d "
+				"langid=0x%x cached", index, langid);
+			return ret;
+		}
+	}
+
 	memset(&ctrl, 0, sizeof(ctrl));
 	ctrl.setup.bmRequestType = USB_REQ_DEV_TO_HOST;
 	ctrl.setup.bRequest = USB_REQ_GET_DESCRIPTOR;
@@ -1156,7 +1710,7 @@ int usbi_get_string(openusb_dev_handle_t dev, int index, int langid, char *buf,
 	ctrl.setup.wIndex = langid;
 	ctrl.payload = (uint8_t *)buf;
 	ctrl.length = buflen;
-	ctrl.timeout = 100;
+	ctrl.timeout = USBI_STRING_TIMEOUT;
 
 	usbi_debug(NULL, 4,
 		"usbi_get_string(): index=%d langid=0x%x len=%d",
@@ -1164,12 +1718,44 @@ int usbi_get_string(openusb_dev_handle_t dev, int index, int langid, char *buf,
 
 
 	if(openusb_ctrl_xfer(dev, 0, 0, &ctrl) == 0) {
-		return ctrl.result.transferred_bytes;
+		ret = ctrl.result.transferred_bytes;
+		if (hdev && usbi_string_valid((uint8_t *)buf, ret))
+			usbi_cache_string(hdev->idev, index, langid,
+				(uint8_t *)buf);
+
+		return ret;
 	} else {
 		return -1;
 	}
 }
 
+/*
+ * the LANGID strings are read in: the first one the device lists, or US
+ * English if it lists none
+ */
+int usbi_get_langid(openusb_dev_handle_t dev)
+{
+	unsigned char tbuf[256];
+	int ret;
+
+	/*
+	 * Asking for the zero'th index is special - it returns a string
+	 * descriptor that contains all the language IDs supported by the
+	 * device. Typically there aren't many - often only one. The
+	 * language IDs are 16 bit numbers, and they start at the third byte
+	 * in the descriptor. See USB 2.0 specification, section 9.6.7, for
+	 * more information on this.
+	 */
+	ret = usbi_get_string(dev, 0, 0, (char *)tbuf, sizeof (tbuf));
+	usbi_debug(NULL, 4, "usbi_get_string() first returned %d", ret);
+
+	if (ret < 4) {
+		return 0x409;
+	}
+
+	return USBI_LE16(tbuf + 2);
+}
+
 /* return value:
  * 	> 0 string character numbers 
  *      < 0 errors
@@ -1196,22 +1782,7 @@ int usbi_get_string_simple(openusb_dev_handle_t dev, int index, char *buf,
 
 	(void) memset(buf, 0, buflen);
 
-	/*
-	 * Asking for the zero'th index is special - it returns a string
-	 * descriptor that contains all the language IDs supported by the
-	 * device. Typically there aren't many - often only one. The
-	 * language IDs are 16 bit numbers, and they start at the third byte
-	 * in the descriptor. See USB 2.0 specification, section 9.6.7, for
-	 * more information on this.
-	 */
-	ret = usbi_get_string(dev, 0, 0, tbuf, sizeof (tbuf));
-	usbi_debug(NULL, 4, "usbi_get_string() first returned %d", ret);
-
-	if (ret < 4) {
-		langid = 0x409;
-	} else {
-		langid = tbuf[2] | (tbuf[3] << 8);
-	}
+	langid = usbi_get_langid(dev);
 
 	ret = usbi_get_string(dev, index, langid, tbuf, sizeof (tbuf));
 
@@ -1249,6 +1820,38 @@ int usbi_get_string_simple(openusb_dev_handle_t dev, int index, char *buf,
 }
 
 
+/*
+ * fill the string descriptors of pdata from the cache, -1 if one of them
+ * hasn't been read yet
+ */
+static int usbi_dup_cached_strings(struct usbi_device *idev, uint16_t langid,
+	openusb_dev_data_t *pdata)
+{
+	usb_device_desc_t *desc = &pdata->dev_desc;
+
+	if (desc->iManufacturer && !(pdata->manufacturer =
+		usbi_dup_cached_string(idev, desc->iManufacturer, langid, 0)))
+		goto missing;
+	if (desc->iProduct && !(pdata->product =
+		usbi_dup_cached_string(idev, desc->iProduct, langid, 0)))
+		goto missing;
+	if (desc->iSerialNumber && !(pdata->serialnumber =
+		usbi_dup_cached_string(idev, desc->iSerialNumber, langid, 0)))
+		goto missing;
+
+	return 0;
+
+missing:
+	free(pdata->manufacturer);
+	free(pdata->product);
+	free(pdata->serialnumber);
+	pdata->manufacturer = NULL;
+	pdata->product = NULL;
+	pdata->serialnumber = NULL;
+
+	return -1;
+}
+
 /* TODO */
 int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 	uint32_t flags, openusb_dev_data_t **data)
@@ -1260,8 +1863,9 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 	uint8_t *descdata = NULL;
 	int ret;
 	char strings[256];
-	openusb_dev_handle_t hdev;
+	openusb_dev_handle_t hdev = 0;
 	struct usbi_dev_handle *devh = NULL, *dev_found=NULL;
+	int langid;
 
 	usbi_debug(NULL, 4, "devid=%d, flags=%d",(int)devid, flags);
 
@@ -1284,7 +1888,7 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 	}
 	memset(pdata, 0, sizeof(*pdata));
 
-	pthread_mutex_lock(&pdev->bus->lock);
+	usbi_mutex_lock(&pdev->bus->lock, USBI_LOCK_BUS);
 	pdata->bulk_max_xfer_size = pdev->bus->max_xfer_size[USB_TYPE_BULK];
 	pdata->ctrl_max_xfer_size = pdev->bus->max_xfer_size[USB_TYPE_CONTROL];
 	pdata->intr_max_xfer_size = pdev->bus->max_xfer_size[USB_TYPE_INTERRUPT];
@@ -1292,7 +1896,7 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 
 	pdata->busid = pdev->bus->busid;
 	pdata->bus_address = pdev->bus->busnum;
-	pthread_mutex_unlock(&pdev->bus->lock);
+	usbi_mutex_unlock(&pdev->bus->lock);
 
 	/* since we're not allowed to cache device data internally,we'll have
 	 * to get raw descriptors
@@ -1311,17 +1915,25 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 	}
 
 #if 1
-	/* get manufacturer, product, serialnumber strings
-	 * Use 0x0409 US English as default LANGID. To get other
-	 * language strings, use openusb_get_raw_desc instead.
+	/* get manufacturer, product, serialnumber strings in the first
+	 * LANGID the device lists. To get other language strings, use
+	 * openusb_get_raw_desc instead.
+	 *
+	 * Strings read before come from the cache and don't need the
+	 * device to be opened.
 	 */
+	langid = usbi_cached_langid(pdev);
+	if (langid >= 0 && usbi_dup_cached_strings(pdev, langid, pdata) == 0) {
+		usbi_debug(NULL, 4, "strings cached");
+		goto get_raw;
+	}
 
 	/* find if we have already opened this device
 	 * We have to access an opened device to get_string
 	 * FIXME: what about just re-opening it no matter it's
 	 *	opened or not.
 	 */
-	pthread_mutex_lock(&usbi_dev_handles.lock);
+	usbi_mutex_lock(&usbi_dev_handles.lock, USBI_LOCK_DEV_HANDLES);
 	list_for_each_entry(devh, &usbi_dev_handles.head, list) {
 	/* safe */
 		if (devh && devh->idev && devh->idev->devid == devid) {
@@ -1329,7 +1941,7 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 			break;
 		}
 	}
-	pthread_mutex_unlock(&usbi_dev_handles.lock);
+	usbi_mutex_unlock(&usbi_dev_handles.lock);
 
 	if (!dev_found) {
 	/* not opened yet */
@@ -1360,15 +1972,17 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 		hdev = dev_found->handle;
 	}
 
+	langid = usbi_get_langid(hdev);
+
 	/* manufacturer */
 	if (pdata->dev_desc.iManufacturer) {
 		usbi_debug(NULL, 1, "get manufacturer");
 		if ((ret = usbi_get_string(hdev, pdata->dev_desc.iManufacturer,
-			0x409, strings, sizeof(strings))) < 0) {
+			langid, strings, sizeof(strings))) < 0) {
 			/* this should not be an error, perhaps we just don't have permission */
 			pdata->manufacturer = NULL;
 		} else {
-			if ((pdata->manufacturer = calloc(strings[0], 1)) == NULL) {
+			if ((pdata->manufacturer = calloc((uint8_t)strings[0], 1)) == NULL) {
 				free(pdata);
 				if (!dev_found) {
 					openusb_close_device(hdev);
@@ -1376,7 +1990,7 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 				}
 				return OPENUSB_NO_RESOURCES;
 			}
-			memcpy(pdata->manufacturer, strings, strings[0]);
+			memcpy(pdata->manufacturer, strings, (uint8_t)strings[0]);
 		}
 	}
 
@@ -1384,11 +1998,11 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 	if (pdata->dev_desc.iProduct) {
 		usbi_debug(NULL, 1, "get product");
 		if ((ret = usbi_get_string(hdev, pdata->dev_desc.iProduct,
-			0x409, strings, sizeof(strings))) < 0) {
+			langid, strings, sizeof(strings))) < 0) {
 			/* this should not be an error, perhaps we just don't have permission */
 			pdata->product = NULL;
 		} else {
-			if ((pdata->product= calloc(strings[0], 1)) == NULL) {
+			if ((pdata->product= calloc((uint8_t)strings[0], 1)) == NULL) {
 				free(pdata->manufacturer);
 				free(pdata);
 				if (!dev_found) {
@@ -1397,18 +2011,18 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 				}
 				return OPENUSB_NO_RESOURCES;
 			}
-			memcpy(pdata->product, strings, strings[0]);
+			memcpy(pdata->product, strings, (uint8_t)strings[0]);
 		}
 	}
 
 	/* serial Number */
 	if (pdata->dev_desc.iSerialNumber) {
 		if ((ret = usbi_get_string(hdev, pdata->dev_desc.iSerialNumber,
-			0x409, strings, sizeof(strings))) < 0) {
+			langid, strings, sizeof(strings))) < 0) {
 			/* this should not be an error, perhaps we just don't have permission */
 			pdata->serialnumber = NULL;
 		} else {
-			if ((pdata->serialnumber = calloc(strings[0], 1)) == NULL) {
+			if ((pdata->serialnumber = calloc((uint8_t)strings[0], 1)) == NULL) {
 				free(pdata->product);
 				free(pdata->manufacturer);
 				free(pdata);
@@ -1418,7 +2032,7 @@ int32_t openusb_get_device_data(openusb_handle_t handle, openusb_devid_t devid,
 				}
 				return OPENUSB_NO_RESOURCES;
 			}
-			memcpy(pdata->serialnumber, strings, strings[0]);
+			memcpy(pdata->serialnumber, strings, (uint8_t)strings[0]);
 		}
 	}
 	
@@ -1463,8 +2077,10 @@ get_raw:
 
 	pdata->devid = devid;
 	pdata->nports = pdev->nports;
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 	pdata->pdevid = (pdev->parent)?pdev->parent->devid:0;/* 0 for root hub */
 	pdata->pport = pdev->pport;
+	usbi_mutex_unlock(&usbi_devices.lock);
 
 	*data = pdata;
 	return 0;
@@ -1507,6 +2123,351 @@ void openusb_free_device_data(openusb_dev_data_t *data)
 	free(data);
 }
 
+/*
+ * openusb_get_device_strings() state for one device
+ */
+struct usbi_strings_dev {
+	openusb_dev_strings_t	*result;
+	struct usbi_device	*idev;
+	openusb_dev_handle_t	hdev;
+	int			opened;		/* by us, close when done */
+	int			need_io;
+	uint16_t		langid;
+	uint8_t			index[3];	/* manufacturer, product, serial */
+};
+
+/* one GET_DESCRIPTOR(STRING) request */
+struct usbi_string_xfer {
+	struct openusb_request_handle	req;
+	openusb_ctrl_request_t		ctrl;
+	struct usbi_strings_dev		*dev;
+	uint8_t				index;
+	uint16_t			langid;
+	int32_t				status;
+	uint8_t				buf[256];
+};
+
+static void usbi_init_string_xfer(struct usbi_string_xfer *xfer,
+	struct usbi_strings_dev *dev, uint8_t index, uint16_t langid)
+{
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->dev = dev;
+	xfer->index = index;
+	xfer->langid = langid;
+
+	xfer->ctrl.setup.bmRequestType = USB_REQ_DEV_TO_HOST;
+	xfer->ctrl.setup.bRequest = USB_REQ_GET_DESCRIPTOR;
+	xfer->ctrl.setup.wValue = (USB_DESC_TYPE_STRING << 8) + index;
+	xfer->ctrl.setup.wIndex = langid;
+	xfer->ctrl.payload = xfer->buf;
+	xfer->ctrl.length = sizeof(xfer->buf);
+	xfer->ctrl.timeout = USBI_STRING_TIMEOUT;
+
+	xfer->req.dev = dev->hdev;
+	xfer->req.interface = 0;
+	xfer->req.endpoint = 0;
+	xfer->req.type = USB_TYPE_CONTROL;
+	xfer->req.req.ctrl = &xfer->ctrl;
+}
+
+/*
+ * Submit all requests at once, then wait for them. Requests to different
+ * devices run in parallel and the ones to the same device are queued on its
+ * default pipe back to back. Successful reads go into the string cache.
+ * Returns -1 if waiting failed with requests still in flight.
+ */
+static int usbi_run_string_xfers(struct usbi_string_xfer *xfers, uint32_t num)
+{
+	openusb_request_handle_t *pending, done;
+	uint32_t npending = 0, i;
+	int ret = 0;
+
+	if (num == 0)
+		return 0;
+
+	pending = calloc(num, sizeof(*pending));
+	if (!pending) {
+		for (i = 0; i < num; i++)
+			xfers[i].status = OPENUSB_NO_RESOURCES;
+		return 0;
+	}
+
+	for (i = 0; i < num; i++) {
+		xfers[i].status = openusb_xfer_aio(&xfers[i].req);
+		if (xfers[i].status == OPENUSB_SUCCESS)
+			pending[npending++] = &xfers[i].req;
+	}
+
+	while (npending) {
+		if (openusb_wait(npending, pending, &done) != 0) {
+			usbi_debug(NULL, 1, "waiting for %d string requests "
+				"failed", npending);
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < npending; i++) {
+			if (pending[i] == done) {
+				pending[i] = pending[--npending];
+				break;
+			}
+		}
+	}
+	free(pending);
+
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < num; i++) {
+		struct usbi_string_xfer *xfer = xfers + i;
+
+		if (xfer->status != OPENUSB_SUCCESS)
+			continue;
+
+		xfer->status = xfer->ctrl.result.status;
+		if (xfer->status != OPENUSB_SUCCESS)
+			continue;
+
+		if (usbi_string_valid(xfer->buf,
+			xfer->ctrl.result.transferred_bytes))
+			usbi_cache_string(xfer->dev->idev, xfer->index,
+				xfer->langid, xfer->buf);
+		else
+			xfer->status = OPENUSB_PARSE_ERROR;
+	}
+
+	return 0;
+}
+
+/* fill in the strings from the cache, -1 if some are still missing */
+static int usbi_fill_strings(struct usbi_strings_dev *dev)
+{
+	openusb_dev_strings_t *res = dev->result;
+	char **str[3];
+	int i, missing = 0;
+
+	str[0] = &res->manufacturer;
+	str[1] = &res->product;
+	str[2] = &res->serialnumber;
+
+	res->langid = dev->langid;
+	for (i = 0; i < 3; i++) {
+		if (!dev->index[i] || *str[i])
+			continue;
+
+		*str[i] = usbi_dup_cached_string(dev->idev, dev->index[i],
+			dev->langid, 1);
+		if (!*str[i])
+			missing = 1;
+	}
+
+	return missing ? -1 : 0;
+}
+
+/* a handle of this openusb instance the device is already open with */
+static openusb_dev_handle_t usbi_find_open_handle(struct usbi_handle *hdl,
+	openusb_devid_t devid)
+{
+	struct usbi_dev_handle *devh;
+	openusb_dev_handle_t handle = 0;
+
+	usbi_mutex_lock(&usbi_dev_handles.lock, USBI_LOCK_DEV_HANDLES);
+	list_for_each_entry(devh, &usbi_dev_handles.head, list) {
+	/* safe */
+		if (devh->lib_hdl == hdl && devh->idev &&
+			devh->idev->devid == devid &&
+			devh->state == USBI_DEVICE_OPENED) {
+			handle = devh->handle;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&usbi_dev_handles.lock);
+
+	return handle;
+}
+
+int32_t openusb_get_device_strings(openusb_handle_t handle,
+	openusb_devid_t *devids, uint32_t num, openusb_dev_strings_t **strings)
+{
+	struct usbi_handle *hdl;
+	struct usbi_strings_dev *devs = NULL, *dev;
+	struct usbi_string_xfer *xfers = NULL;
+	openusb_dev_strings_t *res = NULL;
+	openusb_devid_t *open_ids = NULL;
+	openusb_dev_handle_t *open_devs = NULL;
+	int32_t *open_status = NULL;
+	usb_device_desc_t desc;
+	uint32_t i, j, k, nopen = 0, nxfers;
+	int langid, ret;
+
+	hdl = usbi_find_handle(handle);
+	if (!hdl)
+		return OPENUSB_INVALID_HANDLE;
+
+	if (!devids || num == 0 || !strings)
+		return OPENUSB_BADARG;
+
+	res = calloc(num, sizeof(*res));
+	devs = calloc(num, sizeof(*devs));
+	open_ids = calloc(num, sizeof(*open_ids));
+	open_devs = calloc(num, sizeof(*open_devs));
+	open_status = calloc(num, sizeof(*open_status));
+	xfers = calloc(num * 3, sizeof(*xfers));
+	if (!res || !devs || !open_ids || !open_devs || !open_status ||
+		!xfers) {
+		free(res);
+		ret = OPENUSB_NO_RESOURCES;
+		goto out;
+	}
+
+	/* answer what we can from the cache */
+	for (i = 0; i < num; i++) {
+		dev = devs + i;
+		dev->result = res + i;
+		res[i].devid = devids[i];
+
+		dev->idev = usbi_find_device_by_id(devids[i]);
+		if (!dev->idev) {
+			res[i].status = OPENUSB_UNKNOWN_DEVICE;
+			continue;
+		}
+
+		ret = openusb_parse_device_desc(handle, devids[i], NULL, 0,
+			&desc);
+		if (ret != OPENUSB_SUCCESS) {
+			res[i].status = ret;
+			continue;
+		}
+
+		dev->index[0] = desc.iManufacturer;
+		dev->index[1] = desc.iProduct;
+		dev->index[2] = desc.iSerialNumber;
+		if (!dev->index[0] && !dev->index[1] && !dev->index[2])
+			continue;
+
+		langid = usbi_cached_langid(dev->idev);
+		if (langid >= 0) {
+			dev->langid = langid;
+			if (usbi_fill_strings(dev) == 0)
+				continue;
+		}
+
+		dev->need_io = 1;
+		dev->hdev = usbi_find_open_handle(hdl, devids[i]);
+		if (!dev->hdev)
+			open_ids[nopen++] = devids[i];
+	}
+
+	/* open everything that isn't open yet in one go */
+	if (nopen) {
+		openusb_open_devices(handle, open_ids, nopen, USB_INIT_DEFAULT,
+			open_devs, open_status);
+
+		for (i = 0, j = 0; i < num; i++) {
+			dev = devs + i;
+			if (!dev->need_io || dev->hdev)
+				continue;
+
+			if (open_status[j] == OPENUSB_SUCCESS) {
+				dev->hdev = open_devs[j];
+				dev->opened = 1;
+			} else {
+				res[i].status = open_status[j];
+				dev->need_io = 0;
+			}
+			j++;
+		}
+	}
+
+	/* LANGID tables of all devices that need them */
+	for (i = 0, nxfers = 0; i < num; i++) {
+		dev = devs + i;
+		if (dev->need_io && usbi_cached_langid(dev->idev) < 0)
+			usbi_init_string_xfer(xfers + nxfers++, dev, 0, 0);
+	}
+
+	if (usbi_run_string_xfers(xfers, nxfers) < 0) {
+		/* requests may still be in flight, don't free them */
+		xfers = NULL;
+		ret = OPENUSB_PLATFORM_FAILURE;
+		goto close;
+	}
+
+	/* then all the strings */
+	for (i = 0, nxfers = 0; i < num; i++) {
+		dev = devs + i;
+		if (!dev->need_io)
+			continue;
+
+		langid = usbi_cached_langid(dev->idev);
+		dev->langid = langid >= 0 ? langid : 0x409;
+
+		for (k = 0; k < 3; k++) {
+			if (dev->index[k] && !usbi_string_cached(dev->idev,
+				dev->index[k], dev->langid))
+				usbi_init_string_xfer(xfers + nxfers++, dev,
+					dev->index[k], dev->langid);
+		}
+	}
+
+	if (usbi_run_string_xfers(xfers, nxfers) < 0) {
+		xfers = NULL;
+		ret = OPENUSB_PLATFORM_FAILURE;
+		goto close;
+	}
+
+	for (i = 0; i < nxfers; i++) {
+		if (xfers[i].status != OPENUSB_SUCCESS &&
+			xfers[i].dev->result->status == OPENUSB_SUCCESS)
+			xfers[i].dev->result->status = xfers[i].status;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (devs[i].need_io)
+			usbi_fill_strings(devs + i);
+	}
+
+	ret = OPENUSB_SUCCESS;
+
+close:
+	for (i = 0, j = 0; i < num; i++) {
+		if (devs[i].opened)
+			open_devs[j++] = devs[i].hdev;
+	}
+	if (j)
+		openusb_close_devices(open_devs, j, NULL);
+
+	if (ret == OPENUSB_SUCCESS)
+		*strings = res;
+	else
+		openusb_free_device_strings(res, num);
+
+out:
+	free(devs);
+	free(open_ids);
+	free(open_devs);
+	free(open_status);
+	free(xfers);
+
+	return ret;
+}
+
+void openusb_free_device_strings(openusb_dev_strings_t *strings, uint32_t num)
+{
+	uint32_t i;
+
+	if (strings == NULL)
+		return;
+
+	for (i = 0; i < num; i++) {
+		free(strings[i].manufacturer);
+		free(strings[i].product);
+		free(strings[i].serialnumber);
+	}
+
+	free(strings);
+}
+
 int32_t openusb_get_max_xfer_size(openusb_handle_t handle,
 	openusb_busid_t bus, openusb_transfer_type_t type, uint32_t *bytes)
 {
@@ -1531,9 +2492,9 @@ int32_t openusb_get_max_xfer_size(openusb_handle_t handle,
 	}
 
 	/* return our value */
-	pthread_mutex_lock(&ibus->lock);
+	usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
 	*bytes = ibus->max_xfer_size[type];
-	pthread_mutex_unlock(&ibus->lock);
+	usbi_mutex_unlock(&ibus->lock);
 
 	return (OPENUSB_SUCCESS);
 }
@@ -1579,3 +2540,70 @@ int usbi_get_cfg_index_by_value(struct usbi_dev_handle *hdev, uint8_t cfgval)
 
 	return cfgndx;
 }
+
+/*
+ * The service interval of an isochronous endpoint in the alternate setting
+ * its interface is in, counted in frames on full speed and microframes on
+ * high speed, as host controllers number isochronous packets. 1 if the
+ * endpoint can't be found.
+ */
+uint32_t usbi_ep_interval(struct usbi_dev_handle *hdev, uint8_t ifc,
+	uint8_t ept)
+{
+	struct usbi_device *idev = hdev->idev;
+	struct usbi_desc_index *ix;
+	struct usbi_alt_index *alt;
+	uint32_t interval = 1;
+	uint8_t *desc;
+	int i;
+
+	if (idev->cur_config_index < 0 || ifc >= USBI_MAXINTERFACES ||
+	    usbi_lock_desc_index(idev, idev->cur_config_index, &ix) != 0)
+		return interval;
+
+	alt = usbi_find_alt_index(ix, ifc, hdev->claimed_ifs[ifc].altsetting);
+	for (i = 0; alt && i < alt->num_eps; i++) {
+		desc = ix->raw + ix->ep_offsets[alt->first_ep + i];
+		if (desc[2] == ept) {
+			/* bInterval is an exponent for isochronous endpoints */
+			if (desc[6] >= 1 && desc[6] <= 16)
+				interval = 1 << (desc[6] - 1);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&usbi_desc_lock);
+
+	return interval;
+}
+
+/*
+ * The wMaxPacketSize of an endpoint in the alternate setting its interface
+ * is in, without the additional transactions bits of high bandwidth
+ * endpoints. 0 if the endpoint can't be found.
+ */
+uint32_t usbi_ep_max_packet(struct usbi_dev_handle *hdev, uint8_t ifc,
+	uint8_t ept)
+{
+	struct usbi_device *idev = hdev->idev;
+	struct usbi_desc_index *ix;
+	struct usbi_alt_index *alt;
+	uint32_t packet = 0;
+	uint8_t *desc;
+	int i;
+
+	if (idev->cur_config_index < 0 || ifc >= USBI_MAXINTERFACES ||
+	    usbi_lock_desc_index(idev, idev->cur_config_index, &ix) != 0)
+		return packet;
+
+	alt = usbi_find_alt_index(ix, ifc, hdev->claimed_ifs[ifc].altsetting);
+	for (i = 0; alt && i < alt->num_eps; i++) {
+		desc = ix->raw + ix->ep_offsets[alt->first_ep + i];
+		if (desc[2] == ept) {
+			packet = (desc[4] | (desc[5] << 8)) & 0x7ff;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&usbi_desc_lock);
+
+	return packet;
+}
@@ -39,8 +39,9 @@ openusb_handle_t wr_handle = 0;
 
 struct usb_bus *usb_busses = NULL;
 
-static int wr_setup_dev_config(struct usb_device *dev, openusb_devid_t devid,
-	openusb_dev_handle_t);
+static int wr_setup_dev_desc(struct usb_device *dev, openusb_devid_t devid,
+	struct usbi_dev_handle *hdev);
+static void wr_free_dev_desc(struct usb_device *dev);
 
 /* process openusb0.1.x error strings */
 typedef enum {
@@ -160,107 +161,219 @@ int usb_find_busses(void)
 	return 1;
 }
 
-static int wr_create_devices(struct usb_bus *bus, struct usbi_bus *ibus) 
+/*
+ * Devices handed out through usb_busses, hashed by devid, so that
+ * usb_find_devices() only has to deal with what changed since the last
+ * scan.
+ */
+struct wr_device {
+	struct list_head	list;
+	struct usb_device	*dev;
+	openusb_devid_t		devid;
+	int			found;
+};
+
+#define WR_DEVICE_HASH_SIZE	64
+static struct list_head wr_devices[WR_DEVICE_HASH_SIZE];
+static int wr_devices_inited;
+
+/* last device on usb_busses, devices are appended in scan order */
+static struct usb_device *wr_last_device;
+
+/* what the scan needs to know of a usbi_device, copied under the locks */
+struct wr_scan_entry {
+	openusb_devid_t		devid;
+	char			sys_path[PATH_MAX + 1];
+};
+
+static struct wr_device *wr_lookup_device(openusb_devid_t devid)
 {
-	struct usbi_device *idev, *tdev;
-	struct usb_device *dev, *ndev;
-	int dev_cnt = 0;
-	struct usb_dev_handle *tmph;
+	struct wr_device *wdev;
 
-	pthread_mutex_lock(&ibus->lock);
-	list_for_each_entry_safe(idev, tdev, &ibus->devices.head, bus_list) {
-		if (idev) {
-			dev = calloc(sizeof(*dev), 1);
-			if (!dev) {
-				wr_error_str(errno, "create_devices: No memory");
-				pthread_mutex_unlock(&ibus->lock);
-				return -1;
-			}
-			memcpy(dev->filename, idev->sys_path, PATH_MAX);
-			dev->bus = bus;
-	
-			dev->config = NULL; 
-			dev->dev = NULL;
-	
-			pthread_mutex_unlock(&ibus->lock);
-			tmph = usb_open(dev); /* device descriptors will be filled */
-			pthread_mutex_lock(&ibus->lock);
-	
-			if (!tmph) {
-			/* if it can't be opened, don't add it to device list */
-				continue;
-			}
-	
-			pthread_mutex_unlock(&ibus->lock);
-			usb_close(tmph); /* descriptors get set up */
-			pthread_mutex_lock(&ibus->lock);
-			
-			/* add this device to the bus's device list */
-			if(bus->devices == NULL) {
-				bus->devices = dev;
-				usbi_debug(NULL, 4, "add device: %s",dev->filename);
-			} else {
-				ndev = bus->devices;
-				while(ndev->next) {
-					ndev = ndev->next;
-				}
-				ndev->next = dev;
-				usbi_debug(NULL, 4, "add device: %s",dev->filename);
-			}
-	
-			if(idev->parent != NULL) {
-				/* don't account for root hubs */
-				dev_cnt++;
-			}
-		}
+	list_for_each_entry(wdev, &wr_devices[devid % WR_DEVICE_HASH_SIZE],
+		list) {
+		if (wdev->devid == devid)
+			return wdev;
 	}
 
-	pthread_mutex_unlock(&ibus->lock);
-
-	return dev_cnt;
+	return NULL;
 }
 
-int usb_find_devices(void)
+static int wr_setup_dev_desc_open(struct usb_device *dev,
+	openusb_devid_t devid)
 {
-	struct usb_bus *bus;
-	struct usbi_bus *ibus, *tbus;
-	int dev_cnt=0;
+	openusb_dev_handle_t devh;
 	int ret;
 
-	pthread_mutex_lock(&usbi_buses.lock);	
-	bus = usb_busses;
+	ret = openusb_open_device(wr_handle, devid, 0, &devh);
+	if (ret != 0)
+		return ret;
+
+	ret = wr_setup_dev_desc(dev, devid, usbi_find_dev_handle(devh));
+	openusb_close_device(devh);
+
+	return ret;
+}
 
-	while(bus) {
+static struct usb_device *wr_create_device(struct usb_bus *bus,
+	struct wr_scan_entry *entry)
+{
+	struct wr_device *wdev;
+	struct usb_device *dev;
 
-		list_for_each_entry_safe(ibus, tbus, &usbi_buses.head, list) {
-			if (ibus) {
+	dev = calloc(sizeof(*dev), 1);
+	wdev = calloc(sizeof(*wdev), 1);
+	if (!dev || !wdev) {
+		wr_error_str(errno, "create_devices: No memory");
+		free(dev);
+		free(wdev);
+		return NULL;
+	}
 
-				pthread_mutex_unlock(&usbi_buses.lock);	
+	memcpy(dev->filename, entry->sys_path, PATH_MAX);
+	dev->bus = bus;
+
+	/*
+	 * descriptors come from the backend's cache, the device is only
+	 * opened if the backend has none to offer
+	 */
+	if (wr_setup_dev_desc(dev, entry->devid, NULL) != 0 &&
+		wr_setup_dev_desc_open(dev, entry->devid) != 0) {
+		/* if it can't be opened, don't add it to device list */
+		usbi_debug(NULL, 4, "no descriptors for %s", dev->filename);
+		free(dev);
+		free(wdev);
+		return NULL;
+	}
 
-				ret = wr_create_devices(bus, ibus);
+	wdev->dev = dev;
+	wdev->devid = entry->devid;
+	wdev->found = 1;
+	list_add(&wdev->list, &wr_devices[entry->devid % WR_DEVICE_HASH_SIZE]);
 
-				pthread_mutex_lock(&usbi_buses.lock);	
+	dev->prev = wr_last_device;
+	if (wr_last_device)
+		wr_last_device->next = dev;
+	else
+		bus->devices = dev;
+	wr_last_device = dev;
 
-				if (ret >= 0) {
-					dev_cnt += ret;
-				} else {
-					usbi_debug(NULL, 1,
-							"create_device error");
-					wr_error_str(1,
-							"wr_create_device error");
-	
-					pthread_mutex_unlock(&usbi_buses.lock);	
+	usbi_debug(NULL, 4, "add device: %s", dev->filename);
+
+	return dev;
+}
+
+static void wr_remove_device(struct usb_bus *bus, struct wr_device *wdev)
+{
+	struct usb_device *dev = wdev->dev;
+
+	usbi_debug(NULL, 4, "remove device: %s", dev->filename);
+
+	if (dev->prev)
+		dev->prev->next = dev->next;
+	else
+		bus->devices = dev->next;
+	if (dev->next)
+		dev->next->prev = dev->prev;
+	else
+		wr_last_device = dev->prev;
+
+	list_del(&wdev->list);
+
+	wr_free_dev_desc(dev);
+	free(dev);
+	free(wdev);
+}
+
+/*
+ * Bring usb_busses up to date with the devices openusb knows about and
+ * return the number of devices added or removed, as libusb 0.1 does.
+ */
+int usb_find_devices(void)
+{
+	struct usb_bus *bus = usb_busses;
+	struct usbi_bus *ibus;
+	struct usbi_device *idev;
+	struct wr_scan_entry *entries = NULL, *tmp;
+	struct wr_device *wdev, *twdev;
+	int num = 0, max = 0;
+	int changes = 0;
+	int i;
+
+	if (!bus) {
+		wr_error_str(EINVAL, "usb_find_busses not called");
+		return -1;
+	}
+
+	if (!wr_devices_inited) {
+		for (i = 0; i < WR_DEVICE_HASH_SIZE; i++)
+			list_init(&wr_devices[i]);
+		wr_devices_inited = 1;
+	}
+
+	/* snapshot the device list */
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
+	list_for_each_entry(ibus, &usbi_buses.head, list) {
+	/* safe */
+		usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
+		list_for_each_entry(idev, &ibus->devices.head, bus_list) {
+		/* safe */
+			if (num == max) {
+				max = max ? max * 2 : 64;
+				tmp = realloc(entries, max * sizeof(*entries));
+				if (!tmp) {
+					usbi_mutex_unlock(&ibus->lock);
+					usbi_mutex_unlock(&usbi_buses.lock);
+					free(entries);
+					wr_error_str(ENOMEM,
+						"find_devices: No memory");
 					return -1;
 				}
+				entries = tmp;
 			}
+
+			entries[num].devid = idev->devid;
+			strncpy(entries[num].sys_path, idev->sys_path,
+				PATH_MAX);
+			entries[num].sys_path[PATH_MAX] = 0;
+			num++;
 		}
+		usbi_mutex_unlock(&ibus->lock);
+	}
+	usbi_mutex_unlock(&usbi_buses.lock);
 
-		usbi_debug(NULL, 1, "bus: %s", bus->dirname);
-		bus = bus->next;
+	for (i = 0; i < WR_DEVICE_HASH_SIZE; i++) {
+		list_for_each_entry(wdev, &wr_devices[i], list) {
+		/* safe */
+			wdev->found = 0;
+		}
+	}
+
+	/* devids are never reused, so a known devid is the same device */
+	for (i = 0; i < num; i++) {
+		wdev = wr_lookup_device(entries[i].devid);
+		if (wdev) {
+			wdev->found = 1;
+			continue;
+		}
+
+		if (wr_create_device(bus, &entries[i]))
+			changes++;
+	}
+	free(entries);
+
+	for (i = 0; i < WR_DEVICE_HASH_SIZE; i++) {
+		list_for_each_entry_safe(wdev, twdev, &wr_devices[i], list) {
+			if (!wdev->found) {
+				wr_remove_device(bus, wdev);
+				changes++;
+			}
+		}
 	}
 
-	pthread_mutex_unlock(&usbi_buses.lock);	
-	return(dev_cnt);
+	usbi_debug(NULL, 4, "%d devices, %d changes", num, changes);
+
+	return changes;
 }
 
 /*
@@ -274,23 +387,23 @@ static openusb_devid_t wr_find_device(struct usb_device *dev)
 	struct usbi_device *idev = NULL;
 	int found = 0;
 	
-	pthread_mutex_lock(&usbi_buses.lock);
+	usbi_mutex_lock(&usbi_buses.lock, USBI_LOCK_BUSES);
 	list_for_each_entry(ibus, &usbi_buses.head, list) {
 	/* safe */
 		if (ibus) {
-			pthread_mutex_lock(&ibus->devices.lock);
+			usbi_mutex_lock(&ibus->devices.lock, USBI_LOCK_BUS);
 			list_for_each_entry(idev, &ibus->devices.head, bus_list) {
 			/* safe */
 				if (strncmp(idev->sys_path, dev->filename,
 			    	PATH_MAX) == 0) {
 	
 					found = 1;
-					pthread_mutex_unlock(&ibus->devices.lock);
+					usbi_mutex_unlock(&ibus->devices.lock);
 	
 					goto out;
 				}
 			}
-			pthread_mutex_unlock(&ibus->devices.lock);
+			usbi_mutex_unlock(&ibus->devices.lock);
 		}
 	}
 out:
@@ -298,7 +411,7 @@ out:
 		devid = idev->devid;
 	}
 
-	pthread_mutex_unlock(&usbi_buses.lock);
+	usbi_mutex_unlock(&usbi_buses.lock);
 
 	return devid;
 }
@@ -404,8 +517,58 @@ static int wr_parse_interface(struct usb_interface * ifc01,
 			ifdesc->extralen = alt->extralen;
 		}
 		
+		/* partial results are freed by wr_free_dev_desc */
 		if (wr_parse_endpoint(ifdesc, alt) != 0) {
-			free(ifc01->altsetting);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* convert a parsed openusb 1.0 configuration to the 0.1 layout */
+static int wr_setup_config(struct usb_config_descriptor *pcfg,
+	struct usbi_config *config)
+{
+	usb_config_desc_t *picfg = &config->desc;
+	int num_ifs;
+	int j;
+
+	pcfg->bLength = picfg->bLength;
+	pcfg->bDescriptorType = picfg->bDescriptorType;
+	pcfg->wTotalLength = openusb_le32_to_cpu(picfg->wTotalLength);
+	pcfg->bNumInterfaces = picfg->bNumInterfaces;
+	pcfg->bConfigurationValue = picfg->bConfigurationValue;
+	pcfg->iConfiguration = picfg->iConfiguration;
+	pcfg->bmAttributes = picfg->bmAttributes;
+	pcfg->MaxPower = picfg->bMaxPower;
+
+	if (config->extralen) {
+		pcfg->extra = calloc(config->extralen, 1);
+		if (!pcfg->extra) {
+			return -1;
+		}
+		memcpy(pcfg->extra, config->extra, config->extralen);
+		pcfg->extralen = config->extralen;
+	}
+
+	/* begin build up interfaces */
+	num_ifs = config->num_interfaces;
+	if (num_ifs == 0) {
+	/* zero interfaces ? */
+		usbi_debug(NULL, 4, "Zero interfaces");
+		return 0;
+	}
+	pcfg->interface = calloc(sizeof(struct usb_interface) * num_ifs, 1);
+	if (!pcfg->interface) {
+		return -1;
+	}
+
+	for (j = 0; j < num_ifs; j++) {
+		/* bNumInterfaces bounds the array wr_free_dev_desc walks */
+		pcfg->bNumInterfaces = j + 1;
+		if (wr_parse_interface(&pcfg->interface[j],
+			&config->interfaces[j]) != 0) {
 			return -1;
 		}
 	}
@@ -414,47 +577,82 @@ static int wr_parse_interface(struct usb_interface * ifc01,
 }
 
 /*
- * the current implemetation just copy openusb1.0 cached descriptors to 0.1
- * device's descriptors. Since 1.0 doesn't cache Vendor/Class specific data,
- * the 0.1 extra of config,interface,endpoint is NULL. usbi_parse_configuration
- * should be enhanced to support extra data parsing.
+ * Raw descriptors of a device. Without a handle they come from the
+ * backend's descriptor cache, so the device doesn't have to be opened.
+ * With a handle they are read from the device. The caller frees *buf.
  */
-static int wr_setup_dev_config(struct usb_device *dev, openusb_devid_t devid,
-	openusb_dev_handle_t devh)
+static int wr_get_raw_desc(openusb_devid_t devid, struct usbi_dev_handle *hdev,
+	uint8_t type, uint8_t idx, uint8_t **buf, uint16_t *len)
 {
-	struct usbi_device *idev;
-	struct usbi_descriptors *desc;
+	struct usbi_raw_desc *raw;
+
+	if (!hdev)
+		return openusb_get_raw_desc(wr_handle, devid, type, idx, 0,
+			buf, len);
+
+	if (type == USB_DESC_TYPE_DEVICE) {
+		raw = &hdev->idev->desc.device_raw;
+	} else {
+		if (idx >= hdev->idev->desc.num_configs)
+			return OPENUSB_PARSE_ERROR;
+		raw = &hdev->idev->desc.configs_raw[idx];
+	}
+	if (!raw->data)
+		return OPENUSB_PARSE_ERROR;
+
+	*buf = malloc(raw->len);
+	if (!*buf)
+		return OPENUSB_NO_RESOURCES;
+	memcpy(*buf, raw->data, raw->len);
+	*len = raw->len;
+
+	return 0;
+}
+
+/*
+ * Build the 0.1 device and configuration descriptors from the raw
+ * descriptors. The configuration trees are parsed into a temporary
+ * usbi_config each, so nothing is left behind in the usbi_device.
+ */
+static int wr_setup_dev_desc(struct usb_device *dev, openusb_devid_t devid,
+	struct usbi_dev_handle *hdev)
+{
+	struct usbi_config config;
+	uint8_t *buf;
+	uint16_t len;
 	int num_configs;
 	int i;
-	struct usb_config_descriptor *pcfg;
-	usb_config_desc_t *picfg;
-	struct usbi_config *config;
 	int ret;
-	struct usbi_dev_handle *hdev;
 
-	hdev = usbi_find_dev_handle(devh);
-	if (!hdev) {
-		return -1;
+	if (hdev) {
+		/* get descriptors on the fly */
+		ret = usbi_fetch_and_parse_descriptors(hdev);
+		if (ret != 0) {
+			usbi_debug(NULL, 1, "fail to get descriptor");
+			return -1;
+		}
 	}
-	
-	/* get descriptors on the fly */
-	ret = usbi_fetch_and_parse_descriptors(hdev);
+
+	ret = wr_get_raw_desc(devid, hdev, USB_DESC_TYPE_DEVICE, 0, &buf, &len);
 	if (ret != 0) {
-		usbi_debug(NULL, 1, "fail to get descriptor");
+		usbi_debug(NULL, 1, "fail to get device descriptor");
 		return -1;
 	}
 
-	idev = usbi_find_device_by_id(devid);
-	if (!idev) {
-		usbi_debug(NULL, 1, "Can't find device %d",(int)devid);
+	ret = usbi_decode_device_desc(buf, len,
+		(usb_device_desc_t *)&dev->descriptor);
+	free(buf);
+	if (ret < 0) {
+		usbi_debug(NULL, 1, "fail to parse device descriptor");
 		return -1;
 	}
-	
-	desc = (struct usbi_descriptors*)&idev->desc;
 
-	memcpy(&dev->descriptor, &desc->device, sizeof(usb_device_desc_t));
-
-	num_configs = desc->device.bNumConfigurations;
+	num_configs = dev->descriptor.bNumConfigurations;
+	if (num_configs > USBI_MAXCONFIG) {
+		usbi_debug(NULL, 1, "too many configurations (%d), only %d "
+			"will be used", num_configs, USBI_MAXCONFIG);
+		num_configs = USBI_MAXCONFIG;
+	}
 
 	if (num_configs == 0) {
 		usbi_debug(NULL, 1, "Zero configurations");
@@ -469,60 +667,75 @@ static int wr_setup_dev_config(struct usb_device *dev, openusb_devid_t devid,
 		return OPENUSB_NO_RESOURCES;
 	}
 
-	for(i = 0; i < num_configs; i++) {
-		int num_ifs;
-		struct usbi_interface *ifc10;
-		struct usb_interface *ifc01;
-		int j;
-
-		pcfg = (struct usb_config_descriptor *)&dev->config[i];	
-		config = &idev->desc.configs[i];
-
-		picfg = &config->desc;
+	for (i = 0; i < num_configs; i++) {
+		/* bNumConfigurations bounds the array wr_free_dev_desc walks */
+		dev->descriptor.bNumConfigurations = i + 1;
 
-		pcfg->bLength = picfg->bLength;
-		pcfg->bDescriptorType = picfg->bDescriptorType;
-		pcfg->wTotalLength = openusb_le32_to_cpu(picfg->wTotalLength);
-		pcfg->bNumInterfaces = picfg->bNumInterfaces;
-		pcfg->bConfigurationValue = picfg->bConfigurationValue;
-		pcfg->iConfiguration = picfg->iConfiguration;
-		pcfg->bmAttributes = picfg->bmAttributes;
-		pcfg->MaxPower = picfg->bMaxPower;
-
-		if (config->extralen) {
-			pcfg->extra = calloc(config->extralen, 1);
-			if (!pcfg->extra) {
-				return -1;
-			}
-			memcpy(pcfg->extra, config->extra, config->extralen);
-			pcfg->extralen = config->extralen;
+		ret = wr_get_raw_desc(devid, hdev, USB_DESC_TYPE_CONFIG, i,
+			&buf, &len);
+		if (ret != 0) {
+			usbi_debug(NULL, 1, "fail to get config %d", i);
+			goto err;
 		}
 
-		/* begin build up interfaces */
-		num_ifs = config->num_interfaces;
-		if(num_ifs == 0) {
-		/* zero interfaces ? */
-			usbi_debug(NULL, 4, "Zero interfaces");
-			return 0;
+		memset(&config, 0, sizeof(config));
+		ret = usbi_parse_configuration(&config, buf, len);
+		free(buf);
+		if (ret < 0) {
+			usbi_debug(NULL, 1, "fail to parse config %d", i);
+			goto err;
 		}
-		pcfg->interface = 
-			calloc(sizeof(struct usb_interface) * num_ifs, 1);
-		if (!pcfg->interface) {
-			free(dev->config);
-			return OPENUSB_NO_RESOURCES;
+
+		ret = wr_setup_config(&dev->config[i], &config);
+		free(config.arena);
+		if (ret != 0) {
+			goto err;
 		}
-		
-		for(j = 0; j < num_ifs; j++) {
-			ifc01 = &pcfg->interface[j];
-			ifc10 = &config->interfaces[j];
-			if (wr_parse_interface(ifc01, ifc10) != 0) {
-				free(pcfg->interface);
-				return -1;
+	}
+
+	return 0;
+
+err:
+	wr_free_dev_desc(dev);
+	return -1;
+}
+
+/* free what wr_setup_dev_desc built */
+static void wr_free_dev_desc(struct usb_device *dev)
+{
+	struct usb_config_descriptor *pcfg;
+	struct usb_interface *ifc;
+	struct usb_interface_descriptor *alt;
+	int i, j, k, l;
+
+	if (!dev->config)
+		return;
+
+	for (i = 0; i < dev->descriptor.bNumConfigurations; i++) {
+		pcfg = &dev->config[i];
+
+		for (j = 0; pcfg->interface && j < pcfg->bNumInterfaces; j++) {
+			ifc = &pcfg->interface[j];
+
+			for (k = 0; ifc->altsetting &&
+				k < ifc->num_altsetting; k++) {
+				alt = &ifc->altsetting[k];
+
+				for (l = 0; alt->endpoint &&
+					l < alt->bNumEndpoints; l++) {
+					free(alt->endpoint[l].extra);
+				}
+				free(alt->endpoint);
+				free(alt->extra);
 			}
+			free(ifc->altsetting);
 		}
+		free(pcfg->interface);
+		free(pcfg->extra);
 	}
 
-	return 0;
+	free(dev->config);
+	dev->config = NULL;
 }
 
 struct usb_dev_handle *usb_open(struct usb_device *dev)
@@ -555,11 +768,18 @@ struct usb_dev_handle *usb_open(struct usb_device *dev)
 		return NULL;
 	}
 
-	/* shall we build up device descriptors on open ? */
-	ret = wr_setup_dev_config(dev, devid, usb1_devh);
-	if (ret != 0) {
-		usbi_debug(NULL, 1, "Fail to set device config");
-		return NULL;
+	/*
+	 * descriptors are normally set up by usb_find_devices(), only read
+	 * them from the device if the backend couldn't provide them
+	 */
+	if (!dev->config) {
+		ret = wr_setup_dev_desc(dev, devid,
+			usbi_find_dev_handle(usb1_devh));
+		if (ret != 0) {
+			usbi_debug(NULL, 1, "Fail to set device config");
+			openusb_close_device(usb1_devh);
+			return NULL;
+		}
 	}
 
 
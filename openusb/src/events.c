@@ -0,0 +1,444 @@
+/*
+ * Event loop integration
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ *
+ * Normally the backends and the frontend run threads of their own to reap
+ * completed I/O, expire timeouts, watch for hotplug and deliver event
+ * callbacks. An application that calls openusb_init() with
+ * OPENUSB_INIT_NO_THREADS gets none of them. The backends register here
+ * the descriptors their threads would have polled, along with a handler
+ * for each, and the application polls them in its own loop, calling
+ * openusb_handle_events_timeout() as they become ready. Timeouts the
+ * backends keep are asked for through their next_timeout op.
+ *
+ * The frontend has a pipe of its own among the descriptors, written when
+ * an event callback is queued, so the loop wakes up to run it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbi.h"
+
+/* descriptors polled without allocating, most processes have fewer */
+#define USBI_POLLFDS_STACK	16
+
+/* how long waiting for a request polls before checking on it again, in ms */
+#define USBI_EVENTS_WAIT	10
+
+struct usbi_pollfd {
+	struct list_head	list;
+	int			fd;
+	short			events;
+	usbi_pollfd_handler_t	handler;
+	void			*arg;
+};
+
+static struct list_head usbi_pollfds = { .prev = &usbi_pollfds,
+		.next = &usbi_pollfds };
+static uint32_t usbi_num_pollfds = 0;		/* protected by the lock */
+static pthread_mutex_t usbi_pollfds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int usbi_events_pipe[2] = { -1, -1 };
+
+/* notifiers called without allocating, most processes have fewer handles */
+#define USBI_NOTIFIERS_STACK	8
+
+struct usbi_pollfd_notifier {
+	openusb_pollfd_added_callback_t		added;
+	openusb_pollfd_removed_callback_t	removed;
+	void					*arg;
+};
+
+/*
+ * Tell every lib handle that wants to know, fd added if events != 0. The
+ * notifiers are copied under the lock and called after it's dropped, so
+ * they may call back into openusb.
+ */
+static void usbi_notify_pollfd(int fd, short events)
+{
+	struct usbi_pollfd_notifier nbuf[USBI_NOTIFIERS_STACK], *n = nbuf;
+	struct usbi_handle *hdl;
+	uint32_t i, num = 0;
+
+	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
+	list_for_each_entry(hdl, &usbi_handles.head, list) {
+		if (hdl->pollfd_added || hdl->pollfd_removed)
+			num++;
+	}
+	if (num > USBI_NOTIFIERS_STACK) {
+		n = malloc(num * sizeof(*n));
+		if (!n) {
+			usbi_mutex_unlock(&usbi_handles.lock);
+			usbi_debug(NULL, 1, "unable to notify of fd %d", fd);
+			return;
+		}
+	}
+
+	i = 0;
+	list_for_each_entry(hdl, &usbi_handles.head, list) {
+		if (!hdl->pollfd_added && !hdl->pollfd_removed)
+			continue;
+		n[i].added = hdl->pollfd_added;
+		n[i].removed = hdl->pollfd_removed;
+		n[i].arg = hdl->pollfd_arg;
+		i++;
+	}
+	usbi_mutex_unlock(&usbi_handles.lock);
+
+	for (i = 0; i < num; i++) {
+		if (events && n[i].added)
+			n[i].added(fd, events, n[i].arg);
+		else if (!events && n[i].removed)
+			n[i].removed(fd, n[i].arg);
+	}
+
+	if (n != nbuf)
+		free(n);
+}
+
+int32_t usbi_add_pollfd(int fd, short events, usbi_pollfd_handler_t handler,
+	void *arg)
+{
+	struct usbi_pollfd *pfd;
+
+	pfd = calloc(1, sizeof(*pfd));
+	if (!pfd)
+		return OPENUSB_NO_RESOURCES;
+
+	pfd->fd = fd;
+	pfd->events = events;
+	pfd->handler = handler;
+	pfd->arg = arg;
+
+	usbi_mutex_lock(&usbi_pollfds_lock, USBI_LOCK_POLLFDS);
+	list_add(&pfd->list, &usbi_pollfds);
+	usbi_num_pollfds++;
+	usbi_mutex_unlock(&usbi_pollfds_lock);
+
+	usbi_notify_pollfd(fd, events);
+
+	return OPENUSB_SUCCESS;
+}
+
+void usbi_remove_pollfd(int fd)
+{
+	struct usbi_pollfd *pfd, *found = NULL;
+
+	usbi_mutex_lock(&usbi_pollfds_lock, USBI_LOCK_POLLFDS);
+	list_for_each_entry(pfd, &usbi_pollfds, list) {
+		if (pfd->fd == fd) {
+			found = pfd;
+			break;
+		}
+	}
+	if (found) {
+		list_del(&found->list);
+		usbi_num_pollfds--;
+	}
+	usbi_mutex_unlock(&usbi_pollfds_lock);
+
+	if (!found)
+		return;
+
+	free(found);
+	usbi_notify_pollfd(fd, 0);
+}
+
+/* the pipe only wakes the loop, the callbacks run after the handlers */
+static void usbi_events_drain(int fd, short revents, void *arg)
+{
+	char buf[16];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/* called from usbi_init_common() when there are no threads */
+int32_t usbi_events_init(void)
+{
+	int32_t ret;
+
+	if (pipe(usbi_events_pipe) < 0) {
+		usbi_debug(NULL, 1, "unable to create events pipe (errno = %d)",
+			errno);
+		return OPENUSB_SYS_FUNC_FAILURE;
+	}
+	fcntl(usbi_events_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(usbi_events_pipe[1], F_SETFL, O_NONBLOCK);
+
+	ret = usbi_add_pollfd(usbi_events_pipe[0], POLLIN, usbi_events_drain,
+		NULL);
+	if (ret < 0) {
+		close(usbi_events_pipe[0]);
+		close(usbi_events_pipe[1]);
+		usbi_events_pipe[0] = usbi_events_pipe[1] = -1;
+	}
+
+	return ret;
+}
+
+void usbi_events_fini(void)
+{
+	if (usbi_events_pipe[0] < 0)
+		return;
+
+	usbi_remove_pollfd(usbi_events_pipe[0]);
+	close(usbi_events_pipe[0]);
+	close(usbi_events_pipe[1]);
+	usbi_events_pipe[0] = usbi_events_pipe[1] = -1;
+}
+
+void usbi_events_wakeup(void)
+{
+	char c = 0;
+
+	while (write(usbi_events_pipe[1], &c, 1) < 0) {
+		if (errno == EINTR)
+			continue;
+		/* a full pipe has a wakeup pending already */
+		if (errno != EAGAIN)
+			usbi_debug(NULL, 1, "unable to wake up the event loop "
+				"(errno = %d)", errno);
+		break;
+	}
+}
+
+/*
+ * Poll the registered descriptors for up to timeout ms (-1 for ever, or
+ * until a backend's request times out), run the handlers of those that are
+ * ready, expire requests and deliver the queued event callbacks.
+ */
+int32_t usbi_handle_events(int32_t timeout)
+{
+	struct pollfd fdbuf[USBI_POLLFDS_STACK], *fds = fdbuf;
+	struct usbi_pollfd pfdbuf[USBI_POLLFDS_STACK], *pfds = pfdbuf;
+	struct usbi_pollfd *pfd;
+	uint32_t i, num;
+	int32_t next;
+	int ret;
+
+	usbi_mutex_lock(&usbi_pollfds_lock, USBI_LOCK_POLLFDS);
+	num = usbi_num_pollfds;
+	if (num > USBI_POLLFDS_STACK) {
+		fds = malloc(num * sizeof(*fds));
+		pfds = malloc(num * sizeof(*pfds));
+		if (!fds || !pfds) {
+			usbi_mutex_unlock(&usbi_pollfds_lock);
+			free(fds);
+			free(pfds);
+			return OPENUSB_NO_RESOURCES;
+		}
+	}
+
+	i = 0;
+	list_for_each_entry(pfd, &usbi_pollfds, list) {
+		pfds[i] = *pfd;
+		fds[i].fd = pfd->fd;
+		fds[i].events = pfd->events;
+		fds[i].revents = 0;
+		i++;
+	}
+	usbi_mutex_unlock(&usbi_pollfds_lock);
+
+	next = usbi_backends_next_timeout();
+	if (next >= 0 && (timeout < 0 || next < timeout))
+		timeout = next;
+
+	ret = poll(fds, num, timeout);
+	if (ret < 0 && errno != EINTR) {
+		usbi_debug(NULL, 1, "poll() failed (errno = %d)", errno);
+		ret = OPENUSB_SYS_FUNC_FAILURE;
+		goto out;
+	}
+
+	for (i = 0; ret > 0 && i < num; i++) {
+		if (fds[i].revents) {
+			pfds[i].handler(fds[i].fd, fds[i].revents, pfds[i].arg);
+			ret--;
+		}
+	}
+
+	usbi_backends_handle_timeouts();
+	usbi_dispatch_event_callbacks();
+	ret = OPENUSB_SUCCESS;
+
+out:
+	if (fds != fdbuf) {
+		free(fds);
+		free(pfds);
+	}
+
+	return ret;
+}
+
+/*
+ * Wait for cv with m held, or without threads to signal it, handle events
+ * for a while. Either way the caller checks its condition again after.
+ */
+void usbi_wait_events(pthread_cond_t *cv, pthread_mutex_t *m,
+	enum usbi_lock_class c)
+{
+	if (usbi_threads_enabled()) {
+		usbi_cond_wait(cv, m);
+		return;
+	}
+
+	usbi_mutex_unlock(m);
+	usbi_handle_events(USBI_EVENTS_WAIT);
+	usbi_mutex_lock(m, c);
+}
+
+/*
+ * As usbi_wait_events(), giving up at ts on CLOCK_REALTIME. Returns
+ * ETIMEDOUT once ts has passed.
+ */
+int usbi_wait_events_until(pthread_cond_t *cv, pthread_mutex_t *m,
+	enum usbi_lock_class c, const struct timespec *ts)
+{
+	struct timespec now;
+	int64_t ms;
+
+	if (usbi_threads_enabled())
+		return usbi_cond_timedwait(cv, m, ts);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = (int64_t)(ts->tv_sec - now.tv_sec) * 1000 +
+		(ts->tv_nsec - now.tv_nsec) / 1000000;
+	if (ms <= 0)
+		return ETIMEDOUT;
+
+	usbi_mutex_unlock(m);
+	usbi_handle_events(ms < USBI_EVENTS_WAIT ? ms : USBI_EVENTS_WAIT);
+	usbi_mutex_lock(m, c);
+
+	return 0;
+}
+
+static int32_t usbi_events_handle(openusb_handle_t handle,
+	struct usbi_handle **hdl)
+{
+	*hdl = usbi_find_handle(handle);
+	if (!*hdl)
+		return OPENUSB_INVALID_HANDLE;
+
+	if (usbi_threads_enabled())
+		return OPENUSB_NOT_SUPPORTED;
+
+	return OPENUSB_SUCCESS;
+}
+
+int32_t openusb_get_pollfds(openusb_handle_t handle, openusb_pollfd_t **fds,
+	uint32_t *num)
+{
+	struct usbi_handle *hdl;
+	struct usbi_pollfd *pfd;
+	openusb_pollfd_t *f;
+	uint32_t i;
+	int32_t ret;
+
+	if (!fds || !num)
+		return OPENUSB_BADARG;
+
+	ret = usbi_events_handle(handle, &hdl);
+	if (ret < 0)
+		return ret;
+
+	usbi_mutex_lock(&usbi_pollfds_lock, USBI_LOCK_POLLFDS);
+	f = calloc(usbi_num_pollfds + 1, sizeof(*f));
+	if (!f) {
+		usbi_mutex_unlock(&usbi_pollfds_lock);
+		return OPENUSB_NO_RESOURCES;
+	}
+
+	i = 0;
+	list_for_each_entry(pfd, &usbi_pollfds, list) {
+		f[i].fd = pfd->fd;
+		f[i].events = pfd->events;
+		i++;
+	}
+	usbi_mutex_unlock(&usbi_pollfds_lock);
+
+	*fds = f;
+	*num = i;
+
+	return OPENUSB_SUCCESS;
+}
+
+void openusb_free_pollfds(openusb_pollfd_t *fds)
+{
+	free(fds);
+}
+
+int32_t openusb_set_pollfd_notifiers(openusb_handle_t handle,
+	openusb_pollfd_added_callback_t added,
+	openusb_pollfd_removed_callback_t removed, void *arg)
+{
+	struct usbi_handle *hdl;
+	int32_t ret;
+
+	ret = usbi_events_handle(handle, &hdl);
+	if (ret < 0)
+		return ret;
+
+	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
+	hdl->pollfd_added = added;
+	hdl->pollfd_removed = removed;
+	hdl->pollfd_arg = arg;
+	usbi_mutex_unlock(&usbi_handles.lock);
+
+	return OPENUSB_SUCCESS;
+}
+
+int32_t openusb_get_next_timeout(openusb_handle_t handle, int32_t *ms)
+{
+	struct usbi_handle *hdl;
+	int32_t ret;
+
+	if (!ms)
+		return OPENUSB_BADARG;
+
+	ret = usbi_events_handle(handle, &hdl);
+	if (ret < 0)
+		return ret;
+
+	*ms = usbi_backends_next_timeout();
+
+	return OPENUSB_SUCCESS;
+}
+
+int32_t openusb_handle_events_timeout(openusb_handle_t handle,
+	struct timeval *tv)
+{
+	struct usbi_handle *hdl;
+	int32_t ret, timeout = -1;
+
+	ret = usbi_events_handle(handle, &hdl);
+	if (ret < 0)
+		return ret;
+
+	if (tv) {
+		if (tv->tv_sec < 0 || tv->tv_usec < 0)
+			return OPENUSB_BADARG;
+
+		/* round up, a poll() that returns early only loops */
+		if (tv->tv_sec >= INT32_MAX / 1000)
+			timeout = INT32_MAX;
+		else
+			timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+	}
+
+	return usbi_handle_events(timeout);
+}
+
+int32_t openusb_handle_events(openusb_handle_t handle)
+{
+	return openusb_handle_events_timeout(handle, NULL);
+}
@@ -20,10 +20,161 @@
 static struct list_head completions = { .prev = &completions,
 		.next = &completions };
 
+/* callbacks run by usbi_io_complete() on this thread, it completes I/O */
+static __thread int usbi_io_completing = 0;
+
 /*
  * Helper functions
  */
 
+/* the queue a request goes on, all control requests share endpoint 0 */
+struct usbi_ep_queue *usbi_ep_queue(struct usbi_dev_handle *dev,
+		openusb_request_handle_t req)
+{
+	if (req->type == USB_TYPE_CONTROL)
+		return &dev->ep[0];
+
+	return &dev->ep[USBI_EP_INDEX(req->endpoint)];
+}
+
+/* take an io off its queue, the queue must be locked */
+static void usbi_unlink_io(struct usbi_io *io)
+{
+	/* off every list already, the request may be gone by now */
+	if (!io->list.next)
+		return;
+
+	list_del(&io->list);
+	io->magic = 0;
+
+	/* the request may have been submitted again already */
+	if (io->req->io == io)
+		io->req->io = NULL;
+}
+
+/* the iovec array of an interrupt or bulk request, NULL if it has none */
+struct iovec *usbi_req_iov(openusb_request_handle_t req, uint32_t *iovcnt)
+{
+	struct iovec *iov = NULL;
+
+	*iovcnt = 0;
+
+	if (req->type == USB_TYPE_BULK) {
+		iov = req->req.bulk->iov;
+		*iovcnt = req->req.bulk->iovcnt;
+	} else if (req->type == USB_TYPE_INTERRUPT) {
+		iov = req->req.intr->iov;
+		*iovcnt = req->req.intr->iovcnt;
+	}
+
+	if (*iovcnt == 0)
+		return NULL;
+
+	return iov;
+}
+
+/*
+ * set the length of a scatter-gather request to the total of its iovec
+ * array, before the request is checked and submitted
+ */
+int32_t usbi_req_iov_length(openusb_request_handle_t req)
+{
+	struct iovec *iov;
+	uint32_t i, iovcnt;
+	uint64_t total = 0;
+
+	if (req->type != USB_TYPE_BULK && req->type != USB_TYPE_INTERRUPT)
+		return OPENUSB_SUCCESS;
+
+	iov = usbi_req_iov(req, &iovcnt);
+	if (iovcnt == 0)
+		return OPENUSB_SUCCESS;
+
+	if (!iov)
+		return OPENUSB_BADARG;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	if (total > UINT32_MAX)
+		return OPENUSB_IO_REQ_TOO_BIG;
+
+	if (req->type == USB_TYPE_BULK)
+		req->req.bulk->length = total;
+	else
+		req->req.intr->length = total;
+
+	return OPENUSB_SUCCESS;
+}
+
+/*
+ * Give a scatter-gather request a contiguous buffer, for backends that
+ * can't take the iovec array or a request they can't map onto it. The data
+ * of an OUT request is gathered into it now, the data read by an IN request
+ * is scattered to the iovec array when it completes.
+ */
+int32_t usbi_io_bounce(struct usbi_io *io)
+{
+	struct iovec *iov;
+	uint32_t i, iovcnt, len, off = 0;
+	uint8_t *p;
+
+	iov = usbi_req_iov(io->req, &iovcnt);
+	if (!iov || io->bounce)
+		return OPENUSB_SUCCESS;
+
+	len = io->req->type == USB_TYPE_BULK ? io->req->req.bulk->length :
+		io->req->req.intr->length;
+
+	/* one byte at least, a zero length request still needs a buffer */
+	p = malloc(len ? len : 1);
+	if (!p)
+		return OPENUSB_NO_RESOURCES;
+
+	if (!(io->req->endpoint & USB_ENDPOINT_IN)) {
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(p + off, iov[i].iov_base, iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+	}
+
+	io->bounce = p;
+
+	return OPENUSB_SUCCESS;
+}
+
+/* the data buffer of an interrupt or bulk request, as a backend sees it */
+uint8_t *usbi_io_payload(struct usbi_io *io)
+{
+	if (io->bounce)
+		return io->bounce;
+
+	if (io->req->type == USB_TYPE_BULK)
+		return io->req->req.bulk->payload;
+
+	return io->req->req.intr->payload;
+}
+
+/* hand what an IN request read through its bounce buffer to the iovecs */
+static void usbi_io_unbounce(struct usbi_io *io, size_t transferred)
+{
+	struct iovec *iov;
+	uint32_t i, iovcnt, off = 0;
+	size_t len;
+
+	if (!io->bounce || !(io->req->endpoint & USB_ENDPOINT_IN))
+		return;
+
+	iov = usbi_req_iov(io->req, &iovcnt);
+	for (i = 0; iov && i < iovcnt && off < transferred; i++) {
+		len = transferred - off;
+		if (len > iov[i].iov_len)
+			len = iov[i].iov_len;
+		memcpy(iov[i].iov_base, io->bounce + off, len);
+		off += len;
+	}
+}
+
 /* allocate usbi_io, caller must ensure arguments valid */
 struct usbi_io *usbi_alloc_io(struct usbi_dev_handle *dev,
 		openusb_request_handle_t req, uint32_t timeout) 
@@ -31,10 +182,6 @@ struct usbi_io *usbi_alloc_io(struct usbi_dev_handle *dev,
 	struct usbi_io *io;
 	struct timeval tvc;
 
-	#ifndef __APPLE__
-		char buf[2] = {1, 1};	/* We don't need this on OS/X */
-	#endif
-
 	io = malloc(sizeof(struct usbi_io));
 	if (!io)
 		return NULL;
@@ -44,10 +191,11 @@ struct usbi_io *usbi_alloc_io(struct usbi_dev_handle *dev,
 	pthread_mutex_init(&io->lock, NULL);
 	pthread_cond_init(&io->cond, NULL);
 
-	pthread_mutex_lock(&io->lock);
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 	list_init(&io->list);
 	
 	io->dev = dev;
+	io->queue = usbi_ep_queue(dev, req);
 	if (timeout == 0) {
 	/* set it to a big value to avoid the timeout thread delete it */
 		timeout = io->timeout = 0xFFFFFFFF;
@@ -58,6 +206,14 @@ struct usbi_io *usbi_alloc_io(struct usbi_dev_handle *dev,
 	io->status = USBI_IO_INPROGRESS;
 	io->req = req;
 
+	if (!dev->idev->bus->ops->io_iovec && usbi_io_bounce(io) != 0) {
+		usbi_mutex_unlock(&io->lock);
+		pthread_cond_destroy(&io->cond);
+		pthread_mutex_destroy(&io->lock);
+		free(io);
+		return NULL;
+	}
+
 	/* Set the end time for the timeout */
 	gettimeofday(&tvc, NULL);
 	io->tvo.tv_sec = tvc.tv_sec + timeout / 1000;
@@ -67,47 +223,39 @@ struct usbi_io *usbi_alloc_io(struct usbi_dev_handle *dev,
 		io->tvo.tv_usec -= 1000000;
 		io->tvo.tv_sec++;
 	}
-	pthread_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->lock);
 
 	/*timeout thread will process this list */
-	pthread_mutex_lock(&dev->lock);
+	usbi_mutex_lock(&io->queue->lock, USBI_LOCK_EP);
 
 	/*
 	 * add all outstanding io requests (incld SYNC&ASYNC)to
-	 * this device's io_head
+	 * the io_head of their endpoint
 	 */
-	list_add(&io->list,&dev->io_head);
+	list_add(&io->list, &io->queue->io_head);
+	io->magic = USBI_IO_MAGIC;
+	req->io = io;
 
-	/* We don't use the timeout thread on OS/X and there's no IO polling on
-	 * OS/X as there is on Linux, so there's no good place to read from this
-	 * pipe to keep it cleared out (it will block if we just write without 
-	 * reading). So, we won't bother writing to it if we're on OS/X */
-	#ifndef __APPLE__
-		write(dev->event_pipe[1],buf, 1); /* notify timeout thread */
-	#endif
+	usbi_mutex_unlock(&io->queue->lock);
 
-	pthread_mutex_unlock(&dev->lock);
+	usbi_notify_event_pipe(dev); /* notify timeout thread */
 
 	return io;
 }
 
 void usbi_free_io(struct usbi_io *io)
 {
-	#ifndef __APPLE__
-		char buf[1]={1};	/* We don't need this on OS/X */
-	#endif
-
 	if (!io) {
 		return;
 	}
 
-	pthread_mutex_lock(&io->lock);
-	pthread_mutex_lock(&io->dev->lock);
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
+	usbi_mutex_lock(&io->queue->lock, USBI_LOCK_EP);
 	/* remove it from its original list to prevent
 	 * other threads further processing on it
 	 */
-	list_del(&io->list);
-	pthread_mutex_unlock(&io->dev->lock);
+	usbi_unlink_io(io);
+	usbi_mutex_unlock(&io->queue->lock);
 
 	if (io->status == USBI_IO_INPROGRESS && io->flag == USBI_ASYNC) {
 		usbi_debug(io->dev->lib_hdl, 4, "IO is in progress, cancel it");
@@ -115,25 +263,21 @@ void usbi_free_io(struct usbi_io *io)
 			io->dev->idev->ops->io_cancel(io);
 	}
 	
-	/* We don't use the timeout thread on OS/X and there's no IO polling on
-	 * OS/X as there is on Linux, so there's no good place to read from this
-	 * pipe to keep it cleared out (it will block if we just write without 
-	 * reading). So, we won't bother writing to it if we're on OS/X */
-	#ifndef __APPLE__
-		write(io->dev->event_pipe[1],buf, 1); /* notify timeout thread */
-	#endif
+	usbi_notify_event_pipe(io->dev); /* notify timeout thread */
 
 	if (io->priv) {
 		free(io->priv);
 	}
 
-	pthread_mutex_unlock(&io->lock);
+	free(io->bounce);
+
+	usbi_mutex_unlock(&io->lock);
 
 	/* Delete the condition variable and wakeup any threads waiting */
 	while (pthread_cond_destroy(&io->cond) == EBUSY) {
-		pthread_mutex_lock(&io->lock);
+		usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 		pthread_cond_broadcast(&io->cond);
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 	}
 
 	pthread_mutex_destroy(&io->lock);
@@ -141,29 +285,53 @@ void usbi_free_io(struct usbi_io *io)
 	free(io);
 }
 
-/* Helper routine. To be called from the various ports */
+/*
+ * Backends report when the packets of an isochronous request were on the
+ * bus with this, if the request asks for it: num packets from first went
+ * out interval (micro)frames apart from frame on, and completed just now.
+ */
+void usbi_isoc_frames(struct usbi_io *io, uint32_t first, uint32_t num,
+	uint32_t frame, uint32_t interval)
+{
+	openusb_isoc_request_t *isoc = io->req->req.isoc;
+	struct timespec ts;
+	uint64_t now;
+	uint32_t i;
+
+	if (!(isoc->flags & OPENUSB_ISOC_FRAMES) || !isoc->frames)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	for (i = 0; i < num && first + i < isoc->pkts.num_packets; i++) {
+		isoc->frames[first + i].frame = frame + i * interval;
+		isoc->frames[first + i].timestamp = now;
+	}
+}
+
+/*
+ * Helper routine. To be called from the various ports. A callback run from
+ * here may close the request's device, so the backend must not touch the
+ * device handle afterwards without checking it's still open.
+ */
 void usbi_io_complete(struct usbi_io *io, int32_t status, size_t transferred_bytes)
 {
 	openusb_request_result_t *result = NULL;
 	openusb_transfer_type_t type;
 	struct usbi_dev_handle *hdev = io->dev;
+	int flag = io->flag;
 
-	pthread_mutex_lock(&io->lock);
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 	io->status = USBI_IO_COMPLETED;
-	pthread_mutex_unlock(&io->lock);
-	list_del(&io->list);
-	
-	/* Add completion for later retrieval */
-	if (io->flag == USBI_ASYNC) {
-		/* for synchronous IO, not necessary to put it on this list */
-		pthread_mutex_lock(&hdev->lib_hdl->complete_lock);
-		list_add(&io->list, &hdev->lib_hdl->complete_list);
-		hdev->lib_hdl->complete_count++;
-		pthread_cond_signal(&hdev->lib_hdl->complete_cv);
-		pthread_mutex_unlock(&hdev->lib_hdl->complete_lock);
-	}
+	usbi_mutex_unlock(&io->lock);
 
-	pthread_mutex_lock(&io->lock);
+	/* backends must not hold the queue lock when completing a request */
+	usbi_mutex_lock(&io->queue->lock, USBI_LOCK_EP);
+	usbi_unlink_io(io);
+	usbi_mutex_unlock(&io->queue->lock);
+	
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 	type = io->req->type;
 
 	if (type == USB_TYPE_CONTROL) {
@@ -180,24 +348,61 @@ void usbi_io_complete(struct usbi_io *io, int32_t status, size_t transferred_byt
 
 	} else if (type == USB_TYPE_ISOCHRONOUS) {
 
-		result = &io->req->req.isoc->isoc_results[0];
+		/* the packets have results of their own */
+		io->req->req.isoc->isoc_status = status;
 
 	}
-	pthread_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->lock);
 
-	result->status = status;
-	result->transferred_bytes = transferred_bytes;
+	usbi_io_unbounce(io, transferred_bytes);
+
+	if (result) {
+		result->status = status;
+		result->transferred_bytes = transferred_bytes;
+	}
 
-	pthread_mutex_lock(&io->lock);
+	if (io->rec_id)
+		usbi_record_complete(io, status, transferred_bytes);
+
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 	pthread_cond_broadcast(&io->cond);
-	pthread_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->lock);
+
+	/*
+	 * Run the user supplied callback. Nobody waits for such a request with
+	 * openusb_wait(), so it's done with here; freeing the io first leaves
+	 * the callback free to resubmit the request, free it or close the device
+	 */
+	if (flag == USBI_ASYNC && io->req->cb) {
+		openusb_request_handle_t req = io->req;
 
-	/* run the user supplied callback */
-	if(io->flag == USBI_ASYNC && io->req->cb) {	io->req->cb(io->req);	}
+		usbi_free_io(io);
+		usbi_io_completing++;
+		req->cb(req);
+		usbi_io_completing--;
+		return;
+	}
 
 	/* run the internal callback, if it exists */
-	if(io->callback) { io->callback(io,status);	}
-	
+	if (io->callback) {
+		usbi_io_completing++;
+		io->callback(io, status);
+		usbi_io_completing--;
+	}
+
+	/*
+	 * Add completion for later retrieval. This comes last, openusb_wait()
+	 * may return and free the request right away
+	 */
+	if (flag == USBI_ASYNC) {
+		/* for synchronous IO, not necessary to put it on this list */
+		usbi_mutex_lock(&hdev->lib_hdl->complete_lock, USBI_LOCK_COMPLETE);
+		list_add(&io->list, &hdev->lib_hdl->complete_list);
+		hdev->lib_hdl->complete_count++;
+		pthread_cond_signal(&hdev->lib_hdl->complete_cv);
+		usbi_mutex_unlock(&hdev->lib_hdl->complete_lock);
+	}
+
 	/* remove usbi_free_io */
 }
 
@@ -210,9 +415,9 @@ int usbi_async_submit(struct usbi_io *io)
 	int ret;
 	openusb_transfer_type_t type;
 	
-	pthread_mutex_lock(&io->lock);
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 	type = io->req->type;
-	pthread_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->lock);
   
 	dev = io->dev;
 	if (!dev)
@@ -278,6 +483,12 @@ int usbi_sync_submit(struct usbi_io *io)
 			ret = OPENUSB_BADARG;
 	}
 
+	/* what a failed request read before it failed is passed on too */
+	if (type == USB_TYPE_BULK)
+		usbi_io_unbounce(io, io->req->req.bulk->result.transferred_bytes);
+	else if (type == USB_TYPE_INTERRUPT)
+		usbi_io_unbounce(io, io->req->req.intr->result.transferred_bytes);
+
 	/* upon success, the return value on Solaris is >= 0 */
 	if (ret < 0) {
 		return ret;
@@ -315,12 +526,12 @@ static int simple_io_wait(struct simple_io *io)
 	 * already been signaled. Use io->completed == 1 as the signal
 	 * this has happened. 
 	 */
-	pthread_mutex_lock(&io->lock);
-	if (!io->completed) {
-		pthread_cond_wait(&io->complete, &io->lock);
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
+	while (!io->completed) {
+		usbi_wait_events(&io->complete, &io->lock, USBI_LOCK_IO);
 	}
 	status = io->status;
-	pthread_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->lock);
 	
 	return (status);
 }
@@ -331,13 +542,13 @@ static void simple_io_complete(struct simple_io *io, int status)
 	 * already been signaled. Use io->completed == 1 as the signal this
 	 * has happened. 
 	 */
-	pthread_mutex_lock(&io->lock); 
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO); 
 
 	io->completed = 1;
 	io->status = status;
 
 	pthread_cond_signal(&io->complete);
-	pthread_mutex_unlock(&io->lock); 
+	usbi_mutex_unlock(&io->lock); 
 }
 
 /* backend is responsible to provide status of this io */
@@ -346,6 +557,51 @@ static void async_callback(struct usbi_io *io, int32_t status)
 	simple_io_complete(io->arg, status);
 }
 
+/* if the backend's synchronous function takes this request */
+static int usbi_io_sync_fits(struct usbi_dev_handle *dev,
+	openusb_request_handle_t req)
+{
+	struct usbi_device_ops *ops = dev->idev->ops;
+	uint32_t max, len;
+	int32_t timeout;
+
+	switch (req->type) {
+		case USB_TYPE_CONTROL:
+			if (!ops->ctrl_xfer_wait)
+				return 0;
+			len = req->req.ctrl->length;
+			break;
+		case USB_TYPE_INTERRUPT:
+			if (!ops->intr_xfer_wait)
+				return 0;
+			len = req->req.intr->length;
+			break;
+		case USB_TYPE_BULK:
+			if (!ops->bulk_xfer_wait)
+				return 0;
+			len = req->req.bulk->length;
+			break;
+		case USB_TYPE_ISOCHRONOUS:
+			return (ops->isoc_xfer_wait != NULL &&
+				!dev->idev->bus->ops->sync_xfer_max[req->type]);
+		default:
+			return 0;
+	}
+
+	max = dev->idev->bus->ops->sync_xfer_max[req->type];
+	if (max && len > max)
+		return 0;
+
+	max = dev->idev->bus->ops->sync_timeout_max;
+	if (max) {
+		timeout = usbi_get_xfer_timeout(req, dev);
+		if (timeout <= 0 || (uint32_t)timeout > max)
+			return 0;
+	}
+
+	return 1;
+}
+
 /*
  * internal synchronous xfer function:
  *
@@ -359,6 +615,20 @@ int usbi_io_sync(struct usbi_dev_handle *dev, openusb_request_handle_t req)
 
 	io_pattern = dev->idev->bus->ops->io_pattern;
 
+	/* a backend doing both may only take some requests synchronously */
+	if (io_pattern == PATTERN_BOTH && !usbi_io_sync_fits(dev, req))
+		io_pattern = PATTERN_ASYNC;
+
+	/*
+	 * Backends complete every device's requests from one thread, a
+	 * callback running there would wait for itself to complete this one
+	 */
+	if (io_pattern == PATTERN_ASYNC && usbi_io_completing) {
+		usbi_debug(dev->lib_hdl, 1, "synchronous request from a callback "
+			"would wait for its own thread");
+		return OPENUSB_BUSY;
+	}
+
 	if (io_pattern == PATTERN_ASYNC) {
 		struct simple_io *io;
 		struct usbi_io *iop;
@@ -368,6 +638,8 @@ int usbi_io_sync(struct usbi_dev_handle *dev, openusb_request_handle_t req)
 		iop = usbi_alloc_io(dev, req, timeout);
 		io = calloc(sizeof(*io), 1);
 		if (!iop || !io) {
+			usbi_free_io(iop);
+			free(io);
 			return OPENUSB_NO_RESOURCES;
 		}
 
@@ -394,6 +666,8 @@ int usbi_io_sync(struct usbi_dev_handle *dev, openusb_request_handle_t req)
 		timeout = usbi_get_xfer_timeout(req, dev);
 
 		io = usbi_alloc_io(dev, req, timeout);
+		if (!io)
+			return OPENUSB_NO_RESOURCES;
 
 		ret = usbi_sync_submit(io);
 		usbi_free_io(io);
@@ -428,14 +702,20 @@ io_submit(void *arg)
 	}
 
 	/*remove this element from its original list */
-	list_del(&iop->list);
+	usbi_mutex_lock(&iop->queue->lock, USBI_LOCK_EP);
+	usbi_unlink_io(iop);
+	usbi_mutex_unlock(&iop->queue->lock);
 	
 	ret = usbi_sync_submit(iop);
 
 	if(iop->req->cb){
+		openusb_request_handle_t req = iop->req;
+
 		usbi_debug(iop->dev->lib_hdl, 4, "callback get called");
-		iop->req->cb(iop->req);
-		usbi_free_io(iop); /* should be removed ? */
+
+		/* as in usbi_io_complete(), the callback may free the request */
+		usbi_free_io(iop);
+		req->cb(req);
 	} else {
 		/* somebody is waiting for this asnyc io,add it to
 		 * complete list
@@ -447,13 +727,13 @@ io_submit(void *arg)
 			dev->lib_hdl, iop, &dev->lib_hdl->complete_cv,
 			&dev->lib_hdl->complete_lock);
 
-		pthread_mutex_lock(&dev->lib_hdl->complete_lock);
+		usbi_mutex_lock(&dev->lib_hdl->complete_lock, USBI_LOCK_COMPLETE);
 
 		list_add(&iop->list,&dev->lib_hdl->complete_list);
 		dev->lib_hdl->complete_count++;
 		pthread_cond_signal(&(dev->lib_hdl->complete_cv));
 
-		pthread_mutex_unlock(&dev->lib_hdl->complete_lock);
+		usbi_mutex_unlock(&dev->lib_hdl->complete_lock);
 	}
 
 	return NULL;
@@ -471,17 +751,17 @@ int usbi_io_async(struct usbi_io *iop)
 	int ret = OPENUSB_PLATFORM_FAILURE;
 	openusb_transfer_type_t type;
 
-	pthread_mutex_lock(&iop->lock);
+	usbi_mutex_lock(&iop->lock, USBI_LOCK_IO);
 	dev = iop->dev;
 	type = iop->req->type;
-	pthread_mutex_unlock(&iop->lock);
+	usbi_mutex_unlock(&iop->lock);
 
 	if (!dev)
 		return OPENUSB_UNKNOWN_DEVICE;
 
-	pthread_mutex_lock(&dev->idev->bus->lock);
+	usbi_mutex_lock(&dev->idev->bus->lock, USBI_LOCK_BUS);
 	io_pattern = dev->idev->bus->ops->io_pattern;
-	pthread_mutex_unlock(&dev->idev->bus->lock);
+	usbi_mutex_unlock(&dev->idev->bus->lock);
 	
 	if (type < USB_TYPE_CONTROL || type > USB_TYPE_ISOCHRONOUS) {
 		return OPENUSB_BADARG;
@@ -506,7 +786,7 @@ int usbi_io_async(struct usbi_io *iop)
 		 * I suggest to spawn one or a bunch of threads for every
 		 * opened device.
 		 * This thread will process async ios on this device's
-		 * io_head list.
+		 * endpoint queues.
 		 */
 		ret = pthread_create(&thrid, NULL, io_submit, (void *)iop);
 
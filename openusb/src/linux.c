@@ -8,6 +8,7 @@
  */
 
 #include <stdlib.h>	/* getenv, etc */
+#include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <string.h>
@@ -15,6 +16,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <dirent.h>
 #include <ctype.h>
 #include <stdarg.h>
@@ -22,12 +24,36 @@
 #include <libudev.h>
 #include <sys/utsname.h>
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #include "usbi.h"
 #include "linux.h"
 
 #define	LINUX_MAX_BULK_INTR_XFER	16384
+#define	LINUX_MAX_BULK_SG_XFER		(1024 * 1024)	/* with scatter-gather */
+/* a multiple of every bulk wMaxPacketSize, so no URB ends in a short packet */
+#define	LINUX_BULK_CHAIN_ALIGN		1024
 #define LINUX_MAX_ISOC_XFER				32768
 #define LINUX_MAX_CTRL_XFER       4096
+/*
+ * synchronous ioctls can't be discarded like URBs, only small requests with
+ * a timeout bounding how long they can hold up an abort or close use them
+ */
+#define	LINUX_MAX_SYNC_XFER		1024
+#define	LINUX_MAX_SYNC_TIMEOUT		5000	/* ms */
+
+/* the io_uring reactor needs multishot polls to be worth having */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_POLL_ADD_MULTI)
+#define	LINUX_IO_URING	1
+#endif
 
 
 static pthread_t  hotplug_thread;
@@ -35,6 +61,32 @@ static int        hotplug_pipe[2] = {0, 0};
 static char       device_dir[PATH_MAX + 1] = "";
 static int32_t    linux_backend_inited = 0;
 static int8_t     supports_flag_bulk_continuation = 0;
+static int8_t     use_sysfs_enum = 0;
+
+/* The io thread, shared by every open handle */
+static pthread_t        io_thread;
+static int              io_thread_pipe[2] = {-1, -1};
+static int              io_thread_running = 0;
+static int              io_thread_changed = 0;
+static pthread_mutex_t  io_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head io_thread_handles = { .prev = &io_thread_handles,
+		.next = &io_thread_handles };
+/* set in the thread doing the io thread's work, which holds io_thread_lock:
+ * the io thread itself or, without threads, one handling events */
+static __thread int     io_thread_self = 0;
+/* OPENUSB_INIT_IO_URING, from the first openusb_init() */
+static int              io_thread_uring = 0;
+
+/* without threads, hotplug events are read from the application's loop */
+static struct udev         *hotplug_udev = NULL;
+static struct udev_monitor *hotplug_monitor = NULL;
+static pthread_mutex_t      hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int32_t start_io_thread(void);
+static void    stop_io_thread(void);
+static void    linux_handle_fd(int fd, short revents, void *arg);
+static int32_t start_hotplug_monitor(void);
+static void    stop_hotplug_monitor(void);
 
 
 
@@ -70,6 +122,9 @@ int32_t translate_errno(int errnum)
 
 		case ENODEV:
 			return (OPENUSB_UNKNOWN_DEVICE);
+
+		case ETIMEDOUT:
+			return (OPENUSB_IO_TIMEOUT);
 	}
 }
 
@@ -150,27 +205,40 @@ static int32_t linux_close(struct usbi_dev_handle *hdev)
   if (hdev->state != USBI_DEVICE_OPENED) { return (OPENUSB_SUCCESS); }
 
 	/* Make sure we know we're closing */
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	hdev->state = USBI_DEVICE_CLOSING;
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
+
+	/* Take the handle away from the io thread. Once we hold the lock the io
+	 * thread is either waiting in poll() or done with its pass over the
+	 * handles, unless we're being called from one of its callbacks */
+	if (io_thread_self) {
+		list_del(&hdev->priv->io_thread_list);
+		io_thread_changed = 1;
+	} else {
+		pthread_mutex_lock(&io_thread_lock);
+		list_del(&hdev->priv->io_thread_list);
+		/* an io_uring poll holds the usbfs file open until it's removed */
+		if (io_thread_uring) {
+			wakeup_io_thread(hdev);
+		}
+		pthread_mutex_unlock(&io_thread_lock);
+	}
+	if (!usbi_threads_enabled() && hdev->priv->fd > 0) {
+		usbi_remove_pollfd(hdev->priv->fd);
+	}
+
+	/* the device no longer has a handle */
+	if (hdev->idev->priv->hdev == hdev)
+		hdev->idev->priv->hdev = NULL;
 
-	/* Stop the IO processing (polling) thread */
-	wakeup_io_thread(hdev);
-	pthread_join(hdev->priv->io_thread, NULL);
-	
-	/* close the event pipes */
-	if (hdev->priv->event_pipe[0] > 0)
-		close(hdev->priv->event_pipe[0]);
-	if (hdev->priv->event_pipe[1] > 0)
-		close(hdev->priv->event_pipe[1]);
-	
 	/* If we've already closed the file, we're done */
 	if (hdev->priv->fd <= 0) {
 		free(hdev->priv);
 		return (OPENUSB_SUCCESS);
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	if (close(hdev->priv->fd) == -1) {
 		/* Log the fact that we had a problem closing the file, however failing a
 		 * close isn't really an error, so return success anyway */
@@ -178,7 +246,7 @@ static int32_t linux_close(struct usbi_dev_handle *hdev)
 							 hdev->priv->fd, strerror(errno));
 	}
 	hdev->state = USBI_DEVICE_CLOSED;
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	/* free our private data */
 	free(hdev->priv);
@@ -191,11 +259,12 @@ static int32_t linux_close(struct usbi_dev_handle *hdev)
 /*
  * linux_open
  *
- *   Prepare the device and make the default endpoint accessible
+ *   Prepare the device and make the default endpoint accessible. All this
+ *   takes is opening the usbfs node and handing it to the shared io thread.
  */
 static int32_t linux_open(struct usbi_dev_handle *hdev)
 {
-	int ret;
+	int32_t ret;
 
 	/* Validate... */
 	if (!hdev) {
@@ -210,27 +279,56 @@ static int32_t linux_open(struct usbi_dev_handle *hdev)
 	if (!hdev->priv) {
 		return (OPENUSB_NO_RESOURCES);
 	}
+	hdev->priv->hdev = hdev;
+	hdev->priv->poll_idx = -1;
 
 	/* open the device */
 	hdev->priv->fd = device_open(hdev->idev);
 	if (hdev->priv->fd < 0) {
-		return (hdev->priv->fd);
+		ret = hdev->priv->fd;
+		free(hdev->priv);
+		hdev->priv = NULL;
+		return (ret);
 	}
-	
-	/* setup the event pipe for this device */
-	ret = pipe(hdev->priv->event_pipe);
-	if (ret == -1) {
-	  usbi_debug(NULL, 1, "unable to create io event pipe: %d", ret);
-	  return (OPENUSB_SYS_FUNC_FAILURE);
+
+	/* older kernels don't know the ioctl, they have none of the caps */
+	if (ioctl(hdev->priv->fd, IOCTL_USB_GET_CAPABILITIES,
+	    &hdev->priv->caps) < 0) {
+		hdev->priv->caps = 0;
 	}
 
-	/* Start up thread for polling io */
-	ret = pthread_create(&hdev->priv->io_thread, NULL, poll_io, (void*)hdev);
-	if (ret < 0) {
-		usbi_debug(NULL, 1, "unable to create io polling thread (ret = %d)", ret);
-		linux_close(hdev);
-		return (OPENUSB_NO_RESOURCES);
+	/* without threads the application polls the fd for completions */
+	if (!usbi_threads_enabled()) {
+		ret = usbi_add_pollfd(hdev->priv->fd, POLLOUT, linux_handle_fd, NULL);
+		if (ret != OPENUSB_SUCCESS) {
+			close(hdev->priv->fd);
+			free(hdev->priv);
+			hdev->priv = NULL;
+			return (ret);
+		}
+	}
+
+	/* Hand the device over to the io thread, starting it if need be */
+	if (io_thread_self) {
+		list_add(&hdev->priv->io_thread_list, &io_thread_handles);
+		io_thread_changed = 1;
+	} else {
+		pthread_mutex_lock(&io_thread_lock);
+		ret = start_io_thread();
+		if (ret != OPENUSB_SUCCESS) {
+			pthread_mutex_unlock(&io_thread_lock);
+			if (!usbi_threads_enabled()) {
+				usbi_remove_pollfd(hdev->priv->fd);
+			}
+			close(hdev->priv->fd);
+			free(hdev->priv);
+			hdev->priv = NULL;
+			return (ret);
+		}
+		list_add(&hdev->priv->io_thread_list, &io_thread_handles);
+		pthread_mutex_unlock(&io_thread_lock);
 	}
+	wakeup_io_thread(hdev);
 
 	/* link the handle and the usbi_device */
 	hdev->idev->priv->hdev = hdev;
@@ -269,22 +367,172 @@ static int32_t linux_set_configuration(struct usbi_dev_handle *hdev, uint8_t cfg
 
 
 
+/*
+ * sysfs_get_configuration
+ *
+ *  Read the active configuration value from the device's bConfigurationValue
+ *  sysfs attribute, which saves us a GET_CONFIGURATION control request.
+ */
+static int32_t sysfs_get_configuration(struct usbi_device *idev, uint8_t *cfg)
+{
+	char     path[PATH_MAX + 1];
+	char     buf[8];
+	ssize_t  len;
+	int      fd;
+
+	if (!idev->priv->sysfspath) {
+		return (OPENUSB_PLATFORM_FAILURE);
+	}
+
+	snprintf(path, sizeof(path), "%s/bConfigurationValue",
+	         idev->priv->sysfspath);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return (OPENUSB_PLATFORM_FAILURE);
+	}
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	/* an unconfigured device reads back empty */
+	if (len <= 0 || !isdigit(buf[0])) {
+		return (OPENUSB_PLATFORM_FAILURE);
+	}
+
+	buf[len] = 0;
+	*cfg = (uint8_t)atoi(buf);
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * desc_cfg_index_by_value
+ *
+ *  Look up a configuration's index in a raw descriptor blob, the device
+ *  descriptor followed by every configuration as sysfs "descriptors" holds
+ *  them. Returns -1 if we can't tell.
+ */
+static int32_t desc_cfg_index_by_value(const uint8_t *desc, size_t len,
+                                       uint8_t cfgval)
+{
+	size_t   offset = USBI_DEVICE_DESC_SIZE, total;
+	int32_t  i;
+
+	if (!desc || len < USBI_DEVICE_DESC_SIZE) {
+		return (-1);
+	}
+
+	for (i = 0; i < desc[17]; i++) {
+		if (offset + USBI_CONFIG_DESC_SIZE > len ||
+		    desc[offset + 1] != USB_DESC_TYPE_CONFIG) {
+			return (-1);
+		}
+
+		/* bConfigurationValue */
+		if (desc[offset + 5] == cfgval) {
+			return (i);
+		}
+
+		total = desc[offset + 2] | (desc[offset + 3] << 8);
+		if (total < USBI_CONFIG_DESC_SIZE) {
+			return (-1);
+		}
+		offset += total;
+	}
+
+	return (-1);
+}
+
+
+
+/*
+ * cached_cfg_index_by_value
+ *
+ *  Look up a configuration's index without fetching and parsing all the
+ *  descriptors. The sysfs enumerator cached them, devices found through
+ *  libudev have them read from their sysfs "descriptors" attribute, which
+ *  the kernel serves from its own copy, so neither touches the bus.
+ *  Returns -1 if we can't tell.
+ */
+static int32_t cached_cfg_index_by_value(struct usbi_device *idev,
+                                         uint8_t cfgval)
+{
+	char     path[PATH_MAX + 1];
+	uint8_t  *desc;
+	size_t   len = 0;
+	ssize_t  ret;
+	int32_t  ndx;
+	int      fd;
+
+	if (idev->priv->descriptors) {
+		return (desc_cfg_index_by_value(idev->priv->descriptors,
+		                                idev->priv->descriptors_len, cfgval));
+	}
+
+	if (!idev->priv->sysfspath) {
+		return (-1);
+	}
+
+	snprintf(path, sizeof(path), "%s/descriptors", idev->priv->sysfspath);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return (-1);
+	}
+
+	desc = malloc(LINUX_SYSFS_DESC_MAX);
+	if (!desc) {
+		close(fd);
+		return (-1);
+	}
+
+	do {
+		ret = read(fd, desc + len, LINUX_SYSFS_DESC_MAX - len);
+		if (ret > 0) {
+			len += ret;
+		}
+	} while (ret > 0 && len < LINUX_SYSFS_DESC_MAX);
+	close(fd);
+
+	ndx = ret < 0 ? -1 : desc_cfg_index_by_value(desc, len, cfgval);
+	free(desc);
+
+	return (ndx);
+}
+
+
+
 /*
  * linux_get_configuration
  *
- *  Gets the usb configuration from our cache. There is no usbdevfs IOCTL
- *  for getting the current configuration so this is the best we can do.
+ *  Gets the current usb configuration. There is no usbdevfs IOCTL for this,
+ *  so we read it from sysfs and only fall back to a GET_CONFIGURATION
+ *  request if that doesn't work.
  */
 int32_t linux_get_configuration(struct usbi_dev_handle *hdev, uint8_t *cfg)
 {
 	int32_t ret = OPENUSB_SUCCESS;
 	uint8_t current_cfg;
-	int32_t current_ndx;
+	int32_t current_ndx = -1;
 
 	if ((!hdev) || (!cfg))
 		return OPENUSB_BADARG;
 
-	pthread_mutex_unlock(&hdev->lock);
+	/* The cheap way first, sysfs and the descriptor cache */
+	if (sysfs_get_configuration(hdev->idev, &current_cfg) == OPENUSB_SUCCESS) {
+		current_ndx = cached_cfg_index_by_value(hdev->idev, current_cfg);
+		if (current_ndx >= 0) {
+			usbi_debug(NULL, 4, "current device configuration value: %d",
+			           current_cfg);
+			*cfg = current_cfg;
+			hdev->idev->cur_config_value = current_cfg;
+			hdev->idev->cur_config_index = current_ndx;
+			return (OPENUSB_SUCCESS);
+		}
+	}
+
+	usbi_mutex_unlock(&hdev->lock);
 
 	/* Get current device configuration value via control request. */
 	/* The timeout has been bumped from 100ms to 1000ms to work better */
@@ -302,7 +550,7 @@ int32_t linux_get_configuration(struct usbi_dev_handle *hdev, uint8_t *cfg)
 		usbi_debug(NULL, 4, "current device configuration value: %d", current_cfg);
 	}
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 	if (ret == OPENUSB_SUCCESS) {
 		*cfg = current_cfg;
@@ -540,7 +788,9 @@ static int32_t linux_clear_halt(struct usbi_dev_handle *hdev, uint8_t ept)
 /* linux_init
  *
  *  Backend initialization, called in openusb_init()
- *    flags - inherited from openusb_init(), TBD
+ *    flags - inherited from openusb_init(), with OPENUSB_INIT_NO_THREADS
+ *            the hotplug monitor and usbfs fds are polled by the application,
+ *            OPENUSB_INIT_IO_URING has the io thread wait on io_uring
  */
 static int32_t linux_init(struct usbi_handle *hdl, uint32_t flags )
 {
@@ -586,7 +836,27 @@ static int32_t linux_init(struct usbi_handle *hdl, uint32_t flags )
 	
 	/* Does the kernel support bulk continuation? */
   supports_flag_bulk_continuation = check_bulk_continuation_flag();
+
+	/* Enumerate straight from sysfs instead of going through libudev? */
+	if (getenv("OPENUSB_LINUX_ENUM") &&
+	    strcmp(getenv("OPENUSB_LINUX_ENUM"), "sysfs") == 0) {
+		usbi_debug(hdl, 4, "using direct sysfs enumeration");
+		use_sysfs_enum = 1;
+	}
+
+	/* the io thread falls back to poll() if io_uring isn't up to it */
+	io_thread_uring = (flags & OPENUSB_INIT_IO_URING) != 0;
 	
+	/* Without threads, the application's loop watches for hotplug */
+	if (!usbi_threads_enabled()) {
+		ret = start_hotplug_monitor();
+		if (ret != OPENUSB_SUCCESS) {
+			return (ret);
+		}
+		linux_backend_inited++;
+		return (OPENUSB_SUCCESS);
+	}
+
 	/* Create the device pipe */
 	ret = pipe(hotplug_pipe);
 	if (ret == -1) {
@@ -629,6 +899,15 @@ static void linux_fini(struct usbi_handle *hdl)
 		return;
 	}
 	
+	/* shutdown the io thread */
+	stop_io_thread();
+
+	if (!usbi_threads_enabled()) {
+		stop_hotplug_monitor();
+		linux_backend_inited--;
+		return;
+	}
+
 	/* shutdown the hotplug thread */
   if (write(hotplug_pipe[1], buf, 1) == -1) {
     usbi_debug(hdl, 1, "unable to write to the hotplug pipe, hanging...");
@@ -750,6 +1029,10 @@ static void linux_free_device(struct usbi_device *idev)
 			free(idev->priv->sysfspath);
 			idev->priv->sysfspath = NULL;
 		}
+		if (idev->priv->descriptors) {
+			free(idev->priv->descriptors);
+			idev->priv->descriptors = NULL;
+		}
 		free(idev->priv);
 		idev->priv = NULL;
 	}
@@ -778,14 +1061,14 @@ static int32_t linux_submit_ctrl(struct usbi_dev_handle *hdev, struct usbi_io *i
 		return (OPENUSB_BADARG);
 	}
 
-	pthread_mutex_lock(&io->lock);
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 	
 	/* allocate memory for the private part */
 	io->priv = malloc(sizeof(struct usbi_io_private));
 	if (!io->priv) {
 		usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for the "
 							 "private io member");
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 	memset(io->priv, 0, sizeof(*io->priv));
@@ -795,7 +1078,7 @@ static int32_t linux_submit_ctrl(struct usbi_dev_handle *hdev, struct usbi_io *i
 	io->priv->urbs = (struct usbk_urb*)malloc(sizeof(struct usbk_urb));
 	if (!io->priv->urbs) {
 		usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for the urb");
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 	memset(io->priv->urbs, 0, sizeof(struct usbk_urb));
@@ -819,7 +1102,7 @@ static int32_t linux_submit_ctrl(struct usbi_dev_handle *hdev, struct usbi_io *i
 	/* allocate a temporary buffer for the payload */
 	io->priv->urbs[0].buffer = malloc(USBI_CONTROL_SETUP_LEN + ctrl->length);
 	if (!io->priv->urbs[0].buffer) {
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 	memset(io->priv->urbs[0].buffer,0,USBI_CONTROL_SETUP_LEN + ctrl->length);
@@ -834,8 +1117,8 @@ static int32_t linux_submit_ctrl(struct usbi_dev_handle *hdev, struct usbi_io *i
 					 ctrl->payload, ctrl->length);
 	}
 
-	/* lock the device */
-	pthread_mutex_lock(&hdev->lock);
+	/* lock the endpoint */
+	usbi_mutex_lock(&io->queue->lock, USBI_LOCK_EP);
 	
 	/* submit the URB */
 	ret = urb_submit(hdev, &io->priv->urbs[0]);
@@ -844,14 +1127,14 @@ static int32_t linux_submit_ctrl(struct usbi_dev_handle *hdev, struct usbi_io *i
 							 io->req->endpoint, strerror(errno));
 		io->status = USBI_IO_COMPLETED_FAIL;
 		
-		pthread_mutex_unlock(&io->lock);
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->queue->lock);
 		return translate_errno(errno);
 	}
 	
-	/* unlock the device & io request */
-	pthread_mutex_unlock(&io->lock);
-	pthread_mutex_unlock(&hdev->lock);
+	/* unlock the endpoint & io request */
+	usbi_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->queue->lock);
 
 	/* always do this to avoid race conditions */
 	wakeup_io_thread(hdev);
@@ -861,6 +1144,125 @@ static int32_t linux_submit_ctrl(struct usbi_dev_handle *hdev, struct usbi_io *i
 
 
 
+/*
+ * The synchronous functions, for small requests. One IOCTL_USB_CONTROL or
+ * IOCTL_USB_BULK moves the data and waits for it, without URBs to reap or
+ * the io thread to wake; the frontend sends larger requests through the
+ * asynchronous functions. IOCTL_USB_BULK takes interrupt endpoints too.
+ * These requests can't be aborted, the kernel times them out.
+ */
+static int32_t linux_sync_result(struct usbi_io *io,
+	openusb_request_result_t *result, int ret)
+{
+	if (ret < 0) {
+		result->status = translate_errno(errno);
+		result->transferred_bytes = 0;
+		usbi_debug(io->dev->lib_hdl, 4, "sync xfer on ep %x failed: %s",
+		           io->req->endpoint, strerror(errno));
+	} else {
+		result->status = OPENUSB_SUCCESS;
+		result->transferred_bytes = ret;
+	}
+
+	return (result->status);
+}
+
+/* never 0, which usbfs takes for no timeout, sync_timeout_max rules it out */
+static uint32_t linux_sync_timeout(struct usbi_io *io)
+{
+	if (io->timeout == 0 || io->timeout > LINUX_MAX_SYNC_TIMEOUT) {
+		return (LINUX_MAX_SYNC_TIMEOUT);
+	}
+
+	return (io->timeout);
+}
+
+static int32_t linux_ctrl_xfer_wait(struct usbi_dev_handle *hdev,
+	struct usbi_io *io)
+{
+	openusb_ctrl_request_t   *ctrl = io->req->req.ctrl;
+	struct usbk_ctrltransfer xfer;
+	int                      ret;
+
+	xfer.bRequestType = ctrl->setup.bmRequestType;
+	xfer.bRequest = ctrl->setup.bRequest;
+	xfer.wValue = ctrl->setup.wValue;
+	xfer.wIndex = ctrl->setup.wIndex;
+	xfer.wLength = ctrl->length;
+	xfer.timeout = linux_sync_timeout(io);
+	xfer.data = ctrl->payload;
+
+	ret = ioctl(hdev->priv->fd, IOCTL_USB_CONTROL, &xfer);
+
+	return (linux_sync_result(io, &ctrl->result, ret));
+}
+
+static int32_t linux_bulk_intr_xfer_wait(struct usbi_dev_handle *hdev,
+	struct usbi_io *io)
+{
+	openusb_request_result_t *result;
+	struct usbk_bulktransfer xfer;
+	int                      ret;
+
+	/* scatter-gather requests go through one buffer */
+	if (usbi_io_bounce(io) != 0) {
+		return (OPENUSB_NO_RESOURCES);
+	}
+
+	if (io->req->type == USB_TYPE_BULK) {
+		xfer.len = io->req->req.bulk->length;
+		result = &io->req->req.bulk->result;
+	} else {
+		xfer.len = io->req->req.intr->length;
+		result = &io->req->req.intr->result;
+	}
+	xfer.ep = io->req->endpoint;
+	xfer.timeout = linux_sync_timeout(io);
+	xfer.data = usbi_io_payload(io);
+
+	ret = ioctl(hdev->priv->fd, IOCTL_USB_BULK, &xfer);
+
+	return (linux_sync_result(io, result, ret));
+}
+
+
+/*
+ * linux_iov_chainable
+ *
+ *  usbfs takes one buffer per URB, so a scatter-gather request becomes a
+ *  chain of URBs, at least one per iovec entry. That only works if no URB
+ *  but the last ends in a short packet, which would end the transfer early,
+ *  so every entry but the last has to be a multiple of the largest bulk
+ *  packet size. Interrupt endpoints may use any packet size, they only go
+ *  straight from a single iovec.
+ */
+static int linux_iov_chainable(struct usbi_io *io, struct iovec *iov,
+															 uint32_t iovcnt)
+{
+	uint32_t	i, last;
+
+	/* empty entries carry nothing, the last one that does counts */
+	for (last = iovcnt; last > 0 && iov[last - 1].iov_len == 0; last--)
+		;
+	if (last <= 1) {
+		return (1);
+	}
+
+	if (io->req->type != USB_TYPE_BULK) {
+		return (0);
+	}
+
+	for (i = 0; i < last - 1; i++) {
+		if (iov[i].iov_len % LINUX_BULK_CHAIN_ALIGN) {
+			return (0);
+		}
+	}
+
+	return (1);
+}
+
+
+
 /*
  * linux_submit_bulk_intr
  *
@@ -869,9 +1271,10 @@ static int32_t linux_submit_ctrl(struct usbi_dev_handle *hdev, struct usbi_io *i
 static int32_t linux_submit_bulk_intr(struct usbi_dev_handle *hdev, struct usbi_io *io)
 {
 	int32_t		ret;
-	int32_t		i;
-	uint8_t		partial_last_urb = 0;
-	uint8_t		*payload;
+	int32_t		i, n;
+	struct iovec	*iov, one;
+	uint32_t	iovcnt;
+	size_t		off, chunk, max;
 	uint32_t	length;
 	uint8_t		xfertype;
 
@@ -880,39 +1283,64 @@ static int32_t linux_submit_bulk_intr(struct usbi_dev_handle *hdev, struct usbi_
 		return (OPENUSB_BADARG);
 	}
 
-	pthread_mutex_lock(&io->lock);
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 	
 	/* allocate memory for the private part */
 	io->priv = malloc(sizeof(struct usbi_io_private));
 	if (!io->priv) {
 		usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for the "
 							 "private io member");
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 	memset(io->priv, 0, sizeof(*io->priv));
 
-	/* setup the payload, length and type we need for later */
+	/* setup the length and type we need for later */
 	if (io->req->type == USB_TYPE_BULK) {
-		payload = io->req->req.bulk->payload;
 		length	= io->req->req.bulk->length;
 		xfertype= USBK_URB_TYPE_BULK;
 	} else if (io->req->type == USB_TYPE_INTERRUPT) {
-		payload = io->req->req.intr->payload;
 		length	= io->req->req.intr->length;
 		xfertype= USBK_URB_TYPE_INTERRUPT;
 	} else {
 		usbi_debug(hdev->lib_hdl, 1, "transfer type is not bulk or interrupt");
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_BADARG);
 	}
 
-	/* usbfs only allows transfer sizes of up to 16KB, so we'll probably need to
-	 * split this request up into multiple chunks and fire them all off at once */
-	io->priv->num_urbs = length / LINUX_MAX_BULK_INTR_XFER;
-	if ((length % LINUX_MAX_BULK_INTR_XFER) > 0) {
-		partial_last_urb = 1;
-		io->priv->num_urbs++;
+	/* the data goes straight from the iovecs if the URBs can be chained */
+	iov = usbi_req_iov(io->req, &iovcnt);
+	if (iov && !linux_iov_chainable(io, iov, iovcnt)) {
+		if (usbi_io_bounce(io) != 0) {
+			usbi_mutex_unlock(&io->lock);
+			return (OPENUSB_NO_RESOURCES);
+		}
+		iov = NULL;
+	}
+	if (!iov) {
+		one.iov_base = usbi_io_payload(io);
+		one.iov_len = length;
+		iov = &one;
+		iovcnt = 1;
+	}
+
+	/* usbfs only allows transfer sizes of up to 16KB, unless the host
+	 * controller takes scatter-gather lists for bulk, so we'll probably need
+	 * to split this request up into multiple chunks and fire them all off
+	 * at once */
+	if ((xfertype == USBK_URB_TYPE_BULK) &&
+	    (hdev->priv->caps & USBK_CAP_BULK_SCATTER_GATHER)) {
+		max = LINUX_MAX_BULK_SG_XFER;
+	} else {
+		max = LINUX_MAX_BULK_INTR_XFER;
+	}
+
+	io->priv->num_urbs = 0;
+	for (i = 0; i < iovcnt; i++) {
+		io->priv->num_urbs += (iov[i].iov_len + max - 1) / max;
+	}
+	if (io->priv->num_urbs == 0) {
+		io->priv->num_urbs = 1;		/* a zero length transfer */
 	}
 	usbi_debug(hdev->lib_hdl, 4, "%d urbs needed for bulk/intr xfer of length %d",
 						 io->priv->num_urbs, length);
@@ -923,7 +1351,7 @@ static int32_t linux_submit_bulk_intr(struct usbi_dev_handle *hdev, struct usbi_
 	if (!io->priv->urbs) {
 		usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for %d urbs",
 							 io->priv->num_urbs);
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 	
@@ -932,8 +1360,18 @@ static int32_t linux_submit_bulk_intr(struct usbi_dev_handle *hdev, struct usbi_
 	io->priv->urbs_to_reap = 0;
 	io->priv->urbs_to_cancel = 0;
 
+	/* point each urb at its piece of the data */
+	io->priv->urbs[0].buffer = iov[0].iov_base;
+	for (i = 0, n = 0; i < iovcnt; i++) {
+		for (off = 0; off < iov[i].iov_len; off += chunk, n++) {
+			chunk = iov[i].iov_len - off < max ? iov[i].iov_len - off : max;
+			io->priv->urbs[n].buffer = (uint8_t *)iov[i].iov_base + off;
+			io->priv->urbs[n].buffer_length = chunk;
+		}
+	}
+
 	/* now setup each urb and fire it off */
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&io->queue->lock, USBI_LOCK_EP);
 	io->status = USBI_IO_INPROGRESS;
 	io->priv->reap_action = NORMAL;
 	for(i = 0; i < io->priv->num_urbs; i++) {
@@ -945,14 +1383,7 @@ static int32_t linux_submit_bulk_intr(struct usbi_dev_handle *hdev, struct usbi_
 		urb->endpoint			= io->req->endpoint;
 		urb->usercontext	= (void*)io;
 		urb->type					= xfertype;
-		urb->buffer				= payload + (i * LINUX_MAX_BULK_INTR_XFER);
 
-		if ((i == io->priv->num_urbs - 1) && partial_last_urb) {
-			urb->buffer_length	= length % LINUX_MAX_BULK_INTR_XFER;
-		} else {
-			urb->buffer_length	= LINUX_MAX_BULK_INTR_XFER;
-		}
-		
 		/* USBFS in kernel 2.6.32+ supports enhanced handling for short transfers,
 		 * however, if we don't have more than one transfer, it doesn't matter */
 		if ((io->priv->num_urbs > 1) && supports_flag_bulk_continuation)
@@ -980,8 +1411,8 @@ static int32_t linux_submit_bulk_intr(struct usbi_dev_handle *hdev, struct usbi_
 									 strerror(errno));
 				io->status = USBI_IO_COMPLETED_FAIL;
 				
-				pthread_mutex_unlock(&io->lock);
-				pthread_mutex_unlock(&hdev->lock);
+				usbi_mutex_unlock(&io->lock);
+				usbi_mutex_unlock(&io->queue->lock);
 				return translate_errno(errno);
 			}
   
@@ -995,16 +1426,16 @@ static int32_t linux_submit_bulk_intr(struct usbi_dev_handle *hdev, struct usbi_
 			/* if it's not the first urb then the logic gets more complicated */
 			handle_partial_submit(hdev, io, i);
 
-			pthread_mutex_unlock(&io->lock);
-			pthread_mutex_unlock(&hdev->lock);
+			usbi_mutex_unlock(&io->lock);
+			usbi_mutex_unlock(&io->queue->lock);
 			return (OPENUSB_SUCCESS);
 		}
 
 	} /* end for(i = 0; i < io->priv->num_urbs; i++) */
 
-	/* unlock the device & io request */
-	pthread_mutex_unlock(&io->lock);
-	pthread_mutex_unlock(&hdev->lock);
+	/* unlock the endpoint & io request */
+	usbi_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->queue->lock);
 
 	/* always do this to avoid race conditions */
 	wakeup_io_thread(hdev);
@@ -1030,12 +1461,18 @@ static int32_t linux_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *i
 	int32_t									urb_packet_offset;
 	int32_t									j,k;
 	uint8_t									*urb_buffer;
+	uint32_t								interval = 1;
 	
 	if((!io) || (!hdev)) {
 		return (OPENUSB_BADARG);
 	}
 
-	pthread_mutex_lock(&io->lock);
+	/* the packets' frame numbers are only worked out if they're wanted */
+	if (io->req->req.isoc->flags & OPENUSB_ISOC_FRAMES) {
+		interval = usbi_ep_interval(hdev, io->req->interface, io->req->endpoint);
+	}
+
+	usbi_mutex_lock(&io->lock, USBI_LOCK_IO);
 
 	/* intialize */
 	this_urb_len = 0;
@@ -1046,11 +1483,12 @@ static int32_t linux_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *i
 	if (!io->priv) {
 		usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for the "
 							 "private io member");
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 	memset(io->priv, 0, sizeof(*io->priv));
 	io->priv->num_urbs = 1;
+	io->priv->isoc_interval = interval;
 
 	/* get a pointer to our request (for easier access) */
 	isoc = io->req->req.isoc;
@@ -1077,7 +1515,7 @@ static int32_t linux_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *i
 	if(!io->priv->iso_urbs) {
 		usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for %d urbs",
 							 io->priv->num_urbs);
-		pthread_mutex_unlock(&io->lock);
+		usbi_mutex_unlock(&io->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 	memset(io->priv->iso_urbs, 0, io->priv->num_urbs * sizeof(struct usbk_urb*));
@@ -1085,20 +1523,29 @@ static int32_t linux_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *i
 	io->priv->urbs_to_cancel			= 0;
 	io->priv->urbs_to_reap				= 0;
 	io->priv->reap_action					= NORMAL;
-	io->priv->isoc_packet_offset	= 0;
 
 	/* allocate and initialize each urb with the correct number of packets */
 	for (i = 0; i < io->priv->num_urbs; i++) {
+		struct linux_iso_urb	*lurb;
+		int32_t								in_place = 1;
+		size_t								size;
 
 		space_remaining_in_urb = LINUX_MAX_ISOC_XFER;
 		urb_packet_offset = 0;
 		this_urb_len = 0;
 
-		/* get all of the packets that will fit in this urb */
+		/* get all of the packets that will fit in this urb, noting whether
+		 * they lie back to back in memory as usbfs wants them */
 		while (packet_offset < isoc->pkts.num_packets) {
 			packet_len = isoc->pkts.packets[packet_offset].length;
 			if (packet_len <= space_remaining_in_urb) {
 				/* include this packet */
+				if (urb_packet_offset > 0 &&
+				    isoc->pkts.packets[packet_offset].payload !=
+				    isoc->pkts.packets[packet_offset - 1].payload +
+				    isoc->pkts.packets[packet_offset - 1].length) {
+					in_place = 0;
+				}
 				urb_packet_offset++;
 				packet_offset++;
 				space_remaining_in_urb -= packet_len;
@@ -1109,52 +1556,67 @@ static int32_t linux_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *i
 			}
 		}
 
-		/* allocate memory for this specific urb */
-		urb = (struct usbk_urb*)malloc(  sizeof(*urb)
-																	 + (  urb_packet_offset
-																			* sizeof(struct usbk_iso_packet_desc)) );
-		if (!urb) {
+		/* one allocation holds the urb, its packet descriptors and, if the
+		 * packets are scattered, the buffer they are gathered in */
+		size = sizeof(*lurb)
+				 + urb_packet_offset * sizeof(struct usbk_iso_packet_desc);
+		lurb = (struct linux_iso_urb*)malloc(size + (in_place ? 0 : this_urb_len));
+		if (!lurb) {
+			usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for urb "
+								 "of length %d", this_urb_len);
 			free_isoc_urbs(io);
-			pthread_mutex_unlock(&io->lock);
+			usbi_mutex_unlock(&io->lock);
 			return (OPENUSB_NO_RESOURCES);
 		}
-		memset(urb, 0,  sizeof(*urb)
-									+ (urb_packet_offset * sizeof(struct usbk_iso_packet_desc)));
+		memset(lurb, 0, size);
+		lurb->index = i;
+		lurb->first_packet = packet_offset - urb_packet_offset;
+		urb = &lurb->urb;
 		io->priv->iso_urbs[i] = urb;
 
-		/* allocate memory for the urb buffer */
 		urb->buffer_length = this_urb_len;
-		urb->buffer = (void*)malloc(urb->buffer_length);
-		if (!urb->buffer) {
-			usbi_debug(hdev->lib_hdl, 1, "unable to allocate memory for urb buffer "
-								 "of length %d", urb->buffer_length);
-			free_isoc_urbs(io);
-			pthread_mutex_unlock(&io->lock);
-			return (OPENUSB_NO_RESOURCES);
+		if (in_place) {
+			/* usbfs reads and writes the application's packets directly */
+			urb->buffer = urb_packet_offset ?
+				isoc->pkts.packets[lurb->first_packet].payload : NULL;
+		} else {
+			lurb->bounce = (uint8_t *)lurb + size;
+			urb->buffer = lurb->bounce;
 		}
-		memset(urb->buffer, 0, urb->buffer_length);
 		urb_buffer = urb->buffer;
 		
-		/* setup the packet lengths and copy in the data */
-		for (j=0, k=packet_offset-urb_packet_offset; k<packet_offset; k++, j++) {
+		/* setup the packet lengths and copy in the data if it's scattered */
+		for (j=0, k=lurb->first_packet; k<packet_offset; k++, j++) {
 			packet_len = isoc->pkts.packets[k].length;
 			urb->iso_frame_desc[j].length = packet_len;
-			if ((io->req->endpoint & USB_REQ_DIR_MASK) == USB_REQ_HOST_TO_DEV) {
-				memcpy(urb_buffer, isoc->pkts.packets[k].payload, packet_len);
+			if (!in_place) {
+				if ((io->req->endpoint & USB_REQ_DIR_MASK) == USB_REQ_HOST_TO_DEV) {
+					memcpy(urb_buffer, isoc->pkts.packets[k].payload, packet_len);
+				} else {
+					memset(urb_buffer, 0, packet_len);
+				}
 			}
 			urb_buffer += packet_len;
 		}
 
 		urb->usercontext	= io;
 		urb->type					= USBK_URB_TYPE_ISO;
-		urb->flags				= USBK_URB_ISO_ASAP;
 		urb->endpoint			= io->req->endpoint;
 		urb->number_of_packets = urb_packet_offset;
 
+		/* Only the first URB goes at a given frame, the kernel queues the rest
+		 * right behind whatever is already scheduled on the endpoint */
+		if (i == 0 && (isoc->flags & OPENUSB_ISOC_START_FRAME)) {
+			urb->flags				= 0;
+			urb->start_frame	= isoc->start_frame;
+		} else {
+			urb->flags				= USBK_URB_ISO_ASAP;
+		}
+
 	}
 
 	/* now setup each urb and fire it off */
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&io->queue->lock, USBI_LOCK_EP);
 	io->status = USBI_IO_INPROGRESS;
 	io->priv->reap_action = NORMAL;
 	for(i = 0; i < io->priv->num_urbs; i++) {
@@ -1172,24 +1634,24 @@ static int32_t linux_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *i
 									 strerror(errno));
 				io->status = USBI_IO_COMPLETED_FAIL;
 
-				pthread_mutex_unlock(&io->lock);
-				pthread_mutex_unlock(&hdev->lock);
+				usbi_mutex_unlock(&io->lock);
+				usbi_mutex_unlock(&io->queue->lock);
 				return translate_errno(errno);
 			}
 
 			/* if it's not the first urb then the logic gets more complicated */
 			handle_partial_submit(hdev, io, i);
 
-			pthread_mutex_unlock(&io->lock);
-			pthread_mutex_unlock(&hdev->lock);
+			usbi_mutex_unlock(&io->lock);
+			usbi_mutex_unlock(&io->queue->lock);
 			return (OPENUSB_SUCCESS);
 		}
 
 	} /* end for(i = 0; i < io->priv->num_urbs; i++) */
 
-	/* unlock the device & io request */
-	pthread_mutex_unlock(&io->lock);
-	pthread_mutex_unlock(&hdev->lock);
+	/* unlock the endpoint & io request */
+	usbi_mutex_unlock(&io->lock);
+	usbi_mutex_unlock(&io->queue->lock);
 
 	/* always do this to avoid race conditions */
 	wakeup_io_thread(hdev);
@@ -1227,8 +1689,8 @@ void free_isoc_urbs(struct usbi_io *io)
 		if (!urb) {
 			break;
 		}
-		free(urb->buffer);
-		free(urb);
+		/* the buffer is the application's or part of the same allocation */
+		free(LINUX_ISO_URB(urb));
 	}
 
 	free(io->priv->iso_urbs);
@@ -1246,11 +1708,18 @@ void free_isoc_urbs(struct usbi_io *io)
 void discard_urbs(struct usbi_dev_handle *hdev, struct usbi_io *io,
 									linux_reap_action_t reap_action)
 {
+	struct usbk_urb	*urb;
 	int32_t	i, ret;
 
 	io->priv->reap_action = reap_action;
 	for (i = 0; i < io->priv->num_urbs; i++) {
-		ret = ioctl(hdev->priv->fd, IOCTL_USB_DISCARDURB, &io->priv->urbs[i]);
+		/* isochronous URBs are allocated one by one */
+		if (io->req->type == USB_TYPE_ISOCHRONOUS)
+			urb = io->priv->iso_urbs[i];
+		else
+			urb = &io->priv->urbs[i];
+
+		ret = ioctl(hdev->priv->fd, IOCTL_USB_DISCARDURB, urb);
 		if (ret == 0) {
 			io->priv->urbs_to_cancel++;
 		} else if (errno == EINVAL) {
@@ -1276,6 +1745,7 @@ void discard_urbs(struct usbi_dev_handle *hdev, struct usbi_io *io,
 void handle_partial_submit(struct usbi_dev_handle *hdev, struct usbi_io *io,
 													 int32_t idx)
 {
+	struct usbk_urb	*urb;
 	int32_t	i, ret;
 
 	/* This function is called when submitting a set of urbs to usbfs and
@@ -1293,7 +1763,13 @@ void handle_partial_submit(struct usbi_dev_handle *hdev, struct usbi_io *io,
 	*/
 	io->priv->reap_action = SUBMIT_FAILED;
 	for (i = 0; i < idx; i++) {
-		ret = ioctl(hdev->priv->fd, IOCTL_USB_DISCARDURB, &io->priv->urbs[i]);
+		/* isochronous URBs are allocated one by one */
+		if (io->req->type == USB_TYPE_ISOCHRONOUS)
+			urb = io->priv->iso_urbs[i];
+		else
+			urb = &io->priv->urbs[i];
+
+		ret = ioctl(hdev->priv->fd, IOCTL_USB_DISCARDURB, urb);
 		if (ret == 0) {
 			io->priv->urbs_to_cancel++;
 		} else if (errno == EINVAL) {
@@ -1312,21 +1788,46 @@ void handle_partial_submit(struct usbi_dev_handle *hdev, struct usbi_io *io,
 
 
 
+/*
+ * finish_io
+ *
+ *  Called with the endpoint queue lock held once the last URB of an io
+ *  request is handled. io_complete() completes the request after dropping
+ *  the lock, since completing it runs callbacks that may submit more.
+ */
+static void finish_io(struct usbi_io *io, int32_t status, uint32_t bytes)
+{
+	io->priv->done = 1;
+	io->priv->done_status = status;
+	io->priv->done_bytes = bytes;
+}
+
+
+
 /*
  * io_complete
  *
  *  This function is called by the poll_io thread when a submitted io request
- *  has been completed.
+ *  has been completed. It stops early when a callback opened or closed a
+ *  device, hdev may be gone then, and the caller must not touch it again.
  */
 int32_t io_complete(struct usbi_dev_handle *hdev)
 {
 	struct usbk_urb		*urb	= NULL;
 	struct usbi_io		*io		= NULL;
+	struct usbi_ep_queue	*q;
+	int32_t			status;
+	uint32_t		bytes;
+	int			done;
 
 
 	while(ioctl(hdev->priv->fd, IOCTL_USB_REAPURBNDELAY, (void*)&urb) >= 0) {
 
 		io = urb->usercontext;
+		q = io->queue;
+
+		/* keep submitting and cancelling out while we account for the urb */
+		usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
 
 		/* We handle the completion of bulk, interrupt and control requests
 		 * differently than we handle the completion of isochronous requests */
@@ -1344,20 +1845,20 @@ int32_t io_complete(struct usbi_dev_handle *hdev)
 								 urb->buffer + USBI_CONTROL_SETUP_LEN,
 								 io->req->req.ctrl->length);
 					io->status = USBI_IO_COMPLETED;
-					usbi_io_complete(io, OPENUSB_SUCCESS, urb->actual_length);
+					finish_io(io, OPENUSB_SUCCESS, urb->actual_length);
 				}
 			
 				/* report successful completion */
 				if (urb->status == -ENOENT) {
 					if (io->priv->reap_action == CANCELED) {
 						io->status = USBI_IO_CANCEL;
-						usbi_io_complete(io, OPENUSB_IO_CANCELED, urb->actual_length);
+						finish_io(io, OPENUSB_IO_CANCELED, urb->actual_length);
 					} else if (io->priv->reap_action == TIMEDOUT) {
 						io->status = USBI_IO_TIMEOUT;
-						usbi_io_complete(io, OPENUSB_IO_TIMEOUT, urb->actual_length);
+						finish_io(io, OPENUSB_IO_TIMEOUT, urb->actual_length);
 					} else {
 						io->status = USBI_IO_COMPLETED_FAIL;
-						usbi_io_complete(io, OPENUSB_SYS_FUNC_FAILURE, urb->actual_length);
+						finish_io(io, OPENUSB_SYS_FUNC_FAILURE, urb->actual_length);
 					}
 				}
 
@@ -1374,6 +1875,22 @@ int32_t io_complete(struct usbi_dev_handle *hdev)
 				handle_isoc_complete(hdev, urb);
 				break;
 		}
+
+		done = io->priv->done;
+		status = io->priv->done_status;
+		bytes = io->priv->done_bytes;
+		usbi_mutex_unlock(&q->lock);
+
+		/* the request may be freed as soon as it's complete */
+		if (done) {
+			usbi_io_complete(io, status, bytes);
+
+			/* the callback may have closed this very device, the rest of its
+			 * URBs are reaped on the next pass if it's still open */
+			if (io_thread_changed) {
+				break;
+			}
+		}
 	}
 
 	return (OPENUSB_SUCCESS);
@@ -1455,7 +1972,7 @@ void handle_bulk_intr_complete(struct usbi_dev_handle *hdev,
 				case UNKNOWNFAILURE:
 					usbi_debug(hdev->lib_hdl, 2, "An unknown failure was reported after "
 										 " the io request has been reported as complete");
-					usbi_io_complete(io, OPENUSB_SYS_FUNC_FAILURE,
+					finish_io(io, OPENUSB_SYS_FUNC_FAILURE,
 													 io->priv->bytes_transferred);
 					break;
 					
@@ -1466,16 +1983,16 @@ void handle_bulk_intr_complete(struct usbi_dev_handle *hdev,
 					return;
 
 				case CANCELED:
-					usbi_io_complete(io, OPENUSB_IO_CANCELED,
+					finish_io(io, OPENUSB_IO_CANCELED,
 													 io->priv->bytes_transferred);
 					break;
 
 				case COMPLETED_EARLY:
-					usbi_io_complete(io, OPENUSB_SUCCESS, io->priv->bytes_transferred);
+					finish_io(io, OPENUSB_SUCCESS, io->priv->bytes_transferred);
 					break;
 
 				case TIMEDOUT:
-					usbi_io_complete(io, OPENUSB_IO_TIMEOUT, io->priv->bytes_transferred);
+					finish_io(io, OPENUSB_IO_TIMEOUT, io->priv->bytes_transferred);
 					break;
 			}
 			free(io->priv->urbs);
@@ -1500,7 +2017,7 @@ void handle_bulk_intr_complete(struct usbi_dev_handle *hdev,
   		usbi_debug(hdev->lib_hdl, 1, "endpoint %x stalled", io->req->endpoint);
   		handle_partial_xfer(hdev, io, urb_index + 1, STALL);
   		free(io->priv->urbs);
-  		usbi_io_complete(io, OPENUSB_IO_STALL, io->priv->bytes_transferred);
+  		finish_io(io, OPENUSB_IO_STALL, io->priv->bytes_transferred);
   		return;
 	}
 
@@ -1509,7 +2026,7 @@ void handle_bulk_intr_complete(struct usbi_dev_handle *hdev,
 	if (urb_index == io->priv->num_urbs - 1) {
 
 		usbi_debug(hdev->lib_hdl, 4, "last URB in transfer, io request complete");
-		usbi_io_complete(io, OPENUSB_SUCCESS, io->priv->bytes_transferred);
+		finish_io(io, OPENUSB_SUCCESS, io->priv->bytes_transferred);
 		free(io->priv->urbs);
 		return;
 
@@ -1540,8 +2057,10 @@ void handle_bulk_intr_complete(struct usbi_dev_handle *hdev,
 void handle_isoc_complete(struct usbi_dev_handle *hdev, struct usbk_urb *urb)
 {
 	struct usbi_io	*io;
+	struct linux_iso_urb	*lurb;
 	int32_t					urb_index;
 	int32_t					i;
+	uint32_t				pkt;
 	uint8_t					*urb_buffer;
 
 	openusb_request_result_t	*isoc_results;
@@ -1549,18 +2068,8 @@ void handle_isoc_complete(struct usbi_dev_handle *hdev, struct usbk_urb *urb)
 
 	/* Initialization */
 	io = urb->usercontext;
-	urb_index = 0;
-
-	for (i = 0; i < io->priv->num_urbs; i++) {
-		if (urb == io->priv->iso_urbs[i]) {
-			urb_index = i + 1;
-			break;
-		}
-	}
-	if (urb_index == 0) {
-		usbi_debug(hdev->lib_hdl, 1, "failed to find urb (isoc xfer)");
-		return;
-	}
+	lurb = LINUX_ISO_URB(urb);
+	urb_index = lurb->index + 1;
 
 	usbi_debug(hdev->lib_hdl, 4, "handling completion of iso urb %d/%d: %d",
 						 urb_index, io->priv->num_urbs, urb->status);
@@ -1571,21 +2080,31 @@ void handle_isoc_complete(struct usbi_dev_handle *hdev, struct usbk_urb *urb)
 		urb_buffer = urb->buffer;
 		isoc = io->req->req.isoc;
 		isoc_results = isoc->isoc_results;
-		for (i = 0; i < urb->number_of_packets; i++) {
+
+		/* the kernel tells where the URB went */
+		if (urb_index == 1) {
+			isoc->start_frame = urb->start_frame;
+		}
+		usbi_isoc_frames(io, lurb->first_packet, urb->number_of_packets,
+		                 urb->start_frame, io->priv->isoc_interval);
+		for (i = 0, pkt = lurb->first_packet; i < urb->number_of_packets;
+		     i++, pkt++) {
 			if (urb->iso_frame_desc[i].status) {
-				isoc_results[io->priv->isoc_packet_offset].status =
+				isoc_results[pkt].status =
 					translate_errno(-urb->iso_frame_desc[i].status);
 			}
 
-			isoc_results[io->priv->isoc_packet_offset].transferred_bytes =
+			isoc_results[pkt].transferred_bytes =
 					urb->iso_frame_desc[i].actual_length;
-			if ((io->req->endpoint & USB_REQ_DIR_MASK) == USB_REQ_DEV_TO_HOST) {
-				memcpy(isoc->pkts.packets[io->priv->isoc_packet_offset].payload,
-							 urb_buffer, urb->iso_frame_desc[i].actual_length);
-				urb_buffer += urb->iso_frame_desc[i].actual_length;
+
+			/* packets sit at their full length apart, however short they are */
+			if (lurb->bounce &&
+			    (io->req->endpoint & USB_REQ_DIR_MASK) == USB_REQ_DEV_TO_HOST) {
+				memcpy(isoc->pkts.packets[pkt].payload, urb_buffer,
+							 urb->iso_frame_desc[i].actual_length);
 			}
+			urb_buffer += urb->iso_frame_desc[i].length;
 			io->priv->bytes_transferred += urb->iso_frame_desc[i].actual_length;
-			io->priv->isoc_packet_offset++;
 		}
 	}
 
@@ -1618,11 +2137,11 @@ void handle_isoc_complete(struct usbi_dev_handle *hdev, struct usbk_urb *urb)
 
 			usbi_debug(hdev->lib_hdl, 4, "last URB handled, io request complete");
 			if (io->priv->reap_action == CANCELED) {
-				usbi_io_complete(io, OPENUSB_IO_CANCELED, io->priv->bytes_transferred);
+				finish_io(io, OPENUSB_IO_CANCELED, io->priv->bytes_transferred);
 				free_isoc_urbs(io);
 				return;
 			} else {
-				usbi_io_complete(io, OPENUSB_SYS_FUNC_FAILURE,
+				finish_io(io, OPENUSB_SYS_FUNC_FAILURE,
 												 io->priv->bytes_transferred);
 				free_isoc_urbs(io);
 				return;
@@ -1642,7 +2161,7 @@ void handle_isoc_complete(struct usbi_dev_handle *hdev, struct usbk_urb *urb)
 	if (urb_index == io->priv->num_urbs) {
 		usbi_debug(hdev->lib_hdl, 4, "last URB in transfer completed");
 		free_isoc_urbs(io);
-		usbi_io_complete(io, OPENUSB_SUCCESS, io->priv->bytes_transferred);
+		finish_io(io, OPENUSB_SUCCESS, io->priv->bytes_transferred);
 	}
 
 	return;
@@ -1699,11 +2218,16 @@ void handle_partial_xfer(struct usbi_dev_handle *hdev, struct usbi_io *io,
  */
 int32_t io_timeout(struct usbi_dev_handle *hdev, struct timeval *tvc)
 {
+	struct usbi_ep_queue	*q;
 	struct usbi_io	*io, *tio;
+	int32_t		i;
 
-	/* check each entry in the io list to find out if it's timed out */
-	list_for_each_entry_safe(io, tio, &hdev->io_head, list) {
-		if (io) {
+	/* check each entry in the io lists to find out if it's timed out */
+	for (i = 0; i < USBI_MAXENDPOINTS; i++) {
+		q = &hdev->ep[i];
+
+		usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
+		list_for_each_entry_safe(io, tio, &q->io_head, list) {
 
 			/* currently, isochronous io doesn't consider timeout issue and we don't
 		 	* want to process any requests that aren't in progress */
@@ -1711,11 +2235,17 @@ int32_t io_timeout(struct usbi_dev_handle *hdev, struct timeval *tvc)
 			 	|| (io->req->type == USB_TYPE_ISOCHRONOUS)) { 
 				break;
 			}
+
+			/* synchronous ioctls time out in the kernel */
+			if (!io->priv) {
+				continue;
+			}
 	
 			if (usbi_timeval_compare(&io->tvo, tvc) <= 0) {
 				discard_urbs(hdev, io, TIMEDOUT);
 			}
 		}
+		usbi_mutex_unlock(&q->lock);
 	}
 
 	return (OPENUSB_SUCCESS);
@@ -1733,6 +2263,14 @@ int32_t io_timeout(struct usbi_dev_handle *hdev, struct timeval *tvc)
  */
 static int32_t linux_io_cancel(struct usbi_io *io)
 {
+	/*
+	 * nothing to discard for a synchronous ioctl, those are only used for
+	 * small requests ending within LINUX_MAX_SYNC_TIMEOUT
+	 */
+	if (!io->priv) {
+		return (OPENUSB_NOT_SUPPORTED);
+	}
+
 	io->status = USBI_IO_CANCEL;
 	
 	/* Discard/Cancel all the URBs for this io request */
@@ -1745,155 +2283,228 @@ static int32_t linux_io_cancel(struct usbi_io *io)
 }
 
 
+/*
+ * linux_abort_endpoint
+ *
+ *  usbfs has no call to flush an endpoint, so discard the URBs of every
+ *  request queued on it in one pass and wake the io thread once. The queue
+ *  is locked by the caller.
+ */
+static int32_t linux_abort_endpoint(struct usbi_dev_handle *hdev,
+	struct usbi_ep_queue *q)
+{
+	struct usbi_io *io;
+
+	list_for_each_entry(io, &q->io_head, list) {
+		if (io->status != USBI_IO_INPROGRESS || !io->priv)
+			continue;
+
+		io->status = USBI_IO_CANCEL;
+		discard_urbs(hdev, io, CANCELED);
+	}
+
+	wakeup_io_thread(hdev);
+
+	return (OPENUSB_SUCCESS);
+}
+
+
 
 /******************************************************************************
  *                             Thread Functions                               *
  *****************************************************************************/
 
 /*
- * poll_io
+ * find_next_timeout
  *
- *  This is our worker thread. It's a forever loop, so it must be shutdown with
- *  pthread_cancel (currently done in linux_close).
+ *  Set priv->next_timeout to the soonest timeout of the handle's requests, 0
+ *  if none has one. Called with io_thread_lock held.
  */
-void *poll_io(void *devhdl)
+static void find_next_timeout(struct usbi_dev_hdl_private *priv)
 {
-	struct usbi_dev_handle  *hdev = (struct usbi_dev_handle*)devhdl;
-	struct timeval					tvc, tvo, tvNext;
-	fd_set									readfds, writefds;
-	int											ret, maxfd;
-	struct usbi_io					*io;
-	uint8_t 								buf[16];
-	
-	/*
-	 * Loop forever checking to see if we have io requests that need to be
-	 * processed and process them.
-	 */
-	while (1) {
+	struct usbi_dev_handle *hdev = priv->hdev;
+	struct usbi_ep_queue   *q;
+	struct usbi_io         *io;
+	int                    i;
 
-		/* find out if there is any reading/writing to be done */
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-
-		/* We need to check our private event pipe, our device's file, and the
-		 * event pipe used by the frontend's timeout thread (which the Linux
-		 * backened doesn't use). */
-		pthread_mutex_lock(&hdev->lock);
-		FD_SET(hdev->priv->event_pipe[0], &readfds);
-		FD_SET(hdev->event_pipe[0], &readfds);
-		FD_SET(hdev->priv->fd, &writefds);
-
-		/* get the max file descriptor for select() */
-		if (hdev->priv->event_pipe[0] > hdev->priv->fd) {
-			maxfd = hdev->priv->event_pipe[0];
-		} else {
-			maxfd = hdev->priv->fd;
-		}
-		if (hdev->event_pipe[0] > maxfd) {
-			maxfd = hdev->event_pipe[0];
-		}
+	memset(&priv->next_timeout, 0, sizeof(priv->next_timeout));
 
-		/* get the time so that we can determine if any timeouts have passed */
-		gettimeofday(&tvc, NULL);
-		memset(&tvo, 0, sizeof(tvo));
-		memset(&tvNext, 0, sizeof(tvNext));
-
-		/* loop through the pending io requests and find our next soonest timeout */
-		list_for_each_entry(io, &hdev->io_head, list) {
-			if (io) {
-				/* skip the timeout calculation if it's an isochronous request, or if
-			 	* the IO is not in progress (to avoid processing aborted requests), if we
- 			 	* hit one of these cases, then break */
-				if(   (io->status != USBI_IO_INPROGRESS) 
-				 	|| (io->req->type == USB_TYPE_ISOCHRONOUS)) {
-					break;
-				}
-				
-				if (   io->tvo.tv_sec
-						&& (!tvo.tv_sec || usbi_timeval_compare(&io->tvo, &tvo))) {
-					/* new soonest timeout */
-					memcpy(&tvo, &io->tvo, sizeof(tvo));
-				}
+	for (i = 0; i < USBI_MAXENDPOINTS; i++) {
+		q = &hdev->ep[i];
+
+		usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
+		list_for_each_entry(io, &q->io_head, list) {
+			/* skip the timeout calculation if it's an isochronous request, or if
+		 	* the IO is not in progress (to avoid processing aborted requests), if we
+			* hit one of these cases, then break */
+			if(   (io->status != USBI_IO_INPROGRESS) 
+			 	|| (io->req->type == USB_TYPE_ISOCHRONOUS)) {
+				break;
+			}
+
+			/* synchronous ioctls time out in the kernel */
+			if (!io->priv) {
+				continue;
+			}
+
+			if (   io->tvo.tv_sec
+					&& (!priv->next_timeout.tv_sec
+					    || usbi_timeval_compare(&io->tvo, &priv->next_timeout) < 0)) {
+				/* new soonest timeout */
+				memcpy(&priv->next_timeout, &io->tvo, sizeof(io->tvo));
+			}
+		}
+		usbi_mutex_unlock(&q->lock);
+	}
+}
+
+/*
+ * poll_io
+ *
+ *  This is our io thread. A single instance services every open handle: it
+ *  polls the usbfs fds for completed URBs and handles request timeouts. It is
+ *  started on the first open and runs until linux_fini() writes WAKEUPANDEXIT
+ *  to the io pipe.
+ */
+void *poll_io(void *unused)
+{
+	struct usbi_dev_hdl_private  *priv, *tpriv;
+	struct usbi_dev_handle       *hdev;
+	struct pollfd                *fds = NULL;
+	struct timeval               tvc, tvo;
+	int                          nfds, maxfds = 0, ret, i, timeout, closing;
+	uint8_t                      buf[16];
+
+	/* device callbacks run here may open and close handles */
+	io_thread_self = 1;
+
+	/*
+	 * Loop forever checking to see if we have io requests that need to be
+	 * processed and process them.
+	 */
+	while (1) {
+
+		pthread_mutex_lock(&io_thread_lock);
+
+		/* make room for the io pipe and every open handle */
+		nfds = 1;
+		list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+			nfds++;
+		}
+		if (nfds > maxfds) {
+			struct pollfd *tmp;
+
+			tmp = realloc(fds, nfds * sizeof(*fds));
+			if (!tmp) {
+				usbi_debug(NULL, 1, "unable to allocate pollfds");
+				pthread_mutex_unlock(&io_thread_lock);
+				usleep(100000);
+				continue;
 			}
+			fds = tmp;
+			maxfds = nfds;
 		}
-		pthread_mutex_unlock(&hdev->lock);
 
-		/* save the next soonest timeout */
-		memcpy(&tvNext, &tvo, sizeof(tvo));
+		fds[0].fd = io_thread_pipe[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		/* get the time so that we can determine if any timeouts have passed */
+		gettimeofday(&tvc, NULL);
+		memset(&tvo, 0, sizeof(tvo));
+
+		/* Completed URBs make the usbfs fd writable. While we're at it, find the
+		 * soonest timeout of each handle and the soonest one overall */
+		nfds = 1;
+		list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+			hdev = priv->hdev;
+
+			priv->poll_idx = nfds;
+			fds[nfds].fd = priv->fd;
+			fds[nfds].events = POLLOUT;
+			fds[nfds].revents = 0;
+			nfds++;
 
-		/* calculate the timeout for select() based on what we found above */
+			find_next_timeout(priv);
+
+			if (   priv->next_timeout.tv_sec
+			    && (!tvo.tv_sec || usbi_timeval_compare(&priv->next_timeout, &tvo) < 0)) {
+				memcpy(&tvo, &priv->next_timeout, sizeof(tvo));
+			}
+		}
+		pthread_mutex_unlock(&io_thread_lock);
+
+		/* calculate the timeout for poll() based on what we found above */
 		if (!tvo.tv_sec) {
-			/* Default to an hour from now */
-			tvo.tv_sec = tvc.tv_sec + (60 * 60);
-			tvo.tv_usec = tvc.tv_usec;
-		} else if (usbi_timeval_compare(&tvo, &tvc) < 0) {
-			/* Don't give a negative timeout */
-			memcpy(&tvo, &tvc, sizeof(tvo));
-		}
-
-		/* Make tvo absolute time now */
-		tvo.tv_sec -= tvc.tv_sec;
-		if (tvo.tv_usec < tvc.tv_usec) {
-			tvo.tv_sec--;
-			tvo.tv_usec += (1000000 - tvc.tv_usec);
+			timeout = -1;
+		} else if (usbi_timeval_compare(&tvo, &tvc) <= 0) {
+			timeout = 0;
 		} else {
-			tvo.tv_usec -= tvc.tv_usec;
+			timeout = (tvo.tv_sec - tvc.tv_sec) * 1000
+			          + (tvo.tv_usec - tvc.tv_usec) / 1000 + 1;
 		}
 
-		/* determine if we have file descriptors reading for reading/writing */
-		ret = select(maxfd + 1, &readfds, &writefds, NULL, &tvo);
+		ret = poll(fds, nfds, timeout);
 		if (ret < 0) {
-			usbi_debug(hdev->lib_hdl, 1, "select() call failed: %s", strerror(errno));
+			if (errno != EINTR) {
+				usbi_debug(NULL, 1, "poll() call failed: %s", strerror(errno));
+			}
 			continue;
 		}
 
 		/* Get the current time of day, for timeout processing */
 		gettimeofday(&tvc, NULL);
 
-		pthread_mutex_lock(&hdev->lock);
-
-		/* if there is data to be read on the event pipe read it and discard */
-		if (FD_ISSET(hdev->priv->event_pipe[0], &readfds)) {
-			if (read(hdev->priv->event_pipe[0], buf, 1) == -1) {
-			  usbi_debug(hdev->lib_hdl, 1, "failed to read from the io event pipe");
-			}
-			if(hdev->state == USBI_DEVICE_CLOSING) {
-				/* device is closing, exit this thread */
-				pthread_mutex_unlock(&hdev->lock);
-				return NULL;
+		/* drain the io pipe, checking whether we've been asked to exit */
+		if (fds[0].revents & POLLIN) {
+			while ((ret = read(io_thread_pipe[0], buf, sizeof(buf))) > 0) {
+				for (i = 0; i < ret; i++) {
+					if (buf[i] == WAKEUPANDEXIT) {
+						free(fds);
+						return (NULL);
+					}
+				}
 			}
 		}
 
-		/* If there is data to be read on the frontend's even pipe, read it.
-		 * Even though the Linux backend doesn't use the frontend's timeout
-		 * thread, the frontend will write to the even pipe everytime a request
-		 * is submitted, so if we don't read the data out eventually we'll no
-		 * longer be able to submit io requests (because the file buffer will
-		 * fill up. */
-		if (FD_ISSET(hdev->event_pipe[0], &readfds)) {
-			if (read(hdev->event_pipe[0], buf, 1) == -1) {
-			  usbi_debug(hdev->lib_hdl, 1, "failed to read from the event pipe");
+		pthread_mutex_lock(&io_thread_lock);
+		io_thread_changed = 0;
+
+		list_for_each_entry_safe(priv, tpriv, &io_thread_handles, io_thread_list) {
+			hdev = priv->hdev;
+
+			/* Completions run callbacks and take the endpoint locks, don't hold
+			 * the device lock. Closing needs io_thread_lock, which we hold */
+			usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
+			closing = hdev->state == USBI_DEVICE_CLOSING;
+			usbi_mutex_unlock(&hdev->lock);
+
+			if (closing) {
+				continue;
 			}
-			if(hdev->state == USBI_DEVICE_CLOSING) {
-				/* device is closing, exit this thread */
-				pthread_mutex_unlock(&hdev->lock);
-				return NULL;
+
+			/* Have any io requests completed? Handles added since we built the
+			 * poll set have a stale (or no) slot, we'll get them next time */
+			i = priv->poll_idx;
+			if (   i > 0 && i < nfds && fds[i].fd == priv->fd
+			    && (fds[i].revents & POLLOUT)) {
+				io_complete(hdev);
 			}
-		}
 
-		/* now that we've waited for select, determine what action to take */
-		/* Have any io requests completed? */
-		if (FD_ISSET(hdev->priv->fd, &writefds)) {
-			io_complete(hdev);
-		}
+			/* a callback opened or closed a device, the list may have changed
+			 * under us and this handle may be gone with it. Anything we didn't
+			 * get to is picked up next time, usbfs keeps polling writable */
+			if (io_thread_changed) {
+				break;
+			}
 
-		/* Check for requests that may have timed out: This is handled by the
-		 * separate timeout thread now */
-		if (usbi_timeval_compare(&tvNext, &tvc) <= 0) {
-			io_timeout(hdev, &tvc);
+			/* Check for requests that may have timed out, no callbacks run */
+			if (   priv->next_timeout.tv_sec
+			    && usbi_timeval_compare(&priv->next_timeout, &tvc) <= 0) {
+				io_timeout(hdev, &tvc);
+			}
 		}
-
-		pthread_mutex_unlock(&hdev->lock);
+		pthread_mutex_unlock(&io_thread_lock);
 	}
 
 	return (NULL);
@@ -1901,491 +2512,1719 @@ void *poll_io(void *devhdl)
 
 
 
+#ifdef LINUX_IO_URING
 /*
- * create_new_device
+ * The io_uring reactor
  *
- *  Allocate memory for the new device and fill in the require information.
+ *  With OPENUSB_INIT_IO_URING, and a kernel that has what it takes, the io
+ *  thread runs poll_io_uring() instead of poll_io(). A multishot poll stays
+ *  armed on the io pipe and on every usbfs fd, and a single timeout on the
+ *  soonest request deadline. Each pass submits whatever changed and collects
+ *  everything that happened in one io_uring_enter(), instead of building a
+ *  pollfd set for every poll(). Only the io thread touches the ring once
+ *  start_io_thread() has set it up, and it tears the ring down on exit.
  */
-int32_t create_new_device(struct usbi_device **dev, struct usbi_bus *ibus,
-                          uint16_t devnum, uint32_t max_children)
-{
-	struct usbi_device *idev;
-
-	idev = malloc(sizeof(*idev));
-	if (!idev) {
-		return (OPENUSB_NO_RESOURCES);
-	}  
-	memset(idev, 0, sizeof(*idev));
+#define URING_SQ_ENTRIES	64
+#define URING_CQ_ENTRIES	512
+
+/* what a completion is about, in the low byte of its user_data */
+#define URING_PIPE		1	/* poll on the io pipe */
+#define URING_POLL		2	/* poll on a usbfs fd, its id above */
+#define URING_TIMEOUT		3	/* the deadline, its sequence above */
+#define URING_CANCEL		4	/* POLL_REMOVE or TIMEOUT_REMOVE */
+
+#define URING_DATA(id, what)	(((uint64_t)(id) << 8) | (what))
+
+/* a poll armed on a handle's fd */
+struct uring_poll {
+	uint32_t  id;		/* the handle's uring_id */
+	int       seen;		/* the handle is still open */
+	int       removing;	/* POLL_REMOVE sent, waiting for the last cqe */
+};
 
-	idev->priv = calloc(sizeof(struct usbi_dev_private), 1);
-	if (!idev->priv) {
-		free(idev);
-		return (OPENUSB_NO_RESOURCES);
+static struct {
+	int                  fd;
+	void                 *sq_ring, *cq_ring;
+	size_t               sq_ring_size, cq_ring_size, sqes_size;
+	unsigned             *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned             *cq_head, *cq_tail, *cq_mask;
+	unsigned             sq_entries;
+	unsigned             to_submit;
+	struct io_uring_sqe  *sqes;
+	struct io_uring_cqe  *cqes;
+	int                  multishot;	/* cleared if the kernel refuses them */
+} io_ring = { .fd = -1 };
+
+static void uring_teardown(void)
+{
+	if (io_ring.sqes) {
+		munmap(io_ring.sqes, io_ring.sqes_size);
 	}
-
-	idev->devnum = devnum;
-	snprintf(idev->sys_path, sizeof(idev->sys_path) - 1, "%s/%03d",
-					 ibus->sys_path, idev->devnum);
-	usbi_debug(NULL, 4, "usbfs path: %s", idev->sys_path);
-
-	idev->nports = max_children;
-	if (max_children) {
-		idev->children = malloc(idev->nports * sizeof(idev->children[0]));
-		if (!idev->children) {
-			free(idev);
-			return (OPENUSB_NO_RESOURCES);
-		}
-
-		memset(idev->children, 0, idev->nports * sizeof(idev->children[0]));
+	if (io_ring.cq_ring && io_ring.cq_ring != io_ring.sq_ring) {
+		munmap(io_ring.cq_ring, io_ring.cq_ring_size);
+	}
+	if (io_ring.sq_ring) {
+		munmap(io_ring.sq_ring, io_ring.sq_ring_size);
+	}
+	if (io_ring.fd >= 0) {
+		close(io_ring.fd);
 	}
 
-	*dev = idev;
-	ibus->priv->dev_by_num[devnum] = idev;
-	
-
-	return (OPENUSB_SUCCESS);
+	memset(&io_ring, 0, sizeof(io_ring));
+	io_ring.fd = -1;
 }
 
+static void *uring_mmap(size_t size, off_t offset)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	         io_ring.fd, offset);
 
+	return (p == MAP_FAILED ? NULL : p);
+}
 
 /*
- * check_usb_path
+ * uring_setup
  *
- *  Verify that we have access to the specified path
+ *  Create the ring, called from start_io_thread(). Fails if the kernel has no
+ *  io_uring or lacks one of the operations the reactor uses, the io thread
+ *  then polls as usual.
  */
-int32_t check_usb_path(const char *dirname)
+static int32_t uring_setup(void)
 {
-	DIR *dir;
-	struct dirent *entry;
-	int found = 0;
+	static const uint8_t    ops[] = { IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE,
+	                                  IORING_OP_TIMEOUT, IORING_OP_TIMEOUT_REMOVE };
+	struct io_uring_params  p;
+	struct io_uring_probe   *probe;
+	size_t                  i;
+	int                     ret;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+
+	io_ring.fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (io_ring.fd < 0) {
+		usbi_debug(NULL, 2, "io_uring unavailable: %s", strerror(errno));
+		io_ring.fd = -1;
+		return (OPENUSB_NOT_SUPPORTED);
+	}
 
-	dir = opendir(dirname);
-	if (!dir)
-		return (0);
+	/* kernels older than the probe are too old for the reactor anyway */
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+	if (!probe) {
+		uring_teardown();
+		return (OPENUSB_NO_RESOURCES);
+	}
 
-	while ((entry = readdir(dir)) != NULL) {
-		/* Skip anything starting with a . */
-		if (entry->d_name[0] == '.')
-			continue;
+	ret = syscall(__NR_io_uring_register, io_ring.fd, IORING_REGISTER_PROBE,
+	              probe, 256);
+	for (i = 0; ret >= 0 && i < sizeof(ops); i++) {
+		if (   ops[i] > probe->last_op
+		    || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			ret = -1;
+		}
+	}
+	free(probe);
 
-		/* We assume if we find any files that it must be the right place */
-		found = 1;
-		break;
+	if (ret < 0) {
+		usbi_debug(NULL, 2, "io_uring lacks poll or timeout operations");
+		uring_teardown();
+		return (OPENUSB_NOT_SUPPORTED);
 	}
 
-	closedir(dir);
+	io_ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	io_ring.cq_ring_size = p.cq_off.cqes
+	                       + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (io_ring.cq_ring_size > io_ring.sq_ring_size) {
+			io_ring.sq_ring_size = io_ring.cq_ring_size;
+		}
+		io_ring.cq_ring_size = io_ring.sq_ring_size;
+	}
+	io_ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
 
-	return (found);
-}
+	io_ring.sq_ring = uring_mmap(io_ring.sq_ring_size, IORING_OFF_SQ_RING);
+	if (io_ring.sq_ring && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		io_ring.cq_ring = io_ring.sq_ring;
+	} else if (io_ring.sq_ring) {
+		io_ring.cq_ring = uring_mmap(io_ring.cq_ring_size, IORING_OFF_CQ_RING);
+	}
+	if (io_ring.cq_ring) {
+		io_ring.sqes = uring_mmap(io_ring.sqes_size, IORING_OFF_SQES);
+	}
+	if (!io_ring.sqes) {
+		usbi_debug(NULL, 1, "unable to map the io_uring: %s", strerror(errno));
+		uring_teardown();
+		return (OPENUSB_NO_RESOURCES);
+	}
 
+	io_ring.sq_head = (unsigned *)((char *)io_ring.sq_ring + p.sq_off.head);
+	io_ring.sq_tail = (unsigned *)((char *)io_ring.sq_ring + p.sq_off.tail);
+	io_ring.sq_mask = (unsigned *)((char *)io_ring.sq_ring + p.sq_off.ring_mask);
+	io_ring.sq_array = (unsigned *)((char *)io_ring.sq_ring + p.sq_off.array);
+	io_ring.cq_head = (unsigned *)((char *)io_ring.cq_ring + p.cq_off.head);
+	io_ring.cq_tail = (unsigned *)((char *)io_ring.cq_ring + p.cq_off.tail);
+	io_ring.cq_mask = (unsigned *)((char *)io_ring.cq_ring + p.cq_off.ring_mask);
+	io_ring.cqes = (struct io_uring_cqe *)((char *)io_ring.cq_ring
+	                                       + p.cq_off.cqes);
+	io_ring.sq_entries = p.sq_entries;
+	io_ring.multishot = 1;
 
+	usbi_debug(NULL, 4, "io thread running on io_uring");
+
+	return (OPENUSB_SUCCESS);
+}
 
 /*
- * check_usb_path
+ * uring_enter
  *
- *  Write data to the event pipe to wakeup the io thread
+ *  Submit the queued sqes and, if wait is set, block until something
+ *  completes. Returns -1 with errno set if the call failed.
  */
-int32_t wakeup_io_thread(struct usbi_dev_handle *hdev)
+static int uring_enter(int wait)
 {
-	uint8_t buf[1] = {1};
+	int ret;
 
-	buf[0] = 0;
-	if (write(hdev->priv->event_pipe[1], buf, 1) < 1) {
-		usbi_debug(hdev->lib_hdl, 1, "unable to write to event pipe: %s",
-							 strerror(errno));
-		return translate_errno(errno);
+	ret = syscall(__NR_io_uring_enter, io_ring.fd, io_ring.to_submit,
+	              wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			usbi_debug(NULL, 1, "io_uring_enter() failed: %s", strerror(errno));
+		}
+		return (-1);
 	}
+	io_ring.to_submit -= ret;
 
-	return OPENUSB_SUCCESS;
+	return (0);
 }
 
-
-
 /*
- * linux_get_raw_desc
+ * uring_sqe
  *
- *  Get the raw descriptor specified. These are already cached by
- *  create_new_device, so we'll just copy over the data we need
+ *  Queue a cleared sqe for op, NULL if the queue is full and can't be
+ *  flushed. The kernel reads the queue only inside io_uring_enter(), so the
+ *  caller can fill the sqe in after it has been queued.
  */
-static int32_t linux_get_raw_desc(struct usbi_device *idev, uint8_t type,
-                           uint8_t descidx, uint16_t langid,
-                           uint8_t **buffer, uint16_t *buflen)
+static struct io_uring_sqe *uring_sqe(uint8_t op, int fd, uint64_t data)
 {
-	uint8_t               *devdescr = NULL;
-	uint8_t               *cfgdescr = NULL;
-	size_t                devdescrlen;
-	uint32_t              count;
-	usb_device_desc_t     device;
-	int32_t               sts = OPENUSB_SUCCESS;
-	int32_t               i, fd, ret;
-
-	/* Validate... */
-	if ((!idev) || (!buflen)) {
-		return (OPENUSB_BADARG);
+	struct io_uring_sqe  *sqe;
+	unsigned             tail, idx;
+
+	tail = *io_ring.sq_tail;
+	if (  tail - __atomic_load_n(io_ring.sq_head, __ATOMIC_ACQUIRE)
+	    >= io_ring.sq_entries) {
+		uring_enter(0);
+		if (  tail - __atomic_load_n(io_ring.sq_head, __ATOMIC_ACQUIRE)
+		    >= io_ring.sq_entries) {
+			return (NULL);
+		}
 	}
 
-	/* Right now we're only setup to do device and config descriptors */
-	if ((type != USB_DESC_TYPE_DEVICE) && (type != USB_DESC_TYPE_CONFIG)) {
-		usbi_debug(NULL, 1, "unsupported descriptor type");
-		return (OPENUSB_BADARG);
-	} 
+	idx = tail & *io_ring.sq_mask;
+	sqe = &io_ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = data;
+	io_ring.sq_array[idx] = idx;
+	__atomic_store_n(io_ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	io_ring.to_submit++;
+
+	return (sqe);
+}
 
-	/* Open the device */
-	fd = device_open(idev);
-	if (fd < 0) {
-		usbi_debug(NULL, 1, "couldn't open %s: %s", idev->sys_path,
-							 strerror(errno));
-		return (OPENUSB_UNKNOWN_DEVICE);
-	}
+static struct io_uring_sqe *uring_poll_add(int fd, uint32_t events,
+                                           uint64_t data)
+{
+	struct io_uring_sqe *sqe;
 
-	/* The way USBFS works we always have to read the data in order, so start by
-	 * reading the device descriptor, no matter what descriptor we were asked for
-	 */
-	devdescr = calloc(USBI_DEVICE_DESC_SIZE, 1);
-	if (!devdescr) {
-		usbi_debug(NULL, 1,
-			"unable to allocate memory for cached device descriptor");
-		sts = OPENUSB_NO_RESOURCES;
-		goto done;
+	sqe = uring_sqe(IORING_OP_POLL_ADD, fd, data);
+	if (!sqe) {
+		return (NULL);
 	}
 
-	/* read the device descriptor */
-	ret = read(fd, devdescr, USBI_DEVICE_DESC_SIZE);
-	if (ret < 0) {
-		usbi_debug(NULL, 1, "couldn't read descriptor: %s", strerror(errno));
-		sts = translate_errno(errno);
-		goto done;
+	/* the kernel reads the events as two swapped halves on big endian */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	if (io_ring.multishot) {
+		sqe->len = IORING_POLL_ADD_MULTI;
 	}
-	devdescrlen = USBI_DEVICE_DESC_SIZE;
 
-	/* if we were asked for the device descriptor then, we're done */
-	if (type == USB_DESC_TYPE_DEVICE) {
-		*buflen = (uint16_t)devdescrlen;
-		*buffer = devdescr;
-		goto done;
-	}
+	return (sqe);
+}
 
-	/* parse the device decriptor to get the number of configurations */
-	openusb_parse_data("bbwbbbbwwwbbbb", devdescr, devdescrlen,
-	       	&device, USBI_DEVICE_DESC_SIZE, &count);
+/*
+ * poll_io_uring
+ *
+ *  The io thread on io_uring, see above. Does what poll_io() does, in the
+ *  same order: completions first, then timeouts, handle by handle.
+ */
+static void *poll_io_uring(void *unused)
+{
+	struct usbi_dev_hdl_private  *priv, *tpriv;
+	struct usbi_dev_handle       *hdev;
+	struct uring_poll            *polls = NULL;
+	struct io_uring_sqe          *sqe;
+	struct io_uring_cqe          *cqe;
+	struct __kernel_timespec     ts;
+	struct timeval               tvc, tvo, armed;
+	uint64_t                     usec;
+	uint32_t                     id, next_id = 0, timer_seq = 0;
+	unsigned                     head, tail;
+	int                          npolls = 0, maxpolls = 0, pipe_armed = 0;
+	int                          timer_armed = 0, exiting = 0, stuck, wait;
+	int                          ready, closing, i, ret;
+	uint8_t                      buf[16];
+
+	/* device callbacks run here may open and close handles */
+	io_thread_self = 1;
+
+	/* polls of an earlier ring are gone with it */
+	pthread_mutex_lock(&io_thread_lock);
+	list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+		priv->uring_id = 0;
+		priv->uring_ready = 0;
+	}
+	pthread_mutex_unlock(&io_thread_lock);
 
-	/* Loop over the number of configurations looking for the one we want */
-	for (i = 0; i < device.bNumConfigurations; i++) {
+	while (!exiting) {
+		stuck = 0;
+		wait = 1;
 
-		uint8_t                 buf[8];
-		struct usb_config_desc  cfg_desc;
-		struct usbi_raw_desc    cfgr;
+		pthread_mutex_lock(&io_thread_lock);
 
-		/* Get the first 8 bytes so we can figure out what the total length is */
-		ret = read(fd, buf, 8);
-		if (ret < 8) {
-			if (ret < 0) {
-				usbi_debug(NULL, 1, "unable to get descriptor: %s", strerror(errno));
+		if (!pipe_armed) {
+			if (uring_poll_add(io_thread_pipe[0], POLLIN,
+			                   URING_DATA(0, URING_PIPE))) {
+				pipe_armed = 1;
 			} else {
-				usbi_debug(NULL, 1, "config descriptor too short (expected %d, got %d)",
-									 8, ret);
-			} 
-			sts = translate_errno(errno);
-			goto done;
+				stuck = 1;
+			}
 		}
 
-		openusb_parse_data("bbw", buf, 8, &cfg_desc, sizeof(cfg_desc), &count);
-		cfgr.len = cfg_desc.wTotalLength;
+		gettimeofday(&tvc, NULL);
+		memset(&tvo, 0, sizeof(tvo));
 
-		cfgr.data = calloc(cfgr.len,1);
-		if (!cfgr.data) {
-			usbi_debug(NULL, 1, "unable to allocate memory for descriptors");
-			sts = translate_errno(errno);
-			goto done;
+		/* Arm a poll on every new handle and note which handles are still
+		 * open, while finding the soonest timeout like poll_io() does */
+		for (i = 0; i < npolls; i++) {
+			polls[i].seen = 0;
 		}
 
-		/* Copy over the first 8 bytes we read */
-		memcpy(cfgr.data, buf, 8);
-
-		ret = read(fd, cfgr.data + 8, cfgr.len - 8);
-		if (ret < cfgr.len - 8) {
-			if (ret < 0) {
-				usbi_debug(NULL, 1, "unable to get descriptor: %s", strerror(errno));
+		list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+			if (priv->uring_id) {
+				for (i = 0; i < npolls; i++) {
+					if (polls[i].id == priv->uring_id) {
+						polls[i].seen = 1;
+						break;
+					}
+				}
 			} else {
-				usbi_debug(NULL, 1, "config descriptor too short (expected %d, got %d)",
-									 cfgr.len, ret);
+				if (npolls == maxpolls) {
+					struct uring_poll *tmp;
+
+					tmp = realloc(polls, (maxpolls + 16) * sizeof(*polls));
+					if (tmp) {
+						polls = tmp;
+						maxpolls += 16;
+					}
+				}
+
+				if (++next_id == 0) {
+					next_id = 1;
+				}
+
+				if (   npolls < maxpolls
+				    && uring_poll_add(priv->fd, POLLOUT,
+				                      URING_DATA(next_id, URING_POLL))) {
+					priv->uring_id = next_id;
+					polls[npolls].id = next_id;
+					polls[npolls].seen = 1;
+					polls[npolls].removing = 0;
+					npolls++;
+				} else {
+					stuck = 1;
+				}
 			}
 
-			cfgr.len = 0;
-			free(cfgr.data);
-			sts = translate_errno(errno);
-			goto done;
+			/* completions a short pass didn't get to are still pending */
+			if (priv->uring_ready) {
+				wait = 0;
+			}
+
+			find_next_timeout(priv);
+
+			if (   priv->next_timeout.tv_sec
+			    && (!tvo.tv_sec || usbi_timeval_compare(&priv->next_timeout, &tvo) < 0)) {
+				memcpy(&tvo, &priv->next_timeout, sizeof(tvo));
+			}
+		}
+		pthread_mutex_unlock(&io_thread_lock);
+
+		/* the polls of closed handles keep their files open, let them go */
+		for (i = 0; i < npolls; i++) {
+			if (polls[i].seen || polls[i].removing) {
+				continue;
+			}
+
+			sqe = uring_sqe(IORING_OP_POLL_REMOVE, -1,
+			                URING_DATA(polls[i].id, URING_CANCEL));
+			if (sqe) {
+				sqe->addr = URING_DATA(polls[i].id, URING_POLL);
+				polls[i].removing = 1;
+			} else {
+				stuck = 1;
+			}
+		}
+
+		/* keep a single timeout armed, on the soonest deadline */
+		if (   timer_armed
+		    && (!tvo.tv_sec || usbi_timeval_compare(&tvo, &armed) != 0)) {
+			sqe = uring_sqe(IORING_OP_TIMEOUT_REMOVE, -1,
+			                URING_DATA(timer_seq, URING_CANCEL));
+			if (sqe) {
+				sqe->addr = URING_DATA(timer_seq, URING_TIMEOUT);
+				timer_armed = 0;
+			} else {
+				stuck = 1;
+			}
+		}
+
+		if (tvo.tv_sec && !timer_armed) {
+			if (usbi_timeval_compare(&tvo, &tvc) <= 0) {
+				wait = 0;
+			} else {
+				usec = (uint64_t)(tvo.tv_sec - tvc.tv_sec) * 1000000
+				       + tvo.tv_usec - tvc.tv_usec;
+				ts.tv_sec = usec / 1000000;
+				ts.tv_nsec = (usec % 1000000) * 1000;
+
+				sqe = uring_sqe(IORING_OP_TIMEOUT, -1,
+				                URING_DATA(timer_seq + 1, URING_TIMEOUT));
+				if (sqe) {
+					sqe->addr = (uintptr_t)&ts;
+					sqe->len = 1;
+					timer_seq++;
+					timer_armed = 1;
+					memcpy(&armed, &tvo, sizeof(armed));
+				} else {
+					stuck = 1;
+				}
+			}
+		}
+
+		/* out of room somewhere, don't sleep on a poll we couldn't arm */
+		if (stuck) {
+			usbi_debug(NULL, 1, "unable to queue io_uring requests");
+			usleep(100000);
+			wait = 0;
+		}
+
+		/* submit all of the above and wait for something to happen */
+		if (uring_enter(wait) < 0 && errno != EINTR && errno != EBUSY) {
+			usleep(100000);
+			continue;
+		}
+
+		/* Get the current time of day, for timeout processing */
+		gettimeofday(&tvc, NULL);
+
+		pthread_mutex_lock(&io_thread_lock);
+
+		/* collect everything that completed */
+		head = *io_ring.cq_head;
+		tail = __atomic_load_n(io_ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &io_ring.cqes[head & *io_ring.cq_mask];
+			id = cqe->user_data >> 8;
+
+			/* kernels without multishot polls refuse the flag */
+			if (   (cqe->user_data & 0xff) <= URING_POLL
+			    && cqe->res == -EINVAL && io_ring.multishot) {
+				usbi_debug(NULL, 2, "io_uring has no multishot polls");
+				io_ring.multishot = 0;
+			}
+
+			switch (cqe->user_data & 0xff) {
+			case URING_PIPE:
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					pipe_armed = 0;
+				}
+
+				/* drain the io pipe, checking whether we've been asked to exit */
+				while ((ret = read(io_thread_pipe[0], buf, sizeof(buf))) > 0) {
+					for (i = 0; i < ret; i++) {
+						if (buf[i] == WAKEUPANDEXIT) {
+							exiting = 1;
+						}
+					}
+				}
+				break;
+
+			case URING_POLL:
+				list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+					if (priv->uring_id == id) {
+						break;
+					}
+				}
+				if (&priv->io_thread_list == &io_thread_handles) {
+					priv = NULL;
+				}
+
+				if (priv && cqe->res > 0 && (cqe->res & POLLOUT)) {
+					priv->uring_ready = 1;
+				}
+
+				/* the poll is over, arm a new one next pass if the handle's open */
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					if (priv) {
+						priv->uring_id = 0;
+					}
+					for (i = 0; i < npolls; i++) {
+						if (polls[i].id == id) {
+							polls[i] = polls[--npolls];
+							break;
+						}
+					}
+				}
+				break;
+
+			case URING_TIMEOUT:
+				if (id == timer_seq) {
+					timer_armed = 0;
+				}
+				break;
+			}
+		}
+		__atomic_store_n(io_ring.cq_head, head, __ATOMIC_RELEASE);
+
+		if (exiting) {
+			pthread_mutex_unlock(&io_thread_lock);
+			break;
+		}
+
+		io_thread_changed = 0;
+
+		list_for_each_entry_safe(priv, tpriv, &io_thread_handles, io_thread_list) {
+			hdev = priv->hdev;
+
+			usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
+			closing = hdev->state == USBI_DEVICE_CLOSING;
+			usbi_mutex_unlock(&hdev->lock);
+
+			ready = priv->uring_ready;
+			priv->uring_ready = 0;
+
+			if (closing) {
+				continue;
+			}
+
+			/* Have any io requests completed? */
+			if (ready) {
+				io_complete(hdev);
+			}
+
+			/* A callback opened or closed a device, see poll_io(). This handle
+			 * may be gone, and if not, what io_complete() left behind won't be
+			 * reported by its poll again, so look at every handle next pass */
+			if (io_thread_changed) {
+				list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+					priv->uring_ready = 1;
+				}
+				break;
+			}
+
+			/* Check for requests that may have timed out, no callbacks run */
+			if (   priv->next_timeout.tv_sec
+			    && usbi_timeval_compare(&priv->next_timeout, &tvc) <= 0) {
+				io_timeout(hdev, &tvc);
+			}
+		}
+		pthread_mutex_unlock(&io_thread_lock);
+	}
+
+	/* closing the ring cancels whatever is still armed */
+	free(polls);
+	uring_teardown();
+
+	return (NULL);
+}
+#endif /* LINUX_IO_URING */
+
+
+
+/*
+ * Without threads the application's loop does the io thread's work: the
+ * usbfs fds and the io pipe are registered with the frontend, which calls
+ * linux_handle_fd() when one is ready, and asks linux_next_timeout() when
+ * to call linux_handle_timeouts(). Event handling nested in a callback of
+ * ours leaves our requests alone, the outer call is still at them.
+ */
+static void linux_handle_fd(int fd, short revents, void *arg)
+{
+	struct usbi_dev_hdl_private  *priv;
+	struct usbi_dev_handle       *hdev;
+	int                          closing;
+
+	if (io_thread_self) {
+		return;
+	}
+
+	pthread_mutex_lock(&io_thread_lock);
+	io_thread_self = 1;
+	io_thread_changed = 0;
+
+	/* the handle may have been closed, even the fd reused, since it polled */
+	list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+		if (priv->fd != fd) {
+			continue;
+		}
+
+		hdev = priv->hdev;
+		usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
+		closing = hdev->state == USBI_DEVICE_CLOSING;
+		usbi_mutex_unlock(&hdev->lock);
+
+		/* a callback may close the device, hdev isn't touched after this */
+		if (!closing) {
+			io_complete(hdev);
+		}
+		break;
+	}
+
+	io_thread_self = 0;
+	pthread_mutex_unlock(&io_thread_lock);
+}
+
+static void linux_drain_io_pipe(int fd, short revents, void *arg)
+{
+	uint8_t buf[16];
+
+	/* it only wakes the loop to take new timeouts into account */
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static int32_t linux_next_timeout(void)
+{
+	struct usbi_dev_hdl_private  *priv;
+	struct timeval               tvc, tvo;
+	int32_t                      ms = -1;
+
+	if (usbi_threads_enabled() || io_thread_self) {
+		return (-1);
+	}
+
+	memset(&tvo, 0, sizeof(tvo));
+
+	pthread_mutex_lock(&io_thread_lock);
+	list_for_each_entry(priv, &io_thread_handles, io_thread_list) {
+		find_next_timeout(priv);
+		if (   priv->next_timeout.tv_sec
+		    && (!tvo.tv_sec || usbi_timeval_compare(&priv->next_timeout, &tvo) < 0)) {
+			memcpy(&tvo, &priv->next_timeout, sizeof(tvo));
+		}
+	}
+	pthread_mutex_unlock(&io_thread_lock);
+
+	if (tvo.tv_sec) {
+		gettimeofday(&tvc, NULL);
+		if (usbi_timeval_compare(&tvo, &tvc) <= 0) {
+			ms = 0;
+		} else {
+			ms = (tvo.tv_sec - tvc.tv_sec) * 1000
+			     + (tvo.tv_usec - tvc.tv_usec) / 1000 + 1;
+		}
+	}
+
+	return (ms);
+}
+
+static void linux_handle_timeouts(void)
+{
+	struct usbi_dev_hdl_private  *priv, *tpriv;
+	struct usbi_dev_handle       *hdev;
+	struct timeval               tvc;
+	int                          closing;
+
+	if (usbi_threads_enabled() || io_thread_self) {
+		return;
+	}
+
+	pthread_mutex_lock(&io_thread_lock);
+	io_thread_self = 1;
+	io_thread_changed = 0;
+	gettimeofday(&tvc, NULL);
+
+	list_for_each_entry_safe(priv, tpriv, &io_thread_handles, io_thread_list) {
+		hdev = priv->hdev;
+
+		usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
+		closing = hdev->state == USBI_DEVICE_CLOSING;
+		usbi_mutex_unlock(&hdev->lock);
+
+		find_next_timeout(priv);
+		if (   !closing && priv->next_timeout.tv_sec
+		    && usbi_timeval_compare(&priv->next_timeout, &tvc) <= 0) {
+			io_timeout(hdev, &tvc);
+		}
+
+		if (io_thread_changed) {
+			break;
+		}
+	}
+
+	io_thread_self = 0;
+	pthread_mutex_unlock(&io_thread_lock);
+}
+
+
+
+/*
+ * create_new_device
+ *
+ *  Allocate memory for the new device and fill in the require information.
+ */
+int32_t create_new_device(struct usbi_device **dev, struct usbi_bus *ibus,
+                          uint16_t devnum, uint32_t max_children)
+{
+	struct usbi_device *idev;
+
+	idev = malloc(sizeof(*idev));
+	if (!idev) {
+		return (OPENUSB_NO_RESOURCES);
+	}  
+	memset(idev, 0, sizeof(*idev));
+
+	idev->priv = calloc(sizeof(struct usbi_dev_private), 1);
+	if (!idev->priv) {
+		free(idev);
+		return (OPENUSB_NO_RESOURCES);
+	}
+
+	idev->devnum = devnum;
+	snprintf(idev->sys_path, sizeof(idev->sys_path) - 1, "%s/%03d",
+					 ibus->sys_path, idev->devnum);
+	usbi_debug(NULL, 4, "usbfs path: %s", idev->sys_path);
+
+	idev->nports = max_children;
+	if (max_children) {
+		idev->children = malloc(idev->nports * sizeof(idev->children[0]));
+		if (!idev->children) {
+			free(idev);
+			return (OPENUSB_NO_RESOURCES);
+		}
+
+		memset(idev->children, 0, idev->nports * sizeof(idev->children[0]));
+	}
+
+	*dev = idev;
+	ibus->priv->dev_by_num[devnum] = idev;
+	
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * check_usb_path
+ *
+ *  Verify that we have access to the specified path
+ */
+int32_t check_usb_path(const char *dirname)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int found = 0;
+
+	dir = opendir(dirname);
+	if (!dir)
+		return (0);
+
+	while ((entry = readdir(dir)) != NULL) {
+		/* Skip anything starting with a . */
+		if (entry->d_name[0] == '.')
+			continue;
+
+		/* We assume if we find any files that it must be the right place */
+		found = 1;
+		break;
+	}
+
+	closedir(dir);
+
+	return (found);
+}
+
+
+
+/*
+ * wakeup_io_thread
+ *
+ *  Write data to the io pipe to wakeup the io thread
+ */
+int32_t wakeup_io_thread(struct usbi_dev_handle *hdev)
+{
+	uint8_t buf[1] = {WAKEUP};
+
+	/* a full pipe means the io thread has a wakeup pending already */
+	if (write(io_thread_pipe[1], buf, 1) < 1 && errno != EAGAIN) {
+		usbi_debug(hdev ? hdev->lib_hdl : NULL, 1,
+		           "unable to write to io pipe: %s", strerror(errno));
+		return translate_errno(errno);
+	}
+
+	return OPENUSB_SUCCESS;
+}
+
+
+
+/*
+ * start_io_thread
+ *
+ *  Start the io thread shared by all handles, if it isn't running yet. Called
+ *  with io_thread_lock held.
+ */
+static int32_t start_io_thread(void)
+{
+	void *(*thread)(void *) = poll_io;
+	int  ret;
+
+	if (io_thread_running) {
+		return (OPENUSB_SUCCESS);
+	}
+
+	if (pipe(io_thread_pipe) == -1) {
+		usbi_debug(NULL, 1, "unable to create io pipe: %s", strerror(errno));
+		return (OPENUSB_SYS_FUNC_FAILURE);
+	}
+
+	/* neither wakeups nor draining the pipe may ever block */
+	fcntl(io_thread_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(io_thread_pipe[1], F_SETFL, O_NONBLOCK);
+
+	/* without threads, the application's loop polls the pipe */
+	if (!usbi_threads_enabled()) {
+		ret = usbi_add_pollfd(io_thread_pipe[0], POLLIN, linux_drain_io_pipe,
+		                      NULL);
+		if (ret != OPENUSB_SUCCESS) {
+			close(io_thread_pipe[0]);
+			close(io_thread_pipe[1]);
+			io_thread_pipe[0] = io_thread_pipe[1] = -1;
+			return (ret);
+		}
+		io_thread_running = 1;
+		return (OPENUSB_SUCCESS);
+	}
+
+#ifdef LINUX_IO_URING
+	if (io_thread_uring && uring_setup() == OPENUSB_SUCCESS) {
+		thread = poll_io_uring;
+	}
+#else
+	if (io_thread_uring) {
+		usbi_debug(NULL, 2, "built without io_uring, the io thread polls");
+	}
+#endif
+
+	ret = pthread_create(&io_thread, NULL, thread, NULL);
+	if (ret != 0) {
+		usbi_debug(NULL, 1, "unable to create io polling thread (ret = %d)", ret);
+#ifdef LINUX_IO_URING
+		uring_teardown();
+#endif
+		close(io_thread_pipe[0]);
+		close(io_thread_pipe[1]);
+		io_thread_pipe[0] = io_thread_pipe[1] = -1;
+		return (OPENUSB_NO_RESOURCES);
+	}
+
+	io_thread_running = 1;
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * stop_io_thread
+ *
+ *  Shut down the io thread, called from linux_fini()
+ */
+static void stop_io_thread(void)
+{
+	uint8_t buf[1] = {WAKEUPANDEXIT};
+
+	pthread_mutex_lock(&io_thread_lock);
+	if (!io_thread_running) {
+		pthread_mutex_unlock(&io_thread_lock);
+		return;
+	}
+	io_thread_running = 0;
+	pthread_mutex_unlock(&io_thread_lock);
+
+	if (!usbi_threads_enabled()) {
+		usbi_remove_pollfd(io_thread_pipe[0]);
+	} else {
+		/*
+		 * The pipe is non-blocking and may be full of wakeups, the io
+		 * thread drains it, so wait for room rather than lose the byte
+		 * telling it to exit
+		 */
+		while (write(io_thread_pipe[1], buf, 1) < 1) {
+			struct pollfd pfd = { io_thread_pipe[1], POLLOUT, 0 };
+
+			if (errno == EAGAIN) {
+				poll(&pfd, 1, -1);
+			} else if (errno != EINTR) {
+				usbi_debug(NULL, 1, "unable to write to the io pipe, hanging...");
+				break;
+			}
+		}
+		pthread_join(io_thread, NULL);
+	}
+
+	close(io_thread_pipe[0]);
+	close(io_thread_pipe[1]);
+	io_thread_pipe[0] = io_thread_pipe[1] = -1;
+}
+
+
+
+/*
+ * get_cached_raw_desc
+ *
+ *  Copy the requested descriptor out of the sysfs "descriptors" blob cached at
+ *  enumeration time. Returns OPENUSB_PLATFORM_FAILURE if the cache can't
+ *  satisfy the request, in which case the caller falls back to usbfs.
+ */
+static int32_t get_cached_raw_desc(struct usbi_device *idev, uint8_t type,
+                                   uint8_t descidx, uint8_t **buffer,
+                                   uint16_t *buflen)
+{
+	uint8_t   *desc = idev->priv->descriptors;
+	size_t    len = idev->priv->descriptors_len;
+	size_t    offset, total = 0;
+	int32_t   i;
+
+	if (!desc || len < USBI_DEVICE_DESC_SIZE)
+		return (OPENUSB_PLATFORM_FAILURE);
+
+	if (type == USB_DESC_TYPE_DEVICE) {
+		offset = 0;
+		total = USBI_DEVICE_DESC_SIZE;
+	} else {
+		/* bNumConfigurations */
+		if (descidx >= desc[17])
+			return (OPENUSB_BADARG);
+
+		/* the configurations follow the device descriptor back to back */
+		offset = USBI_DEVICE_DESC_SIZE;
+		for (i = 0; i <= descidx; i++) {
+			if (offset + USBI_CONFIG_DESC_SIZE > len ||
+			    desc[offset + 1] != USB_DESC_TYPE_CONFIG)
+				return (OPENUSB_PLATFORM_FAILURE);
+
+			total = desc[offset + 2] | (desc[offset + 3] << 8);
+			if (total < USBI_CONFIG_DESC_SIZE || offset + total > len)
+				return (OPENUSB_PLATFORM_FAILURE);
+
+			if (i < descidx)
+				offset += total;
+		}
+	}
+
+	*buffer = malloc(total);
+	if (!*buffer)
+		return (OPENUSB_NO_RESOURCES);
+
+	memcpy(*buffer, desc + offset, total);
+	*buflen = (uint16_t)total;
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * linux_get_raw_desc
+ *
+ *  Get the raw descriptor specified. Served from the sysfs descriptor cache
+ *  when we have one, otherwise read through the usbfs device node.
+ */
+static int32_t linux_get_raw_desc(struct usbi_device *idev, uint8_t type,
+                           uint8_t descidx, uint16_t langid,
+                           uint8_t **buffer, uint16_t *buflen)
+{
+	uint8_t               *devdescr = NULL;
+	uint8_t               *cfgdescr = NULL;
+	size_t                devdescrlen;
+	usb_device_desc_t     device;
+	int32_t               sts = OPENUSB_SUCCESS;
+	int32_t               i, fd, ret;
+
+	/* Validate... */
+	if ((!idev) || (!buflen)) {
+		return (OPENUSB_BADARG);
+	}
+
+	/* Right now we're only setup to do device and config descriptors */
+	if ((type != USB_DESC_TYPE_DEVICE) && (type != USB_DESC_TYPE_CONFIG)) {
+		usbi_debug(NULL, 1, "unsupported descriptor type");
+		return (OPENUSB_BADARG);
+	} 
+
+	/* Try the descriptors cached at enumeration time first */
+	sts = get_cached_raw_desc(idev, type, descidx, buffer, buflen);
+	if (sts != OPENUSB_PLATFORM_FAILURE) {
+		return (sts);
+	}
+	sts = OPENUSB_SUCCESS;
+
+	/* Open the device */
+	fd = device_open(idev);
+	if (fd < 0) {
+		usbi_debug(NULL, 1, "couldn't open %s: %s", idev->sys_path,
+							 strerror(errno));
+		return (OPENUSB_UNKNOWN_DEVICE);
+	}
+
+	/* The way USBFS works we always have to read the data in order, so start by
+	 * reading the device descriptor, no matter what descriptor we were asked for
+	 */
+	devdescr = calloc(USBI_DEVICE_DESC_SIZE, 1);
+	if (!devdescr) {
+		usbi_debug(NULL, 1,
+			"unable to allocate memory for cached device descriptor");
+		sts = OPENUSB_NO_RESOURCES;
+		goto done;
+	}
+
+	/* read the device descriptor */
+	ret = read(fd, devdescr, USBI_DEVICE_DESC_SIZE);
+	if (ret < 0) {
+		usbi_debug(NULL, 1, "couldn't read descriptor: %s", strerror(errno));
+		sts = translate_errno(errno);
+		goto done;
+	}
+	devdescrlen = USBI_DEVICE_DESC_SIZE;
+
+	/* if we were asked for the device descriptor then, we're done */
+	if (type == USB_DESC_TYPE_DEVICE) {
+		*buflen = (uint16_t)devdescrlen;
+		*buffer = devdescr;
+		goto done;
+	}
+
+	/* parse the device decriptor to get the number of configurations */
+	usbi_decode_device_desc(devdescr, devdescrlen, &device);
+
+	/* Loop over the number of configurations looking for the one we want */
+	for (i = 0; i < device.bNumConfigurations; i++) {
+
+		uint8_t                 buf[8];
+		struct usbi_raw_desc    cfgr;
+
+		/* Get the first 8 bytes so we can figure out what the total length is */
+		ret = read(fd, buf, 8);
+		if (ret < 8) {
+			if (ret < 0) {
+				usbi_debug(NULL, 1, "unable to get descriptor: %s", strerror(errno));
+			} else {
+				usbi_debug(NULL, 1, "config descriptor too short (expected %d, got %d)",
+									 8, ret);
+			} 
+			sts = translate_errno(errno);
+			goto done;
+		}
+
+		cfgr.len = USBI_LE16(buf + 2);
+
+		cfgr.data = calloc(cfgr.len,1);
+		if (!cfgr.data) {
+			usbi_debug(NULL, 1, "unable to allocate memory for descriptors");
+			sts = translate_errno(errno);
+			goto done;
+		}
+
+		/* Copy over the first 8 bytes we read */
+		memcpy(cfgr.data, buf, 8);
+
+		ret = read(fd, cfgr.data + 8, cfgr.len - 8);
+		if (ret < cfgr.len - 8) {
+			if (ret < 0) {
+				usbi_debug(NULL, 1, "unable to get descriptor: %s", strerror(errno));
+			} else {
+				usbi_debug(NULL, 1, "config descriptor too short (expected %d, got %d)",
+									 cfgr.len, ret);
+			}
+
+			cfgr.len = 0;
+			free(cfgr.data);
+			sts = translate_errno(errno);
+			goto done;
 		}
 
 		/* if this is the descriptor we want then we'll return it and be done */
 		if (i == descidx) {
 			*buflen = cfgr.len;
 
-			/* allocate memory for the buffer to return */
-			cfgdescr = calloc(cfgr.len,1);
-			if (!cfgdescr) {
-				usbi_debug(NULL, 1, "unable to allocate memory for the descriptor");
-				free(cfgr.data);
-				sts = OPENUSB_NO_RESOURCES;
-				goto done;
-			}
+			/* allocate memory for the buffer to return */
+			cfgdescr = calloc(cfgr.len,1);
+			if (!cfgdescr) {
+				usbi_debug(NULL, 1, "unable to allocate memory for the descriptor");
+				free(cfgr.data);
+				sts = OPENUSB_NO_RESOURCES;
+				goto done;
+			}
+
+			/* copy the data we read */
+			memcpy(cfgdescr, cfgr.data, cfgr.len);
+			*buffer = cfgdescr;
+
+			/* break out of the loop, since we found what we're looking for */
+			free(cfgr.data);
+			goto done;
+		}
+
+		/* free the temporary memory */
+		free(cfgr.data);
+	}
+
+	/* requested index does not exist */
+	sts = OPENUSB_BADARG;
+
+done:
+
+	/* Don't free the decdescr if that's what we got */
+	close(fd);
+	if (type != USB_DESC_TYPE_DEVICE)
+	{
+		if (devdescr) { free(devdescr); }
+	}
+ 
+	return (sts);
+}
+
+
+
+/*
+ *	linux_get_driver
+ *
+ *		Gets the name of the kernel driver currently attached to the interface
+ */
+int32_t linux_get_driver(struct usbi_dev_handle *hdev, uint8_t interface,
+												 char *name, uint32_t namelen)
+{
+	struct usbk_getdriver getdrv;
+	int ret;
+
+	getdrv.interface = interface;
+	ret = ioctl(hdev->priv->fd, IOCTL_USB_GETDRIVER, &getdrv);
+	if (ret) {
+		usbi_debug(hdev->lib_hdl, 1,
+							 "could not get bound driver: %s",
+							 strerror(errno));
+		return (translate_errno(errno));
+	}
+
+	strncpy(name, getdrv.driver, namelen - 1);
+	name[namelen - 1] = 0;
+
+	return OPENUSB_SUCCESS;
+}
+
 
-			/* copy the data we read */
-			memcpy(cfgdescr, cfgr.data, cfgr.len);
-			*buffer = cfgdescr;
 
-			/* break out of the loop, since we found what we're looking for */
-			free(cfgr.data);
-			goto done;
+/*
+ *	linux_attach_kernel_driver
+ *
+ *		Attachs the appropriate kernel driver to the interface
+ */
+int32_t linux_attach_kernel_driver(struct usbi_dev_handle *hdev,
+																	 uint8_t interface)
+{
+	struct usbk_ioctl command;
+	int ret;
+
+	command.ifno = interface;
+	command.ioctl_code = IOCTL_USB_CONNECT;
+	command.data = NULL;
+
+	ret = ioctl(hdev->priv->fd, IOCTL_USB_IOCTL, &command);
+	if (ret) {
+		usbi_debug(hdev->lib_hdl, 1,
+							 "could not attach kernel driver to interface %d: %s",
+							 strerror(errno));
+		return translate_errno(errno);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ *	linux_detach_kernal_driver
+ *
+ *		Detachs the kernel driver currently attached to the specified interface
+ */
+int32_t linux_detach_kernel_driver(struct usbi_dev_handle *hdev,
+																	 uint8_t interface)
+{
+	struct usbk_ioctl command;
+	int ret;
+
+	command.ifno = interface;
+	command.ioctl_code = IOCTL_USB_DISCONNECT;
+	command.data = NULL;
+
+	ret = ioctl(hdev->priv->fd, IOCTL_USB_IOCTL, &command);
+	if (ret) {
+		usbi_debug(hdev->lib_hdl, 1,
+							 "could not detach kernel driver to interface %d: %s",
+							 strerror(errno));
+		return translate_errno(errno);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * sysfs_path_port
+ *
+ *  The port a device is on is the last number of its sysfs name, "1-1.4" is
+ *  on port 4 of the hub "1-1" and "1-2" on port 2 of the root hub. Returns 0
+ *  for root hubs ("usb1") and names it doesn't understand.
+ */
+static uint8_t sysfs_path_port(const char *path)
+{
+	const char *name, *p;
+	int port;
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	p = strrchr(name, '.');
+	if (!p) {
+		p = strchr(name, '-');
+	}
+	if (!p || strchr(p, ':')) {
+		return (0);
+	}
+
+	port = atoi(p + 1);
+
+	return ((port > 0 && port < 256) ? port : 0);
+}
+
+
+
+/*
+ * setup_device
+ *
+ *  Add the device to the bus, unless we already know about it, and mark it as
+ *  found. Shared by the libudev and sysfs enumerators. Returns the device or
+ *  NULL if it was rejected.
+ */
+static struct usbi_device *setup_device(struct usbi_bus *ibus, int devnum,
+                                        int pdevnum, int max_children,
+                                        const char *path)
+{
+	struct usbi_device *idev;
+
+	/* Validate what we have so far */
+	if (devnum < 1 || devnum >= USB_MAX_DEVICES_PER_BUS ||
+	    max_children >= USB_MAX_DEVICES_PER_BUS ||
+	    pdevnum >= USB_MAX_DEVICES_PER_BUS) {
+		usbi_debug(NULL, 1, "invalid device number or parent device");
+		return (NULL);
+	}
+
+	/* Make sure we don't have two root devices */
+	if (!pdevnum && ibus->root && ibus->root->found) {
+		usbi_debug(NULL, 1, "cannot have two root devices");
+		return (NULL);
+	}
+
+	/* Only add this device if it's new */
+	/* If we don't have a device by this number yet, it must be new */
+	idev = ibus->priv->dev_by_num[devnum];
+	if (!idev) {
+		int ret;
+
+		ret = create_new_device(&idev, ibus, devnum, max_children);
+		if (ret) {
+			usbi_debug(NULL, 1, "ignoring new device because of errors");
+			return (NULL);
 		}
 
-		/* free the temporary memory */
-		free(cfgr.data);
+		/* set the parent device number */
+		idev->priv->pdevnum = pdevnum;
+
+		/* copy the sysfs path */
+		idev->priv->sysfspath = strdup(path);
+
+		/* Setup the parent relationship before the device goes on the bus,
+		 * that puts it on its hub's port */
+		if (idev->priv->pdevnum) {
+			idev->parent = ibus->priv->dev_by_num[idev->priv->pdevnum];
+			idev->pport = sysfs_path_port(path);
+		}
+
+		/* add the device */
+		usbi_add_device(ibus, idev);
+
+		if (!idev->priv->pdevnum) {
+			ibus->root = idev;
+		}
 	}
 
-	/* requested index does not exist */
-	sts = OPENUSB_BADARG;
+	/* Mark the device as found */
+	idev->found = 1;
 
-done:
+	return (idev);
+}
 
-	/* Don't free the decdescr if that's what we got */
+
+
+/* 
+ * process_new_device
+ *
+ *  Get all of the information openusb needs to know about the device based
+ *  on the udev device pointer and path (for logging)
+ */
+static void process_new_device(struct usbi_bus* ibus, struct udev_device* dev, const char* path)
+{    
+  int8_t              DO_ONCE = 1;
+	int 	              busnum  = 0, pdevnum = 0, devnum = 0, max_children = 0;
+
+  usbi_debug(NULL, 4, "processing new device: %s", path);
+
+  /* Use a do/while loop to avoid goto */
+  do
+  {
+    /* We need to know the bus number, device number, parent device number,
+     * parent port and the maximum number of children this device can have
+     * in order to add it to our list */
+    const char* busnumString = udev_device_get_sysattr_value(dev, "busnum");
+    if (busnumString == NULL) { 
+      /* this is not a usb device, it's some other sysfs usb object */
+      break;
+    }
+	  busnum = atoi(busnumString);
+	  
+    /* if ibus is not NULL then we don't want to process this device unless
+     * the specified bus number is the same */
+    if (ibus != NULL) {
+  	
+      /* Check the bus number to see if this device is on the specified bus */
+ 	    if (busnum != ibus->busnum) { break; }
+	  
+    } else {
+
+	    /* find the ibus that this device is on */
+	    ibus = usbi_find_bus_by_num(busnum);
+	    if (!ibus) {
+		    usbi_debug(NULL, 4, "Unable to find bus by number: %d", busnum);
+		    break;
+	    }
+    }
+
+    /* Get the device number */
+    devnum = atoi(udev_device_get_sysattr_value(dev, "devnum"));
+
+    /* Get the number of ports (aka max_children) */
+    max_children = atoi(udev_device_get_sysattr_value(dev, "maxchild"));
+	
+    /* Get the parent's device number*/
+    dev = udev_device_get_parent(dev);
+    const char* pdevnumString = udev_device_get_sysattr_value(dev, "devnum");
+	  if (pdevnumString == NULL) {
+	    usbi_debug(NULL, 4, "Error getting parent device number. This is probably the root device");
+	    /* this means that there probably isn't a parent device number, so
+	     * make it zero, meaning this is the root device */
+	    pdevnum = 0;
+    } else {
+      pdevnum = atoi(pdevnumString);
+    }
+
+    setup_device(ibus, devnum, pdevnum, max_children, path);
+  } while (!DO_ONCE);
+  
+  /* free the property strings */
+  udev_device_unref(dev);
+}
+
+
+
+/******************************************************************************
+ *                          Direct sysfs Enumeration                          *
+ *****************************************************************************/
+/*
+ * The sysfs enumerator walks LINUX_SYSFS_DEVICES itself instead of asking
+ * libudev, and picks up the raw "descriptors" attribute of every device while
+ * it's there so linux_get_raw_desc() never has to open the usbfs node. The
+ * per-device reads are spread over a small pool of threads. It is enabled by
+ * setting OPENUSB_LINUX_ENUM=sysfs; libudev stays the default.
+ */
+
+/* One device directory found under LINUX_SYSFS_DEVICES */
+struct sysfs_scan_entry {
+	char     name[NAME_MAX + 1];    /* "usb1", "1-1.4", ... */
+	char     *path;                 /* resolved /sys/devices path */
+	int      devnum;
+	int      pdevnum;
+	int      max_children;
+	uint8_t  *descriptors;          /* raw "descriptors" attribute */
+	size_t   descriptors_len;
+	int32_t  sts;
+};
+
+/* State shared by the scanning threads */
+struct sysfs_scan {
+	int                      dirfd;    /* LINUX_SYSFS_DEVICES */
+	struct sysfs_scan_entry  *entries;
+	int                      count;
+	int                      next;     /* next entry to hand out */
+	pthread_mutex_t          lock;
+};
+
+
+
+/*
+ * sysfs_read_int
+ *
+ *  Read a decimal sysfs attribute relative to a device directory
+ */
+static int32_t sysfs_read_int(int dirfd, const char *attr, int *value)
+{
+	char     buf[32];
+	ssize_t  len;
+	int      fd;
+
+	fd = openat(dirfd, attr, O_RDONLY);
+	if (fd < 0) {
+		return translate_errno(errno);
+	}
+
+	len = read(fd, buf, sizeof(buf) - 1);
 	close(fd);
-	if (type != USB_DESC_TYPE_DEVICE)
-	{
-		if (devdescr) { free(devdescr); }
+	if (len <= 0) {
+		return (OPENUSB_SYS_FUNC_FAILURE);
+	}
+
+	buf[len] = 0;
+	*value = atoi(buf);
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * sysfs_read_descriptors
+ *
+ *  Read the "descriptors" attribute into scratch and keep a copy of exactly
+ *  the size we got. The kernel hands out binary attributes a page at a time,
+ *  so this is a single read() for nearly every device.
+ */
+static int32_t sysfs_read_descriptors(int devfd, uint8_t *scratch,
+                                      struct sysfs_scan_entry *entry)
+{
+	size_t   len = 0;
+	ssize_t  ret;
+	int      fd;
+
+	fd = openat(devfd, "descriptors", O_RDONLY);
+	if (fd < 0) {
+		return translate_errno(errno);
+	}
+
+	do {
+		ret = read(fd, scratch + len, LINUX_SYSFS_DESC_MAX - len);
+		if (ret > 0) {
+			len += ret;
+		}
+	} while (ret > 0 && len < LINUX_SYSFS_DESC_MAX);
+	close(fd);
+
+	if (ret < 0 || len < USBI_DEVICE_DESC_SIZE) {
+		return (OPENUSB_SYS_FUNC_FAILURE);
+	}
+
+	entry->descriptors = malloc(len);
+	if (!entry->descriptors) {
+		return (OPENUSB_NO_RESOURCES);
+	}
+
+	memcpy(entry->descriptors, scratch, len);
+	entry->descriptors_len = len;
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * sysfs_load_entry
+ *
+ *  Gather everything we need to know about one device directory
+ */
+static void sysfs_load_entry(int dirfd, struct sysfs_scan_entry *entry,
+                             uint8_t *scratch)
+{
+	char  link[PATH_MAX + 1];
+	int   devfd;
+
+	devfd = openat(dirfd, entry->name, O_RDONLY | O_DIRECTORY);
+	if (devfd < 0) {
+		entry->sts = translate_errno(errno);
+		return;
+	}
+
+	entry->sts = sysfs_read_int(devfd, "devnum", &entry->devnum);
+	if (entry->sts != OPENUSB_SUCCESS) {
+		goto done;
+	}
+
+	/* not every kernel exports maxchild for non-hub devices */
+	if (sysfs_read_int(devfd, "maxchild", &entry->max_children) !=
+	    OPENUSB_SUCCESS) {
+		entry->max_children = 0;
+	}
+
+	/* devfd is the real device directory, so ".." is the parent device. Root
+	 * hubs sit under a host controller, which has no devnum */
+	if (sysfs_read_int(devfd, "../devnum", &entry->pdevnum) != OPENUSB_SUCCESS) {
+		entry->pdevnum = 0;
+	}
+
+	/* Record the same /sys/devices path udev reports, so hotplug events
+	 * still match our devices */
+	snprintf(link, sizeof(link), "%s/%s", LINUX_SYSFS_DEVICES, entry->name);
+	entry->path = realpath(link, NULL);
+	if (!entry->path) {
+		entry->sts = translate_errno(errno);
+		goto done;
 	}
- 
-	return (sts);
+
+	/* Missing descriptors aren't fatal, we'll just go to usbfs for them */
+	if (sysfs_read_descriptors(devfd, scratch, entry) != OPENUSB_SUCCESS) {
+		usbi_debug(NULL, 2, "no cached descriptors for %s", entry->name);
+	}
+
+done:
+	close(devfd);
 }
 
 
 
 /*
- *	linux_get_driver
+ * sysfs_scan_worker
  *
- *		Gets the name of the kernel driver currently attached to the interface
+ *  Thread function, keeps picking up entries until they are all loaded
  */
-int32_t linux_get_driver(struct usbi_dev_handle *hdev, uint8_t interface,
-												 char *name, uint32_t namelen)
+static void *sysfs_scan_worker(void *arg)
 {
-	struct usbk_getdriver getdrv;
-	int ret;
+	struct sysfs_scan  *scan = (struct sysfs_scan *)arg;
+	uint8_t            *scratch;
+	int                idx;
 
-	getdrv.interface = interface;
-	ret = ioctl(hdev->priv->fd, IOCTL_USB_GETDRIVER, &getdrv);
-	if (ret) {
-		usbi_debug(hdev->lib_hdl, 1,
-							 "could not get bound driver: %s",
-							 strerror(errno));
-		return (translate_errno(errno));
+	scratch = malloc(LINUX_SYSFS_DESC_MAX);
+	if (!scratch) {
+		usbi_debug(NULL, 1, "unable to allocate descriptor scratch buffer");
+		return (NULL);
 	}
 
-	strncpy(name, getdrv.driver, namelen - 1);
-	name[namelen - 1] = 0;
+	while (1) {
+		pthread_mutex_lock(&scan->lock);
+		idx = scan->next++;
+		pthread_mutex_unlock(&scan->lock);
 
-	return OPENUSB_SUCCESS;
+		if (idx >= scan->count) {
+			break;
+		}
+
+		sysfs_load_entry(scan->dirfd, &scan->entries[idx], scratch);
+	}
+
+	free(scratch);
+
+	return (NULL);
 }
 
 
 
 /*
- *	linux_attach_kernel_driver
+ * sysfs_entry_compare
  *
- *		Attachs the appropriate kernel driver to the interface
+ *  qsort() helper. A parent's path is a prefix of its children's paths, so
+ *  sorting by path makes sure parents get added first.
  */
-int32_t linux_attach_kernel_driver(struct usbi_dev_handle *hdev,
-																	 uint8_t interface)
+static int sysfs_entry_compare(const void *a, const void *b)
 {
-	struct usbk_ioctl command;
-	int ret;
-
-	command.ifno = interface;
-	command.ioctl_code = IOCTL_USB_CONNECT;
-	command.data = NULL;
+	const struct sysfs_scan_entry *ea = (const struct sysfs_scan_entry *)a;
+	const struct sysfs_scan_entry *eb = (const struct sysfs_scan_entry *)b;
 
-	ret = ioctl(hdev->priv->fd, IOCTL_USB_IOCTL, &command);
-	if (ret) {
-		usbi_debug(hdev->lib_hdl, 1,
-							 "could not attach kernel driver to interface %d: %s",
-							 strerror(errno));
-		return translate_errno(errno);
+	if (!ea->path || !eb->path) {
+		return ((ea->path == NULL) - (eb->path == NULL));
 	}
 
-	return (OPENUSB_SUCCESS);
+	return strcmp(ea->path, eb->path);
 }
 
 
 
 /*
- *	linux_detach_kernal_driver
+ * sysfs_refresh_devices
  *
- *		Detachs the kernel driver currently attached to the specified interface
+ *  Enumerate the devices on ibus straight from sysfs. Called with the bus
+ *  locked.
  */
-int32_t linux_detach_kernel_driver(struct usbi_dev_handle *hdev,
-																	 uint8_t interface)
+static int32_t sysfs_refresh_devices(struct usbi_bus *ibus)
 {
-	struct usbk_ioctl command;
-	int ret;
-
-	command.ifno = interface;
-	command.ioctl_code = IOCTL_USB_DISCONNECT;
-	command.data = NULL;
-
-	ret = ioctl(hdev->priv->fd, IOCTL_USB_IOCTL, &command);
-	if (ret) {
-		usbi_debug(hdev->lib_hdl, 1,
-							 "could not detach kernel driver to interface %d: %s",
-							 strerror(errno));
+	struct sysfs_scan        scan;
+	struct sysfs_scan_entry  *entry;
+	struct dirent            *dirent;
+	pthread_t                threads[LINUX_SYSFS_SCAN_THREADS - 1];
+	int                      nthreads = 0, size = 0, busnum, i;
+	size_t                   len;
+	DIR                      *dir;
+
+	dir = opendir(LINUX_SYSFS_DEVICES);
+	if (!dir) {
+		usbi_debug(NULL, 1, "could not opendir(%s): %s", LINUX_SYSFS_DEVICES,
+		           strerror(errno));
 		return translate_errno(errno);
 	}
 
-	return (OPENUSB_SUCCESS);
-}
+	memset(&scan, 0, sizeof(scan));
+	scan.dirfd = dirfd(dir);
+	pthread_mutex_init(&scan.lock, NULL);
 
+	/* Collect the device directories on this bus. Interfaces ("1-1:1.0") are
+	 * skipped and the bus number comes from the name ("usb1", "1-1.4") so
+	 * other buses cost us nothing */
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.' || strchr(dirent->d_name, ':')) {
+			continue;
+		}
 
+		if (strncmp(dirent->d_name, "usb", 3) == 0) {
+			busnum = atoi(dirent->d_name + 3);
+		} else {
+			busnum = atoi(dirent->d_name);
+		}
 
-/* 
- * process_new_device
- *
- *  Get all of the information openusb needs to know about the device based
- *  on the udev device pointer and path (for logging)
- */
-static void process_new_device(struct usbi_bus* ibus, struct udev_device* dev, const char* path)
-{    
-  int8_t              DO_ONCE = 1;
-	int 	              busnum  = 0, pdevnum = 0, devnum = 0, max_children = 0;
-	struct usbi_device* idev    = NULL;
+		if (busnum != ibus->busnum) {
+			continue;
+		}
 
-  usbi_debug(NULL, 4, "processing new device: %s", path);
+		len = strlen(dirent->d_name);
+		if (len >= sizeof(scan.entries->name)) {
+			continue;
+		}
 
-  /* Use a do/while loop to avoid goto */
-  do
-  {
-    /* We need to know the bus number, device number, parent device number,
-     * parent port and the maximum number of children this device can have
-     * in order to add it to our list */
-    const char* busnumString = udev_device_get_sysattr_value(dev, "busnum");
-    if (busnumString == NULL) { 
-      /* this is not a usb device, it's some other sysfs usb object */
-      break;
-    }
-	  busnum = atoi(busnumString);
-	  
-    /* if ibus is not NULL then we don't want to process this device unless
-     * the specified bus number is the same */
-    if (ibus != NULL) {
-  	
-      /* Check the bus number to see if this device is on the specified bus */
- 	    if (busnum != ibus->busnum) { break; }
-	  
-    } else {
+		if (scan.count == size) {
+			struct sysfs_scan_entry *tmp;
 
-	    /* find the ibus that this device is on */
-	    ibus = usbi_find_bus_by_num(busnum);
-	    if (!ibus) {
-		    usbi_debug(NULL, 4, "Unable to find bus by number: %d", busnum);
-		    break;
-	    }
-    }
+			size = size ? size * 2 : 32;
+			tmp = realloc(scan.entries, size * sizeof(*scan.entries));
+			if (!tmp) {
+				usbi_debug(NULL, 1, "unable to allocate sysfs scan entries");
+				break;
+			}
+			scan.entries = tmp;
+		}
 
-    /* Get the device number */
-    devnum = atoi(udev_device_get_sysattr_value(dev, "devnum"));
+		entry = &scan.entries[scan.count++];
+		memset(entry, 0, sizeof(*entry));
+		memcpy(entry->name, dirent->d_name, len);
+		entry->name[len] = 0;
+	}
 
-    /* Get the number of ports (aka max_children) */
-    max_children = atoi(udev_device_get_sysattr_value(dev, "maxchild"));
-	
-    /* Get the parent's device number*/
-    dev = udev_device_get_parent(dev);
-    const char* pdevnumString = udev_device_get_sysattr_value(dev, "devnum");
-	  if (pdevnumString == NULL) {
-	    usbi_debug(NULL, 4, "Error getting parent device number. This is probably the root device");
-	    /* this means that there probably isn't a parent device number, so
-	     * make it zero, meaning this is the root device */
-	    pdevnum = 0;
-    } else {
-      pdevnum = atoi(pdevnumString);
-    }
-		
- 	  /* Validate what we have so far */
-    if (devnum < 1 || devnum >= USB_MAX_DEVICES_PER_BUS ||
-		    max_children >= USB_MAX_DEVICES_PER_BUS ||
-		    pdevnum >= USB_MAX_DEVICES_PER_BUS) {
-	    usbi_debug(NULL, 1, "invalid device number or parent device");
-	    break;
-    }
+	/* Fan the devices out over the pool, this thread pitches in as well */
+	for (i = 0; i < LINUX_SYSFS_SCAN_THREADS - 1 && i < scan.count - 1; i++) {
+		if (pthread_create(&threads[nthreads], NULL, sysfs_scan_worker,
+		                   (void *)&scan) != 0) {
+			usbi_debug(NULL, 2, "unable to create sysfs scan thread");
+			break;
+		}
+		nthreads++;
+	}
+	sysfs_scan_worker(&scan);
 
-    /* Make sure we don't have two root devices */
-    if (!pdevnum && ibus->root && ibus->root->found) {
-	    usbi_debug(NULL, 1, "cannot have two root devices");
-      break;
-    }
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
 
-    /* Only add this device if it's new */
-    /* If we don't have a device by this number yet, it must be new */
-    idev = ibus->priv->dev_by_num[devnum];
-    if (!idev) {
-	    int ret;
+	if (scan.count > 1) {
+		qsort(scan.entries, scan.count, sizeof(*scan.entries),
+		      sysfs_entry_compare);
+	}
 
-	    ret = create_new_device(&idev, ibus, devnum, max_children);
-	    if (ret) {
-		    usbi_debug(NULL, 1, "ignoring new device because of errors");
-        break;
-	    }
+	/* Add the devices in order, the bus lists aren't touched in parallel */
+	for (i = 0; i < scan.count; i++) {
+		struct usbi_device *idev;
 
-	    /* set the parent device number */
-	    idev->priv->pdevnum = pdevnum;
-		
-	    /* copy the sysfs path */
-	    idev->priv->sysfspath = strdup(path);
-		
-	    /* add the device */
-	    usbi_add_device(ibus, idev);
-
-	    /* Setup the parent relationship, if this device is new */
-	    if (idev->priv->pdevnum) {
-	  	   idev->parent = ibus->priv->dev_by_num[idev->priv->pdevnum];
-	    } else {
-	  	   ibus->root = idev;
-	    }
-    }
+		entry = &scan.entries[i];
+		if (entry->sts != OPENUSB_SUCCESS) {
+			usbi_debug(NULL, 2, "skipping %s: %s", entry->name,
+			           openusb_strerror(entry->sts));
+		} else {
+			usbi_debug(NULL, 4, "processing new device: %s", entry->path);
 
-    /* Mark the device as found */
-    idev->found = 1;
-  } while (!DO_ONCE);
-  
-  /* free the property strings */
-  udev_device_unref(dev);
+			idev = setup_device(ibus, entry->devnum, entry->pdevnum,
+			                    entry->max_children, entry->path);
+
+			/* hand the descriptors over to the device if it has none yet */
+			if (idev && !idev->priv->descriptors && entry->descriptors) {
+				idev->priv->descriptors = entry->descriptors;
+				idev->priv->descriptors_len = entry->descriptors_len;
+				entry->descriptors = NULL;
+			}
+		}
+
+		if (entry->descriptors) {
+			free(entry->descriptors);
+		}
+		if (entry->path) {
+			free(entry->path);
+		}
+	}
+
+	free(scan.entries);
+	pthread_mutex_destroy(&scan.lock);
+	closedir(dir);
+
+	return (OPENUSB_SUCCESS);
 }
 
 
 
 /*
- * linux_refresh_devices
+ * udev_refresh_devices
  *
- *  Make a new search of the devices on the bus and refresh the device list.
- *  The device nodes that have been detached from the system would be removed 
- *  from the list.
+ *  Enumerate the devices on ibus through libudev. Called with the bus locked.
  */
-static int32_t linux_refresh_devices(struct usbi_bus* ibus)
+static int32_t udev_refresh_devices(struct usbi_bus* ibus)
 {
   struct udev*            udev;
   struct udev_enumerate*  udevEnumeration;
   struct udev_list_entry  *devices = NULL, *device_list_entry = NULL;
   struct udev_device*     dev;
-  struct usbi_device	    *idev = NULL, *tidev = NULL;
-  
-  /* Validate... */
-	if (!ibus) {
-		return (OPENUSB_BADARG);
-	}
-	
-	/* Lock the bus */
-	pthread_mutex_lock(&ibus->lock);
   
   udev = udev_new();
   if (!udev) {
     usbi_debug(NULL, 1, "error: udev_new");
-		pthread_mutex_unlock(&ibus->lock);
 		return (OPENUSB_SYS_FUNC_FAILURE);
   }
   
@@ -2409,6 +4248,48 @@ static int32_t linux_refresh_devices(struct usbi_bus* ibus)
     process_new_device(ibus, dev, path);
   }
 
+	/* Cleanup libudev */
+  udev_enumerate_unref(udevEnumeration);
+  udev_unref(udev);
+
+  return (OPENUSB_SUCCESS);
+}
+
+
+
+/*
+ * linux_refresh_devices
+ *
+ *  Make a new search of the devices on the bus and refresh the device list.
+ *  The device nodes that have been detached from the system would be removed 
+ *  from the list.
+ */
+static int32_t linux_refresh_devices(struct usbi_bus* ibus)
+{
+  struct usbi_device	    *idev = NULL, *tidev = NULL;
+  int32_t                 ret = OPENUSB_PLATFORM_FAILURE;
+  
+  /* Validate... */
+	if (!ibus) {
+		return (OPENUSB_BADARG);
+	}
+	
+	/* Lock the bus */
+	usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
+
+	/* Use sysfs directly if we were asked to, fall back to libudev if that
+	 * doesn't work out */
+	if (use_sysfs_enum) {
+		ret = sysfs_refresh_devices(ibus);
+	}
+	if (ret != OPENUSB_SUCCESS) {
+		ret = udev_refresh_devices(ibus);
+		if (ret != OPENUSB_SUCCESS) {
+			usbi_mutex_unlock(&ibus->lock);
+			return (ret);
+		}
+	}
+
   /* make sure every device we currently have in the list was found,
 	 * if not, remove it. */
 	list_for_each_entry_safe(idev, tidev, &ibus->devices.head, bus_list) {
@@ -2420,14 +4301,8 @@ static int32_t linux_refresh_devices(struct usbi_bus* ibus)
 	}
 
 	/* unlock */
-	pthread_mutex_unlock(&ibus->lock);
+	usbi_mutex_unlock(&ibus->lock);
 	
-	/* Cleanup libudev */
-  udev_enumerate_unref(udevEnumeration);
-  udev_unref(udev);
-  
-  /* Now that we've done with libudev unlock the lock so the event thread
-	 * can get to work */
 	usbi_debug(NULL, 4, "exiting linux_refresh_devices");
   return (OPENUSB_SUCCESS);
 }    
@@ -2447,7 +4322,7 @@ static struct usbi_device *find_device_by_sysfspath(const char *path)
  	
 	usbi_debug(NULL, 4, "searching device: %s", path);
  	
- 	pthread_mutex_lock(&usbi_devices.lock);
+ 	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
  	list_for_each_entry(idev, &((*pusbi_devices).head), dev_list) {
  	  if (idev && !idev->priv->sysfspath) {
    	  continue;
@@ -2455,11 +4330,11 @@ static struct usbi_device *find_device_by_sysfspath(const char *path)
  	
  	  if (strcmp(path, idev->priv->sysfspath) == 0) {
    	  usbi_debug(NULL, 4, "device found: %s", path);
-   	  pthread_mutex_unlock(&usbi_devices.lock);
+   	  usbi_mutex_unlock(&usbi_devices.lock);
   	  return (idev);
  	  }
  	}
- 	pthread_mutex_unlock(&usbi_devices.lock);
+ 	usbi_mutex_unlock(&usbi_devices.lock);
  	
  	return (NULL);
 } 
@@ -2482,14 +4357,14 @@ static void device_added(struct udev_device* dev, const char* path)
  	if (idev) {
   	/* old device re-inserted */
   	usbi_debug(NULL, 4, "old device: %d", (int)idev->devid);
-  	pthread_mutex_lock(&usbi_handles.lock);
+  	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
    	list_for_each_entry_safe(handle, thdl, &usbi_handles.head, list) {
     	/* every openusb instance should get notification of this event */
 		if (handle) {
    	  		usbi_add_event_callback(handle, idev->devid, USB_ATTACH);
 		}
     }
-    pthread_mutex_unlock(&usbi_handles.lock);
+    usbi_mutex_unlock(&usbi_handles.lock);
   } else {
     process_new_device(NULL, dev, path);
   }
@@ -2526,6 +4401,98 @@ static void device_removed(struct udev_device* dev, const char* path)
 
 
 
+/*
+ * hotplug_receive
+ *
+ *  Take one event off the udev monitor, which has one waiting, and add or
+ *  remove its device
+ */
+static void hotplug_receive(struct udev_monitor *monitor)
+{
+  struct udev_device*  dev;
+
+  dev = udev_monitor_receive_device(monitor);
+  if (dev) {
+    const char* action  = udev_device_get_action(dev);
+    const char* syspath = udev_device_get_syspath(dev);
+    usbi_debug(NULL, 4, "device %s: %s", action, syspath);
+
+    if (   (strcasecmp("add", action)    == 0) 
+        || (strcasecmp("change", action) == 0)
+        || (strcasecmp("move", action)   == 0) )
+    {      
+      device_added(dev, syspath);            
+    } else if (strcasecmp("remove", action) == 0) {    
+      device_removed(dev, syspath);            
+    }
+  }
+}
+
+
+
+/*
+ * Without threads the udev monitor's fd is polled by the application's
+ * loop, which calls here when it is readable
+ */
+static void linux_handle_hotplug(int fd, short revents, void *arg)
+{
+  pthread_mutex_lock(&hotplug_lock);
+  if (hotplug_monitor && udev_monitor_get_fd(hotplug_monitor) == fd) {
+    hotplug_receive(hotplug_monitor);
+  }
+  pthread_mutex_unlock(&hotplug_lock);
+}
+
+
+
+static int32_t start_hotplug_monitor(void)
+{
+  int32_t ret;
+
+  hotplug_udev = udev_new();
+  if (!hotplug_udev) {
+    usbi_debug(NULL, 1, "error: udev_new");
+    return (OPENUSB_SYS_FUNC_FAILURE);
+  }
+
+  hotplug_monitor = udev_monitor_new_from_netlink(hotplug_udev, "udev");
+  if (!hotplug_monitor) {
+    usbi_debug(NULL, 1, "error: udev_monitor_new_from_netlink");
+    udev_unref(hotplug_udev);
+    hotplug_udev = NULL;
+    return (OPENUSB_SYS_FUNC_FAILURE);
+  }
+  udev_monitor_filter_add_match_subsystem_devtype(hotplug_monitor, "usb", NULL);
+  udev_monitor_enable_receiving(hotplug_monitor);
+
+  ret = usbi_add_pollfd(udev_monitor_get_fd(hotplug_monitor), POLLIN,
+                        linux_handle_hotplug, NULL);
+  if (ret != OPENUSB_SUCCESS) {
+    udev_monitor_unref(hotplug_monitor);
+    udev_unref(hotplug_udev);
+    hotplug_monitor = NULL;
+    hotplug_udev = NULL;
+  }
+
+  return (ret);
+}
+
+
+
+static void stop_hotplug_monitor(void)
+{
+  usbi_remove_pollfd(udev_monitor_get_fd(hotplug_monitor));
+
+  pthread_mutex_lock(&hotplug_lock);
+  udev_monitor_unref(hotplug_monitor);
+  udev_unref(hotplug_udev);
+  hotplug_monitor = NULL;
+  hotplug_udev = NULL;
+  pthread_mutex_unlock(&hotplug_lock);
+}
+
+
+
 /*
  * hotplug event monitoring thread
  *
@@ -2536,7 +4503,6 @@ void *udev_hotplug_event_thread(void *unused)
 {
   struct udev*         udev           = NULL;
   struct udev_monitor* udevMonitor    = NULL;
-  struct udev_device*  dev;
   int                  udevfd, maxfd;
   fd_set               fds;
   struct timeval       tv;
@@ -2578,21 +4544,7 @@ void *udev_hotplug_event_thread(void *unused)
     if ((ret > 0) && FD_ISSET(udevfd, &fds)) {
 
       /* select ensured that this call will NOT block */
-      dev = udev_monitor_receive_device(udevMonitor);
-      if (dev) {
-        const char* action  = udev_device_get_action(dev);
-        const char* syspath = udev_device_get_syspath(dev);
-        usbi_debug(NULL, 4, "device %s: %s", action, syspath);
-    
-        if (   (strcasecmp("add", action)    == 0) 
-            || (strcasecmp("change", action) == 0)
-            || (strcasecmp("move", action)   == 0) )
-        {      
-          device_added(dev, syspath);            
-        } else if (strcasecmp("remove", action) == 0) {    
-          device_removed(dev, syspath);            
-        }
-      } /* end if (dev) ... */   
+      hotplug_receive(udevMonitor);
     } /* end if ((ret > 0) ... */
     
     /* Check to see if we're closing */
@@ -2618,12 +4570,21 @@ void *udev_hotplug_event_thread(void *unused)
 /* Assigns the backend operations for linux */
 struct usbi_backend_ops backend_ops = {
 	.backend_version						= 1,
-	.io_pattern									= PATTERN_ASYNC,
+	.io_pattern									= PATTERN_BOTH,
+	.io_iovec										= 1,
+	.sync_xfer_max = {
+		[USB_TYPE_CONTROL]				= LINUX_MAX_SYNC_XFER,
+		[USB_TYPE_INTERRUPT]			= LINUX_MAX_SYNC_XFER,
+		[USB_TYPE_BULK]						= LINUX_MAX_SYNC_XFER,
+	},
+	.sync_timeout_max						= LINUX_MAX_SYNC_TIMEOUT,
 	.init												= linux_init,
 	.fini												= linux_fini,
 	.find_buses									= linux_find_buses,
 	.refresh_devices						= linux_refresh_devices,
 	.free_device								= linux_free_device,
+	.next_timeout								= linux_next_timeout,
+	.handle_timeouts						= linux_handle_timeouts,
 	.dev = {
 		.open											= linux_open,
 		.close										= linux_close,
@@ -2641,11 +4602,12 @@ struct usbi_backend_ops backend_ops = {
 		.intr_xfer_aio						= linux_submit_bulk_intr,
 		.bulk_xfer_aio						= linux_submit_bulk_intr,
 		.isoc_xfer_aio						= linux_submit_isoc,
-		.ctrl_xfer_wait						= NULL,
-		.intr_xfer_wait						= NULL,
-		.bulk_xfer_wait						= NULL,
+		.ctrl_xfer_wait						= linux_ctrl_xfer_wait,
+		.intr_xfer_wait						= linux_bulk_intr_xfer_wait,
+		.bulk_xfer_wait						= linux_bulk_intr_xfer_wait,
 		.isoc_xfer_wait						= NULL,
 		.io_cancel								= linux_io_cancel,
+		.abort_endpoint						= linux_abort_endpoint,
 		.get_raw_desc							= linux_get_raw_desc,
 	},
 };
@@ -10,6 +10,7 @@
 #ifndef __LINUX_H__
 #define __LINUX_H__
 
+#include <stddef.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -94,6 +95,20 @@ struct usbk_urb {
   struct usbk_iso_packet_desc iso_frame_desc[0];
 };
 
+/*
+ * An isochronous URB as the backend allocates it, what completing it needs
+ * comes along so it is found without searching the request's URBs
+ */
+struct linux_iso_urb {
+  uint32_t index;		/* in io->priv->iso_urbs */
+  uint32_t first_packet;	/* request packet of iso_frame_desc[0] */
+  uint8_t *bounce;		/* copy of scattered packets, NULL if in place */
+  struct usbk_urb urb;		/* last, the packet descriptors follow */
+};
+
+#define LINUX_ISO_URB(u) \
+	((struct linux_iso_urb *)((char *)(u) - offsetof(struct linux_iso_urb, urb)))
+
 struct usbk_ioctl {
   int ifno;		/* interface 0..N ; negative numbers reserved */
   int ioctl_code;	/* MUST encode size + direction of data so the
@@ -130,6 +145,10 @@ typedef enum {
 #define WAKEUP									0x00	/* wakeup the io thread */
 #define WAKEUPANDEXIT						0xFF	/* wakeup and exit the io thread */
 
+#define LINUX_SYSFS_DEVICES			"/sys/bus/usb/devices"
+#define LINUX_SYSFS_SCAN_THREADS	4			/* descriptor loading threads */
+#define LINUX_SYSFS_DESC_MAX		(USBI_DEVICE_DESC_SIZE + 65535)
+
 /*
  * IOCTL Definitions
  */
@@ -152,6 +171,10 @@ typedef enum {
 #define IOCTL_USB_CLEAR_HALT    _IOR('U', 21, unsigned int)
 #define IOCTL_USB_DISCONNECT    _IO('U', 22)
 #define IOCTL_USB_CONNECT       _IO('U', 23)
+#define IOCTL_USB_GET_CAPABILITIES _IOR('U', 26, uint32_t)
+
+/* IOCTL_USB_GET_CAPABILITIES bits */
+#define USBK_CAP_BULK_SCATTER_GATHER	0x08	/* bulk URBs may exceed 16KB */
 /*
  * IOCTL_USB_HUB_PORTINFO, IOCTL_USB_DISCONNECT and IOCTL_USB_CONNECT
  * all work via IOCTL_USB_IOCTL
@@ -160,7 +183,7 @@ typedef enum {
 
 
 /* Thread Functions */
-void *poll_io(void *usbihdl);
+void *poll_io(void *unused);
 void *poll_events(void *unused);
 void *udev_hotplug_event_thread(void *unused);
 
@@ -209,6 +232,8 @@ struct usbi_dev_private
 	int     found;                    /* flag to denote if we saw this dev during rescan */
 	int			pdevnum;									/* the device number of this devices parent */
 	char		*sysfspath;				        /* Full SYSFS path to the device */
+	uint8_t	*descriptors;							/* raw sysfs "descriptors" (device + configs) */
+	size_t	descriptors_len;					/* length of the cached descriptors */
 	struct usbi_dev_handle	*hdev;		/* Pointer to this devices handle (for closing on remove) */
 };
 
@@ -216,9 +241,15 @@ struct usbi_dev_private
 struct usbi_dev_hdl_private
 {
 	int       fd;            /* file descriptor for usbdevfs entry */
-	int       event_pipe[2]; /* let's us know when things are happening */
 	int16_t		reattachdrv;	 /* do we need to reattach the kernel driver */
-	pthread_t io_thread;     /* thread for processing io requests */
+	uint32_t	caps;          /* USBK_CAP_*, 0 on kernels that can't tell */
+
+	struct list_head        io_thread_list;/* on the io thread's handle list */
+	struct usbi_dev_handle  *hdev;         /* handle owning this data */
+	int                     poll_idx;      /* slot in the io thread's pollfds */
+	struct timeval          next_timeout;  /* soonest io timeout, 0 if none */
+	uint32_t                uring_id;      /* io_uring poll registration */
+	int                     uring_ready;   /* io_uring poll saw completions */
 };
 
 
@@ -233,9 +264,14 @@ struct usbi_io_private
 	uint32_t	urbs_to_reap;
 	uint32_t	urbs_to_cancel;
 	uint32_t	bytes_transferred;
-	int32_t		isoc_packet_offset;
+	uint32_t	isoc_interval;	/* (micro)frames between packets */
 		
 	linux_reap_action_t	reap_action;
+
+	/* set by finish_io(), io_complete() completes the request then */
+	int		done;
+	int32_t		done_status;
+	uint32_t	done_bytes;
 };
 
 
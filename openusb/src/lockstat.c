@@ -0,0 +1,366 @@
+/*
+ * Lock statistics
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ *
+ * The library's mutexes are taken through usbi_mutex_lock(), which names
+ * the class of the lock: all the locks of a kind, every device handle's
+ * say, share one set of counters. With statistics on it counts the
+ * acquisitions, those that found the lock taken and how long they waited,
+ * and how long the lock was held. A thread keeps the locks it holds in a
+ * small per-thread table, so the hold time is known when it lets go.
+ *
+ * Collecting is off unless OPENUSB_LOCKSTAT is set or an application turns
+ * it on with openusb_set_lock_stats(); it then costs a trylock and two
+ * clock reads per acquisition. OPENUSB_LOCKSTAT_SIGNAL=n dumps the
+ * statistics to stderr whenever the process gets signal n.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "usbi.h"
+
+/* locks a thread holds at once, deeper nesting goes untimed */
+#define USBI_LOCKSTAT_MAX_HELD	16
+
+struct usbi_lockstat {
+	uint64_t	acquisitions;
+	uint64_t	contended;
+	uint64_t	wait_ns;
+	uint64_t	wait_max_ns;
+	uint64_t	hold_ns;
+	uint64_t	hold_max_ns;
+} __attribute__((aligned(64)));	/* a cache line each */
+
+struct usbi_held_lock {
+	pthread_mutex_t		*mutex;
+	enum usbi_lock_class	class;
+	uint64_t		since;
+};
+
+static const char *usbi_lock_names[USBI_LOCK_CLASS_COUNT] = {
+	"usbi_lock",
+	"usbi_handles.lock",
+	"usbi_dev_handles.lock",
+	"usbi_devices.lock",
+	"usbi_buses.lock",
+	"bus->lock",
+	"event_callbacks.lock",
+	"hdl->lock",
+	"hdl->complete_lock",
+	"hdev->lock",
+	"ep->lock",
+	"io->lock",
+	"usbi_strings_lock",
+	"usbi_desc_lock",
+	"multi->lock",
+	"stream->lock",
+	"chan->lock",
+	"usbi_pollfds_lock",
+};
+
+static struct usbi_lockstat usbi_lockstats[USBI_LOCK_CLASS_COUNT];
+static volatile int usbi_lockstat_on = 0;
+
+static __thread struct usbi_held_lock usbi_held[USBI_LOCKSTAT_MAX_HELD];
+static __thread int usbi_num_held = 0;
+
+/* dump on signal: the handler only pokes a thread through a pipe */
+static int usbi_lockstat_pipe[2] = { -1, -1 };
+static pthread_t usbi_lockstat_thread;
+
+static uint64_t usbi_lockstat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void usbi_lockstat_max(uint64_t *max, uint64_t val)
+{
+	uint64_t cur = *max;
+
+	while (val > cur) {
+		uint64_t old = __sync_val_compare_and_swap(max, cur, val);
+
+		if (old == cur)
+			break;
+		cur = old;
+	}
+}
+
+/* the lock is ours from 'now' on */
+static void usbi_lockstat_hold(pthread_mutex_t *m, enum usbi_lock_class c,
+	uint64_t now)
+{
+	if (usbi_num_held < USBI_LOCKSTAT_MAX_HELD) {
+		usbi_held[usbi_num_held].mutex = m;
+		usbi_held[usbi_num_held].class = c;
+		usbi_held[usbi_num_held].since = now;
+		usbi_num_held++;
+	}
+}
+
+/* about to let go of a lock, returns its class or -1 if it wasn't timed */
+static int usbi_lockstat_release(pthread_mutex_t *m)
+{
+	struct usbi_lockstat *st;
+	uint64_t hold;
+	int i, c;
+
+	/* locks are mostly released in the reverse order they were taken */
+	for (i = usbi_num_held - 1; i >= 0; i--) {
+		if (usbi_held[i].mutex == m)
+			break;
+	}
+	if (i < 0)
+		return -1;
+
+	c = usbi_held[i].class;
+	hold = usbi_lockstat_now() - usbi_held[i].since;
+	usbi_held[i] = usbi_held[--usbi_num_held];
+
+	if (usbi_lockstat_on) {
+		st = &usbi_lockstats[c];
+		__sync_fetch_and_add(&st->hold_ns, hold);
+		usbi_lockstat_max(&st->hold_max_ns, hold);
+	}
+
+	return c;
+}
+
+int usbi_mutex_lock(pthread_mutex_t *m, enum usbi_lock_class c)
+{
+	struct usbi_lockstat *st;
+	uint64_t start, now;
+	int ret;
+
+	if (!usbi_lockstat_on)
+		return pthread_mutex_lock(m);
+
+	st = &usbi_lockstats[c];
+
+	ret = pthread_mutex_trylock(m);
+	if (ret == EBUSY) {
+		start = usbi_lockstat_now();
+		ret = pthread_mutex_lock(m);
+		if (ret != 0)
+			return ret;
+		now = usbi_lockstat_now();
+
+		__sync_fetch_and_add(&st->contended, 1);
+		__sync_fetch_and_add(&st->wait_ns, now - start);
+		usbi_lockstat_max(&st->wait_max_ns, now - start);
+	} else if (ret == 0) {
+		now = usbi_lockstat_now();
+	} else {
+		return ret;
+	}
+
+	__sync_fetch_and_add(&st->acquisitions, 1);
+	usbi_lockstat_hold(m, c, now);
+
+	return 0;
+}
+
+int usbi_mutex_unlock(pthread_mutex_t *m)
+{
+	/* collecting may have been turned off while the lock was held */
+	if (usbi_num_held)
+		usbi_lockstat_release(m);
+
+	return pthread_mutex_unlock(m);
+}
+
+/* waiting on a condition doesn't count as holding the lock */
+int usbi_cond_wait(pthread_cond_t *cv, pthread_mutex_t *m)
+{
+	int c = usbi_num_held ? usbi_lockstat_release(m) : -1;
+	int ret;
+
+	ret = pthread_cond_wait(cv, m);
+	if (c >= 0)
+		usbi_lockstat_hold(m, c, usbi_lockstat_now());
+
+	return ret;
+}
+
+int usbi_cond_timedwait(pthread_cond_t *cv, pthread_mutex_t *m,
+	const struct timespec *ts)
+{
+	int c = usbi_num_held ? usbi_lockstat_release(m) : -1;
+	int ret;
+
+	ret = pthread_cond_timedwait(cv, m, ts);
+	if (c >= 0)
+		usbi_lockstat_hold(m, c, usbi_lockstat_now());
+
+	return ret;
+}
+
+static void usbi_lockstat_signal(int sig)
+{
+	char c = 0;
+	int saved = errno;
+
+	if (write(usbi_lockstat_pipe[1], &c, 1) < 0) {
+		/* a dump is pending already */
+	}
+	errno = saved;
+}
+
+static void *usbi_lockstat_dumper(void *unused)
+{
+	ssize_t n;
+	char c;
+
+	for (;;) {
+		n = read(usbi_lockstat_pipe[0], &c, 1);
+		if (n > 0)
+			openusb_dump_lock_stats(STDERR_FILENO);
+		else if (n == 0 || errno != EINTR)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Pick up OPENUSB_LOCKSTAT and OPENUSB_LOCKSTAT_SIGNAL, called once per
+ * process from usbi_init_common()
+ */
+void usbi_lockstat_init(void)
+{
+	struct sigaction sa;
+	const char *env;
+	int sig;
+
+	env = getenv("OPENUSB_LOCKSTAT");
+	if (env && atoi(env))
+		usbi_lockstat_on = 1;
+
+	env = getenv("OPENUSB_LOCKSTAT_SIGNAL");
+	if (!env || usbi_lockstat_pipe[0] >= 0)
+		return;
+
+	sig = atoi(env);
+	if (sig <= 0 || sig >= NSIG) {
+		usbi_debug(NULL, 1, "bad OPENUSB_LOCKSTAT_SIGNAL %s", env);
+		return;
+	}
+
+	if (pipe(usbi_lockstat_pipe) < 0) {
+		usbi_debug(NULL, 1, "unable to create lock stats pipe "
+			"(errno = %d)", errno);
+		return;
+	}
+	/* the handler must never block, one pending byte is enough */
+	fcntl(usbi_lockstat_pipe[1], F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&usbi_lockstat_thread, NULL, usbi_lockstat_dumper,
+	    NULL) != 0) {
+		usbi_debug(NULL, 1, "unable to create lock stats thread");
+		close(usbi_lockstat_pipe[0]);
+		close(usbi_lockstat_pipe[1]);
+		usbi_lockstat_pipe[0] = usbi_lockstat_pipe[1] = -1;
+		return;
+	}
+	pthread_detach(usbi_lockstat_thread);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = usbi_lockstat_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(sig, &sa, NULL);
+
+	usbi_lockstat_on = 1;
+}
+
+void openusb_set_lock_stats(uint32_t enable)
+{
+	usbi_lockstat_on = enable != 0;
+}
+
+int32_t openusb_get_lock_stats(openusb_lock_stat_t **stats, uint32_t *num)
+{
+	openusb_lock_stat_t *s;
+	int i;
+
+	if (!stats || !num)
+		return OPENUSB_BADARG;
+
+	s = calloc(USBI_LOCK_CLASS_COUNT, sizeof(*s));
+	if (!s)
+		return OPENUSB_NO_RESOURCES;
+
+	for (i = 0; i < USBI_LOCK_CLASS_COUNT; i++) {
+		s[i].name = usbi_lock_names[i];
+		s[i].acquisitions = usbi_lockstats[i].acquisitions;
+		s[i].contended = usbi_lockstats[i].contended;
+		s[i].wait_ns = usbi_lockstats[i].wait_ns;
+		s[i].wait_max_ns = usbi_lockstats[i].wait_max_ns;
+		s[i].hold_ns = usbi_lockstats[i].hold_ns;
+		s[i].hold_max_ns = usbi_lockstats[i].hold_max_ns;
+	}
+
+	*stats = s;
+	*num = USBI_LOCK_CLASS_COUNT;
+
+	return OPENUSB_SUCCESS;
+}
+
+void openusb_free_lock_stats(openusb_lock_stat_t *stats)
+{
+	free(stats);
+}
+
+void openusb_reset_lock_stats(void)
+{
+	memset(usbi_lockstats, 0, sizeof(usbi_lockstats));
+}
+
+int32_t openusb_dump_lock_stats(int fd)
+{
+	openusb_lock_stat_t *s;
+	uint32_t i, num;
+	char line[256];
+	int32_t ret;
+	int len;
+
+	ret = openusb_get_lock_stats(&s, &num);
+	if (ret < 0)
+		return ret;
+
+	len = snprintf(line, sizeof(line), "%-24s %12s %12s %12s %12s "
+		"%12s %12s\n", "lock", "acquired", "contended", "wait_us",
+		"wait_max_us", "hold_us", "hold_max_us");
+	ret = write(fd, line, len) == len ? OPENUSB_SUCCESS :
+		OPENUSB_SYS_FUNC_FAILURE;
+
+	for (i = 0; i < num && ret == OPENUSB_SUCCESS; i++) {
+		len = snprintf(line, sizeof(line), "%-24s %12llu %12llu %12llu "
+			"%12llu %12llu %12llu\n", s[i].name,
+			(unsigned long long)s[i].acquisitions,
+			(unsigned long long)s[i].contended,
+			(unsigned long long)s[i].wait_ns / 1000,
+			(unsigned long long)s[i].wait_max_ns / 1000,
+			(unsigned long long)s[i].hold_ns / 1000,
+			(unsigned long long)s[i].hold_max_ns / 1000);
+		if (write(fd, line, len) != len)
+			ret = OPENUSB_SYS_FUNC_FAILURE;
+	}
+
+	openusb_free_lock_stats(s);
+
+	return ret;
+}
@@ -0,0 +1,548 @@
+/*
+ * C++ binding
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ *
+ * Header only, C++20. Wraps the library, device and interface handles in
+ * move-only owners that give them back when they go, and requests in a
+ * type that can be co_await'ed:
+ *
+ *	openusb::library lib;
+ *	openusb::device dev(lib, devid);
+ *	openusb::interface ifc(dev, 0);
+ *	openusb::request rd = openusb::request::bulk(ifc, 0x81, buf);
+ *
+ *	openusb_request_result_t r = co_await rd.submit();
+ *
+ * Requests are sent with openusb_xfer_aio(), their callback resumes the
+ * coroutine waiting for them right away; nothing is allocated per transfer.
+ * openusb::submit_all() sends a batch of requests and resumes once every
+ * one of them is done.
+ *
+ * A coroutine resumed by a completion runs in the thread that reaped it:
+ * the library's own or, with OPENUSB_INIT_NO_THREADS, the one handling
+ * events. Until its next co_await it may send requests but must not make
+ * synchronous ones or wait for anything.
+ */
+
+#ifndef __OPENUSB_HPP__
+#define __OPENUSB_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "openusb.h"
+
+namespace openusb {
+
+/* thrown when acquiring a handle fails, code is the OPENUSB_* error */
+class error : public std::runtime_error {
+public:
+	explicit error(int32_t code)
+		: std::runtime_error(openusb_strerror(code)), code_(code) {}
+
+	int32_t code() const noexcept { return code_; }
+
+private:
+	int32_t code_;
+};
+
+namespace detail {
+
+inline void check(int32_t ret)
+{
+	if (ret < 0)
+		throw error(ret);
+}
+
+/* what the completions of one or more requests resume */
+struct waiter {
+	std::atomic<uint32_t>	pending;
+	std::coroutine_handle<>	coro;
+
+	void done() noexcept
+	{
+		if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			coro.resume();
+	}
+};
+
+} /* namespace detail */
+
+class library {
+public:
+	explicit library(uint32_t flags = 0)
+	{
+		detail::check(openusb_init(flags, &handle_));
+	}
+
+	library(library &&o) noexcept : handle_(std::exchange(o.handle_, 0)) {}
+
+	library &operator=(library &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			handle_ = std::exchange(o.handle_, 0);
+		}
+		return *this;
+	}
+
+	~library() { reset(); }
+
+	openusb_handle_t get() const noexcept { return handle_; }
+
+	/* with OPENUSB_INIT_NO_THREADS, see openusb_handle_events_timeout() */
+	int32_t handle_events(struct timeval *tv = nullptr) const noexcept
+	{
+		return openusb_handle_events_timeout(handle_, tv);
+	}
+
+private:
+	void reset() noexcept
+	{
+		if (handle_)
+			openusb_fini(std::exchange(handle_, 0));
+	}
+
+	openusb_handle_t handle_ = 0;
+};
+
+class device {
+public:
+	device(const library &lib, openusb_devid_t devid,
+		openusb_init_flag_t flags = USB_INIT_DEFAULT)
+	{
+		detail::check(openusb_open_device(lib.get(), devid, flags,
+			&handle_));
+	}
+
+	device(device &&o) noexcept : handle_(std::exchange(o.handle_, 0)) {}
+
+	device &operator=(device &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			handle_ = std::exchange(o.handle_, 0);
+		}
+		return *this;
+	}
+
+	~device() { reset(); }
+
+	openusb_dev_handle_t get() const noexcept { return handle_; }
+
+private:
+	void reset() noexcept
+	{
+		if (handle_)
+			openusb_close_device(std::exchange(handle_, 0));
+	}
+
+	openusb_dev_handle_t handle_ = 0;
+};
+
+class interface {
+public:
+	interface(const device &dev, uint8_t ifc,
+		openusb_init_flag_t flags = USB_INIT_DEFAULT)
+		: dev_(dev.get()), ifc_(ifc)
+	{
+		detail::check(openusb_claim_interface(dev_, ifc_, flags));
+	}
+
+	interface(interface &&o) noexcept
+		: dev_(std::exchange(o.dev_, 0)), ifc_(o.ifc_) {}
+
+	interface &operator=(interface &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			dev_ = std::exchange(o.dev_, 0);
+			ifc_ = o.ifc_;
+		}
+		return *this;
+	}
+
+	~interface() { reset(); }
+
+	openusb_dev_handle_t dev() const noexcept { return dev_; }
+	uint8_t number() const noexcept { return ifc_; }
+
+private:
+	void reset() noexcept
+	{
+		if (dev_)
+			openusb_release_interface(std::exchange(dev_, 0), ifc_);
+	}
+
+	openusb_dev_handle_t	dev_ = 0;
+	uint8_t			ifc_ = 0;
+};
+
+class request;
+
+/* co_await request::submit(), the request's result once it's done */
+class transfer {
+public:
+	explicit transfer(request &req) noexcept : req_(req) {}
+
+	bool await_ready() const noexcept { return false; }
+	inline bool await_suspend(std::coroutine_handle<> coro) noexcept;
+	inline openusb_request_result_t await_resume() const noexcept;
+
+private:
+	request		&req_;
+	detail::waiter	waiter_;
+};
+
+/* co_await submit_all(), the number of requests that didn't succeed */
+class transfer_all {
+public:
+	explicit transfer_all(std::span<request> reqs) noexcept : reqs_(reqs) {}
+
+	bool await_ready() const noexcept { return reqs_.empty(); }
+	inline bool await_suspend(std::coroutine_handle<> coro) noexcept;
+	inline size_t await_resume() const noexcept;
+
+private:
+	std::span<request>	reqs_;
+	detail::waiter		waiter_;
+};
+
+/*
+ * A request handle and the request it points to, kept where the library
+ * finds them while the request is in flight, moving the request doesn't
+ * move them. Destroying one in flight aborts it and waits for it to
+ * complete, without resuming whatever waits for it.
+ */
+class request {
+public:
+	request() = default;
+
+	static request control(const device &dev, uint8_t bmRequestType,
+		uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		std::span<uint8_t> data = {}, uint32_t timeout = 0)
+	{
+		request r(dev.get(), 0, 0, USB_TYPE_CONTROL);
+		openusb_ctrl_request_t &ctrl = r.s_->ctrl;
+
+		ctrl.setup.bmRequestType = bmRequestType;
+		ctrl.setup.bRequest = bRequest;
+		ctrl.setup.wValue = wValue;
+		ctrl.setup.wIndex = wIndex;
+		ctrl.timeout = timeout;
+		r.s_->handle.req.ctrl = &ctrl;
+		r.set_data(data);
+		return r;
+	}
+
+	static request bulk(const interface &ifc, uint8_t ept,
+		std::span<uint8_t> data, uint32_t timeout = 0)
+	{
+		request r(ifc.dev(), ifc.number(), ept, USB_TYPE_BULK);
+
+		r.s_->bulk.timeout = timeout;
+		r.s_->handle.req.bulk = &r.s_->bulk;
+		r.set_data(data);
+		return r;
+	}
+
+	static request interrupt(const interface &ifc, uint8_t ept,
+		std::span<uint8_t> data, uint32_t timeout = 0)
+	{
+		request r(ifc.dev(), ifc.number(), ept, USB_TYPE_INTERRUPT);
+
+		r.s_->intr.timeout = timeout;
+		r.s_->handle.req.intr = &r.s_->intr;
+		r.set_data(data);
+		return r;
+	}
+
+	/* the packets stay the caller's, see openusb_alloc_isoc_request() */
+	static request isochronous(const interface &ifc, uint8_t ept,
+		openusb_isoc_request_t *isoc)
+	{
+		request r(ifc.dev(), ifc.number(), ept,
+			USB_TYPE_ISOCHRONOUS);
+
+		r.s_->handle.req.isoc = isoc;
+		return r;
+	}
+
+	request(request &&o) noexcept = default;
+
+	request &operator=(request &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			s_ = std::move(o.s_);
+		}
+		return *this;
+	}
+
+	~request() { reset(); }
+
+	explicit operator bool() const noexcept { return s_ != nullptr; }
+
+	/* the C structures, for what the constructors don't set, not empty */
+	openusb_request_handle &handle() noexcept { return s_->handle; }
+
+	/* point a control, bulk or interrupt request at another buffer */
+	void set_data(std::span<uint8_t> data) noexcept
+	{
+		if (!s_)
+			return;
+
+		openusb_request_handle &h = s_->handle;
+
+		switch (h.type) {
+		case USB_TYPE_CONTROL:
+			h.req.ctrl->payload = data.data();
+			h.req.ctrl->length = data.size();
+			break;
+		case USB_TYPE_BULK:
+			h.req.bulk->payload = data.data();
+			h.req.bulk->length = data.size();
+			h.req.bulk->iovcnt = 0;
+			break;
+		case USB_TYPE_INTERRUPT:
+			h.req.intr->payload = data.data();
+			h.req.intr->length = data.size();
+			h.req.intr->iovcnt = 0;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* for isochronous requests, isoc_status and no byte count */
+	openusb_request_result_t result() const noexcept
+	{
+		openusb_request_result_t r = { OPENUSB_BADARG, 0 };
+
+		if (!s_)
+			return r;
+
+		const openusb_request_handle &h = s_->handle;
+
+		r.status = 0;
+		switch (h.type) {
+		case USB_TYPE_CONTROL:
+			return h.req.ctrl->result;
+		case USB_TYPE_BULK:
+			return h.req.bulk->result;
+		case USB_TYPE_INTERRUPT:
+			return h.req.intr->result;
+		case USB_TYPE_ISOCHRONOUS:
+			r.status = h.req.isoc->isoc_status;
+			break;
+		default:
+			break;
+		}
+		return r;
+	}
+
+	bool busy() const noexcept
+	{
+		return s_ && s_->busy.load(std::memory_order_acquire);
+	}
+
+	int32_t abort() noexcept
+	{
+		return s_ ? openusb_abort(&s_->handle) : OPENUSB_INVALID_HANDLE;
+	}
+
+	/* send the request, co_await the result */
+	transfer submit() & noexcept { return transfer(*this); }
+
+private:
+	friend class transfer;
+	friend class transfer_all;
+
+	struct state {
+		openusb_request_handle		handle;
+		union {
+			openusb_ctrl_request_t	ctrl;
+			openusb_intr_request_t	intr;
+			openusb_bulk_request_t	bulk;
+		};
+		std::atomic<detail::waiter *>	waiter;
+		std::atomic<bool>		busy;
+
+		state() : waiter(nullptr), busy(false)
+		{
+			std::memset(&handle, 0, sizeof(handle));
+			std::memset(&bulk, 0, std::max(sizeof(ctrl),
+				std::max(sizeof(intr), sizeof(bulk))));
+		}
+	};
+
+	request(openusb_dev_handle_t dev, uint8_t ifc, uint8_t ept,
+		openusb_transfer_type_t type)
+		: s_(std::make_unique<state>())
+	{
+		s_->handle.dev = dev;
+		s_->handle.interface = ifc;
+		s_->handle.endpoint = ept;
+		s_->handle.type = type;
+		s_->handle.cb = &request::complete;
+		s_->handle.arg = s_.get();
+	}
+
+	/* openusb_xfer_aio(), w is done() once it completes if this succeeds */
+	int32_t start(detail::waiter *w) noexcept
+	{
+		state *s = s_.get();
+		int32_t ret;
+
+		/* default constructed or moved from, result() says so */
+		if (!s)
+			return OPENUSB_BADARG;
+
+		s->waiter.store(w, std::memory_order_relaxed);
+		s->busy.store(true, std::memory_order_release);
+
+		/* once sent, it may complete and its owner be gone any time */
+		ret = openusb_xfer_aio(&s->handle);
+		if (ret < 0) {
+			s->waiter.store(nullptr, std::memory_order_relaxed);
+			s->busy.store(false, std::memory_order_release);
+			fail(ret);
+		}
+
+		return ret;
+	}
+
+	void fail(int32_t ret) noexcept
+	{
+		openusb_request_handle &h = s_->handle;
+
+		switch (h.type) {
+		case USB_TYPE_CONTROL:
+			h.req.ctrl->result.status = ret;
+			h.req.ctrl->result.transferred_bytes = 0;
+			break;
+		case USB_TYPE_BULK:
+			h.req.bulk->result.status = ret;
+			h.req.bulk->result.transferred_bytes = 0;
+			break;
+		case USB_TYPE_INTERRUPT:
+			h.req.intr->result.status = ret;
+			h.req.intr->result.transferred_bytes = 0;
+			break;
+		case USB_TYPE_ISOCHRONOUS:
+			h.req.isoc->isoc_status = ret;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* the library is done with the request once this is called */
+	static int32_t complete(openusb_request_handle_t h)
+	{
+		state *s = static_cast<state *>(h->arg);
+		detail::waiter *w;
+
+		w = s->waiter.exchange(nullptr, std::memory_order_acq_rel);
+
+		/* the request may be destroyed from here on */
+		s->busy.store(false, std::memory_order_release);
+
+		if (w)
+			w->done();
+
+		return 0;
+	}
+
+	void reset() noexcept
+	{
+		openusb_handle_t lib = 0;
+		struct timeval tv;
+
+		if (!s_)
+			return;
+
+		if (busy()) {
+			/* nobody is to be resumed by it any more */
+			s_->waiter.store(nullptr, std::memory_order_release);
+			openusb_abort(&s_->handle);
+			openusb_get_lib_handle(s_->handle.dev, &lib);
+
+			/* without threads, nobody else reaps it */
+			while (busy()) {
+				tv.tv_sec = 0;
+				tv.tv_usec = 1000;
+				if (openusb_handle_events_timeout(lib, &tv) < 0) {
+					std::this_thread::sleep_for(
+						std::chrono::milliseconds(1));
+				}
+			}
+		}
+
+		s_.reset();
+	}
+
+	std::unique_ptr<state>	s_;
+};
+
+bool transfer::await_suspend(std::coroutine_handle<> coro) noexcept
+{
+	waiter_.coro = coro;
+	waiter_.pending.store(2, std::memory_order_relaxed);
+
+	if (req_.start(&waiter_) < 0)
+		return false;
+
+	/* the completion resumes us unless it came first */
+	return waiter_.pending.fetch_sub(1, std::memory_order_acq_rel) != 1;
+}
+
+openusb_request_result_t transfer::await_resume() const noexcept
+{
+	return req_.result();
+}
+
+bool transfer_all::await_suspend(std::coroutine_handle<> coro) noexcept
+{
+	waiter_.coro = coro;
+	waiter_.pending.store(reqs_.size() + 1, std::memory_order_relaxed);
+
+	/* the extra count keeps early completions from resuming us */
+	for (request &req : reqs_) {
+		if (req.start(&waiter_) < 0)
+			waiter_.pending.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	return waiter_.pending.fetch_sub(1, std::memory_order_acq_rel) != 1;
+}
+
+size_t transfer_all::await_resume() const noexcept
+{
+	size_t failed = 0;
+
+	for (const request &req : reqs_) {
+		if (req.result().status != OPENUSB_SUCCESS)
+			failed++;
+	}
+
+	return failed;
+}
+
+/* send every request, co_await them all done */
+inline transfer_all submit_all(std::span<request> reqs) noexcept
+{
+	return transfer_all(reqs);
+}
+
+} /* namespace openusb */
+
+#endif /* __OPENUSB_HPP__ */
@@ -0,0 +1,513 @@
+/*
+ * Traffic recording
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ *
+ * With OPENUSB_RECORD naming a file, every request handed to a backend,
+ * its timing and the data it read are logged there in the format described
+ * in record.h, for the replay backend to play back later. Recording sits
+ * between the frontend and the backend's device operations: devices get a
+ * copy of their backend's operations with the I/O functions wrapped.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbi.h"
+#include "record.h"
+
+/* most backends a process loads */
+#define USBI_RECORD_MAX_BACKENDS	8
+
+struct usbi_record_table {
+	struct usbi_device_ops	*orig;
+	struct usbi_device_ops	ops;
+};
+
+/* the file, the sequence numbers and the wrapped operations */
+static pthread_mutex_t usbi_record_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *usbi_record_fp = NULL;
+static uint64_t usbi_record_start = 0;
+static uint32_t usbi_record_devices = 0;
+static uint32_t usbi_record_id = 0;
+
+static struct usbi_record_table usbi_record_tables[USBI_RECORD_MAX_BACKENDS];
+static int usbi_record_num_tables = 0;
+
+static uint64_t usbi_record_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+
+	return (p + 2);
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+	p = put16(p, v & 0xffff);
+
+	return (put16(p, v >> 16));
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+	p = put32(p, v & 0xffffffff);
+
+	return (put32(p, v >> 32));
+}
+
+/* write a record header, called with usbi_record_lock held */
+static void usbi_record_header(uint8_t type, uint8_t flags, uint32_t dev,
+	uint32_t len)
+{
+	uint8_t hdr[USBI_REC_HEADER_SIZE], *p = hdr;
+
+	*p++ = type;
+	*p++ = flags;
+	p = put16(p, dev);
+	p = put32(p, len);
+	put64(p, usbi_record_now() - usbi_record_start);
+
+	fwrite(hdr, sizeof(hdr), 1, usbi_record_fp);
+}
+
+/*
+ * Log a device the first time it is opened, with its descriptors so the
+ * replay backend can present it again
+ */
+static void usbi_record_device(struct usbi_device *idev)
+{
+	struct usbi_device_ops *ops = &idev->bus->ops->dev;
+	uint8_t *desc[1 + USBI_MAXCONFIG], hdr[16], *p;
+	uint16_t desclen[1 + USBI_MAXCONFIG];
+	uint32_t len;
+	int i, num = 0;
+
+	memset(desc, 0, sizeof(desc));
+	memset(desclen, 0, sizeof(desclen));
+
+	/* not every backend can read descriptors without a control request */
+	if (ops->get_raw_desc && ops->get_raw_desc(idev, USB_DESC_TYPE_DEVICE,
+	    0, 0, &desc[0], &desclen[0]) == 0 &&
+	    desclen[0] >= USBI_DEVICE_DESC_SIZE) {
+		num = desc[0][17];	/* bNumConfigurations */
+		if (num > USBI_MAXCONFIG)
+			num = USBI_MAXCONFIG;
+
+		for (i = 0; i < num; i++) {
+			if (ops->get_raw_desc(idev, USB_DESC_TYPE_CONFIG, i, 0,
+			    &desc[1 + i], &desclen[1 + i]) != 0)
+				break;
+		}
+		num = i;
+	}
+
+	len = 12 + 2;
+	for (i = 0; i <= num; i++)
+		len += desclen[i];
+	len += 2 * num;
+
+	pthread_mutex_lock(&usbi_record_lock);
+	if (usbi_record_fp && !idev->rec_index) {
+		idev->rec_index = ++usbi_record_devices;
+
+		p = put32(hdr, idev->bus->busnum);
+		p = put32(p, idev->devnum);
+		*p++ = idev->bus_addr;
+		*p++ = num;
+		put16(p, 0);
+
+		usbi_record_header(USBI_REC_DEVICE, 0, idev->rec_index, len);
+		fwrite(hdr, 12, 1, usbi_record_fp);
+		for (i = 0; i <= num; i++) {
+			put16(hdr, desclen[i]);
+			fwrite(hdr, 2, 1, usbi_record_fp);
+			if (desclen[i])
+				fwrite(desc[i], desclen[i], 1, usbi_record_fp);
+		}
+		fflush(usbi_record_fp);
+	}
+	pthread_mutex_unlock(&usbi_record_lock);
+
+	for (i = 0; i <= num; i++)
+		free(desc[i]);
+}
+
+/* log a request about to be handed to the backend and number it */
+static void usbi_record_submit(struct usbi_io *io, int sync)
+{
+	openusb_request_handle_t req = io->req;
+	openusb_ctrl_request_t *ctrl;
+	openusb_isoc_pkts_t *pkts = NULL;
+	uint8_t buf[USBI_REC_SUBMIT_SIZE], *p;
+	uint32_t i, length = 0, timeout = 0, num = 0;
+
+	memset(buf, 0, sizeof(buf));
+
+	switch (req->type) {
+		case USB_TYPE_CONTROL:
+			ctrl = req->req.ctrl;
+			length = ctrl->length;
+			timeout = ctrl->timeout;
+			p = buf + 16;
+			*p++ = ctrl->setup.bmRequestType;
+			*p++ = ctrl->setup.bRequest;
+			p = put16(p, ctrl->setup.wValue);
+			p = put16(p, ctrl->setup.wIndex);
+			put16(p, ctrl->length);
+			break;
+		case USB_TYPE_INTERRUPT:
+			length = req->req.intr->length;
+			timeout = req->req.intr->timeout;
+			break;
+		case USB_TYPE_BULK:
+			length = req->req.bulk->length;
+			timeout = req->req.bulk->timeout;
+			break;
+		case USB_TYPE_ISOCHRONOUS:
+			pkts = &req->req.isoc->pkts;
+			num = pkts->num_packets;
+			for (i = 0; i < num; i++)
+				length += pkts->packets[i].length;
+			break;
+		default:
+			return;
+	}
+
+	pthread_mutex_lock(&usbi_record_lock);
+	if (!usbi_record_fp) {
+		pthread_mutex_unlock(&usbi_record_lock);
+		return;
+	}
+
+	io->rec_id = ++usbi_record_id;
+
+	p = put32(buf, io->rec_id);
+	*p++ = req->type;
+	*p++ = req->endpoint;
+	*p++ = req->interface;
+	p++;
+	p = put32(p, timeout);
+	put32(p, length);
+
+	usbi_record_header(USBI_REC_SUBMIT, sync ? USBI_REC_FLAG_SYNC : 0,
+		io->dev->idev->rec_index, sizeof(buf) + (pkts ? 4 + 4 * num : 0));
+	fwrite(buf, sizeof(buf), 1, usbi_record_fp);
+	if (pkts) {
+		put32(buf, num);
+		fwrite(buf, 4, 1, usbi_record_fp);
+		for (i = 0; i < num; i++) {
+			put32(buf, pkts->packets[i].length);
+			fwrite(buf, 4, 1, usbi_record_fp);
+		}
+	}
+	pthread_mutex_unlock(&usbi_record_lock);
+}
+
+/* bytes moved by an isochronous packet, as far as its buffer goes */
+static uint32_t usbi_record_pkt_len(openusb_isoc_request_t *isoc, uint32_t i)
+{
+	uint32_t len = isoc->isoc_results[i].transferred_bytes;
+
+	return (len < isoc->pkts.packets[i].length ?
+		len : isoc->pkts.packets[i].length);
+}
+
+static void usbi_record_result(struct usbi_io *io, int32_t status,
+	uint32_t transferred, uint8_t flags)
+{
+	openusb_request_handle_t req = io->req;
+	openusb_isoc_request_t *isoc = NULL;
+	openusb_request_result_t *res;
+	uint8_t buf[USBI_REC_COMPLETE_SIZE], *p, *data = NULL;
+	uint32_t i, len, datalen = 0, num = 0, iovcnt = 0;
+	struct iovec *iov = NULL;
+	int in;
+
+	switch (req->type) {
+		case USB_TYPE_CONTROL:
+			in = req->req.ctrl->setup.bmRequestType & USB_REQ_DEV_TO_HOST;
+			data = req->req.ctrl->payload;
+			datalen = req->req.ctrl->length;
+			break;
+		case USB_TYPE_INTERRUPT:
+			in = req->endpoint & USB_ENDPOINT_IN;
+			data = usbi_io_payload(io);
+			datalen = req->req.intr->length;
+			break;
+		case USB_TYPE_BULK:
+			in = req->endpoint & USB_ENDPOINT_IN;
+			data = usbi_io_payload(io);
+			datalen = req->req.bulk->length;
+			break;
+		default:
+			in = req->endpoint & USB_ENDPOINT_IN;
+			isoc = req->req.isoc;
+			num = isoc->pkts.num_packets;
+			break;
+	}
+
+	/* the data of a scatter-gather request is still in its iovecs */
+	if (!io->bounce)
+		iov = usbi_req_iov(req, &iovcnt);
+
+	/* only what IN requests read is kept */
+	if (!in || (flags & USBI_REC_FLAG_FAILED))
+		datalen = 0;
+	else if (datalen > transferred)
+		datalen = transferred;
+
+	len = sizeof(buf) + datalen;
+	if (isoc) {
+		len += 4 + 8 * num;
+		for (i = 0; in && isoc->isoc_results && i < num; i++)
+			len += usbi_record_pkt_len(isoc, i);
+	}
+
+	pthread_mutex_lock(&usbi_record_lock);
+	if (!usbi_record_fp) {
+		pthread_mutex_unlock(&usbi_record_lock);
+		return;
+	}
+
+	p = put32(buf, io->rec_id);
+	p = put32(p, status);
+	put32(p, transferred);
+
+	usbi_record_header(USBI_REC_COMPLETE, flags, io->dev->idev->rec_index,
+		len);
+	fwrite(buf, sizeof(buf), 1, usbi_record_fp);
+	if (datalen && iov) {
+		for (i = 0; i < iovcnt && datalen; i++) {
+			len = iov[i].iov_len < datalen ? iov[i].iov_len : datalen;
+			fwrite(iov[i].iov_base, len, 1, usbi_record_fp);
+			datalen -= len;
+		}
+	} else if (datalen) {
+		fwrite(data, datalen, 1, usbi_record_fp);
+	}
+
+	if (isoc) {
+		put32(buf, num);
+		fwrite(buf, 4, 1, usbi_record_fp);
+		for (i = 0; i < num; i++) {
+			res = isoc->isoc_results ? &isoc->isoc_results[i] : NULL;
+			put32(buf, res ? res->status : status);
+			put32(buf + 4, res ? usbi_record_pkt_len(isoc, i) : 0);
+			fwrite(buf, 8, 1, usbi_record_fp);
+		}
+		for (i = 0; in && isoc->isoc_results && i < num; i++) {
+			len = usbi_record_pkt_len(isoc, i);
+			if (len)
+				fwrite(isoc->pkts.packets[i].payload, len, 1,
+					usbi_record_fp);
+		}
+	}
+	pthread_mutex_unlock(&usbi_record_lock);
+
+	io->rec_id = 0;
+}
+
+/* the backend's operation for this request */
+static int32_t (*usbi_record_op(struct usbi_device_ops *ops,
+	openusb_transfer_type_t type, int sync))(struct usbi_dev_handle *,
+	struct usbi_io *)
+{
+	switch (type) {
+		case USB_TYPE_CONTROL:
+			return (sync ? ops->ctrl_xfer_wait : ops->ctrl_xfer_aio);
+		case USB_TYPE_INTERRUPT:
+			return (sync ? ops->intr_xfer_wait : ops->intr_xfer_aio);
+		case USB_TYPE_BULK:
+			return (sync ? ops->bulk_xfer_wait : ops->bulk_xfer_aio);
+		case USB_TYPE_ISOCHRONOUS:
+			return (sync ? ops->isoc_xfer_wait : ops->isoc_xfer_aio);
+		default:
+			return (NULL);
+	}
+}
+
+static int32_t usbi_record_xfer(struct usbi_dev_handle *hdev,
+	struct usbi_io *io, int sync)
+{
+	int32_t (*op)(struct usbi_dev_handle *, struct usbi_io *);
+	openusb_request_result_t *res;
+	int32_t ret;
+
+	op = usbi_record_op(&hdev->idev->bus->ops->dev, io->req->type, sync);
+	if (!op)
+		return OPENUSB_NOT_SUPPORTED;
+
+	usbi_record_submit(io, sync);
+
+	ret = op(hdev, io);
+
+	/* a submitted async request may be complete, and gone, by now */
+	if (ret < 0) {
+		if (io->rec_id)
+			usbi_record_result(io, ret, 0, USBI_REC_FLAG_FAILED);
+	} else if (sync && io->rec_id) {
+		/* the backend filled in the results itself */
+		if (io->req->type == USB_TYPE_ISOCHRONOUS) {
+			usbi_record_result(io, io->req->req.isoc->isoc_status, 0, 0);
+		} else {
+			res = &io->req->req.bulk->result;
+			if (io->req->type == USB_TYPE_CONTROL)
+				res = &io->req->req.ctrl->result;
+			else if (io->req->type == USB_TYPE_INTERRUPT)
+				res = &io->req->req.intr->result;
+			usbi_record_result(io, res->status, res->transferred_bytes, 0);
+		}
+	}
+
+	return ret;
+}
+
+static int32_t usbi_record_aio(struct usbi_dev_handle *hdev,
+	struct usbi_io *io)
+{
+	return usbi_record_xfer(hdev, io, 0);
+}
+
+static int32_t usbi_record_wait(struct usbi_dev_handle *hdev,
+	struct usbi_io *io)
+{
+	return usbi_record_xfer(hdev, io, 1);
+}
+
+static int32_t usbi_record_open(struct usbi_dev_handle *hdev)
+{
+	int32_t ret;
+
+	ret = hdev->idev->bus->ops->dev.open(hdev);
+	if (ret == 0 && !hdev->idev->rec_index)
+		usbi_record_device(hdev->idev);
+
+	return ret;
+}
+
+/*
+ * Open the recording named by OPENUSB_RECORD, once per process. Devices
+ * added from now on are recorded.
+ */
+int32_t usbi_record_init(void)
+{
+	uint8_t hdr[USBI_REC_FILE_HEADER_SIZE];
+	const char *path;
+	struct timespec ts;
+
+	path = getenv("OPENUSB_RECORD");
+	if (!path || !*path)
+		return OPENUSB_SUCCESS;
+
+	pthread_mutex_lock(&usbi_record_lock);
+	if (usbi_record_fp) {
+		pthread_mutex_unlock(&usbi_record_lock);
+		return OPENUSB_SUCCESS;
+	}
+
+	usbi_record_fp = fopen(path, "wb");
+	if (!usbi_record_fp) {
+		pthread_mutex_unlock(&usbi_record_lock);
+		usbi_debug(NULL, 1, "unable to create recording %s (errno = %d)",
+			path, errno);
+		return OPENUSB_SYS_FUNC_FAILURE;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	usbi_record_start = usbi_record_now();
+
+	memcpy(hdr, USBI_REC_MAGIC, USBI_REC_MAGIC_SIZE);
+	hdr[USBI_REC_MAGIC_SIZE] = USBI_REC_VERSION;
+	put64(hdr + 8, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	fwrite(hdr, sizeof(hdr), 1, usbi_record_fp);
+	pthread_mutex_unlock(&usbi_record_lock);
+
+	usbi_debug(NULL, 4, "recording to %s", path);
+
+	return OPENUSB_SUCCESS;
+}
+
+/*
+ * The recording stays open for the next openusb_init(), the devices outlive
+ * the last openusb_fini(). Just make sure everything so far is on disk.
+ */
+void usbi_record_fini(void)
+{
+	pthread_mutex_lock(&usbi_record_lock);
+	if (usbi_record_fp)
+		fflush(usbi_record_fp);
+	pthread_mutex_unlock(&usbi_record_lock);
+}
+
+/*
+ * The operations a new device of a backend uses: the backend's own or, when
+ * recording, a copy with open and the I/O functions wrapped
+ */
+struct usbi_device_ops *usbi_record_ops(struct usbi_device_ops *ops)
+{
+	struct usbi_record_table *rec = NULL;
+	int i;
+
+	pthread_mutex_lock(&usbi_record_lock);
+	if (!usbi_record_fp) {
+		pthread_mutex_unlock(&usbi_record_lock);
+		return ops;
+	}
+
+	for (i = 0; i < usbi_record_num_tables; i++) {
+		if (usbi_record_tables[i].orig == ops) {
+			rec = &usbi_record_tables[i];
+			break;
+		}
+	}
+
+	if (!rec && usbi_record_num_tables < USBI_RECORD_MAX_BACKENDS) {
+		rec = &usbi_record_tables[usbi_record_num_tables++];
+		rec->orig = ops;
+		rec->ops = *ops;
+
+		if (ops->open)
+			rec->ops.open = usbi_record_open;
+
+		/* NULL tells the frontend the backend can't, keep it that way */
+#define WRAP(op, fn)	if (ops->op) rec->ops.op = fn
+		WRAP(ctrl_xfer_aio, usbi_record_aio);
+		WRAP(intr_xfer_aio, usbi_record_aio);
+		WRAP(bulk_xfer_aio, usbi_record_aio);
+		WRAP(isoc_xfer_aio, usbi_record_aio);
+		WRAP(ctrl_xfer_wait, usbi_record_wait);
+		WRAP(intr_xfer_wait, usbi_record_wait);
+		WRAP(bulk_xfer_wait, usbi_record_wait);
+		WRAP(isoc_xfer_wait, usbi_record_wait);
+#undef WRAP
+	}
+	pthread_mutex_unlock(&usbi_record_lock);
+
+	if (!rec) {
+		usbi_debug(NULL, 1, "too many backends, not recording");
+		return ops;
+	}
+
+	return &rec->ops;
+}
+
+/* log the completion of a recorded request, from usbi_io_complete() */
+void usbi_record_complete(struct usbi_io *io, int32_t status,
+	size_t transferred)
+{
+	usbi_record_result(io, status, transferred, 0);
+}
@@ -0,0 +1,77 @@
+/*
+ * Traffic recording file format
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ *
+ * Written by the frontend when OPENUSB_RECORD names a file (see record.c)
+ * and played back by the replay backend. All numbers are little endian.
+ *
+ * The file starts with
+ *
+ *	char	magic[7]	"OUSBREC"
+ *	u8	version		USBI_REC_VERSION
+ *	u64	start		wall clock time of the recording, ns
+ *
+ * followed by records, each with a header
+ *
+ *	u8	type		USBI_REC_*
+ *	u8	flags		USBI_REC_FLAG_*
+ *	u16	dev		index of the device, from 1 in DEVICE order
+ *	u32	len		length of the payload that follows
+ *	u64	time		ns since the start of the recording
+ *
+ * and these payloads:
+ *
+ * USBI_REC_DEVICE, the first time a device is opened
+ *	u32	busnum, devnum
+ *	u8	bus_addr, num_configs
+ *	u16	reserved
+ *	u16	length of the device descriptor, the descriptor
+ *	u16	length of configuration descriptor, the descriptor
+ *		... num_configs times
+ *
+ * USBI_REC_SUBMIT, a request is handed to the backend
+ *	u32	id		request sequence number, from 1
+ *	u8	type		openusb_transfer_type_t
+ *	u8	endpoint, interface
+ *	u8	reserved
+ *	u32	timeout		ms
+ *	u32	length		of the data stage
+ *	u8	setup[8]	control requests, zero for others
+ *	u32	num_packets	isochronous requests only
+ *	u32	length		of each packet
+ *
+ * USBI_REC_COMPLETE, the request completed, or the backend refused it
+ * (USBI_REC_FLAG_FAILED, status is what the submission returned)
+ *	u32	id
+ *	i32	status
+ *	u32	transferred
+ *	u32	num_packets	isochronous requests only
+ *	i32	status, u32 transferred of each packet
+ *	...	the data read by IN requests, packet after packet
+ *
+ * Data written by OUT requests isn't kept, only its length.
+ */
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#define USBI_REC_MAGIC		"OUSBREC"
+#define USBI_REC_MAGIC_SIZE	7
+#define USBI_REC_VERSION	1
+
+#define USBI_REC_FILE_HEADER_SIZE	16
+#define USBI_REC_HEADER_SIZE		16
+#define USBI_REC_SUBMIT_SIZE		24	/* without the packet lengths */
+#define USBI_REC_COMPLETE_SIZE		12	/* without packets and data */
+
+enum usbi_rec_type {
+	USBI_REC_DEVICE = 1,
+	USBI_REC_SUBMIT,
+	USBI_REC_COMPLETE
+};
+
+#define USBI_REC_FLAG_SYNC	0x01	/* SUBMIT: through an xfer_wait op */
+#define USBI_REC_FLAG_FAILED	0x02	/* COMPLETE: the submission failed */
+
+#endif /* __RECORD_H__ */
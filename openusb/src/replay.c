@@ -0,0 +1,1187 @@
+/*
+ * Replay of recorded USB traffic
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ *
+ * This backend plays back a recording made with OPENUSB_RECORD (see
+ * record.c and record.h), so the frontend and applications can be run
+ * against captured traffic, reproducibly and without the device. It stays
+ * out of the way unless a recording is given through the environment:
+ *
+ *	OPENUSB_REPLAY		the recording
+ *	OPENUSB_REPLAY_SPEED	how much faster than recorded requests complete,
+ *				1 (the default) keeps the original timing, 0
+ *				completes them right away
+ *
+ * Every device opened during the recording shows up again, on a bus
+ * numbered REPLAY_BUSNUM_BASE plus the recorded one, with the recorded
+ * descriptors. A request submitted to one of its endpoints is matched to
+ * the next recorded request of that endpoint and completes, after the
+ * recorded time scaled by the speed, with the recorded status and, for IN
+ * requests, the recorded data. Control requests are matched to the first
+ * recorded one with the same setup. Requests that weren't recorded, or that
+ * timed out or were canceled back then, run into their timeout; standard
+ * control requests are answered from the descriptors when they can be.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "usbi.h"
+#include "record.h"
+#include "replay.h"
+
+static struct list_head replay_buses = { .prev = &replay_buses,
+		.next = &replay_buses };
+static int32_t          replay_backend_inited = 0;
+static uint8_t          *replay_data = NULL;	/* the recording */
+static struct replay_xfer *replay_xfers = NULL;
+static double           replay_speed = 1.0;
+
+/*
+ * The endpoints' progress through the recording, the device state and the
+ * queue of requests in flight are protected by replay_lock. The queue is a
+ * list ordered by the time the request is due, the io thread sleeps until
+ * the first one is.
+ */
+static pthread_mutex_t  replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   replay_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        replay_thread;
+static int              replay_thread_exit = 0;
+static struct list_head replay_queue = { .prev = &replay_queue,
+		.next = &replay_queue };
+
+
+
+/******************************************************************************
+ *                              Request Queue                                 *
+ *****************************************************************************/
+
+static uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void replay_dequeue(struct usbi_io_private *p)
+{
+	if (p->queued) {
+		list_del(&p->list);
+		p->queued = 0;
+	}
+}
+
+/* (re)queue a request to be due at 'when' */
+static void replay_schedule(struct usbi_io_private *p, uint64_t when)
+{
+	struct usbi_io_private *q;
+
+	replay_dequeue(p);
+	p->when = when;
+
+	/* requests mostly come due in the order they're submitted */
+	for (q = list_entry(replay_queue.prev, struct usbi_io_private, list);
+	     &q->list != &replay_queue && q->when > when;
+	     q = list_entry(q->list.prev, struct usbi_io_private, list))
+		;
+	list_add(&p->list, q->list.next);
+	p->queued = 1;
+
+	/* the io thread sleeps until the first request is due */
+	if (replay_queue.next == &p->list) {
+		pthread_cond_signal(&replay_cond);
+	}
+}
+
+
+
+/******************************************************************************
+ *                               Recording                                    *
+ *****************************************************************************/
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)USBI_LE16(p) | ((uint32_t)USBI_LE16(p + 2) << 16));
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	return ((uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32));
+}
+
+static uint8_t *replay_read_file(const char *path, size_t *len)
+{
+	uint8_t *buf = NULL, *tmp;
+	size_t  size = 0, n;
+	FILE    *f;
+
+	*len = 0;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		usbi_debug(NULL, 1, "could not open %s: %s", path, strerror(errno));
+		return (NULL);
+	}
+
+	do {
+		if (*len + 1 >= size) {
+			size = size ? size * 2 : 65536;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				fclose(f);
+				return (NULL);
+			}
+			buf = tmp;
+		}
+		n = fread(buf + *len, 1, size - *len, f);
+		*len += n;
+	} while (n > 0);
+
+	fclose(f);
+
+	return (buf);
+}
+
+static struct replay_bus *replay_get_bus(unsigned int busnum)
+{
+	struct replay_bus *rbus;
+
+	list_for_each_entry(rbus, &replay_buses, list) {
+		if (rbus->busnum == busnum) {
+			return (rbus);
+		}
+	}
+
+	rbus = calloc(sizeof(*rbus), 1);
+	if (!rbus) {
+		return (NULL);
+	}
+	rbus->busnum = busnum;
+	list_init(&rbus->devices);
+	list_add(&rbus->list, &replay_buses);
+
+	return (rbus);
+}
+
+/* a DEVICE record, the device needs its descriptors to be of any use */
+static struct replay_device *replay_add_device(uint32_t index,
+                                               const uint8_t *p, uint32_t len)
+{
+	struct replay_device *rdev;
+	struct replay_bus    *rbus;
+	const uint8_t        *end = p + len;
+	uint16_t             dlen;
+	int                  i, num;
+
+	if (len < 14) {
+		return (NULL);
+	}
+
+	num = p[9];
+	dlen = USBI_LE16(p + 12);
+	if (dlen < USBI_DEVICE_DESC_SIZE || num > USBI_MAXCONFIG ||
+	    dlen > end - p - 14) {
+		usbi_debug(NULL, 2, "recorded device %u has no descriptors", index);
+		return (NULL);
+	}
+
+	rdev = calloc(sizeof(*rdev), 1);
+	if (!rdev) {
+		return (NULL);
+	}
+	rdev->index = index;
+	rdev->devnum = get32(p + 4);
+	rdev->bus_addr = p[8];
+	rbus = replay_get_bus(REPLAY_BUSNUM_BASE + get32(p));
+
+	p += 14;
+	rdev->desc = p;
+	p += dlen;
+
+	for (i = 0; i < num && end - p >= 2; i++) {
+		dlen = USBI_LE16(p);
+		p += 2;
+		if (dlen < USBI_CONFIG_DESC_SIZE || dlen > end - p ||
+		    USBI_LE16(p + 2) > dlen) {
+			break;
+		}
+		rdev->configs[i] = p;
+		p += dlen;
+	}
+	rdev->num_configs = i;
+
+	if (!rbus) {
+		free(rdev);
+		return (NULL);
+	}
+	list_add(&rdev->list, &rbus->devices);
+
+	return (rdev);
+}
+
+static void replay_add_xfer(struct replay_device *rdev, struct replay_xfer *x,
+                            uint8_t endpoint)
+{
+	struct replay_endpoint *ep;
+
+	ep = &rdev->ep[x->type == USB_TYPE_CONTROL ? 0 :
+	               REPLAY_EP_INDEX(endpoint)];
+	if (ep->last) {
+		ep->last->next = x;
+	} else {
+		ep->first = x;
+	}
+	ep->last = x;
+	if (!ep->next) {
+		ep->next = x;
+	}
+}
+
+/* a COMPLETE record, isochronous results are kept raw */
+static void replay_set_result(struct replay_xfer *x, uint8_t flags,
+                              uint64_t time, const uint8_t *p, uint32_t len)
+{
+	x->done = 1;
+	x->flags = flags;
+	x->completed = time;
+	x->status = get32(p + 4);
+	x->transferred = get32(p + 8);
+	p += USBI_REC_COMPLETE_SIZE;
+	len -= USBI_REC_COMPLETE_SIZE;
+
+	if (x->type == USB_TYPE_ISOCHRONOUS) {
+		if (len < 4 || get32(p) > (len - 4) / 8) {
+			x->done = 0;
+			return;
+		}
+		x->num_packets = get32(p);
+		x->packets = p + 4;
+		p += 4 + 8 * x->num_packets;
+		len -= 4 + 8 * x->num_packets;
+	}
+
+	x->data = p;
+	x->data_len = len;
+}
+
+/*
+ * Load the recording named by OPENUSB_REPLAY. The devices and requests
+ * point into the recording, which stays in memory.
+ */
+static void replay_load(void)
+{
+	struct replay_device **devs = NULL;
+	struct replay_xfer   *x;
+	const char           *path, *speed;
+	const uint8_t        *p, *end;
+	uint32_t             len, id, nxfers = 0, ndevs = 0;
+	size_t               size;
+
+	path = getenv("OPENUSB_REPLAY");
+	if (!path || !*path) {
+		return;
+	}
+
+	speed = getenv("OPENUSB_REPLAY_SPEED");
+	if (speed) {
+		replay_speed = strtod(speed, NULL);
+		if (replay_speed < 0) {
+			replay_speed = 1.0;
+		}
+	}
+
+	replay_data = replay_read_file(path, &size);
+	if (!replay_data) {
+		return;
+	}
+
+	if (size < USBI_REC_FILE_HEADER_SIZE ||
+	    memcmp(replay_data, USBI_REC_MAGIC, USBI_REC_MAGIC_SIZE) != 0 ||
+	    replay_data[USBI_REC_MAGIC_SIZE] != USBI_REC_VERSION) {
+		usbi_debug(NULL, 1, "%s is not a recording", path);
+		goto fail;
+	}
+	end = replay_data + size;
+
+	/* size things up first, a recording may have been cut short */
+	for (p = replay_data + USBI_REC_FILE_HEADER_SIZE;
+	     end - p >= USBI_REC_HEADER_SIZE; p += len) {
+		len = get32(p + 4);
+		p += USBI_REC_HEADER_SIZE;
+		if (len > end - p) {
+			end = p - USBI_REC_HEADER_SIZE;
+			break;
+		}
+
+		if (p[-USBI_REC_HEADER_SIZE] == USBI_REC_SUBMIT) {
+			nxfers++;
+		} else if (p[-USBI_REC_HEADER_SIZE] == USBI_REC_DEVICE &&
+		           USBI_LE16(p - USBI_REC_HEADER_SIZE + 2) > ndevs) {
+			ndevs = USBI_LE16(p - USBI_REC_HEADER_SIZE + 2);
+		}
+	}
+
+	devs = calloc(ndevs + 1, sizeof(devs[0]));
+	replay_xfers = calloc(nxfers + 1, sizeof(replay_xfers[0]));
+	if (!devs || !replay_xfers) {
+		goto fail;
+	}
+
+	for (p = replay_data + USBI_REC_FILE_HEADER_SIZE;
+	     end - p >= USBI_REC_HEADER_SIZE; p += len) {
+		uint8_t  type = p[0], flags = p[1];
+		uint16_t dev = USBI_LE16(p + 2);
+		uint64_t time = get64(p + 8);
+
+		len = get32(p + 4);
+		p += USBI_REC_HEADER_SIZE;
+
+		switch (type) {
+			case USBI_REC_DEVICE:
+				if (!devs[dev]) {
+					devs[dev] = replay_add_device(dev, p, len);
+				}
+				break;
+
+			case USBI_REC_SUBMIT:
+				/* requests are numbered in the order they're submitted */
+				id = len >= USBI_REC_SUBMIT_SIZE ? get32(p) : 0;
+				if (!id || id > nxfers || dev > ndevs || !devs[dev]) {
+					break;
+				}
+				x = &replay_xfers[id];
+				x->type = p[4];
+				x->setup = p + 16;
+				x->length = get32(p + 12);
+				x->submitted = time;
+				replay_add_xfer(devs[dev], x, p[5]);
+				break;
+
+			case USBI_REC_COMPLETE:
+				id = len >= USBI_REC_COMPLETE_SIZE ? get32(p) : 0;
+				if (!id || id > nxfers || !replay_xfers[id].setup) {
+					break;
+				}
+				replay_set_result(&replay_xfers[id], flags, time, p, len);
+				break;
+		}
+	}
+
+	free(devs);
+
+	return;
+
+fail:
+	free(devs);
+	free(replay_xfers);
+	replay_xfers = NULL;
+	free(replay_data);
+	replay_data = NULL;
+}
+
+
+
+/******************************************************************************
+ *                             Device State                                   *
+ *****************************************************************************/
+
+/* index of the configuration with the given bConfigurationValue, or -1 */
+static int replay_config_index(struct replay_device *rdev, uint8_t value)
+{
+	int i;
+
+	for (i = 0; i < rdev->num_configs; i++) {
+		if (rdev->configs[i][5] == value) {
+			return (i);
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * Find a descriptor, strings come from the answers to recorded requests for
+ * them. Returns the length of the descriptor or -1 if there is none.
+ */
+static int replay_get_desc(struct replay_device *rdev, uint8_t type,
+                           uint8_t index, uint16_t langid,
+                           const uint8_t **desc)
+{
+	struct replay_xfer *x;
+
+	switch (type) {
+		case USB_DESC_TYPE_DEVICE:
+			*desc = rdev->desc;
+			return (USBI_DEVICE_DESC_SIZE);
+
+		case USB_DESC_TYPE_CONFIG:
+			if (index >= rdev->num_configs) {
+				return (-1);
+			}
+			*desc = rdev->configs[index];
+			return (USBI_LE16(rdev->configs[index] + 2));
+
+		case USB_DESC_TYPE_STRING:
+			for (x = rdev->ep[0].first; x; x = x->next) {
+				if (x->setup[0] == USB_REQ_DEV_TO_HOST &&
+				    x->setup[1] == USB_REQ_GET_DESCRIPTOR &&
+				    USBI_LE16(x->setup + 2) == (USB_DESC_TYPE_STRING << 8 |
+				                                index) &&
+				    USBI_LE16(x->setup + 4) == langid &&
+				    x->done && x->status == OPENUSB_SUCCESS &&
+				    x->data_len >= 2 && x->data[0] <= x->data_len) {
+					*desc = x->data;
+					return (x->data[0]);
+				}
+			}
+			break;
+	}
+
+	return (-1);
+}
+
+/* take the next recorded request of an endpoint */
+static struct replay_xfer *replay_next(struct replay_endpoint *ep,
+                                       const uint8_t *setup)
+{
+	struct replay_xfer *x;
+
+	for (x = ep->next; x; x = x->next) {
+		if (!x->used && (!setup || memcmp(x->setup, setup, 6) == 0)) {
+			break;
+		}
+	}
+
+	if (!x) {
+		return (NULL);
+	}
+	x->used = 1;
+
+	while (ep->next && ep->next->used) {
+		ep->next = ep->next->next;
+	}
+
+	return (x);
+}
+
+/*
+ * Answer a standard control request that wasn't recorded, from the
+ * descriptors and the device state. Called with replay_lock held.
+ */
+static void replay_control(struct replay_device *rdev,
+                           struct usbi_io_private *p)
+{
+	openusb_ctrl_request_t *ctrl = p->io->req->req.ctrl;
+	const uint8_t          *desc;
+	int                    len;
+
+	p->status = OPENUSB_SUCCESS;
+	p->transferred = 0;
+
+	if ((ctrl->setup.bmRequestType & USB_REQ_TYPE_MASK) !=
+	    USB_REQ_TYPE_STANDARD) {
+		goto stall;
+	}
+
+	switch (ctrl->setup.bRequest) {
+		case USB_REQ_GET_DESCRIPTOR:
+			len = replay_get_desc(rdev, ctrl->setup.wValue >> 8,
+			                      ctrl->setup.wValue & 0xff,
+			                      ctrl->setup.wIndex, &desc);
+			if (len < 0) {
+				goto stall;
+			}
+			p->transferred = ctrl->length < len ? ctrl->length : len;
+			memcpy(ctrl->payload, desc, p->transferred);
+			return;
+
+		case USB_REQ_SET_CONFIGURATION:
+			if (ctrl->setup.wValue &&
+			    replay_config_index(rdev, ctrl->setup.wValue) < 0) {
+				goto stall;
+			}
+			rdev->config = ctrl->setup.wValue;
+			return;
+
+		case USB_REQ_SET_INTERFACE:
+		case USB_REQ_CLEAR_FEATURE:
+		case USB_REQ_SET_FEATURE:
+		case USB_REQ_SET_ADDRESS:
+			return;
+	}
+
+stall:
+	p->status = OPENUSB_IO_STALL;
+}
+
+/* hand over the recorded result of a request */
+static void replay_serve(struct usbi_io_private *p)
+{
+	openusb_request_handle_t req = p->io->req;
+	struct replay_xfer       *x = p->xfer;
+	openusb_isoc_request_t   *isoc;
+	const uint8_t            *data = x->data;
+	uint8_t                  *payload;
+	uint32_t                 i, n, length, avail, total = 0;
+	int                      in;
+
+	p->status = x->status;
+
+	if (req->type == USB_TYPE_ISOCHRONOUS) {
+		isoc = req->req.isoc;
+		in = req->endpoint & USB_ENDPOINT_IN;
+
+		for (i = 0; i < isoc->pkts.num_packets; i++) {
+			struct openusb_isoc_packet *pkt = &isoc->pkts.packets[i];
+			int32_t status = OPENUSB_SUCCESS;
+
+			n = 0;
+			if (i < x->num_packets) {
+				status = get32(x->packets + 8 * i);
+				length = get32(x->packets + 8 * i + 4);
+				if (in) {
+					avail = x->data + x->data_len - data;
+					if (length > avail) {
+						length = avail;
+					}
+				}
+				n = length < pkt->length ? length : pkt->length;
+				if (in) {
+					memcpy(pkt->payload, data, n);
+					data += length;
+				}
+			}
+
+			if (isoc->isoc_results) {
+				isoc->isoc_results[i].status = status;
+				isoc->isoc_results[i].transferred_bytes = n;
+			}
+			total += n;
+		}
+
+		p->transferred = total;
+		return;
+	}
+
+	switch (req->type) {
+		case USB_TYPE_CONTROL:
+			in = req->req.ctrl->setup.bmRequestType & USB_REQ_DEV_TO_HOST;
+			payload = req->req.ctrl->payload;
+			length = req->req.ctrl->length;
+			break;
+		case USB_TYPE_INTERRUPT:
+			in = req->endpoint & USB_ENDPOINT_IN;
+			payload = usbi_io_payload(p->io);
+			length = req->req.intr->length;
+			break;
+		default:
+			in = req->endpoint & USB_ENDPOINT_IN;
+			payload = usbi_io_payload(p->io);
+			length = req->req.bulk->length;
+			break;
+	}
+
+	n = x->transferred < length ? x->transferred : length;
+	if (in) {
+		if (n > x->data_len) {
+			n = x->data_len;
+		}
+		memcpy(payload, x->data, n);
+	}
+	p->transferred = n;
+}
+
+
+
+/******************************************************************************
+ *                             Backend Functions                              *
+ *****************************************************************************/
+
+static void *replay_io_thread(void *unused);
+
+/*
+ * replay_init
+ *
+ *  Backend initialization, called in openusb_init(). Fails if there is no
+ *  recording to play back.
+ */
+static int32_t replay_init(struct usbi_handle *hdl, uint32_t flags)
+{
+	if (!hdl) {
+		return (OPENUSB_BADARG);
+	}
+
+	if (replay_backend_inited) {
+		replay_backend_inited++;
+		return (OPENUSB_SUCCESS);
+	}
+
+	/* the buses outlive openusb_fini(), the frontend keeps their devices */
+	if (list_empty(&replay_buses)) {
+		replay_load();
+	}
+
+	if (list_empty(&replay_buses)) {
+		usbi_debug(hdl, 4, "no recorded devices to replay");
+		return (OPENUSB_PLATFORM_FAILURE);
+	}
+
+	replay_thread_exit = 0;
+	if (pthread_create(&replay_thread, NULL, replay_io_thread, NULL) != 0) {
+		usbi_debug(hdl, 1, "unable to create the replay io thread");
+		return (OPENUSB_SYS_FUNC_FAILURE);
+	}
+
+	replay_backend_inited++;
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * replay_fini
+ *
+ *  Backend specific data cleanup, called in openusb_fini()
+ */
+static void replay_fini(struct usbi_handle *hdl)
+{
+	if (!replay_backend_inited) {
+		return;
+	}
+
+	if (--replay_backend_inited > 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&replay_lock);
+	replay_thread_exit = 1;
+	pthread_cond_signal(&replay_cond);
+	pthread_mutex_unlock(&replay_lock);
+
+	pthread_join(replay_thread, NULL);
+}
+
+/*
+ * replay_find_buses
+ *
+ *  Return the replayed buses, there are none unless we're initialized
+ */
+static int32_t replay_find_buses(struct list_head *buses)
+{
+	struct replay_bus *rbus;
+	struct usbi_bus   *ibus;
+
+	if (!buses) {
+		return (OPENUSB_BADARG);
+	}
+
+	if (!replay_backend_inited) {
+		return (OPENUSB_SUCCESS);
+	}
+
+	list_for_each_entry(rbus, &replay_buses, list) {
+		ibus = calloc(sizeof(*ibus), 1);
+		if (!ibus) {
+			return (OPENUSB_NO_RESOURCES);
+		}
+
+		ibus->priv = calloc(sizeof(struct usbi_bus_private), 1);
+		if (!ibus->priv) {
+			free(ibus);
+			return (OPENUSB_NO_RESOURCES);
+		}
+		ibus->priv->rbus = rbus;
+
+		ibus->max_xfer_size[USB_TYPE_CONTROL]     = REPLAY_MAX_CTRL_XFER;
+		ibus->max_xfer_size[USB_TYPE_INTERRUPT]   = 0xffffffff;
+		ibus->max_xfer_size[USB_TYPE_BULK]        = 0xffffffff;
+		ibus->max_xfer_size[USB_TYPE_ISOCHRONOUS] = 0xffffffff;
+
+		pthread_mutex_init(&ibus->lock, NULL);
+		pthread_mutex_init(&ibus->devices.lock, NULL);
+
+		ibus->busnum = rbus->busnum;
+		snprintf(ibus->sys_path, sizeof(ibus->sys_path), "replay/%03u",
+		         rbus->busnum);
+		list_add(&ibus->list, buses);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * replay_refresh_devices
+ *
+ *  Add the recorded devices that haven't been added yet, they never go away
+ */
+static int32_t replay_refresh_devices(struct usbi_bus *ibus)
+{
+	struct replay_device *rdev;
+	struct usbi_device   *idev;
+	int                  len;
+
+	if (!ibus || !ibus->priv) {
+		return (OPENUSB_BADARG);
+	}
+
+	usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
+
+	list_for_each_entry(rdev, &ibus->priv->rbus->devices, list) {
+		if (rdev->idev) {
+			continue;
+		}
+
+		idev = calloc(sizeof(*idev), 1);
+		if (!idev) {
+			break;
+		}
+
+		idev->priv = calloc(sizeof(struct usbi_dev_private), 1);
+		if (!idev->priv) {
+			free(idev);
+			break;
+		}
+
+		len = snprintf(idev->sys_path, sizeof(idev->sys_path), "%s/%03u",
+		               ibus->sys_path, rdev->devnum);
+		if (len < 0 || len >= (int)sizeof(idev->sys_path)) {
+			usbi_debug(NULL, 1, "path of device %u too long",
+			           rdev->devnum);
+			free(idev->priv);
+			free(idev);
+			continue;
+		}
+		idev->priv->rdev = rdev;
+
+		idev->devnum = rdev->devnum;
+		idev->bus_addr = rdev->bus_addr;
+
+		pthread_mutex_lock(&replay_lock);
+		rdev->idev = idev;
+		pthread_mutex_unlock(&replay_lock);
+
+		usbi_add_device(ibus, idev);
+	}
+
+	usbi_mutex_unlock(&ibus->lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static void replay_free_device(struct usbi_device *idev)
+{
+	if (!idev->priv) {
+		return;
+	}
+
+	pthread_mutex_lock(&replay_lock);
+	if (idev->priv->rdev->idev == idev) {
+		idev->priv->rdev->idev = NULL;
+	}
+	pthread_mutex_unlock(&replay_lock);
+
+	free(idev->priv);
+	idev->priv = NULL;
+}
+
+static int32_t replay_open(struct usbi_dev_handle *hdev)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&replay_lock);
+	hdev->idev->priv->rdev->opened++;
+	pthread_mutex_unlock(&replay_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_close(struct usbi_dev_handle *hdev)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&replay_lock);
+	hdev->idev->priv->rdev->opened--;
+	pthread_mutex_unlock(&replay_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_set_configuration(struct usbi_dev_handle *hdev,
+                                        uint8_t cfg)
+{
+	struct replay_device *rdev = hdev->idev->priv->rdev;
+	int index = cfg ? replay_config_index(rdev, cfg) : 0;
+
+	if (index < 0) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&replay_lock);
+	rdev->config = cfg;
+	pthread_mutex_unlock(&replay_lock);
+
+	hdev->idev->cur_config_value = cfg;
+	hdev->idev->cur_config_index = index;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_get_configuration(struct usbi_dev_handle *hdev,
+                                        uint8_t *cfg)
+{
+	struct replay_device *rdev;
+	int index;
+
+	if (!hdev || !cfg) {
+		return (OPENUSB_BADARG);
+	}
+	rdev = hdev->idev->priv->rdev;
+
+	*cfg = rdev->config;
+	index = replay_config_index(rdev, rdev->config);
+
+	hdev->idev->cur_config_value = rdev->config;
+	hdev->idev->cur_config_index = index < 0 ? 0 : index;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_claim_interface(struct usbi_dev_handle *hdev,
+                                      uint8_t ifc, openusb_init_flag_t flags)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_release_interface(struct usbi_dev_handle *hdev,
+                                        uint8_t ifc)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	/* keep track of the fact that this interface was released */
+	hdev->claimed_ifs[ifc].clm = -1;
+	hdev->claimed_ifs[ifc].altsetting = -1;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_set_altsetting(struct usbi_dev_handle *hdev,
+                                     uint8_t ifc, uint8_t alt)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	if (hdev->claimed_ifs[ifc].clm != USBI_IFC_CLAIMED) {
+		usbi_debug(hdev->lib_hdl, 1, "interface (%d) must be claimed before "
+		           "assigning an alternate setting", ifc);
+		return (OPENUSB_BADARG);
+	}
+
+	hdev->claimed_ifs[ifc].altsetting = alt;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_get_altsetting(struct usbi_dev_handle *hdev,
+                                     uint8_t ifc, uint8_t *alt)
+{
+	if (!hdev || !alt) {
+		return (OPENUSB_BADARG);
+	}
+
+	*alt = hdev->claimed_ifs[ifc].altsetting;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_reset(struct usbi_dev_handle *hdev)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_clear_halt(struct usbi_dev_handle *hdev, uint8_t ept)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t replay_get_raw_desc(struct usbi_device *idev, uint8_t type,
+                                   uint8_t descidx, uint16_t langid,
+                                   uint8_t **buffer, uint16_t *buflen)
+{
+	const uint8_t *desc;
+	int           len;
+
+	if (!idev || !idev->priv || !buffer || !buflen) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&replay_lock);
+	len = replay_get_desc(idev->priv->rdev, type, descidx, langid, &desc);
+	pthread_mutex_unlock(&replay_lock);
+	if (len < 0) {
+		return (OPENUSB_PARSE_ERROR);
+	}
+
+	*buffer = malloc(len);
+	if (!*buffer) {
+		return (OPENUSB_NO_RESOURCES);
+	}
+	memcpy(*buffer, desc, len);
+	*buflen = len;
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/******************************************************************************
+ *                                IO Functions                                *
+ *****************************************************************************/
+
+/*
+ * replay_submit
+ *
+ *  Submit a request of any type. It's matched to a recorded one and queued
+ *  for the io thread to complete when the recording says it's due.
+ */
+static int32_t replay_submit(struct usbi_dev_handle *hdev, struct usbi_io *io)
+{
+	struct replay_device   *rdev;
+	struct usbi_io_private *p;
+	struct replay_xfer     *x;
+	openusb_ctrl_request_t *ctrl;
+	uint8_t                setup[6];
+	uint64_t               now, when;
+	int32_t                ret;
+
+	if (!hdev || !io) {
+		return (OPENUSB_BADARG);
+	}
+	rdev = hdev->idev->priv->rdev;
+
+	p = calloc(sizeof(*p), 1);
+	if (!p) {
+		return (OPENUSB_NO_RESOURCES);
+	}
+	p->io = io;
+	p->deadline = (uint64_t)io->tvo.tv_sec * 1000000000ULL +
+	              (uint64_t)io->tvo.tv_usec * 1000ULL;
+
+	now = replay_now();
+
+	pthread_mutex_lock(&replay_lock);
+
+	if (io->req->type == USB_TYPE_CONTROL) {
+		ctrl = io->req->req.ctrl;
+		setup[0] = ctrl->setup.bmRequestType;
+		setup[1] = ctrl->setup.bRequest;
+		setup[2] = ctrl->setup.wValue & 0xff;
+		setup[3] = ctrl->setup.wValue >> 8;
+		setup[4] = ctrl->setup.wIndex & 0xff;
+		setup[5] = ctrl->setup.wIndex >> 8;
+		x = replay_next(&rdev->ep[0], setup);
+	} else {
+		x = replay_next(&rdev->ep[REPLAY_EP_INDEX(io->req->endpoint)], NULL);
+	}
+
+	if (x && (x->flags & USBI_REC_FLAG_FAILED)) {
+		pthread_mutex_unlock(&replay_lock);
+		free(p);
+		ret = x->status;
+		return (ret < 0 ? ret : OPENUSB_PLATFORM_FAILURE);
+	}
+
+	if (!x && io->req->type == USB_TYPE_CONTROL) {
+		replay_control(rdev, p);
+		when = now;
+	} else if (!x || !x->done || x->status == OPENUSB_IO_TIMEOUT ||
+	           x->status == OPENUSB_IO_CANCELED) {
+		/* it goes on until it's canceled or times out */
+		p->status = OPENUSB_IO_TIMEOUT;
+		when = p->deadline;
+	} else {
+		when = now;
+		if (replay_speed > 0) {
+			when += (uint64_t)((x->completed - x->submitted) / replay_speed);
+		}
+
+		if (when < p->deadline) {
+			p->xfer = x;
+		} else {
+			p->status = OPENUSB_IO_TIMEOUT;
+			when = p->deadline;
+		}
+	}
+
+	replay_schedule(p, when);
+	io->priv = p;
+
+	pthread_mutex_unlock(&replay_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * replay_io_cancel
+ *
+ *  Take a request out of the queue. An aborted request still completes,
+ *  with OPENUSB_IO_CANCELED, one being freed by usbi_free_io() (it's no
+ *  longer on the handle's io list) just goes away.
+ */
+static int32_t replay_io_cancel(struct usbi_io *io)
+{
+	struct usbi_io_private *p = io->priv;
+
+	if (!p) {
+		return (OPENUSB_SUCCESS);
+	}
+
+	pthread_mutex_lock(&replay_lock);
+
+	/* not queued any more, the io thread is completing it */
+	if (p->queued) {
+		if (!io->list.next) {
+			replay_dequeue(p);
+		} else {
+			p->xfer = NULL;
+			p->status = OPENUSB_IO_CANCELED;
+			p->transferred = 0;
+			replay_schedule(p, 0);
+		}
+	}
+
+	pthread_mutex_unlock(&replay_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static void replay_complete(struct usbi_io_private *p)
+{
+	struct usbi_io         *io = p->io;
+
+	if (p->xfer) {
+		replay_serve(p);
+	}
+
+	/* the request may be freed as soon as it's complete */
+	usbi_io_complete(io, p->status, p->transferred);
+}
+
+/*
+ * replay_io_thread
+ *
+ *  Sleep until the first request in the queue is due and complete every
+ *  request that is, without holding the lock, so callbacks may submit new
+ *  requests.
+ */
+static void *replay_io_thread(void *unused)
+{
+	struct usbi_io_private *p;
+	struct list_head       done;
+	struct timespec        ts;
+	uint64_t               now, when;
+
+	pthread_mutex_lock(&replay_lock);
+
+	while (!replay_thread_exit) {
+		list_init(&done);
+
+		now = replay_now();
+		while (!list_empty(&replay_queue)) {
+			p = list_entry(replay_queue.next, struct usbi_io_private, list);
+			if (p->when > now) {
+				break;
+			}
+			replay_dequeue(p);
+			list_add(&p->list, &done);
+		}
+
+		if (!list_empty(&done)) {
+			pthread_mutex_unlock(&replay_lock);
+
+			while (!list_empty(&done)) {
+				p = list_entry(done.next, struct usbi_io_private, list);
+				list_del(&p->list);
+				replay_complete(p);
+			}
+
+			pthread_mutex_lock(&replay_lock);
+			continue;
+		}
+
+		if (!list_empty(&replay_queue)) {
+			when = list_entry(replay_queue.next, struct usbi_io_private,
+			                  list)->when;
+			ts.tv_sec = when / 1000000000ULL;
+			ts.tv_nsec = when % 1000000000ULL;
+			pthread_cond_timedwait(&replay_cond, &replay_lock, &ts);
+		} else {
+			pthread_cond_wait(&replay_cond, &replay_lock);
+		}
+	}
+
+	pthread_mutex_unlock(&replay_lock);
+
+	return (NULL);
+}
+
+
+
+struct usbi_backend_ops backend_ops = {
+	.backend_version          = 1,
+	.io_pattern               = PATTERN_ASYNC,
+	.init                     = replay_init,
+	.fini                     = replay_fini,
+	.find_buses               = replay_find_buses,
+	.refresh_devices          = replay_refresh_devices,
+	.free_device              = replay_free_device,
+	.dev = {
+		.open                     = replay_open,
+		.close                    = replay_close,
+		.set_configuration        = replay_set_configuration,
+		.get_configuration        = replay_get_configuration,
+		.claim_interface          = replay_claim_interface,
+		.release_interface        = replay_release_interface,
+		.get_altsetting           = replay_get_altsetting,
+		.set_altsetting           = replay_set_altsetting,
+		.reset                    = replay_reset,
+		.clear_halt               = replay_clear_halt,
+		.ctrl_xfer_aio            = replay_submit,
+		.intr_xfer_aio            = replay_submit,
+		.bulk_xfer_aio            = replay_submit,
+		.isoc_xfer_aio            = replay_submit,
+		.ctrl_xfer_wait           = NULL,
+		.intr_xfer_wait           = NULL,
+		.bulk_xfer_wait           = NULL,
+		.isoc_xfer_wait           = NULL,
+		.io_cancel                = replay_io_cancel,
+		.get_raw_desc             = replay_get_raw_desc,
+	},
+};
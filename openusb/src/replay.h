@@ -0,0 +1,99 @@
+/*
+ * Replay of recorded USB traffic
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ */
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "openusb.h"
+#include "usbi.h"
+
+/* replayed bus numbers start here, added to the recorded ones */
+#define REPLAY_BUSNUM_BASE	2000
+
+#define REPLAY_MAX_CTRL_XFER	4096
+
+/* endpoint slots, OUT endpoints first, then IN endpoints */
+#define REPLAY_NUM_EPS		32
+#define REPLAY_EP_INDEX(addr) \
+	(((addr) & USB_ENDPOINT_NUM_MASK) + ((addr) & USB_ENDPOINT_IN ? 16 : 0))
+
+/* a recorded request and what became of it */
+struct replay_xfer {
+	struct replay_xfer	*next;		/* on its endpoint */
+	int			used;		/* served already */
+
+	uint8_t			type;		/* openusb_transfer_type_t */
+	uint8_t			flags;		/* USBI_REC_FLAG_* of the result */
+	const uint8_t		*setup;		/* 8 bytes, control requests */
+	uint32_t		length;
+
+	uint64_t		submitted;	/* ns into the recording */
+	uint64_t		completed;
+	int			done;		/* the completion was recorded */
+	int32_t			status;
+	uint32_t		transferred;
+
+	uint32_t		num_packets;	/* isochronous requests */
+	const uint8_t		*packets;	/* status and length pairs */
+
+	const uint8_t		*data;		/* read by IN requests */
+	uint32_t		data_len;
+};
+
+/* the requests of an endpoint, in the order they were submitted */
+struct replay_endpoint {
+	struct replay_xfer	*first;
+	struct replay_xfer	*last;
+	struct replay_xfer	*next;		/* first one not served yet */
+};
+
+struct replay_device {
+	struct list_head	list;		/* on the replay bus */
+	uint32_t		index;		/* in the recording */
+	unsigned int		devnum;
+	uint8_t			bus_addr;
+
+	/* device descriptor and configuration descriptors, in the recording */
+	const uint8_t		*desc;
+	int			num_configs;
+	const uint8_t		*configs[USBI_MAXCONFIG];
+
+	int			opened;		/* open handles */
+	uint8_t			config;		/* bConfigurationValue */
+
+	struct replay_endpoint	ep[REPLAY_NUM_EPS];
+
+	struct usbi_device	*idev;		/* NULL until enumerated */
+};
+
+struct replay_bus {
+	struct list_head	list;
+	unsigned int		busnum;
+	struct list_head	devices;
+};
+
+/* backend specific data */
+struct usbi_bus_private {
+	struct replay_bus	*rbus;
+};
+
+struct usbi_dev_private {
+	struct replay_device	*rdev;
+};
+
+struct usbi_io_private {
+	struct list_head	list;		/* on the queue, by 'when' */
+	int			queued;
+	struct usbi_io		*io;
+	struct replay_xfer	*xfer;		/* NULL runs into the timeout */
+
+	uint64_t		when;		/* ns, completes then */
+	uint64_t		deadline;	/* ns, request timeout */
+	int32_t			status;
+	uint32_t		transferred;
+};
+
+#endif /* __REPLAY_H__ */
@@ -184,7 +184,7 @@ struct usbi_device *find_device_by_udi(const char *udi)
 	
 	usbi_debug(NULL, 4, "searching device: %s", udi);
 	
-	pthread_mutex_lock(&usbi_devices.lock);
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
 
 	list_for_each_entry(idev, &usbi_devices.head, dev_list) {
 		if (!idev || !idev->priv || !idev->priv->udi) {
@@ -192,12 +192,12 @@ struct usbi_device *find_device_by_udi(const char *udi)
 		}
 
 		if (strcmp(udi, idev->priv->udi) == 0) {
-			pthread_mutex_unlock(&usbi_devices.lock);
+			usbi_mutex_unlock(&usbi_devices.lock);
 			return idev;
 		}
 	}
 
-	pthread_mutex_unlock(&usbi_devices.lock);
+	usbi_mutex_unlock(&usbi_devices.lock);
 
 	return NULL;
 }
@@ -347,7 +347,7 @@ device_added (LibHalContext *ctx, const char *udi)
 	if (idev) {
 		/* old device re-inserted */
 		usbi_debug(NULL, 4, "old device: %d", (int)idev->devid);
-		pthread_mutex_lock(&usbi_handles.lock);
+		usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 		list_for_each_entry_safe(handle, thdl, &usbi_handles.head,
 			list) {
 			/* every openusb instance should get notification
@@ -358,7 +358,7 @@ device_added (LibHalContext *ctx, const char *udi)
 					USB_ATTACH);
 			}
 		}
-		pthread_mutex_unlock(&usbi_handles.lock);
+		usbi_mutex_unlock(&usbi_handles.lock);
 
 	} else {
 		usbi_debug(NULL, 4, "new device");
@@ -384,15 +384,15 @@ device_removed (LibHalContext *ctx, const char *udi)
 
 	if (idev) {
 		/* add a callback if REMOVE callback is set */ 
-		pthread_mutex_lock(&usbi_handles.lock);
+		usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 		list_for_each_entry(hdl, &usbi_handles.head, list) {
 			if (hdl) {
-				pthread_mutex_unlock(&usbi_handles.lock);
+				usbi_mutex_unlock(&usbi_handles.lock);
 				usbi_add_event_callback(hdl, idev->devid, USB_REMOVE);
-				pthread_mutex_lock(&usbi_handles.lock);
+				usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 			}
 		}
-		pthread_mutex_unlock(&usbi_handles.lock);
+		usbi_mutex_unlock(&usbi_handles.lock);
 
 	} else {
 		/* we don't care */
@@ -1030,7 +1030,7 @@ solaris_refresh_devices(struct usbi_bus *ibus)
 		return (OPENUSB_PLATFORM_FAILURE);
 	}
 
-	pthread_mutex_lock(&ibus->devices.lock);
+	usbi_mutex_lock(&ibus->devices.lock, USBI_LOCK_BUS);
 
 	/* Reset the found flag for all devices */
 	list_for_each_entry(idev, &ibus->devices.head, bus_list) {
@@ -1053,7 +1053,7 @@ solaris_refresh_devices(struct usbi_bus *ibus)
 		}
 	}
 
-	pthread_mutex_unlock(&ibus->devices.lock);
+	usbi_mutex_unlock(&ibus->devices.lock);
 
 	di_fini(root_node);
 	(void) di_devlink_fini(&devlink_hdl);
@@ -1306,6 +1306,10 @@ solaris_open(struct usbi_dev_handle *hdev)
 		return OPENUSB_SYS_FUNC_FAILURE;
 	}
 #endif
+	if (usbi_open_event_pipe(hdev) != OPENUSB_SUCCESS) {
+		return OPENUSB_SYS_FUNC_FAILURE;
+	}
+
 	if(solaris_create_timeout_thread(hdev) != 0) {
 		return OPENUSB_SYS_FUNC_FAILURE;
 	}
@@ -1545,7 +1549,7 @@ solaris_close(struct usbi_dev_handle *hdev)
 	/* wait for timeout thread exiting */
 	pthread_join(hdev->priv->timeout_thr, NULL);
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 	usbi_debug(hdev->lib_hdl, 4, "timeout thread exit");
 
@@ -1559,7 +1563,7 @@ solaris_close(struct usbi_dev_handle *hdev)
 	hdev->state = USBI_DEVICE_CLOSING;
 	free(hdev->priv);
 
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return (OPENUSB_SUCCESS);
 }
@@ -1985,7 +1989,7 @@ solaris_submit_ctrl_non_default(struct usbi_dev_handle *hdev,
 	ep_addr = io->req->endpoint;
 	ep_index = usb_ep_index(ep_addr);
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 	if ((ret = usb_check_device_and_status_open(hdev, io->req->interface,
 	    ep_addr, USB_ENDPOINT_TYPE_BULK)) != 0) {
@@ -1993,7 +1997,7 @@ solaris_submit_ctrl_non_default(struct usbi_dev_handle *hdev,
 			"check_device_and_status_open for ep %d failed",
 			ep_addr);
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return (OPENUSB_NOACCESS);
 	}
 
@@ -2011,7 +2015,7 @@ solaris_submit_ctrl_non_default(struct usbi_dev_handle *hdev,
 		ctrl->result.transferred_bytes = ret;
 	}
 
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	usbi_debug(hdev->lib_hdl, 4, "send ctrl bytes %d", ret);
 	io->status = USBI_IO_COMPLETED;
@@ -2041,7 +2045,7 @@ solaris_submit_bulk(struct usbi_dev_handle *hdev, struct usbi_io *io)
 	ep_addr = io->req->endpoint;
 	ep_index = usb_ep_index(ep_addr);
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 	if ((ret = usb_check_device_and_status_open(hdev,io->req->interface,
 	    ep_addr, USB_ENDPOINT_TYPE_BULK)) != 0) {
@@ -2049,17 +2053,17 @@ solaris_submit_bulk(struct usbi_dev_handle *hdev, struct usbi_io *io)
 			"check_device_and_status_open for ep %d failed",
 			ep_addr);
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return (OPENUSB_NOACCESS);
 	}
 
 	if (ep_addr & USB_ENDPOINT_DIR_MASK) {
 		ret = usb_do_io(hdev->priv->eps[ep_index].datafd,
-		    hdev->priv->eps[ep_index].statfd, (char *)bulk->payload,
+		    hdev->priv->eps[ep_index].statfd, (char *)usbi_io_payload(io),
 		    bulk->length, READ, &bulk->result.status);
 	} else {
 		ret = usb_do_io(hdev->priv->eps[ep_index].datafd,
-		    hdev->priv->eps[ep_index].statfd, (char *)bulk->payload,
+		    hdev->priv->eps[ep_index].statfd, (char *)usbi_io_payload(io),
 		    bulk->length, WRITE, &bulk->result.status);
 		    
 	}
@@ -2067,7 +2071,7 @@ solaris_submit_bulk(struct usbi_dev_handle *hdev, struct usbi_io *io)
 		bulk->result.transferred_bytes = ret;
 	}
 
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	usbi_debug(hdev->lib_hdl, 4, "send bulk bytes %d", ret);
 	io->status = USBI_IO_COMPLETED;
@@ -2087,7 +2091,7 @@ solaris_submit_intr(struct usbi_dev_handle *hdev, struct usbi_io *io)
 	ep_addr = io->req->endpoint;
 	ep_index = usb_ep_index(ep_addr);
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 	usbi_debug(hdev->lib_hdl, 4, "Begin: TID=%d",pthread_self());
 
@@ -2097,13 +2101,13 @@ solaris_submit_intr(struct usbi_dev_handle *hdev, struct usbi_io *io)
 			"check_device_and_status_open for ep %d failed",
 			ep_addr);
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return (OPENUSB_NOACCESS);
 	}
 
 	if (ep_addr & USB_ENDPOINT_DIR_MASK) {
 		ret = usb_do_io(hdev->priv->eps[ep_index].datafd,
-		    hdev->priv->eps[ep_index].statfd, (char *)intr->payload,
+		    hdev->priv->eps[ep_index].statfd, (char *)usbi_io_payload(io),
 		    intr->length, READ, &intr->result.status);
 
 		/* close the endpoint so we stop polling the endpoint now */
@@ -2113,7 +2117,7 @@ solaris_submit_intr(struct usbi_dev_handle *hdev, struct usbi_io *io)
 		hdev->priv->eps[ep_index].statfd = -1;
 	} else {
 		ret = usb_do_io(hdev->priv->eps[ep_index].datafd,
-		    hdev->priv->eps[ep_index].statfd, (char *)intr->payload,
+		    hdev->priv->eps[ep_index].statfd, (char *)usbi_io_payload(io),
 		    intr->length, WRITE, &intr->result.status);
 	}
 
@@ -2126,7 +2130,7 @@ solaris_submit_intr(struct usbi_dev_handle *hdev, struct usbi_io *io)
 	usbi_debug(hdev->lib_hdl, 4,"Intr status= %d\n",intr->result.status);
 
 	io->status = USBI_IO_COMPLETED;
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return (ret);
 }
@@ -2164,7 +2168,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 	 * the same code and access the same device. Maybe every pipe should 
 	 * have a lock.
 	 */
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 	if ((ret = usb_check_device_and_status_open(hdev,io->req->interface,
 	    ep_addr, USB_ENDPOINT_TYPE_ISOCHRONOUS)) != 0) {
@@ -2172,7 +2176,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 			"check_device_and_status_open for ep %d failed",
 			ep_addr);
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return (OPENUSB_NOACCESS);
 	}
 
@@ -2186,7 +2190,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 	if (pkts_len == 0) {
 		usbi_debug(hdev->lib_hdl, 1, "pkt length invalid");
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return (OPENUSB_BADARG);
 	}
 
@@ -2205,7 +2209,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 			"malloc isoc out buf of length %d failed",
 			len);
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		return (OPENUSB_NO_RESOURCES);
 	}
 
@@ -2275,7 +2279,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 		usbi_debug(hdev->lib_hdl, 1, "write isoc ep failed %d TID=%d",
 			ret, pthread_self());
 
-		pthread_mutex_unlock(&hdev->lock);
+		usbi_mutex_unlock(&hdev->lock);
 		free(buf);
 
 		return (OPENUSB_PLATFORM_FAILURE);
@@ -2293,7 +2297,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 				"get status failed %d TID=%d",
 				ret, pthread_self());
 
-			pthread_mutex_unlock(&hdev->lock);
+			usbi_mutex_unlock(&hdev->lock);
 
 			free(buf);
 
@@ -2326,7 +2330,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 
 		buf = malloc(len);
 		if(!buf) {
-			pthread_mutex_unlock(&hdev->lock);
+			usbi_mutex_unlock(&hdev->lock);
 			return OPENUSB_NO_RESOURCES;
 		}
 		memset(buf, 0, len);
@@ -2345,7 +2349,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 
 			free(buf);
 
-			pthread_mutex_unlock(&hdev->lock);
+			usbi_mutex_unlock(&hdev->lock);
 			return (OPENUSB_PLATFORM_FAILURE);
 		}
 		
@@ -2385,7 +2389,7 @@ solaris_submit_isoc(struct usbi_dev_handle *hdev, struct usbi_io *io)
 #endif
 	}
 
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 	io->status = USBI_IO_COMPLETED;
 	return (0);
 }
@@ -2443,13 +2447,13 @@ solaris_io_cancel(struct usbi_io *io)
 		list_del(&io->list);
 		io->status = USBI_IO_CANCEL;
 		
-		pthread_mutex_lock(&hdev->lib_hdl->complete_lock);
+		usbi_mutex_lock(&hdev->lib_hdl->complete_lock, USBI_LOCK_COMPLETE);
 
 		list_add(&io->list,&hdev->lib_hdl->complete_list);
 		pthread_cond_signal(&hdev->lib_hdl->complete_cv);
 		hdev->lib_hdl->complete_count++;
 
-		pthread_mutex_unlock(&hdev->lib_hdl->complete_lock);
+		usbi_mutex_unlock(&hdev->lib_hdl->complete_lock);
 	}
 
 	return (OPENUSB_SUCCESS);
@@ -42,6 +42,9 @@ static openusb_dev_handle_t cur_dev_handle = 1; /* protected by usbi_lock */
 static int usbi_inited = 0;
 static pthread_mutex_t usbi_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* cleared by OPENUSB_INIT_NO_THREADS on the first openusb_init() */
+static int usbi_threads = 1;
+
 struct list_head backends = { .prev = &backends, .next = &backends };
 
 /*
@@ -68,10 +71,10 @@ void _usbi_debug(struct usbi_handle *hdl, uint32_t level, const char *func,
 		return;
 
 	if (hdl) {
-		pthread_mutex_lock(&hdl->lock);
+		usbi_mutex_lock(&hdl->lock, USBI_LOCK_HANDLE);
 
 		if (level > hdl->debug_level) {
-			pthread_mutex_unlock(&hdl->lock);
+			usbi_mutex_unlock(&hdl->lock);
 
 			return;
 		}
@@ -91,7 +94,7 @@ void _usbi_debug(struct usbi_handle *hdl, uint32_t level, const char *func,
 	va_end(ap);
 
 	if(hdl) {
-		pthread_mutex_unlock(&hdl->lock);
+		usbi_mutex_unlock(&hdl->lock);
 	}
 }
 
@@ -125,84 +128,133 @@ void usbi_add_event_callback(struct usbi_handle *hdl, openusb_devid_t devid,
 	cb->handle = hdl;
 	list_init(&cb->list);
 
-	pthread_mutex_lock(&event_callbacks.lock);
+	usbi_mutex_lock(&event_callbacks.lock, USBI_LOCK_EVENT_CALLBACKS);
 
 	list_add(&cb->list, &event_callbacks.head);
 
-	pthread_cond_signal(&event_callback_cond);
+	if (usbi_threads)
+		pthread_cond_signal(&event_callback_cond);
+	else
+		usbi_events_wakeup();
 
 	callback_queue_full++;
 
-	pthread_mutex_unlock(&event_callbacks.lock);
+	usbi_mutex_unlock(&event_callbacks.lock);
+}
+
+/*
+ * Run the queued event callbacks, from the callback thread or, without
+ * threads, from whichever thread handles events
+ */
+void usbi_dispatch_event_callbacks(void)
+{
+	struct eventcallback *cb = NULL;
+	struct list_head *listh;
+
+	usbi_mutex_lock(&event_callbacks.lock, USBI_LOCK_EVENT_CALLBACKS);
+
+	/*
+	 * Don't use list_for_each_entry(). It's not easy to free cb,
+	 * because cb will be used at every iteration of "for" loop.
+	 */
+	listh = event_callbacks.head.next;
+	while(listh != &event_callbacks.head) {
+		openusb_devid_t devid;
+		openusb_event_t type;
+		struct usbi_handle *hdl;
+		openusb_event_callback_t func;
+		void *arg;
+
+		cb = list_entry(&(listh->prev), struct eventcallback,
+			list);
+		
+		/*Get the pointer to the next list element, then we can delete this one*/
+		listh = listh->next;
+		
+		list_del(&cb->list);
+
+		devid = cb->devid;
+		type = cb->type;
+		hdl = cb->handle;
+
+		func = hdl->event_cbs[type].func;
+		arg = hdl->event_cbs[type].arg;
+
+		/* Risk: if func blocks, no new event can be added.
+		 * 	Release lock before call event callback
+		 */
+		usbi_mutex_unlock(&event_callbacks.lock);
+
+		if (func) {
+			usbi_debug(hdl, 4, "callback called");
+			func(hdl->handle,devid, type, arg);
+		} else {
+			usbi_debug(hdl, 4, "No callback");
+		}
+
+		usbi_mutex_lock(&event_callbacks.lock, USBI_LOCK_EVENT_CALLBACKS);
+
+		/* don't reference any element of cb after this */
+		free(cb);
+
+		/* the list should be empty here */
+		callback_queue_full--;
+	}
+
+	usbi_mutex_unlock(&event_callbacks.lock);
 }
 
 static void *process_event_callbacks(void *unused)
 {
 	while (1) {
-		struct eventcallback *cb = NULL;
-		struct list_head *listh;
-
-		pthread_mutex_lock(&event_callbacks.lock);
+		usbi_mutex_lock(&event_callbacks.lock, USBI_LOCK_EVENT_CALLBACKS);
 
 		while(callback_queue_full == 0) {
-			pthread_cond_wait(&event_callback_cond, &event_callbacks.lock);
+			usbi_cond_wait(&event_callback_cond, &event_callbacks.lock);
 			if (event_callback_exit) {
 				/* we're being told we need to shutdown, reset our flag and exit */
 				event_callback_exit = 0;
-				pthread_mutex_unlock(&event_callbacks.lock);
+				usbi_mutex_unlock(&event_callbacks.lock);
 				return (NULL);
 			}
 		}
 
-		/*
-		 * Don't use list_for_each_entry(). It's not easy to free cb,
-		 * because cb will be used at every iteration of "for" loop.
-		 */
-		listh = event_callbacks.head.next;
-		while(listh != &event_callbacks.head) {
-			openusb_devid_t devid;
-			openusb_event_t type;
-			struct usbi_handle *hdl;
-			openusb_event_callback_t func;
-			void *arg;
-
-			cb = list_entry(&(listh->prev), struct eventcallback,
-				list);
-			
-			/*Get the pointer to the next list element, then we can delete this one*/
-			listh = listh->next;
-			
-			list_del(&cb->list);
-
-			devid = cb->devid;
-			type = cb->type;
-			hdl = cb->handle;
-
-			func = hdl->event_cbs[type].func;
-			arg = hdl->event_cbs[type].arg;
-
-			/* Risk: if func blocks, no new event can be added.
-			 * 	Release lock before call event callback
-			 */
-			pthread_mutex_unlock(&event_callbacks.lock);
-
-			if (func) {
-				usbi_debug(hdl, 4, "callback called");
-				func(hdl->handle,devid, type, arg);
-			} else {
-				usbi_debug(hdl, 4, "No callback");
-			}
+		usbi_mutex_unlock(&event_callbacks.lock);
+
+		usbi_dispatch_event_callbacks();
+	}
+}
 
-			pthread_mutex_lock(&event_callbacks.lock);
+int usbi_threads_enabled(void)
+{
+	return usbi_threads;
+}
 
-			/* don't reference any element of cb after this */
-			free(cb);
+/* soonest timeout of any backend in ms, -1 if none is pending */
+int32_t usbi_backends_next_timeout(void)
+{
+	struct usbi_backend *backend;
+	int32_t next = -1, ms;
 
-			/* the list should be empty here */
-			callback_queue_full--;
-		}
+	list_for_each_entry(backend, &backends, list) {
+		if (!backend->ops->next_timeout)
+			continue;
 
-		pthread_mutex_unlock(&event_callbacks.lock);
+		ms = backend->ops->next_timeout();
+		if (ms >= 0 && (next < 0 || ms < next))
+			next = ms;
+	}
+
+	return next;
+}
+
+void usbi_backends_handle_timeouts(void)
+{
+	struct usbi_backend *backend;
+
+	list_for_each_entry(backend, &backends, list) {
+		if (backend->ops->handle_timeouts)
+			backend->ops->handle_timeouts();
 	}
 }
 
@@ -421,11 +473,16 @@ static int usbi_init_common(void)
 	pthread_cond_init(&event_callback_cond, NULL);
 
 	/* Start up thread for callbacks, make sure our exit flag is 0,
-	 * if we're creating the thread we definitely don't want it to exit */
+	 * if we're creating the thread we definitely don't want it to exit.
+	 * Without threads the application runs them, woken by our pipe */
 	event_callback_exit = 0;
-	ret = pthread_create(&event_callback_thread, NULL,
-		process_event_callbacks, NULL);
-	if (ret < 0) {
+	if (usbi_threads) {
+		ret = pthread_create(&event_callback_thread, NULL,
+			process_event_callbacks, NULL);
+	} else {
+		ret = usbi_events_init();
+	}
+	if (ret != 0) {
 		usbi_debug(NULL, 1, "unable to create callback thread "
 			"(ret = %d)", ret);
 		pthread_cond_destroy(&event_callback_cond);
@@ -438,6 +495,11 @@ static int usbi_init_common(void)
 		return OPENUSB_SYS_FUNC_FAILURE;
 	}
 
+	usbi_lockstat_init();
+
+	/* recording must be on before the first device is added */
+	usbi_record_init();
+
 	/* Load backends. All openusb instances share the same backends */
 	load_backends(DRIVER_PATH); /* may need to check error */
 
@@ -469,9 +531,14 @@ static void usbi_fini_common(void)
 	/* XXX need to free device, bus and backend list */
 
 	/* first we need to make sure that the event callback thread is shutdown */
-	event_callback_exit = 1;
-	pthread_cond_signal(&event_callback_cond);
-	pthread_join(event_callback_thread, NULL);
+	if (usbi_threads) {
+		event_callback_exit = 1;
+		pthread_cond_signal(&event_callback_cond);
+		pthread_join(event_callback_thread, NULL);
+	} else {
+		usbi_dispatch_event_callbacks();
+		usbi_events_fini();
+	}
 	
 	pthread_cond_destroy(&event_callback_cond);
 	usbi_list_fini(&event_callbacks);
@@ -480,6 +547,7 @@ static void usbi_fini_common(void)
 	usbi_list_fini(&usbi_buses);
 	usbi_list_fini(&usbi_handles);
 
+	usbi_record_fini();
 }
 
 struct usbi_handle *usbi_find_handle(openusb_handle_t handle)
@@ -487,24 +555,24 @@ struct usbi_handle *usbi_find_handle(openusb_handle_t handle)
 	struct usbi_handle *hdl;
 
 	/* fail if openusb is not inited */
-	pthread_mutex_lock(&usbi_lock);
+	usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 	if (usbi_inited == 0) {
-		pthread_mutex_unlock(&usbi_lock);
+		usbi_mutex_unlock(&usbi_lock);
 		return NULL;
 	}
-	pthread_mutex_unlock(&usbi_lock);
+	usbi_mutex_unlock(&usbi_lock);
 
-	pthread_mutex_lock(&usbi_handles.lock);
+	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 	list_for_each_entry(hdl, &usbi_handles.head, list) {
 	/* safe */
 		if (hdl) {
 			if (hdl->handle == handle) {
-				pthread_mutex_unlock(&usbi_handles.lock);
+				usbi_mutex_unlock(&usbi_handles.lock);
 				return hdl;
 			}
 		}
 	}
-	pthread_mutex_unlock(&usbi_handles.lock);
+	usbi_mutex_unlock(&usbi_handles.lock);
 
 	return NULL;
 }
@@ -537,13 +605,13 @@ static struct usbi_handle *usbi_init_handle(void)
 		hdl->debug_level = atoi(getenv("OPENUSB_DEBUG"));
 
 	/* the mutex protects cur_handle */
-	pthread_mutex_lock(&usbi_lock);
+	usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 	hdl->handle = cur_handle++;
-	pthread_mutex_unlock(&usbi_lock);
+	usbi_mutex_unlock(&usbi_lock);
 	
-	pthread_mutex_lock(&usbi_handles.lock);
+	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 	list_add(&hdl->list, &usbi_handles.head);
-	pthread_mutex_unlock(&usbi_handles.lock);
+	usbi_mutex_unlock(&usbi_handles.lock);
 
 	list_init(&hdl->complete_list);
 	pthread_mutex_init(&hdl->complete_lock,NULL);
@@ -563,9 +631,9 @@ static void usbi_destroy_handle(struct usbi_handle *hdl)
 		return;
 	}
 
-	pthread_mutex_lock(&usbi_handles.lock);
+	usbi_mutex_lock(&usbi_handles.lock, USBI_LOCK_HANDLES);
 	list_del(&hdl->list);
-	pthread_mutex_unlock(&usbi_handles.lock);
+	usbi_mutex_unlock(&usbi_handles.lock);
 
 	pthread_mutex_destroy(&hdl->lock); /* may fail */
 
@@ -590,26 +658,35 @@ int32_t openusb_init(uint32_t flags, openusb_handle_t *handle)
 	*handle = 0;
 
 	/* init the common part only on the first call */
-	pthread_mutex_lock(&usbi_lock);
+	usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
+	if (usbi_inited == 0) {
+		usbi_threads = !(flags & OPENUSB_INIT_NO_THREADS);
+	} else if (usbi_threads == !!(flags & OPENUSB_INIT_NO_THREADS)) {
+		usbi_debug(NULL, 1, "threads are %s by the first openusb_init()",
+			usbi_threads ? "on" : "off");
+		usbi_mutex_unlock(&usbi_lock);
+
+		return OPENUSB_BADARG;
+	}
 	if (usbi_inited == 0) {
 		if ((ret = usbi_init_common()) < 0) {
 			usbi_debug(NULL, 1, "usbi_init_common failed "
 				"(ret = %d)", ret);
-			pthread_mutex_unlock(&usbi_lock);
+			usbi_mutex_unlock(&usbi_lock);
 
 			return ret;
 		}
 	}
 	usbi_inited++;
-	pthread_mutex_unlock(&usbi_lock);
+	usbi_mutex_unlock(&usbi_lock);
 
 	hdl = usbi_init_handle();
 	if(hdl == NULL) {
-		pthread_mutex_lock(&usbi_lock);
+		usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 		usbi_inited--;
 		if (usbi_inited == 0)
 			usbi_fini_common();
-		pthread_mutex_unlock(&usbi_lock);
+		usbi_mutex_unlock(&usbi_lock);
 
 		return OPENUSB_SYS_FUNC_FAILURE;
 	}
@@ -628,11 +705,11 @@ int32_t openusb_init(uint32_t flags, openusb_handle_t *handle)
 	
 	/* no backends init succeed */
 	if (back_cnt == init_cnt) {
-		pthread_mutex_lock(&usbi_lock);
+		usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 		usbi_inited--;
 		if (usbi_inited == 0)
 			usbi_fini_common();
-		pthread_mutex_unlock(&usbi_lock);
+		usbi_mutex_unlock(&usbi_lock);
 		
 		free(hdl);
 		return OPENUSB_PLATFORM_FAILURE;
@@ -669,14 +746,14 @@ void openusb_fini(openusb_handle_t handle)
 
 	usbi_destroy_handle(hdl);
 
-	pthread_mutex_lock(&usbi_lock);
+	usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 	usbi_inited--;
 	if (usbi_inited == 0) {
 		usbi_debug(NULL, 4, "Last lib handle");
 		usbi_fini_common();
 
 		/* last openusb instance, DON'T destroy it */
-		pthread_mutex_unlock(&usbi_lock);
+		usbi_mutex_unlock(&usbi_lock);
 
 		/* last openusb instance, unload the backends */
 		list_for_each_entry_safe(backend, tbackend, &backends, list) {
@@ -689,7 +766,7 @@ void openusb_fini(openusb_handle_t handle)
 
 		return;
 	}
-	pthread_mutex_unlock(&usbi_lock);
+	usbi_mutex_unlock(&usbi_lock);
 
 	usbi_debug(NULL, 4, "End");
 }
@@ -700,10 +777,10 @@ static void usbi_coldplug_complete(struct usbi_handle *hdl)
 		return;
 	}
 
-	pthread_mutex_lock(&hdl->lock);
+	usbi_mutex_lock(&hdl->lock, USBI_LOCK_HANDLE);
 	hdl->coldplug_complete = 1;
 	pthread_cond_signal(&hdl->coldplug_cv);
-	pthread_mutex_unlock(&hdl->lock);
+	usbi_mutex_unlock(&hdl->lock);
 }
 
 /* 
@@ -722,10 +799,10 @@ int32_t openusb_set_event_callback(openusb_handle_t handle,
 	if (type < 0 || type >= OPENUSB_EVENT_TYPE_COUNT )
 		return OPENUSB_BADARG;
 
-	pthread_mutex_lock(&hdl->lock);
+	usbi_mutex_lock(&hdl->lock, USBI_LOCK_HANDLE);
 	hdl->event_cbs[type].func = callback;
 	hdl->event_cbs[type].arg = arg;
-	pthread_mutex_unlock(&hdl->lock);
+	usbi_mutex_unlock(&hdl->lock);
 	
 	/* FIXME: just call coldplug_complete to prevent
 	 * openusb_coldplug_callbacks_done() blocking.
@@ -744,7 +821,7 @@ void openusb_set_debug(openusb_handle_t handle, uint32_t level,
 	if (!hdl)
 		return;
 
-	pthread_mutex_lock(&hdl->lock);
+	usbi_mutex_lock(&hdl->lock, USBI_LOCK_HANDLE);
 
 	if (callback) {
 		hdl->debug_cb = callback;
@@ -753,7 +830,7 @@ void openusb_set_debug(openusb_handle_t handle, uint32_t level,
 	hdl->debug_level = level;
 	hdl->debug_flags = flags; /* not used, just prevent a warning */
 
-	pthread_mutex_unlock(&hdl->lock);
+	usbi_mutex_unlock(&hdl->lock);
 
 	if (level) {
 		usbi_debug(hdl, 4, "setting debugging level to %d (%s)",
@@ -777,7 +854,7 @@ int32_t openusb_set_default_timeout(openusb_handle_t handle,
 	if ((type < 0) || (type > USB_TYPE_ISOCHRONOUS))
 		return OPENUSB_BADARG;
 
-	pthread_mutex_lock(&hdl->lock);
+	usbi_mutex_lock(&hdl->lock, USBI_LOCK_HANDLE);
 
 	if (type == USB_TYPE_ALL) {
 		int i;
@@ -788,7 +865,7 @@ int32_t openusb_set_default_timeout(openusb_handle_t handle,
 		hdl->timeout[type] = timeout;
 	}
 
-	pthread_mutex_unlock(&hdl->lock);
+	usbi_mutex_unlock(&hdl->lock);
 
 	return OPENUSB_SUCCESS;
 }
@@ -799,31 +876,25 @@ struct usbi_dev_handle *usbi_find_dev_handle(openusb_dev_handle_t dev)
 	struct usbi_dev_handle *hdev;
 
 	/* fail if openusb is not inited */
-	pthread_mutex_lock(&usbi_lock);
+	usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 	if (usbi_inited == 0) {
-		pthread_mutex_unlock(&usbi_lock);
+		usbi_mutex_unlock(&usbi_lock);
 		return NULL;
 	}
-	pthread_mutex_unlock(&usbi_lock);
+	usbi_mutex_unlock(&usbi_lock);
 
 	/* FIXME: We should probably index the device id in a rbtree or
 	 * something
 	 */
-	pthread_mutex_lock(&usbi_dev_handles.lock);
+	usbi_mutex_lock(&usbi_dev_handles.lock, USBI_LOCK_DEV_HANDLES);
 	list_for_each_entry(hdev, &usbi_dev_handles.head, list) {
-	/* safe */
-		if (hdev) {
-			pthread_mutex_lock(&hdev->lock);
-			if (hdev->handle == dev) {
-				pthread_mutex_unlock(&hdev->lock);
-	
-				pthread_mutex_unlock(&usbi_dev_handles.lock);
-				return hdev;
-			}
-			pthread_mutex_unlock(&hdev->lock);
+	/* safe, the handle is set before it goes on the list */
+		if (hdev && hdev->handle == dev) {
+			usbi_mutex_unlock(&usbi_dev_handles.lock);
+			return hdev;
 		}
 	}
-	pthread_mutex_unlock(&usbi_dev_handles.lock);
+	usbi_mutex_unlock(&usbi_dev_handles.lock);
 
 	return NULL;
 }
@@ -834,29 +905,73 @@ struct usbi_device *usbi_find_device_by_id(openusb_devid_t devid)
 	struct usbi_device *idev;
 
 	/* fail if openusb is not inited */
-	pthread_mutex_lock(&usbi_lock);
+	usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 	if (usbi_inited == 0) {
-		pthread_mutex_unlock(&usbi_lock);
+		usbi_mutex_unlock(&usbi_lock);
 		return NULL;
 	}
-	pthread_mutex_unlock(&usbi_lock);
+	usbi_mutex_unlock(&usbi_lock);
 
-	/* FIXME: We should probably index the device id in a rbtree
-	 * or something
-	 */
-	pthread_mutex_lock(&usbi_devices.lock);
-	list_for_each_entry(idev, &usbi_devices.head, dev_list) {
-	/* safe */
-		if (idev) {
-			if (idev->devid == devid) {
-				pthread_mutex_unlock(&usbi_devices.lock);
-				return idev;
-			}
-		}
+	usbi_mutex_lock(&usbi_devices.lock, USBI_LOCK_DEVICES);
+	idev = usbi_lookup_device(devid);
+	usbi_mutex_unlock(&usbi_devices.lock);
+
+	return idev;
+}
+
+/*
+ * The event pipe wakes up timeout_thread() as requests come and go. Only
+ * backends running a timeout thread need it, so it's created on demand from
+ * the backend's open routine rather than for every handle.
+ */
+int32_t usbi_open_event_pipe(struct usbi_dev_handle *hdev)
+{
+	if (hdev->event_pipe[0] >= 0)
+		return OPENUSB_SUCCESS;
+
+	if (pipe(hdev->event_pipe) < 0) {
+		hdev->event_pipe[0] = hdev->event_pipe[1] = -1;
+		return OPENUSB_SYS_FUNC_FAILURE;
 	}
-	pthread_mutex_unlock(&usbi_devices.lock);
 
-	return NULL;
+	return OPENUSB_SUCCESS;
+}
+
+/* wake up the timeout thread, if the backend runs one for this handle */
+void usbi_notify_event_pipe(struct usbi_dev_handle *hdev)
+{
+	char buf[1] = {1};
+
+	if (hdev->event_pipe[1] >= 0)
+		write(hdev->event_pipe[1], buf, 1);
+}
+
+static void usbi_close_event_pipe(struct usbi_dev_handle *hdev)
+{
+	if (hdev->event_pipe[0] >= 0)
+		close(hdev->event_pipe[0]);
+	if (hdev->event_pipe[1] >= 0)
+		close(hdev->event_pipe[1]);
+
+	hdev->event_pipe[0] = hdev->event_pipe[1] = -1;
+}
+
+static void usbi_init_ep_queues(struct usbi_dev_handle *hdev)
+{
+	int i;
+
+	for (i = 0; i < USBI_MAXENDPOINTS; i++) {
+		pthread_mutex_init(&hdev->ep[i].lock, NULL);
+		list_init(&hdev->ep[i].io_head);
+	}
+}
+
+static void usbi_destroy_ep_queues(struct usbi_dev_handle *hdev)
+{
+	int i;
+
+	for (i = 0; i < USBI_MAXENDPOINTS; i++)
+		pthread_mutex_destroy(&hdev->ep[i].lock);
 }
 
 /*
@@ -892,9 +1007,9 @@ int32_t openusb_open_device(openusb_handle_t handle, openusb_devid_t devid,
 		return OPENUSB_NO_RESOURCES;
 
 	/* protect cur_dev_handle */
-	pthread_mutex_lock(&usbi_lock);
+	usbi_mutex_lock(&usbi_lock, USBI_LOCK_GLOBAL);
 	hdev->handle = cur_dev_handle++;
-	pthread_mutex_unlock(&usbi_lock);
+	usbi_mutex_unlock(&usbi_lock);
 
 	hdev->lib_hdl = hdl;
 	hdev->idev = idev;
@@ -910,26 +1025,24 @@ int32_t openusb_open_device(openusb_handle_t handle, openusb_devid_t devid,
 		hdev->claimed_ifs[i].altsetting = -1;
 	}
 	
-	list_init(&hdev->io_head);
+	usbi_init_ep_queues(hdev);
 	list_init(&hdev->m_head);
 	
-	/* backend open will use event_pipe. so create pipe first */
-	if (pipe(hdev->event_pipe) < 0) {
-		pthread_mutex_destroy(&hdev->lock);
-		free(hdev);
-		return OPENUSB_SYS_FUNC_FAILURE;
-	}
+	/* backends that need the event pipe create it in their open */
+	hdev->event_pipe[0] = hdev->event_pipe[1] = -1;
 
 	ret = idev->ops->open(hdev);
 	if (ret < 0) {
+		usbi_close_event_pipe(hdev);
+		usbi_destroy_ep_queues(hdev);
 		pthread_mutex_destroy(&hdev->lock);
 		free(hdev);
 		return ret;
 	}
 
-	pthread_mutex_lock(&usbi_dev_handles.lock);
+	usbi_mutex_lock(&usbi_dev_handles.lock, USBI_LOCK_DEV_HANDLES);
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
 	list_add(&hdev->list, &usbi_dev_handles.head);
 	hdev->state = USBI_DEVICE_OPENED;
@@ -937,9 +1050,9 @@ int32_t openusb_open_device(openusb_handle_t handle, openusb_devid_t devid,
 	/* do we need to add the handle to idev and make a ref count */
 	*dev = hdev->handle;
 
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
-	pthread_mutex_unlock(&usbi_dev_handles.lock);
+	usbi_mutex_unlock(&usbi_dev_handles.lock);
 
 	/* get current device configuration value */
 	ret = openusb_get_configuration(*dev, &cfg);
@@ -955,7 +1068,8 @@ int32_t openusb_open_device(openusb_handle_t handle, openusb_devid_t devid,
 int32_t openusb_close_device(openusb_dev_handle_t dev)
 {
         struct usbi_dev_handle *hdev;
-        int ret;
+        struct usbi_ep_queue *q;
+        int ret, i;
         struct usbi_io *io, *tio;
 
         if (!dev) {
@@ -968,36 +1082,39 @@ int32_t openusb_close_device(openusb_dev_handle_t dev)
         }
 
         /* FIXME: need to abort the outstanding io request first */
-        pthread_mutex_lock(&hdev->lock);
-
-        list_for_each_entry_safe(io, tio, &hdev->io_head, list) {
-                if (io)
-                {
-                        pthread_mutex_unlock(&hdev->lock);
-                        usbi_free_io(io);
-                        pthread_mutex_lock(&hdev->lock);
+        for (i = 0; i < USBI_MAXENDPOINTS; i++) {
+                q = &hdev->ep[i];
+                usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
+
+                list_for_each_entry_safe(io, tio, &q->io_head, list) {
+                        if (io)
+                        {
+                                usbi_mutex_unlock(&q->lock);
+                                usbi_free_io(io);
+                                usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
+                        }
                 }
+                usbi_mutex_unlock(&q->lock);
         }
-        pthread_mutex_unlock(&hdev->lock);
 
         ret = OPENUSB_SUCCESS;
         if (hdev && hdev->idev && hdev->idev->ops && hdev->idev->ops->close) {
                 ret = hdev->idev->ops->close(hdev);
         }
 
-        pthread_mutex_lock(&usbi_dev_handles.lock);
+        usbi_mutex_lock(&usbi_dev_handles.lock, USBI_LOCK_DEV_HANDLES);
 
-        pthread_mutex_lock(&hdev->lock);
+        usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 
         list_del(&hdev->list);
 
-        close(hdev->event_pipe[0]);
-        close(hdev->event_pipe[1]);
+        usbi_close_event_pipe(hdev);
 
-        pthread_mutex_unlock(&hdev->lock);
+        usbi_mutex_unlock(&hdev->lock);
 
-        pthread_mutex_unlock(&usbi_dev_handles.lock);
+        usbi_mutex_unlock(&usbi_dev_handles.lock);
 
+        usbi_destroy_ep_queues(hdev);
         pthread_mutex_destroy(&hdev->lock);
 
         free(hdev);
@@ -1005,6 +1122,131 @@ int32_t openusb_close_device(openusb_dev_handle_t dev)
         return ret;
 }
 
+/*
+ * Open or close a batch of devices concurrently. Up to USBI_BATCH_MAX_THREADS
+ * workers keep taking the next device off the batch until it's done, so a
+ * batch of n slow devices takes about ceil(n / USBI_BATCH_MAX_THREADS) times
+ * as long as one of them rather than n times.
+ */
+struct usbi_batch {
+	openusb_handle_t	handle;
+	openusb_init_flag_t	flags;
+	openusb_devid_t		*devids;	/* devices to open, NULL to close */
+	openusb_dev_handle_t	*devs;
+	int32_t			*status;
+	uint32_t		num;
+	uint32_t		next;		/* next device to hand out */
+	pthread_mutex_t		lock;
+};
+
+static void *usbi_batch_worker(void *arg)
+{
+	struct usbi_batch *batch = (struct usbi_batch *)arg;
+	uint32_t i;
+
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (i >= batch->num)
+			break;
+
+		if (batch->devids) {
+			batch->status[i] = openusb_open_device(batch->handle,
+				batch->devids[i], batch->flags, &batch->devs[i]);
+		} else {
+			batch->status[i] = openusb_close_device(batch->devs[i]);
+		}
+	}
+
+	return NULL;
+}
+
+static int32_t usbi_run_batch(struct usbi_batch *batch, int32_t *status)
+{
+	pthread_t threads[USBI_BATCH_MAX_THREADS - 1];
+	uint32_t nthreads = 0, i;
+	int32_t ret = OPENUSB_SUCCESS;
+
+	/* the caller doesn't have to care about per-device status */
+	batch->status = status;
+	if (!batch->status) {
+		batch->status = calloc(batch->num, sizeof(int32_t));
+		if (!batch->status)
+			return OPENUSB_NO_RESOURCES;
+	}
+
+	batch->next = 0;
+	pthread_mutex_init(&batch->lock, NULL);
+
+	/* this thread works on the batch as well */
+	for (i = 0; i < USBI_BATCH_MAX_THREADS - 1 && i < batch->num - 1; i++) {
+		if (pthread_create(&threads[nthreads], NULL, usbi_batch_worker,
+			batch) != 0) {
+			usbi_debug(NULL, 2, "unable to create batch thread");
+			break;
+		}
+		nthreads++;
+	}
+	usbi_batch_worker(batch);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&batch->lock);
+
+	/* report the first failure */
+	for (i = 0; i < batch->num; i++) {
+		if (batch->status[i] != OPENUSB_SUCCESS) {
+			ret = batch->status[i];
+			break;
+		}
+	}
+
+	if (batch->status != status)
+		free(batch->status);
+
+	return ret;
+}
+
+int32_t openusb_open_devices(openusb_handle_t handle, openusb_devid_t *devids,
+	uint32_t num, openusb_init_flag_t flags, openusb_dev_handle_t *devs,
+	int32_t *status)
+{
+	struct usbi_batch batch;
+
+	if (!devids || !devs || !num)
+		return OPENUSB_BADARG;
+
+	if (!usbi_find_handle(handle))
+		return OPENUSB_INVALID_HANDLE;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.handle = handle;
+	batch.flags = flags;
+	batch.devids = devids;
+	batch.devs = devs;
+	batch.num = num;
+
+	return usbi_run_batch(&batch, status);
+}
+
+int32_t openusb_close_devices(openusb_dev_handle_t *devs, uint32_t num,
+	int32_t *status)
+{
+	struct usbi_batch batch;
+
+	if (!devs || !num)
+		return OPENUSB_BADARG;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.devs = devs;
+	batch.num = num;
+
+	return usbi_run_batch(&batch, status);
+}
+
 int32_t openusb_get_devid(openusb_dev_handle_t dev, openusb_devid_t *devid)
 {
 	struct usbi_dev_handle *hdev;
@@ -1017,9 +1259,9 @@ int32_t openusb_get_devid(openusb_dev_handle_t dev, openusb_devid_t *devid)
 	if (!hdev)
 		return OPENUSB_UNKNOWN_DEVICE;
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	*devid = hdev->idev->devid;
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return OPENUSB_SUCCESS;
 }
@@ -1037,9 +1279,9 @@ int32_t openusb_get_lib_handle(openusb_dev_handle_t dev,
 	if (!hdev)
 		return OPENUSB_UNKNOWN_DEVICE;
 
-	pthread_mutex_lock(&hdev->lock);
+	usbi_mutex_lock(&hdev->lock, USBI_LOCK_DEV);
 	*lib_handle = hdev->lib_hdl->handle;
-	pthread_mutex_unlock(&hdev->lock);
+	usbi_mutex_unlock(&hdev->lock);
 
 	return OPENUSB_SUCCESS;
 }
@@ -1048,64 +1290,89 @@ int32_t openusb_get_lib_handle(openusb_dev_handle_t dev,
 int openusb_abort(openusb_request_handle_t phdl)
 {
 	struct usbi_dev_handle *hdev;
-	struct usbi_io *io,*tio;
-	int ret = OPENUSB_PLATFORM_FAILURE; 
-
-	#ifndef __APPLE__
-		char buf[1]={1};	/* We don't need this on OS/X */
-	#endif
+	struct usbi_ep_queue *q;
+	struct usbi_io *io;
+	int ret;
 
 	if(!phdl) {
 		return OPENUSB_INVALID_HANDLE;
 	}
 
-	/* We're looking at all open devices (open devices are ones we have
-	 * handles for) and search for io requests with the specified tag.
-	 * When we find one we'll cancel it. We don't lock here because we
-	 * leave it up to the backend to handle that appropriately.
+	hdev = usbi_find_dev_handle(phdl->dev);
+	if (!hdev)
+		return OPENUSB_INVALID_HANDLE;
+
+	if (!hdev->idev->ops->io_cancel)
+		return OPENUSB_NOT_SUPPORTED;
+
+	/*
+	 * The request points at its io while it is queued, and only its
+	 * endpoint's queue lock changes that. Once completed the pointer goes
+	 * stale, and the io's magic is cleared as it leaves the queue, so the
+	 * io is only trusted while it carries the magic and points back at
+	 * the request. That keeps abort O(1) however deep the queue is.
 	 */
-	pthread_mutex_lock(&usbi_dev_handles.lock);
+	q = usbi_ep_queue(hdev, phdl);
+	usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
+
+	io = phdl->io;
+	if (!io || io->magic != USBI_IO_MAGIC || io->req != phdl ||
+	    io->queue != q) {
+		usbi_mutex_unlock(&q->lock);
+		return OPENUSB_INVALID_HANDLE; /* not in flight */
+	}
 
-	list_for_each_entry(hdev, &usbi_dev_handles.head, list) {
-		if (hdev) {
-			pthread_mutex_unlock(&usbi_dev_handles.lock);
-	
-			pthread_mutex_lock(&hdev->lock);
-			list_for_each_entry_safe(io, tio, &hdev->io_head, list) {
-				if (io->req == phdl) {
-				/* Is it possible for one request to put on multiple
-			 	* device's request list? No
-			 	*/
-					ret = hdev->idev->ops->io_cancel(io);
-					if (ret != 0) {
-						usbi_debug(hdev->lib_hdl, 1,
-							"abort error");
-					} else {
-						
-						/* We don't use the timeout thread on OS/X and there's no 
-					 	* IO polling on OS/X as there is on Linux, so there's no 
-					 	* good place to read from this pipe to keep it cleared out 
-					 	* (it will block if we just write without reading). So, we 
-					 	* won't bother writing to it if we're on OS/X */
-						#ifndef __APPLE__
-							write(hdev->event_pipe[1],buf, 1); /* wake up timeout thread */
-						#endif
-	
-						/*free io?*/
-					}
-					pthread_mutex_unlock(&hdev->lock);
-					return ret;
-				}
+	ret = hdev->idev->ops->io_cancel(io);
+	if (ret != 0)
+		usbi_debug(hdev->lib_hdl, 1, "abort error");
+	else
+		usbi_notify_event_pipe(hdev); /* wake up timeout thread */
+
+	usbi_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+int32_t openusb_abort_endpoint(openusb_dev_handle_t dev, uint8_t ept)
+{
+	struct usbi_dev_handle *hdev;
+	struct usbi_ep_queue *q;
+	struct usbi_io *io, *tio;
+	int ret = OPENUSB_SUCCESS;
+
+	hdev = usbi_find_dev_handle(dev);
+	if (!hdev)
+		return OPENUSB_UNKNOWN_DEVICE;
+
+	/* the default pipe's queue carries control requests both ways */
+	if ((ept & USB_ENDPOINT_NUM_MASK) == 0)
+		q = &hdev->ep[0];
+	else
+		q = &hdev->ep[USBI_EP_INDEX(ept)];
+
+	usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
+
+	if (hdev->idev->ops->abort_endpoint) {
+		ret = hdev->idev->ops->abort_endpoint(hdev, q);
+	} else if (!hdev->idev->ops->io_cancel) {
+		ret = OPENUSB_NOT_SUPPORTED;
+	} else {
+		list_for_each_entry_safe(io, tio, &q->io_head, list) {
+			if (io->status != USBI_IO_INPROGRESS)
+				continue;
+
+			if (hdev->idev->ops->io_cancel(io) != 0) {
+				usbi_debug(hdev->lib_hdl, 1, "abort error");
+				ret = OPENUSB_PLATFORM_FAILURE;
 			}
-			pthread_mutex_unlock(&hdev->lock);
-	
-			pthread_mutex_lock(&usbi_dev_handles.lock);
 		}
 	}
 
-	pthread_mutex_unlock(&usbi_dev_handles.lock);
+	usbi_mutex_unlock(&q->lock);
+
+	usbi_notify_event_pipe(hdev); /* wake up timeout thread */
 
-	return (OPENUSB_INVALID_HANDLE); /* can't find specified request */
+	return ret;
 }
 
 
@@ -1222,7 +1489,9 @@ const char *openusb_strerror(int32_t error)
 void *timeout_thread(void *arg)
 {
 	struct usbi_dev_handle *devh;
+	struct usbi_ep_queue *q;
 	struct usbi_io *io, *tio;
+	int i;
 
 	devh = (struct usbi_dev_handle *)arg;
 
@@ -1247,12 +1516,12 @@ void *timeout_thread(void *arg)
 		 *    see cancellation(5) on Solaris for detail.
 		 */
 
-		pthread_mutex_lock(&devh->lock);
+		usbi_mutex_lock(&devh->lock, USBI_LOCK_DEV);
 		/* Always check the event_pipe and the devices file */
 		FD_SET(devh->event_pipe[0], &readfds);
 
 		maxfd = devh->event_pipe[0];
-		pthread_mutex_unlock(&devh->lock);
+		usbi_mutex_unlock(&devh->lock);
 
 		gettimeofday(&tvc, NULL);
 
@@ -1262,27 +1531,30 @@ void *timeout_thread(void *arg)
 		 * find the next soonest timeout so select() knows how
 		 * long to wait
 		 */  
-		pthread_mutex_lock(&devh->lock);
+		for (i = 0; i < USBI_MAXENDPOINTS; i++) {
+			q = &devh->ep[i];
+			usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
 
-		list_for_each_entry(io, &devh->io_head, list) {
-		/* safe */
-			if (io) {
-				/* avoid possible process on aborted io request */
-				if (io->status != USBI_IO_INPROGRESS) {
-	
-					continue;
-				}
-	
-				if (io->tvo.tv_sec &&
-					(!tvo.tv_sec ||
-				 	usbi_timeval_compare(&io->tvo, &tvo))) {
-					/* New soonest timeout */
-	
-					memcpy(&tvo, &io->tvo, sizeof(tvo));
+			list_for_each_entry(io, &q->io_head, list) {
+			/* safe */
+				if (io) {
+					/* avoid possible process on aborted io request */
+					if (io->status != USBI_IO_INPROGRESS) {
+
+						continue;
+					}
+
+					if (io->tvo.tv_sec &&
+						(!tvo.tv_sec ||
+					 	usbi_timeval_compare(&io->tvo, &tvo))) {
+						/* New soonest timeout */
+
+						memcpy(&tvo, &io->tvo, sizeof(tvo));
+					}
 				}
 			}
+			usbi_mutex_unlock(&q->lock);
 		}
-		pthread_mutex_unlock(&devh->lock);
 
 		/* calculate the timeout for select() based on 
 		 * what we found above
@@ -1325,33 +1597,36 @@ void *timeout_thread(void *arg)
 			char buf[16];
 			read(devh->event_pipe[0], buf, sizeof(buf));
 
-			pthread_mutex_lock(&devh->lock);
+			usbi_mutex_lock(&devh->lock, USBI_LOCK_DEV);
 			if(devh->state == USBI_DEVICE_CLOSING) {
 			/* device is closing, exit this thread */
 
-				pthread_mutex_unlock(&devh->lock);
+				usbi_mutex_unlock(&devh->lock);
 				return NULL;
 			}
-			pthread_mutex_unlock(&devh->lock);
+			usbi_mutex_unlock(&devh->lock);
 		}
 
 		pthread_testcancel();
 		/* now we'll process any pending io requests & timeouts */
-		pthread_mutex_lock(&devh->lock);
+		for (i = 0; i < USBI_MAXENDPOINTS; i++) {
+			q = &devh->ep[i];
+			usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
 
-		list_for_each_entry_safe(io, tio, &devh->io_head, list) {
-			if (io) {
-				pthread_mutex_unlock(&devh->lock);
-				if (usbi_timeval_compare(&io->tvo, &tvc) <= 0) {
-	
-					usbi_io_complete(io, OPENUSB_IO_TIMEOUT, 0);
-	
+			list_for_each_entry_safe(io, tio, &q->io_head, list) {
+				if (io) {
+					usbi_mutex_unlock(&q->lock);
+					if (usbi_timeval_compare(&io->tvo, &tvc) <= 0) {
+
+						usbi_io_complete(io, OPENUSB_IO_TIMEOUT, 0);
+
+					}
+					usbi_mutex_lock(&q->lock, USBI_LOCK_EP);
 				}
-				pthread_mutex_lock(&devh->lock);
 			}
-		}
 
-		pthread_mutex_unlock(&devh->lock);
+			usbi_mutex_unlock(&q->lock);
+		}
 	}
 
 	return NULL;
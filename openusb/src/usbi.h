@@ -49,6 +49,48 @@ struct usbi_bus {
 	struct usbi_bus_private	*priv;	/* backend specific data */
 };
 
+/* a string descriptor read from a device, see usbi_get_string() */
+struct usbi_string {
+	struct usbi_string	*next;
+	uint8_t			index;
+	uint16_t		langid;
+	uint8_t			*raw;	/* descriptor as the device sent it */
+	char			*utf8;	/* decoded bString */
+};
+
+/* timeout of string descriptor requests, in ms */
+#define USBI_STRING_TIMEOUT	100
+
+/* buckets of the devid hash, a power of two */
+#define USBI_DEVID_HASH		64
+
+/* where the descriptors of an alternate setting are in its configuration */
+struct usbi_alt_index {
+	uint8_t			ifc;		/* bInterfaceNumber */
+	uint8_t			alt;		/* bAlternateSetting */
+	uint16_t		offset;		/* of the interface descriptor */
+	uint16_t		first_ep;	/* in the endpoint offsets */
+	uint16_t		num_eps;	/* endpoint descriptors that follow */
+};
+
+/*
+ * A raw configuration descriptor with the offsets of its interface and
+ * endpoint descriptors, built in one pass over it. The alternate settings
+ * are sorted by interface and setting, so an interface's settings are
+ * found straight from its number (devices.c).
+ */
+struct usbi_desc_index {
+	uint8_t			*raw;
+	uint16_t		rawlen;
+
+	uint16_t		num_alts;
+	struct usbi_alt_index	*alts;
+	uint16_t		*ep_offsets;
+
+	uint16_t		ifc_first[256];	/* indexed by bInterfaceNumber */
+	uint8_t			ifc_num_alts[256];
+};
+
 /* internal representation of USB device, counterpart of openusb_devid_t */
 struct usbi_device {
 	struct list_head	dev_list;
@@ -62,11 +104,17 @@ struct usbi_device {
 	uint8_t			bus_addr;
 	struct usbi_bus		*bus;
 	struct usbi_device	*parent;/* NULL for root hub */
-	uint8_t			pport;	/* parent port */
+	uint8_t			pport;	/* parent port, 1 based, 0 if unknown */
 	uint8_t			nports;	/* number of ports */
 	char			sys_path[PATH_MAX + 1];
 	char			bus_path[OPENUSB_BUS_PATH_MAX];
+	/*
+	 * Indexed by port - 1, filled in by usbi_add_device() when the backend
+	 * has set parent and pport. Like parent, protected by usbi_devices.lock
+	 * once the device is added.
+	 */
 	struct usbi_device	**children;
+	struct usbi_device	*devid_next; /* devid hash chain */
 	struct usbi_device_ops	*ops;
 
 	uint8_t			cur_config_value;/* bConfigurationValue */
@@ -76,6 +124,14 @@ struct usbi_device {
 	
 	int found; /* used by some backend for search */
 	struct usbi_descriptors desc; /* temp */
+
+	/* string descriptors read so far, index 0 is the LANGID table */
+	struct usbi_string	*strings;
+
+	/* configuration descriptors indexed so far, by descriptor index */
+	struct usbi_desc_index	*desc_index[USBI_MAXCONFIG];
+
+	uint32_t		rec_index; /* in the traffic recording, 0 if not */
 };
 
 struct usbi_event_callback {
@@ -104,6 +160,37 @@ struct usbi_handle {
 	int32_t complete_count;
 
 	uint32_t	timeout[USB_TYPE_LAST];
+
+	/* told of pollfds coming and going, protected by usbi_handles.lock */
+	openusb_pollfd_added_callback_t		pollfd_added;
+	openusb_pollfd_removed_callback_t	pollfd_removed;
+	void					*pollfd_arg;
+};
+
+/*
+ * Lock classes for lock statistics, see lockstat.c. Take the library's
+ * mutexes with usbi_mutex_lock() and friends, naming their class.
+ */
+enum usbi_lock_class {
+	USBI_LOCK_GLOBAL,		/* usbi_lock */
+	USBI_LOCK_HANDLES,		/* usbi_handles.lock */
+	USBI_LOCK_DEV_HANDLES,		/* usbi_dev_handles.lock */
+	USBI_LOCK_DEVICES,		/* usbi_devices.lock */
+	USBI_LOCK_BUSES,		/* usbi_buses.lock */
+	USBI_LOCK_BUS,			/* usbi_bus lock and devices.lock */
+	USBI_LOCK_EVENT_CALLBACKS,	/* event_callbacks.lock */
+	USBI_LOCK_HANDLE,		/* usbi_handle lock */
+	USBI_LOCK_COMPLETE,		/* usbi_handle complete_lock */
+	USBI_LOCK_DEV,			/* usbi_dev_handle lock */
+	USBI_LOCK_EP,			/* usbi_ep_queue lock */
+	USBI_LOCK_IO,			/* usbi_io lock */
+	USBI_LOCK_STRINGS,		/* usbi_strings_lock */
+	USBI_LOCK_DESC,			/* usbi_desc_lock */
+	USBI_LOCK_MULTI,		/* multi-xfer request lock */
+	USBI_LOCK_STREAM,		/* isochronous stream lock */
+	USBI_LOCK_CHANNEL,		/* buffered bulk channel lock */
+	USBI_LOCK_POLLFDS,		/* usbi_pollfds_lock */
+	USBI_LOCK_CLASS_COUNT
 };
 
 #define USBI_IFC_UNCLAIMED 0
@@ -122,12 +209,33 @@ enum usbi_devstate{
 
 #define USBI_MAXINTERFACES	32
 
+/*
+ * threads used by openusb_open_devices()/openusb_close_devices(), the 16
+ * is documented in openusb.h.in and functions.xml
+ */
+#define USBI_BATCH_MAX_THREADS	16
+
+/* endpoint queues, OUT endpoints first, then IN endpoints */
+#define USBI_MAXENDPOINTS	32
+#define USBI_EP_INDEX(addr) \
+	(((addr) & USB_ENDPOINT_NUM_MASK) + ((addr) & USB_ENDPOINT_IN ? 16 : 0))
+
+/*
+ * The outstanding io requests of one endpoint. Requests on different
+ * endpoints of a device don't share a lock, control requests in either
+ * direction all go on the queue of endpoint 0.
+ */
+struct usbi_ep_queue {
+	pthread_mutex_t		lock;	/* io_head and submitting to the backend */
+	struct list_head	io_head;
+};
+
 /* internal representation of openusb_dev_handle_t */
 struct usbi_dev_handle {
 	struct list_head	list;
 
 	/* keep track of this device's outstanding io requests */
-	struct list_head io_head;
+	struct usbi_ep_queue	ep[USBI_MAXENDPOINTS];
 
 	struct list_head m_head; /* multi-xfer request list */
 
@@ -139,9 +247,14 @@ struct usbi_dev_handle {
 	/*claimed interfaces of this dev */
 	struct interface_set claimed_ifs[USBI_MAXINTERFACES];
 
-	pthread_mutex_t lock; /* protect all data field in this structure */
+	/*
+	 * protects the device wide state: claimed_ifs, state, m_head and the
+	 * event pipe. It changes on open, close and claiming, requests only
+	 * take the lock of their endpoint queue
+	 */
+	pthread_mutex_t lock;
 
-	int event_pipe[2]; /* event pipe */
+	int event_pipe[2]; /* timeout thread event pipe, -1 until opened */
 
 	enum usbi_devstate state; /* device current state */
 
@@ -160,12 +273,19 @@ enum usbi_io_status {
 #define USBI_ASYNC 1
 #define USBI_SYNC 0
 
+/* usbi_io.magic while the io is on its endpoint queue */
+#define USBI_IO_MAGIC	0x5553424f
+
 /* internal representation of openusb I/O request */
 struct usbi_io {
 	struct list_head	list;
 	pthread_mutex_t		lock;
 	struct usbi_dev_handle	*dev;
+	struct usbi_ep_queue	*queue;	/* the io is on its io_head, and
+					 * req->io points back while it is */
 	openusb_request_handle_t	req;
+	uint32_t		magic;	/* USBI_IO_MAGIC while queued, lets
+					 * openusb_abort() trust req->io */
 
 	enum usbi_io_status status; /* status of this io request */
 
@@ -179,6 +299,11 @@ struct usbi_io {
 
 	pthread_cond_t		cond;	/* for waiting on completion */
 	struct usbi_io_private	*priv;	/* backend specific data */
+
+	uint8_t			*bounce; /* the data of a scatter-gather request,
+					  * gathered for the backend */
+
+	uint32_t		rec_id;	/* recorded request, 0 if not, record.c */
 };
 
 /*
@@ -264,6 +389,13 @@ struct usbi_device_ops {
 	/* I/O abort function */
 	int32_t (*io_cancel)(struct usbi_io *io);
 
+	/*
+	 * cancel every request on an endpoint queue, called with the queue
+	 * locked. Optional, io_cancel is called for each request if NULL
+	 */
+	int32_t (*abort_endpoint)(struct usbi_dev_handle *hdev,
+		struct usbi_ep_queue *q);
+
 	/* Non-portable functions */
 	int32_t (*get_driver_np)(struct usbi_dev_handle *hdev, uint8_t interface,
 													char *name, uint32_t namelen);
@@ -294,6 +426,27 @@ struct usbi_backend_ops {
 	 */
 	int io_pattern;
 
+	/*
+	 * set if the backend takes scatter-gather interrupt and bulk requests
+	 * as they are, otherwise their data is gathered into io->bounce and
+	 * the backend finds it with usbi_io_payload()
+	 */
+	int io_iovec;
+
+	/*
+	 * with PATTERN_BOTH, the largest request of each type the *_xfer_wait
+	 * functions are given, larger ones go through the asynchronous
+	 * functions, as do all of a type without one; 0 for no limit
+	 */
+	uint32_t sync_xfer_max[USB_TYPE_LAST];
+
+	/*
+	 * with PATTERN_BOTH and not 0, only requests with a timeout of at most
+	 * this many ms go to the *_xfer_wait functions, the others, and those
+	 * without a timeout, stay abortable through the asynchronous functions
+	 */
+	uint32_t sync_timeout_max;
+
 	/*
 	 * backend initialization, called in openusb_init()
 	 *   flags - inherited from openusb_init(), TBD
@@ -324,6 +477,15 @@ struct usbi_backend_ops {
 	 */
 	void (*free_device)(struct usbi_device *idev);
 
+	/*
+	 * with OPENUSB_INIT_NO_THREADS, the milliseconds until the backend's
+	 * soonest request times out (-1 if none does), and expiring those
+	 * that have, called from the application's thread. NULL if the
+	 * backend keeps no timeouts of its own
+	 */
+	int32_t (*next_timeout)(void);
+	void (*handle_timeouts)(void);
+
 
 	struct usbi_device_ops dev;
 };
@@ -366,10 +528,38 @@ struct usbi_handle *usbi_find_handle(openusb_handle_t handle);
 
 openusb_request_handle_t usbi_alloc_request_handle(void);
 void *timeout_thread(void *arg);
+int32_t usbi_open_event_pipe(struct usbi_dev_handle *hdev);
+void usbi_notify_event_pipe(struct usbi_dev_handle *hdev);
 int32_t usbi_get_driver_np(openusb_dev_handle_t dev, uint8_t interface,
 			   char *name, uint32_t namelen);
 int32_t usbi_attach_kernel_driver_np(openusb_dev_handle_t dev, uint8_t interface);
 int32_t usbi_detach_kernel_driver_np(openusb_dev_handle_t dev, uint8_t interface);
+int usbi_threads_enabled(void);
+int32_t usbi_backends_next_timeout(void);
+void usbi_backends_handle_timeouts(void);
+void usbi_dispatch_event_callbacks(void);
+
+/*
+ * events.c
+ *
+ * Without threads, backends register the descriptors their threads would
+ * have polled. The handler runs in whichever thread handles events, it may
+ * still be called once the fd has been removed and must find its state
+ * from the fd rather than trust arg to be alive.
+ */
+typedef void (*usbi_pollfd_handler_t)(int fd, short revents, void *arg);
+
+int32_t usbi_add_pollfd(int fd, short events, usbi_pollfd_handler_t handler,
+	void *arg);
+void usbi_remove_pollfd(int fd);
+int32_t usbi_events_init(void);
+void usbi_events_fini(void);
+void usbi_events_wakeup(void);
+int32_t usbi_handle_events(int32_t timeout);
+void usbi_wait_events(pthread_cond_t *cv, pthread_mutex_t *m,
+	enum usbi_lock_class c);
+int usbi_wait_events_until(pthread_cond_t *cv, pthread_mutex_t *m,
+	enum usbi_lock_class c, const struct timespec *ts);
 
 /* io.c */
 int usbi_io_sync(struct usbi_dev_handle *dev, openusb_request_handle_t req);
@@ -377,11 +567,20 @@ int usbi_io_async(struct usbi_io *iop);
 
 void usbi_io_complete(struct usbi_io *io, int32_t status,
 	size_t transferred_bytes);
+void usbi_isoc_frames(struct usbi_io *io, uint32_t first, uint32_t num,
+	uint32_t frame, uint32_t interval);
 
+struct usbi_ep_queue *usbi_ep_queue(struct usbi_dev_handle *dev,
+	openusb_request_handle_t req);
 struct usbi_io *usbi_alloc_io(struct usbi_dev_handle *dev,
 	openusb_request_handle_t req, unsigned int timeout);
 void usbi_free_io(struct usbi_io *io);
 
+int32_t usbi_req_iov_length(openusb_request_handle_t req);
+struct iovec *usbi_req_iov(openusb_request_handle_t req, uint32_t *iovcnt);
+int32_t usbi_io_bounce(struct usbi_io *io);
+uint8_t *usbi_io_payload(struct usbi_io *io);
+
 int usbi_async_submit(struct usbi_io *io);
 int usbi_sync_submit(struct usbi_io *io);
 
@@ -400,14 +599,22 @@ void usbi_remove_device(struct usbi_device *idev);
 void usbi_free_device(struct usbi_device *idev);
 void usbi_rescan_devices(void);
 struct usbi_device *usbi_find_device_by_id(openusb_devid_t devid);
+struct usbi_device *usbi_lookup_device(openusb_devid_t devid);
 struct usbi_bus *usbi_find_bus_by_num(unsigned int busnum);
 int usbi_get_string(openusb_dev_handle_t dev, int index, int langid, char *buf,
     size_t buflen);
 int usbi_get_string_simple(openusb_dev_handle_t dev, int index, char *buf,
     size_t buflen);
+int usbi_get_langid(openusb_dev_handle_t dev);
+void usbi_flush_string_cache(struct usbi_device *idev);
+void usbi_flush_desc_index(struct usbi_device *idev);
 struct usbi_list *usbi_get_devices_list(void);
 uint8_t usbi_get_cfg_value_by_index(struct usbi_dev_handle *hdev, int cfgndx);
 int usbi_get_cfg_index_by_value(struct usbi_dev_handle *hdev, uint8_t cfgval);
+uint32_t usbi_ep_interval(struct usbi_dev_handle *hdev, uint8_t ifc,
+	uint8_t ept);
+uint32_t usbi_ep_max_packet(struct usbi_dev_handle *hdev, uint8_t ifc,
+	uint8_t ept);
 
 /* api.c */
 int32_t usbi_get_xfer_timeout(openusb_request_handle_t req, 
@@ -415,4 +622,19 @@ int32_t usbi_get_xfer_timeout(openusb_request_handle_t req,
 int32_t usbi_control_xfer(struct usbi_dev_handle *devh,int requesttype,
 	int request, int value, int index, char *bytes, int size, int timeout);
 
+/* lockstat.c */
+void usbi_lockstat_init(void);
+int usbi_mutex_lock(pthread_mutex_t *m, enum usbi_lock_class c);
+int usbi_mutex_unlock(pthread_mutex_t *m);
+int usbi_cond_wait(pthread_cond_t *cv, pthread_mutex_t *m);
+int usbi_cond_timedwait(pthread_cond_t *cv, pthread_mutex_t *m,
+	const struct timespec *ts);
+
+/* record.c */
+int32_t usbi_record_init(void);
+void usbi_record_fini(void);
+struct usbi_device_ops *usbi_record_ops(struct usbi_device_ops *ops);
+void usbi_record_complete(struct usbi_io *io, int32_t status,
+	size_t transferred);
+
 #endif /* _WRAPPER_H_ */
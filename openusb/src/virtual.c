@@ -0,0 +1,2240 @@
+/*
+ * Virtual USB device support
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ *
+ * This backend simulates buses and devices entirely in userspace, so the
+ * frontend and applications can be exercised and benchmarked without any
+ * hardware. It stays out of the way unless virtual devices are configured
+ * through the environment:
+ *
+ *	OPENUSB_VIRTUAL_CONFIG	file with the configuration below
+ *	OPENUSB_VIRTUAL		the same, inline, ';' separates lines
+ *
+ * The configuration is a list of lines, '#' starts a comment:
+ *
+ *	bus
+ *		start a new bus. Every bus has a root hub, a bus holds at most
+ *		VIRTUAL_MAX_DEVICES devices and a new one is started as needed.
+ *
+ *	device [count=N] [vid=V] [pid=P] [speed=low|full|high|super]
+ *	       [desc=FILE] [manufacturer=S] [product=S] [serial=S]
+ *	       [latency=US] [bandwidth=B] [stall=N] [timeout=N]
+ *	       [disconnect=N] [loopback=0|1] [loopsize=B]
+ *		add N (default 1) devices. Without desc= the device has one
+ *		configuration with a single vendor specific interface holding
+ *		the endpoints below, or bulk 0x01/0x81, interrupt 0x02/0x82
+ *		and isochronous 0x03/0x83 endpoints if none are given. desc=
+ *		names a file with the raw device descriptor followed by the
+ *		configuration descriptors. latency, bandwidth, stall and
+ *		timeout are the defaults of the device's endpoints, latency
+ *		also applies to ep0.
+ *
+ *	endpoint ADDR [type=bulk|interrupt|isoc] [maxpacket=N] [interval=N]
+ *	         [latency=US] [bandwidth=B] [stall=N] [timeout=N]
+ *		add an endpoint to the last device or, with desc=, override
+ *		the model of one of its endpoints.
+ *
+ * Numbers may be given in hex and take k, M and G (powers of 1000).
+ *
+ *	latency=US	microseconds from the end of a transfer on the bus to
+ *			its completion.
+ *	bandwidth=B	bytes per second an endpoint moves, transfers on an
+ *			endpoint are serialized. 0 (the default) is unlimited.
+ *	stall=N		every Nth transfer on an endpoint stalls it, until
+ *			the halt is cleared.
+ *	timeout=N	every Nth transfer is lost and runs into its timeout.
+ *	disconnect=N	the device drops off the bus when its Nth bulk,
+ *			interrupt or isochronous transfer is submitted, that
+ *			and any pending transfer fail.
+ *	loopback=1	(default) data written to an OUT endpoint is read back
+ *			from the IN endpoint with the same number, through a
+ *			loopsize (default 1M) buffer. With loopback=0 IN
+ *			endpoints produce data and OUT endpoints consume it.
+ *
+ * Vendor and class control requests are looped back through a 4K buffer,
+ * standard requests are answered from the descriptors.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "usbi.h"
+#include "virtual.h"
+
+static struct list_head virtual_buses = { .prev = &virtual_buses,
+		.next = &virtual_buses };
+static int              virtual_num_buses = 0;
+static int32_t          virtual_backend_inited = 0;
+
+/*
+ * Everything below is protected by virtual_lock: the models, the loopback
+ * buffers and the queue of requests in flight. The queue is a binary heap
+ * ordered by the time the request is due, the io thread sleeps until the
+ * first one is.
+ */
+static pthread_mutex_t          virtual_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           virtual_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t                virtual_thread;
+static int                      virtual_thread_exit = 0;
+static int                      virtual_pipe[2] = { -1, -1 };	/* no thread */
+static struct usbi_io_private   **virtual_heap = NULL;
+static int                      virtual_heap_len = 0;
+static int                      virtual_heap_size = 0;
+
+
+
+/******************************************************************************
+ *                              Request Queue                                 *
+ *****************************************************************************/
+
+static uint64_t virtual_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void virtual_heap_set(int i, struct usbi_io_private *p)
+{
+	virtual_heap[i] = p;
+	p->heap_idx = i;
+}
+
+static void virtual_heap_up(int i)
+{
+	struct usbi_io_private *p = virtual_heap[i];
+
+	while (i > 0 && virtual_heap[(i - 1) / 2]->when > p->when) {
+		virtual_heap_set(i, virtual_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	virtual_heap_set(i, p);
+}
+
+static void virtual_heap_down(int i)
+{
+	struct usbi_io_private *p = virtual_heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < virtual_heap_len) {
+		if (child + 1 < virtual_heap_len &&
+		    virtual_heap[child + 1]->when < virtual_heap[child]->when) {
+			child++;
+		}
+		if (virtual_heap[child]->when >= p->when) {
+			break;
+		}
+		virtual_heap_set(i, virtual_heap[child]);
+		i = child;
+	}
+	virtual_heap_set(i, p);
+}
+
+/* take a request off the queue */
+static void virtual_dequeue(struct usbi_io_private *p)
+{
+	int i = p->heap_idx;
+
+	if (i < 0) {
+		return;
+	}
+
+	p->heap_idx = -1;
+	virtual_heap_len--;
+	if (i == virtual_heap_len) {
+		return;
+	}
+
+	virtual_heap_set(i, virtual_heap[virtual_heap_len]);
+	virtual_heap_up(i);
+	virtual_heap_down(virtual_heap[i]->heap_idx);
+}
+
+/* the first request due changed, without the io thread wake the app's loop */
+static void virtual_wakeup(void)
+{
+	char c = 0;
+
+	pthread_cond_signal(&virtual_cond);
+	if (virtual_pipe[1] >= 0 && write(virtual_pipe[1], &c, 1) < 0) {
+		/* a wakeup is pending already */
+	}
+}
+
+/* (re)queue a request to be due at 'when' */
+static int32_t virtual_schedule(struct usbi_io_private *p, uint64_t when)
+{
+	if (p->heap_idx >= 0) {
+		virtual_dequeue(p);
+	}
+
+	if (virtual_heap_len == virtual_heap_size) {
+		struct usbi_io_private **tmp;
+		int size = virtual_heap_size ? virtual_heap_size * 2 : 256;
+
+		tmp = realloc(virtual_heap, size * sizeof(*tmp));
+		if (!tmp) {
+			return (OPENUSB_NO_RESOURCES);
+		}
+		virtual_heap = tmp;
+		virtual_heap_size = size;
+	}
+
+	p->when = when;
+	virtual_heap_set(virtual_heap_len++, p);
+	virtual_heap_up(p->heap_idx);
+
+	/* the io thread sleeps until the first request is due */
+	if (p->heap_idx == 0) {
+		virtual_wakeup();
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/******************************************************************************
+ *                              Device Model                                  *
+ *****************************************************************************/
+
+static struct virtual_endpoint *virtual_endpoint(struct virtual_device *vdev,
+                                                 uint8_t addr)
+{
+	return (&vdev->ep[VIRTUAL_EP_INDEX(addr)]);
+}
+
+static void virtual_loop_put(struct virtual_loop *loop, const uint8_t *data,
+                             size_t len)
+{
+	size_t tail, n;
+
+	/*
+	 * The buffer is allocated on first use, an empty one grows to take a
+	 * transfer larger than itself
+	 */
+	if (!loop->buf || (!loop->len && len > loop->size)) {
+		size_t  size = len > loop->size ? len : loop->size;
+		uint8_t *tmp = realloc(loop->buf, size);
+
+		if (!tmp) {
+			return;
+		}
+		loop->buf = tmp;
+		loop->size = size;
+		loop->head = 0;
+	}
+
+	if (!len) {
+		return;
+	}
+
+	tail = (loop->head + loop->len) % loop->size;
+	n = loop->size - tail < len ? loop->size - tail : len;
+	memcpy(loop->buf + tail, data, n);
+	memcpy(loop->buf, data + n, len - n);
+	loop->len += len;
+}
+
+static size_t virtual_loop_get(struct virtual_loop *loop, uint8_t *data,
+                               size_t len)
+{
+	size_t n;
+
+	if (len > loop->len) {
+		len = loop->len;
+	}
+
+	n = loop->size - loop->head < len ? loop->size - loop->head : len;
+	memcpy(data, loop->buf + loop->head, n);
+	memcpy(data + n, loop->buf, len - n);
+
+	loop->head = (loop->head + len) % loop->size;
+	loop->len -= len;
+
+	return (len);
+}
+
+/* the buffer and length of a bulk or interrupt request */
+static void virtual_io_buffer(struct usbi_io *io, uint8_t **data,
+                              uint32_t *len)
+{
+	*data = usbi_io_payload(io);
+
+	if (io->req->type == USB_TYPE_BULK) {
+		*len = io->req->req.bulk->length;
+	} else {
+		*len = io->req->req.intr->length;
+	}
+}
+
+static void virtual_done(struct usbi_io_private *p, int32_t status,
+                         uint32_t transferred, struct list_head *done)
+{
+	p->state = VIRTUAL_IO_DONE;
+	p->status = status;
+	p->transferred = transferred;
+	list_add(&p->wait_list, done);
+}
+
+/*
+ * Move the data of a bulk or interrupt request. Returns 0 if the request
+ * has to wait for the other side of the loopback.
+ */
+static int virtual_transfer(struct usbi_io_private *p, struct list_head *done)
+{
+	struct virtual_device *vdev = p->vdev;
+	struct virtual_loop   *loop;
+	struct usbi_io_private *w;
+	uint8_t               *data;
+	uint32_t              len;
+	size_t                n;
+
+	virtual_io_buffer(p->io, &data, &len);
+	loop = &vdev->loop[p->ep->addr & USB_ENDPOINT_NUM_MASK];
+
+	if (!(p->ep->addr & USB_ENDPOINT_IN)) {
+		if (vdev->loopback) {
+			if (loop->len && len > loop->size - loop->len) {
+				return (0);
+			}
+			virtual_loop_put(loop, data, len);
+		}
+		virtual_done(p, OPENUSB_SUCCESS, len, done);
+
+		/* hand the data to whoever is waiting for it */
+		while (loop->len && !list_empty(&loop->readers)) {
+			w = list_entry(loop->readers.next, struct usbi_io_private,
+			               wait_list);
+			list_del(&w->wait_list);
+			virtual_dequeue(w);
+			virtual_io_buffer(w->io, &data, &len);
+			n = virtual_loop_get(loop, data, len);
+			virtual_done(w, OPENUSB_SUCCESS, n, done);
+		}
+
+		return (1);
+	}
+
+	if (!vdev->loopback) {
+		memset(data, p->ep->addr, len);
+		virtual_done(p, OPENUSB_SUCCESS, len, done);
+		return (1);
+	}
+
+	if (!loop->len && len) {
+		return (0);
+	}
+	n = virtual_loop_get(loop, data, len);
+	virtual_done(p, OPENUSB_SUCCESS, n, done);
+
+	/* there may be room for a waiting writer now */
+	while (!list_empty(&loop->writers)) {
+		w = list_entry(loop->writers.next, struct usbi_io_private,
+		               wait_list);
+		virtual_io_buffer(w->io, &data, &len);
+		if (loop->len && len > loop->size - loop->len) {
+			break;
+		}
+		list_del(&w->wait_list);
+		virtual_dequeue(w);
+		virtual_loop_put(loop, data, len);
+		virtual_done(w, OPENUSB_SUCCESS, len, done);
+	}
+
+	return (1);
+}
+
+/* ns in a frame, or a microframe from high speed on */
+static uint64_t virtual_frame_len(enum virtual_speed speed)
+{
+	return (speed < VIRTUAL_SPEED_HIGH ? 1000000ULL : 125000ULL);
+}
+
+/* isochronous transfers never wait, packets without room or data are empty */
+static void virtual_transfer_isoc(struct usbi_io_private *p,
+                                  struct list_head *done)
+{
+	struct virtual_device   *vdev = p->vdev;
+	struct virtual_loop     *loop;
+	openusb_isoc_request_t  *isoc = p->io->req->req.isoc;
+	uint32_t                i, n, total = 0;
+	uint64_t                frame_len;
+
+	loop = &vdev->loop[p->ep->addr & USB_ENDPOINT_NUM_MASK];
+
+	for (i = 0; i < isoc->pkts.num_packets; i++) {
+		struct openusb_isoc_packet *pkt = &isoc->pkts.packets[i];
+
+		n = pkt->length;
+		if (!vdev->loopback) {
+			if (p->ep->addr & USB_ENDPOINT_IN) {
+				memset(pkt->payload, p->ep->addr, n);
+			}
+		} else if (p->ep->addr & USB_ENDPOINT_IN) {
+			n = virtual_loop_get(loop, pkt->payload, n);
+		} else if (!loop->len || n <= loop->size - loop->len) {
+			virtual_loop_put(loop, pkt->payload, n);
+		}
+
+		if (isoc->isoc_results) {
+			isoc->isoc_results[i].status = OPENUSB_SUCCESS;
+			isoc->isoc_results[i].transferred_bytes = n;
+		}
+		total += n;
+	}
+
+	/* frames count from the epoch of the virtual clock */
+	frame_len = virtual_frame_len(vdev->speed);
+	isoc->start_frame = p->start / frame_len;
+	usbi_isoc_frames(p->io, 0, isoc->pkts.num_packets, isoc->start_frame,
+	                 p->ep->interval / frame_len);
+
+	virtual_done(p, OPENUSB_SUCCESS, total, done);
+}
+
+/*
+ * A request came up in the queue. Either its time has come or, for one that
+ * is waiting on a loopback buffer, its timeout.
+ */
+static void virtual_finish(struct usbi_io_private *p, uint64_t now,
+                           struct list_head *done)
+{
+	struct virtual_loop *loop;
+
+	switch (p->state) {
+		case VIRTUAL_IO_DONE:
+			list_add(&p->wait_list, done);
+			return;
+
+		case VIRTUAL_IO_WAITING:
+			list_del(&p->wait_list);
+			virtual_done(p, OPENUSB_IO_TIMEOUT, 0, done);
+			return;
+
+		case VIRTUAL_IO_QUEUED:
+			break;
+	}
+
+	/* lost transfers and those slower than their timeout */
+	if (p->deadline <= now) {
+		virtual_done(p, OPENUSB_IO_TIMEOUT, 0, done);
+		return;
+	}
+
+	if (p->io->req->type == USB_TYPE_ISOCHRONOUS) {
+		virtual_transfer_isoc(p, done);
+		return;
+	}
+
+	if (!virtual_transfer(p, done)) {
+		loop = &p->vdev->loop[p->ep->addr & USB_ENDPOINT_NUM_MASK];
+		p->state = VIRTUAL_IO_WAITING;
+		list_add(&p->wait_list, p->ep->addr & USB_ENDPOINT_IN ?
+		         &loop->readers : &loop->writers);
+		virtual_schedule(p, p->deadline);
+	}
+}
+
+/*
+ * Work out when a bulk, interrupt or isochronous request completes. Requests
+ * on an endpoint are serialized, each one takes its length over the
+ * endpoint's bandwidth, or its packets' service intervals for isochronous
+ * ones, plus the latency.
+ */
+static uint64_t virtual_model_xfer(struct usbi_io_private *p, uint64_t now)
+{
+	struct virtual_endpoint *ep = p->ep;
+	openusb_request_handle_t req = p->io->req;
+	uint64_t                 start, duration = 0, when;
+	uint8_t                  *data;
+	uint32_t                 len;
+
+	ep->count++;
+
+	if (ep->halted) {
+		p->state = VIRTUAL_IO_DONE;
+		p->status = OPENUSB_IO_STALL;
+		return (now);
+	}
+
+	if (ep->model.stall && ep->count % ep->model.stall == 0) {
+		ep->halted = 1;
+		p->state = VIRTUAL_IO_DONE;
+		p->status = OPENUSB_IO_STALL;
+		return (now + ep->model.latency);
+	}
+
+	/* a lost transfer only completes by timing out */
+	if (ep->model.timeout && ep->count % ep->model.timeout == 0) {
+		return (p->deadline);
+	}
+
+	if (req->type == USB_TYPE_ISOCHRONOUS) {
+		duration = req->req.isoc->pkts.num_packets * ep->interval;
+	} else {
+		virtual_io_buffer(p->io, &data, &len);
+		if (ep->model.bandwidth) {
+			duration = (uint64_t)len * 1000000000ULL / ep->model.bandwidth;
+		}
+		if (req->type == USB_TYPE_INTERRUPT && duration < ep->interval) {
+			duration = ep->interval;
+		}
+	}
+
+	start = ep->busy_until > now ? ep->busy_until : now;
+
+	/* a start frame still to come holds the request back until then */
+	if (req->type == USB_TYPE_ISOCHRONOUS &&
+	    (req->req.isoc->flags & OPENUSB_ISOC_START_FRAME)) {
+		uint64_t frame_len = virtual_frame_len(p->vdev->speed);
+		int32_t  ahead;
+
+		ahead = (int32_t)(req->req.isoc->start_frame -
+		                  (uint32_t)(now / frame_len));
+		if (ahead > 0 && (now / frame_len + ahead) * frame_len > start) {
+			start = (now / frame_len + ahead) * frame_len;
+		}
+	}
+	p->start = start;
+
+	ep->busy_until = start + duration;
+
+	when = ep->busy_until + ep->model.latency;
+
+	return (when < p->deadline ? when : p->deadline);
+}
+
+/* fail everything a disconnected device still has in flight */
+static void virtual_disconnect(struct virtual_device *vdev, uint64_t now)
+{
+	struct usbi_io_private *p;
+	int i;
+
+	usbi_debug(NULL, 2, "virtual device %d-%d disconnected",
+	           vdev->vbus->busnum, vdev->devnum);
+
+	vdev->gone = 1;
+
+	for (i = 0; i < virtual_heap_len; i++) {
+		p = virtual_heap[i];
+		if (p->vdev != vdev) {
+			continue;
+		}
+
+		if (p->state == VIRTUAL_IO_WAITING) {
+			list_del(&p->wait_list);
+		}
+		p->state = VIRTUAL_IO_DONE;
+		p->status = OPENUSB_UNKNOWN_DEVICE;
+		p->transferred = 0;
+		p->when = now;
+	}
+
+	/* restore the heap order */
+	for (i = virtual_heap_len / 2 - 1; i >= 0; i--) {
+		virtual_heap_down(i);
+	}
+	virtual_wakeup();
+}
+
+
+
+/******************************************************************************
+ *                               Descriptors                                  *
+ *****************************************************************************/
+
+static int virtual_string_desc(struct virtual_device *vdev, uint8_t index,
+                               uint8_t *buf)
+{
+	char        str[64];
+	const char  *s;
+	int         i, len;
+
+	/* the LANGID table, US English only */
+	if (index == 0) {
+		buf[0] = 4;
+		buf[1] = USB_DESC_TYPE_STRING;
+		buf[2] = 0x09;
+		buf[3] = 0x04;
+		return (4);
+	}
+
+	switch (index) {
+		case 1:
+			s = vdev->manufacturer;
+			break;
+		case 2:
+			s = vdev->product;
+			break;
+		case 3:
+			s = vdev->serial;
+			break;
+		default:
+			snprintf(str, sizeof(str), "String %d", index);
+			s = str;
+			break;
+	}
+
+	len = strlen(s);
+	if (len > 126) {
+		len = 126;
+	}
+
+	buf[0] = 2 + 2 * len;
+	buf[1] = USB_DESC_TYPE_STRING;
+	for (i = 0; i < len; i++) {
+		buf[2 + 2 * i] = s[i];
+		buf[3 + 2 * i] = 0;
+	}
+
+	return (buf[0]);
+}
+
+/*
+ * Find a descriptor, strings are built in strbuf (256 bytes). Returns the
+ * length of the descriptor or -1 if there is no such descriptor.
+ */
+static int virtual_get_desc(struct virtual_device *vdev, uint8_t type,
+                            uint8_t index, uint8_t *strbuf,
+                            const uint8_t **desc)
+{
+	switch (type) {
+		case USB_DESC_TYPE_DEVICE:
+			*desc = vdev->desc;
+			return (USBI_DEVICE_DESC_SIZE);
+
+		case USB_DESC_TYPE_CONFIG:
+			if (index >= vdev->num_configs) {
+				return (-1);
+			}
+			*desc = vdev->configs[index];
+			return (USBI_LE16(vdev->configs[index] + 2));
+
+		case USB_DESC_TYPE_STRING:
+			*desc = strbuf;
+			return (virtual_string_desc(vdev, index, strbuf));
+	}
+
+	return (-1);
+}
+
+/* index of the configuration with the given bConfigurationValue, or -1 */
+static int virtual_config_index(struct virtual_device *vdev, uint8_t value)
+{
+	int i;
+
+	for (i = 0; i < vdev->num_configs; i++) {
+		if (vdev->configs[i][5] == value) {
+			return (i);
+		}
+	}
+
+	return (-1);
+}
+
+/* does the current configuration have this interface and alternate setting */
+static int virtual_has_altsetting(struct virtual_device *vdev, uint8_t ifc,
+                                  uint8_t alt)
+{
+	uint8_t  *buf;
+	uint16_t len;
+	int      i;
+
+	i = virtual_config_index(vdev, vdev->config);
+	if (i < 0) {
+		return (0);
+	}
+
+	buf = vdev->configs[i];
+	len = USBI_LE16(buf + 2);
+	while (len >= USBI_DESC_HEADER_SIZE && buf[0] >= USBI_DESC_HEADER_SIZE &&
+	       buf[0] <= len) {
+		if (buf[1] == USB_DESC_TYPE_INTERFACE &&
+		    buf[0] >= USBI_INTERFACE_DESC_SIZE &&
+		    buf[2] == ifc && buf[3] == alt) {
+			return (1);
+		}
+		len -= buf[0];
+		buf += buf[0];
+	}
+
+	return (0);
+}
+
+/* time between service periods of an interrupt or isochronous endpoint */
+static uint64_t virtual_ep_interval(enum virtual_speed speed, uint8_t type,
+                                    uint8_t bInterval)
+{
+	if (type != USB_ENDPOINT_TYPE_INTERRUPT &&
+	    type != USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+		return (0);
+	}
+
+	if (bInterval == 0) {
+		bInterval = 1;
+	}
+	if (bInterval > 16 && !(type == USB_ENDPOINT_TYPE_INTERRUPT &&
+	    speed < VIRTUAL_SPEED_HIGH)) {
+		bInterval = 16;
+	}
+
+	/* frames on low and full speed, 125us microframes above */
+	if (speed < VIRTUAL_SPEED_HIGH) {
+		if (type == USB_ENDPOINT_TYPE_INTERRUPT) {
+			return (bInterval * 1000000ULL);
+		}
+		return ((1ULL << (bInterval - 1)) * 1000000ULL);
+	}
+
+	return ((1ULL << (bInterval - 1)) * 125000ULL);
+}
+
+static uint16_t virtual_default_maxpacket(enum virtual_speed speed,
+                                          uint8_t type)
+{
+	if (speed == VIRTUAL_SPEED_LOW) {
+		return (8);
+	}
+
+	switch (type) {
+		case USB_ENDPOINT_TYPE_BULK:
+			return (speed == VIRTUAL_SPEED_FULL ? 64 :
+			        speed == VIRTUAL_SPEED_HIGH ? 512 : 1024);
+		case USB_ENDPOINT_TYPE_ISOCHRONOUS:
+			return (speed == VIRTUAL_SPEED_FULL ? 1023 : 1024);
+	}
+
+	return (64);
+}
+
+static void virtual_add_endpoint(struct virtual_device *vdev, uint8_t addr,
+                                 uint8_t type, uint16_t maxpacket,
+                                 uint8_t bInterval)
+{
+	struct virtual_endpoint *ep = virtual_endpoint(vdev, addr);
+
+	ep->present = 1;
+	ep->addr = addr;
+	ep->type = type;
+	ep->maxpacket = maxpacket ? maxpacket :
+	                virtual_default_maxpacket(vdev->speed, type);
+	ep->bInterval = bInterval ? bInterval : 1;
+}
+
+/*
+ * Build the descriptors of a device without a descriptor file: a single
+ * configuration with one interface holding all of the endpoints.
+ */
+static int32_t virtual_build_desc(struct virtual_device *vdev, uint16_t vid,
+                                  uint16_t pid)
+{
+	static const uint16_t bcd[] = { 0x0110, 0x0110, 0x0200, 0x0300 };
+	static const uint8_t  mps0[] = { 8, 64, 64, 9 };
+	struct virtual_endpoint *ep;
+	uint8_t  *d;
+	int      num_eps = 0, total, i, dir;
+
+	for (i = 0; i < VIRTUAL_NUM_EPS; i++) {
+		num_eps += vdev->ep[i].present;
+	}
+
+	total = USBI_CONFIG_DESC_SIZE + USBI_INTERFACE_DESC_SIZE +
+	        num_eps * USBI_ENDPOINT_DESC_SIZE;
+
+	vdev->desc_len = USBI_DEVICE_DESC_SIZE + total;
+	vdev->desc = d = calloc(vdev->desc_len, 1);
+	if (!d) {
+		return (OPENUSB_NO_RESOURCES);
+	}
+
+	d[0] = USBI_DEVICE_DESC_SIZE;
+	d[1] = USB_DESC_TYPE_DEVICE;
+	d[2] = bcd[vdev->speed] & 0xff;
+	d[3] = bcd[vdev->speed] >> 8;
+	d[4] = vdev->hub ? USB_CLASS_HUB : USB_CLASS_PER_INTERFACE;
+	d[7] = mps0[vdev->speed];
+	d[8] = vid & 0xff;
+	d[9] = vid >> 8;
+	d[10] = pid & 0xff;
+	d[11] = pid >> 8;
+	d[13] = 0x01;		/* bcdDevice 1.00 */
+	d[14] = 1;		/* iManufacturer */
+	d[15] = 2;		/* iProduct */
+	d[16] = 3;		/* iSerialNumber */
+	d[17] = 1;		/* bNumConfigurations */
+
+	d += USBI_DEVICE_DESC_SIZE;
+	vdev->configs[0] = d;
+	vdev->num_configs = 1;
+	vdev->config = 1;
+
+	d[0] = USBI_CONFIG_DESC_SIZE;
+	d[1] = USB_DESC_TYPE_CONFIG;
+	d[2] = total & 0xff;
+	d[3] = total >> 8;
+	d[4] = 1;		/* bNumInterfaces */
+	d[5] = 1;		/* bConfigurationValue */
+	d[7] = vdev->hub ? 0xe0 : 0x80;
+	d[8] = 50;		/* 100mA */
+
+	d += USBI_CONFIG_DESC_SIZE;
+	d[0] = USBI_INTERFACE_DESC_SIZE;
+	d[1] = USB_DESC_TYPE_INTERFACE;
+	d[4] = num_eps;
+	d[5] = vdev->hub ? USB_CLASS_HUB : USB_CLASS_VENDOR_SPEC;
+
+	/* endpoints in number order, OUT before IN */
+	d += USBI_INTERFACE_DESC_SIZE;
+	for (i = 1; i < 16; i++) {
+		for (dir = 0; dir <= USB_ENDPOINT_IN; dir += USB_ENDPOINT_IN) {
+			ep = virtual_endpoint(vdev, i | dir);
+			if (!ep->present) {
+				continue;
+			}
+
+			d[0] = USBI_ENDPOINT_DESC_SIZE;
+			d[1] = USB_DESC_TYPE_ENDPOINT;
+			d[2] = ep->addr;
+			d[3] = ep->type;
+			d[4] = ep->maxpacket & 0xff;
+			d[5] = ep->maxpacket >> 8;
+			d[6] = ep->bInterval;
+			d += USBI_ENDPOINT_DESC_SIZE;
+		}
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * Check the descriptors read from a descriptor file and set up the device's
+ * configurations and endpoints from them.
+ */
+static int32_t virtual_setup_desc(struct virtual_device *vdev)
+{
+	uint8_t  *buf;
+	size_t   offset = USBI_DEVICE_DESC_SIZE, total;
+	int      i, left;
+
+	if (vdev->desc_len < USBI_DEVICE_DESC_SIZE ||
+	    vdev->desc[0] != USBI_DEVICE_DESC_SIZE ||
+	    vdev->desc[1] != USB_DESC_TYPE_DEVICE ||
+	    vdev->desc[17] < 1 || vdev->desc[17] > USBI_MAXCONFIG) {
+		usbi_debug(NULL, 1, "bad virtual device descriptor");
+		return (OPENUSB_PARSE_ERROR);
+	}
+
+	vdev->num_configs = vdev->desc[17];
+	for (i = 0; i < vdev->num_configs; i++) {
+		buf = vdev->desc + offset;
+		if (offset + USBI_CONFIG_DESC_SIZE > vdev->desc_len ||
+		    buf[1] != USB_DESC_TYPE_CONFIG) {
+			usbi_debug(NULL, 1, "bad virtual configuration %d", i);
+			return (OPENUSB_PARSE_ERROR);
+		}
+
+		total = USBI_LE16(buf + 2);
+		if (total < USBI_CONFIG_DESC_SIZE ||
+		    offset + total > vdev->desc_len) {
+			usbi_debug(NULL, 1, "bad virtual configuration %d length", i);
+			return (OPENUSB_PARSE_ERROR);
+		}
+		vdev->configs[i] = buf;
+		offset += total;
+
+		/* the endpoints of all alternate settings */
+		for (left = total; left >= USBI_DESC_HEADER_SIZE &&
+		     buf[0] >= USBI_DESC_HEADER_SIZE && buf[0] <= left;
+		     left -= buf[0], buf += buf[0]) {
+			if (buf[1] != USB_DESC_TYPE_ENDPOINT ||
+			    buf[0] < USBI_ENDPOINT_DESC_SIZE ||
+			    !(buf[2] & USB_ENDPOINT_NUM_MASK)) {
+				continue;
+			}
+			virtual_add_endpoint(vdev, buf[2],
+			                     buf[3] & USB_ENDPOINT_TYPE_MASK,
+			                     USBI_LE16(buf + 4) & 0x7ff, buf[6]);
+		}
+	}
+
+	vdev->config = vdev->configs[0][5];
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/******************************************************************************
+ *                              Configuration                                 *
+ *****************************************************************************/
+
+/* the device being configured, instantiated 'count' times */
+struct virtual_parse {
+	int                     line;
+	int                     count;
+	uint16_t                vid;
+	uint16_t                pid;
+	char                    *desc_path;
+	struct virtual_device   tmpl;
+	struct virtual_endpoint ep[VIRTUAL_NUM_EPS];	/* endpoint lines */
+	int                     num_eps;
+};
+
+static struct virtual_bus *virtual_new_bus(void);
+
+static int virtual_parse_number(const char *s, uint64_t *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(s, &end, 0);
+	if (end == s || errno) {
+		return (-1);
+	}
+
+	switch (*end) {
+		case 'k':
+		case 'K':
+			*val *= 1000ULL;
+			end++;
+			break;
+		case 'M':
+			*val *= 1000000ULL;
+			end++;
+			break;
+		case 'G':
+			*val *= 1000000000ULL;
+			end++;
+			break;
+	}
+
+	return (*end ? -1 : 0);
+}
+
+/* key=value settings shared by devices and endpoints, returns 0 if known */
+static int virtual_parse_model(struct virtual_model *model, const char *key,
+                               uint64_t val)
+{
+	if (strcmp(key, "latency") == 0) {
+		model->latency = val * 1000ULL;
+		model->fields |= VIRTUAL_MODEL_LATENCY;
+	} else if (strcmp(key, "bandwidth") == 0) {
+		model->bandwidth = val;
+		model->fields |= VIRTUAL_MODEL_BANDWIDTH;
+	} else if (strcmp(key, "stall") == 0) {
+		model->stall = val;
+		model->fields |= VIRTUAL_MODEL_STALL;
+	} else if (strcmp(key, "timeout") == 0) {
+		model->timeout = val;
+		model->fields |= VIRTUAL_MODEL_TIMEOUT;
+	} else {
+		return (-1);
+	}
+
+	return (0);
+}
+
+static uint8_t *virtual_read_file(const char *path, size_t *len)
+{
+	uint8_t *buf = NULL, *tmp;
+	size_t  size = 0, n;
+	FILE    *f;
+
+	*len = 0;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		usbi_debug(NULL, 1, "could not open %s: %s", path, strerror(errno));
+		return (NULL);
+	}
+
+	do {
+		if (*len + 1 >= size) {
+			size = size ? size * 2 : 4096;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				fclose(f);
+				return (NULL);
+			}
+			buf = tmp;
+		}
+		n = fread(buf + *len, 1, size - *len, f);
+		*len += n;
+	} while (n > 0);
+
+	fclose(f);
+
+	return (buf);
+}
+
+/* create the devices described by the last device line */
+static void virtual_add_devices(struct virtual_parse *ps)
+{
+	struct virtual_device   *vdev;
+	struct virtual_endpoint *ep;
+	struct virtual_bus      *vbus;
+	char                    serial[64];
+	int                     n, i;
+
+	for (n = 0; n < ps->count; n++) {
+		vbus = list_empty(&virtual_buses) ? NULL :
+		       list_entry(virtual_buses.prev, struct virtual_bus, list);
+		if (!vbus || vbus->num_devices >= VIRTUAL_MAX_DEVICES) {
+			vbus = virtual_new_bus();
+			if (!vbus) {
+				return;
+			}
+		}
+
+		vdev = malloc(sizeof(*vdev));
+		if (!vdev) {
+			return;
+		}
+		memcpy(vdev, &ps->tmpl, sizeof(*vdev));
+		vdev->vbus = vbus;
+		vdev->devnum = vbus->num_devices + 2;
+
+		if (ps->desc_path) {
+			vdev->desc = virtual_read_file(ps->desc_path, &vdev->desc_len);
+			if (!vdev->desc || virtual_setup_desc(vdev) != OPENUSB_SUCCESS) {
+				usbi_debug(NULL, 1, "line %d: unusable descriptor file %s",
+				           ps->line, ps->desc_path);
+				free(vdev->desc);
+				free(vdev);
+				return;
+			}
+		} else {
+			for (i = 0; i < VIRTUAL_NUM_EPS; i++) {
+				ep = &ps->ep[i];
+				if (ep->present) {
+					virtual_add_endpoint(vdev, ep->addr, ep->type,
+					                     ep->maxpacket, ep->bInterval);
+				}
+			}
+
+			if (!ps->num_eps) {
+				for (i = 1; i <= 3; i++) {
+					static const uint8_t types[] = { 0,
+						USB_ENDPOINT_TYPE_BULK, USB_ENDPOINT_TYPE_INTERRUPT,
+						USB_ENDPOINT_TYPE_ISOCHRONOUS };
+
+					virtual_add_endpoint(vdev, i, types[i], 0, 0);
+					virtual_add_endpoint(vdev, i | USB_ENDPOINT_IN, types[i],
+					                     0, 0);
+				}
+			}
+
+			if (virtual_build_desc(vdev, ps->vid, ps->pid) != OPENUSB_SUCCESS) {
+				free(vdev);
+				return;
+			}
+		}
+
+		/* the endpoint models, falling back to the device's */
+		for (i = 0; i < VIRTUAL_NUM_EPS; i++) {
+			ep = &vdev->ep[i];
+			if (!ep->present) {
+				continue;
+			}
+
+			if (ps->ep[i].present) {
+				ep->model = ps->ep[i].model;
+			}
+
+			if (!(ep->model.fields & VIRTUAL_MODEL_LATENCY)) {
+				ep->model.latency = vdev->model.latency;
+			}
+			if (!(ep->model.fields & VIRTUAL_MODEL_BANDWIDTH)) {
+				ep->model.bandwidth = vdev->model.bandwidth;
+			}
+			if (!(ep->model.fields & VIRTUAL_MODEL_STALL)) {
+				ep->model.stall = vdev->model.stall;
+			}
+			if (!(ep->model.fields & VIRTUAL_MODEL_TIMEOUT)) {
+				ep->model.timeout = vdev->model.timeout;
+			}
+
+			ep->interval = virtual_ep_interval(vdev->speed, ep->type,
+			                                   ep->bInterval);
+		}
+
+		for (i = 0; i < 16; i++) {
+			vdev->loop[i].buf = NULL;
+			vdev->loop[i].size = vdev->loop_size;
+			list_init(&vdev->loop[i].readers);
+			list_init(&vdev->loop[i].writers);
+		}
+
+		/* every device needs a serial number of its own */
+		if (!vdev->serial || ps->count > 1) {
+			snprintf(serial, sizeof(serial), "%s%s%u-%d",
+			         vdev->serial ? vdev->serial : "",
+			         vdev->serial ? "-" : "VIRT", vbus->busnum, vdev->devnum);
+			vdev->serial = strdup(serial);
+		}
+
+		list_add(&vdev->list, &vbus->devices);
+		vbus->num_devices++;
+
+		usbi_debug(NULL, 4, "virtual device %d-%d", vbus->busnum, vdev->devnum);
+	}
+}
+
+static struct virtual_bus *virtual_new_bus(void)
+{
+	struct virtual_bus    *vbus;
+	struct virtual_device *hub;
+	int                   i;
+
+	vbus = calloc(sizeof(*vbus), 1);
+	hub = calloc(sizeof(*hub), 1);
+	if (!vbus || !hub) {
+		free(vbus);
+		free(hub);
+		return (NULL);
+	}
+
+	vbus->busnum = VIRTUAL_BUSNUM_BASE + virtual_num_buses++;
+	list_init(&vbus->devices);
+
+	/* the root hub, its status change endpoint never has anything to say */
+	hub->vbus = vbus;
+	hub->hub = 1;
+	hub->devnum = 1;
+	hub->speed = VIRTUAL_SPEED_HIGH;
+	hub->manufacturer = "OpenUSB";
+	hub->product = "Virtual root hub";
+	hub->serial = "";
+	hub->loopback = 1;
+	hub->loop_size = 64;
+	virtual_add_endpoint(hub, 0x81, USB_ENDPOINT_TYPE_INTERRUPT, 2, 12);
+	if (virtual_build_desc(hub, 0x1d6b, 0x0002) != OPENUSB_SUCCESS) {
+		free(vbus);
+		free(hub);
+		return (NULL);
+	}
+	hub->ep[VIRTUAL_EP_INDEX(0x81)].interval =
+		virtual_ep_interval(hub->speed, USB_ENDPOINT_TYPE_INTERRUPT, 12);
+
+	for (i = 0; i < 16; i++) {
+		hub->loop[i].size = hub->loop_size;
+		list_init(&hub->loop[i].readers);
+		list_init(&hub->loop[i].writers);
+	}
+
+	vbus->root = hub;
+	list_add(&hub->list, &vbus->devices);
+	list_add(&vbus->list, &virtual_buses);
+
+	return (vbus);
+}
+
+static void virtual_parse_line(struct virtual_parse *ps, char *line)
+{
+	struct virtual_endpoint *ep = NULL;
+	char     *save = NULL, *word, *key, *val;
+	uint64_t num;
+	int      n;
+
+	if ((word = strchr(line, '#')) != NULL) {
+		*word = 0;
+	}
+
+	word = strtok_r(line, " \t\r\n", &save);
+	if (!word) {
+		return;
+	}
+
+	if (strcmp(word, "bus") == 0 || strcmp(word, "device") == 0) {
+		/* the previous device is complete */
+		virtual_add_devices(ps);
+
+		free(ps->desc_path);
+		n = ps->line;
+		memset(ps, 0, sizeof(*ps));
+		ps->line = n;
+
+		if (strcmp(word, "bus") == 0) {
+			virtual_new_bus();
+			return;
+		}
+
+		ps->count = 1;
+		ps->vid = 0x6666;
+		ps->pid = 0x0001;
+		ps->tmpl.speed = VIRTUAL_SPEED_HIGH;
+		ps->tmpl.manufacturer = "OpenUSB";
+		ps->tmpl.product = "Virtual device";
+		ps->tmpl.loopback = 1;
+		ps->tmpl.loop_size = VIRTUAL_LOOP_SIZE;
+	} else if (strcmp(word, "endpoint") == 0) {
+		if (!ps->count) {
+			usbi_debug(NULL, 1, "line %d: endpoint without a device", ps->line);
+			return;
+		}
+
+		word = strtok_r(NULL, " \t\r\n", &save);
+		if (!word || virtual_parse_number(word, &num) != 0 ||
+		    !(num & USB_ENDPOINT_NUM_MASK) || num > 0x8f ||
+		    (num & 0x70)) {
+			usbi_debug(NULL, 1, "line %d: bad endpoint address", ps->line);
+			return;
+		}
+
+		ep = &ps->ep[VIRTUAL_EP_INDEX(num)];
+		if (!ep->present) {
+			ps->num_eps++;
+		}
+		ep->present = 1;
+		ep->addr = num;
+		ep->type = USB_ENDPOINT_TYPE_BULK;
+	} else {
+		usbi_debug(NULL, 1, "line %d: unknown keyword %s", ps->line, word);
+		return;
+	}
+
+	while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+		key = word;
+		val = strchr(word, '=');
+		if (!val) {
+			usbi_debug(NULL, 1, "line %d: expected key=value, not %s",
+			           ps->line, word);
+			continue;
+		}
+		*val++ = 0;
+
+		/* the string valued ones */
+		if (!ep && strcmp(key, "desc") == 0) {
+			free(ps->desc_path);
+			ps->desc_path = strdup(val);
+			continue;
+		} else if (!ep && strcmp(key, "manufacturer") == 0) {
+			ps->tmpl.manufacturer = strdup(val);
+			continue;
+		} else if (!ep && strcmp(key, "product") == 0) {
+			ps->tmpl.product = strdup(val);
+			continue;
+		} else if (!ep && strcmp(key, "serial") == 0) {
+			ps->tmpl.serial = strdup(val);
+			continue;
+		} else if (!ep && strcmp(key, "speed") == 0) {
+			if (strcmp(val, "low") == 0) {
+				ps->tmpl.speed = VIRTUAL_SPEED_LOW;
+			} else if (strcmp(val, "full") == 0) {
+				ps->tmpl.speed = VIRTUAL_SPEED_FULL;
+			} else if (strcmp(val, "high") == 0) {
+				ps->tmpl.speed = VIRTUAL_SPEED_HIGH;
+			} else if (strcmp(val, "super") == 0) {
+				ps->tmpl.speed = VIRTUAL_SPEED_SUPER;
+			} else {
+				usbi_debug(NULL, 1, "line %d: unknown speed %s", ps->line, val);
+			}
+			continue;
+		} else if (ep && strcmp(key, "type") == 0) {
+			if (strcmp(val, "bulk") == 0) {
+				ep->type = USB_ENDPOINT_TYPE_BULK;
+			} else if (strncmp(val, "int", 3) == 0) {
+				ep->type = USB_ENDPOINT_TYPE_INTERRUPT;
+			} else if (strncmp(val, "iso", 3) == 0) {
+				ep->type = USB_ENDPOINT_TYPE_ISOCHRONOUS;
+			} else {
+				usbi_debug(NULL, 1, "line %d: unknown type %s", ps->line, val);
+			}
+			continue;
+		}
+
+		if (virtual_parse_number(val, &num) != 0) {
+			usbi_debug(NULL, 1, "line %d: bad number %s=%s", ps->line, key, val);
+			continue;
+		}
+
+		if (virtual_parse_model(ep ? &ep->model : &ps->tmpl.model, key,
+		                        num) == 0) {
+			continue;
+		}
+
+		if (ep) {
+			if (strcmp(key, "maxpacket") == 0) {
+				ep->maxpacket = num;
+			} else if (strcmp(key, "interval") == 0) {
+				ep->bInterval = num;
+			} else {
+				usbi_debug(NULL, 1, "line %d: unknown key %s", ps->line, key);
+			}
+		} else if (strcmp(key, "count") == 0) {
+			ps->count = num;
+		} else if (strcmp(key, "vid") == 0) {
+			ps->vid = num;
+		} else if (strcmp(key, "pid") == 0) {
+			ps->pid = num;
+		} else if (strcmp(key, "disconnect") == 0) {
+			ps->tmpl.disconnect = num;
+		} else if (strcmp(key, "loopback") == 0) {
+			ps->tmpl.loopback = num != 0;
+		} else if (strcmp(key, "loopsize") == 0) {
+			ps->tmpl.loop_size = num ? num : 1;
+		} else {
+			usbi_debug(NULL, 1, "line %d: unknown key %s", ps->line, key);
+		}
+	}
+}
+
+/* parse a chunk of configuration text, lines end at '\n' or ';' */
+static void virtual_parse_text(struct virtual_parse *ps, char *text)
+{
+	char *line, *save = NULL;
+
+	for (line = strtok_r(text, "\n;", &save); line;
+	     line = strtok_r(NULL, "\n;", &save)) {
+		ps->line++;
+		virtual_parse_line(ps, line);
+	}
+}
+
+static void virtual_load_config(void)
+{
+	struct virtual_parse ps;
+	const char  *path, *spec;
+	char        *text;
+	size_t      len;
+
+	memset(&ps, 0, sizeof(ps));
+
+	path = getenv("OPENUSB_VIRTUAL_CONFIG");
+	if (path) {
+		text = (char *)virtual_read_file(path, &len);
+		if (text) {
+			text[len] = 0;
+			virtual_parse_text(&ps, text);
+			free(text);
+		}
+	}
+
+	spec = getenv("OPENUSB_VIRTUAL");
+	if (spec) {
+		text = strdup(spec);
+		if (text) {
+			virtual_parse_text(&ps, text);
+			free(text);
+		}
+	}
+
+	/* the last device */
+	virtual_add_devices(&ps);
+	free(ps.desc_path);
+}
+
+
+
+/******************************************************************************
+ *                             Backend Functions                              *
+ *****************************************************************************/
+
+static void *virtual_io_thread(void *unused);
+static void virtual_drain(int fd, short revents, void *arg);
+
+/*
+ * virtual_init
+ *
+ *  Backend initialization, called in openusb_init(). Fails if there are no
+ *  virtual devices configured.
+ */
+static int32_t virtual_init(struct usbi_handle *hdl, uint32_t flags)
+{
+	if (!hdl) {
+		return (OPENUSB_BADARG);
+	}
+
+	if (virtual_backend_inited) {
+		virtual_backend_inited++;
+		return (OPENUSB_SUCCESS);
+	}
+
+	/* the buses outlive openusb_fini(), the frontend keeps their devices */
+	if (list_empty(&virtual_buses)) {
+		virtual_load_config();
+	}
+
+	if (list_empty(&virtual_buses)) {
+		usbi_debug(hdl, 4, "no virtual devices configured");
+		return (OPENUSB_PLATFORM_FAILURE);
+	}
+
+	/* without threads the application's loop polls our pipe instead */
+	if (!usbi_threads_enabled()) {
+		if (pipe(virtual_pipe) < 0) {
+			usbi_debug(hdl, 1, "unable to create the virtual pipe");
+			return (OPENUSB_SYS_FUNC_FAILURE);
+		}
+		fcntl(virtual_pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(virtual_pipe[1], F_SETFL, O_NONBLOCK);
+		if (usbi_add_pollfd(virtual_pipe[0], POLLIN, virtual_drain,
+		    NULL) < 0) {
+			close(virtual_pipe[0]);
+			close(virtual_pipe[1]);
+			virtual_pipe[0] = virtual_pipe[1] = -1;
+			return (OPENUSB_NO_RESOURCES);
+		}
+	} else {
+		virtual_thread_exit = 0;
+		if (pthread_create(&virtual_thread, NULL, virtual_io_thread,
+		    NULL) != 0) {
+			usbi_debug(hdl, 1, "unable to create the virtual io thread");
+			return (OPENUSB_SYS_FUNC_FAILURE);
+		}
+	}
+
+	virtual_backend_inited++;
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * virtual_fini
+ *
+ *  Backend specific data cleanup, called in openusb_fini()
+ */
+static void virtual_fini(struct usbi_handle *hdl)
+{
+	if (!virtual_backend_inited) {
+		return;
+	}
+
+	if (--virtual_backend_inited > 0) {
+		return;
+	}
+
+	if (virtual_pipe[0] >= 0) {
+		usbi_remove_pollfd(virtual_pipe[0]);
+		close(virtual_pipe[0]);
+		close(virtual_pipe[1]);
+		virtual_pipe[0] = virtual_pipe[1] = -1;
+	} else {
+		pthread_mutex_lock(&virtual_lock);
+		virtual_thread_exit = 1;
+		pthread_cond_signal(&virtual_cond);
+		pthread_mutex_unlock(&virtual_lock);
+
+		pthread_join(virtual_thread, NULL);
+	}
+
+	if (!virtual_heap_len) {
+		free(virtual_heap);
+		virtual_heap = NULL;
+		virtual_heap_size = 0;
+	}
+}
+
+/*
+ * virtual_find_buses
+ *
+ *  Return the virtual buses, there are none unless we're initialized
+ */
+static int32_t virtual_find_buses(struct list_head *buses)
+{
+	struct virtual_bus *vbus;
+	struct usbi_bus    *ibus;
+
+	if (!buses) {
+		return (OPENUSB_BADARG);
+	}
+
+	if (!virtual_backend_inited) {
+		return (OPENUSB_SUCCESS);
+	}
+
+	list_for_each_entry(vbus, &virtual_buses, list) {
+		ibus = calloc(sizeof(*ibus), 1);
+		if (!ibus) {
+			return (OPENUSB_NO_RESOURCES);
+		}
+
+		ibus->priv = calloc(sizeof(struct usbi_bus_private), 1);
+		if (!ibus->priv) {
+			free(ibus);
+			return (OPENUSB_NO_RESOURCES);
+		}
+		ibus->priv->vbus = vbus;
+
+		ibus->max_xfer_size[USB_TYPE_CONTROL]     = VIRTUAL_MAX_CTRL_XFER;
+		ibus->max_xfer_size[USB_TYPE_INTERRUPT]   = 0xffffffff;
+		ibus->max_xfer_size[USB_TYPE_BULK]        = 0xffffffff;
+		ibus->max_xfer_size[USB_TYPE_ISOCHRONOUS] = 0xffffffff;
+
+		pthread_mutex_init(&ibus->lock, NULL);
+		pthread_mutex_init(&ibus->devices.lock, NULL);
+
+		ibus->busnum = vbus->busnum;
+		snprintf(ibus->sys_path, sizeof(ibus->sys_path), "virtual/%03u",
+		         vbus->busnum);
+		list_add(&ibus->list, buses);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * virtual_refresh_devices
+ *
+ *  Add the devices of a virtual bus that haven't been added yet and remove
+ *  the ones that were disconnected.
+ */
+static int32_t virtual_refresh_devices(struct usbi_bus *ibus)
+{
+	struct usbi_device    *idev, *tidev;
+	struct virtual_device *vdev;
+	struct virtual_bus    *vbus;
+	int                   len;
+
+	if (!ibus || !ibus->priv) {
+		return (OPENUSB_BADARG);
+	}
+	vbus = ibus->priv->vbus;
+
+	usbi_mutex_lock(&ibus->lock, USBI_LOCK_BUS);
+
+	list_for_each_entry(idev, &ibus->devices.head, bus_list) {
+		idev->found = 0;
+	}
+
+	/* the root hub comes first, so it's there to be every device's parent */
+	list_for_each_entry(vdev, &vbus->devices, list) {
+		/* a disconnected device goes away once its last handle is closed */
+		if (vdev->gone) {
+			if (vdev->idev && vdev->opened) {
+				vdev->idev->found = 1;
+			}
+			continue;
+		}
+
+		if (!vdev->idev) {
+			idev = calloc(sizeof(*idev), 1);
+			if (!idev) {
+				break;
+			}
+
+			idev->priv = calloc(sizeof(struct usbi_dev_private), 1);
+			if (!idev->priv) {
+				free(idev);
+				break;
+			}
+
+			len = snprintf(idev->sys_path, sizeof(idev->sys_path),
+			               "%s/%03d", ibus->sys_path, vdev->devnum);
+			if (len < 0 || len >= (int)sizeof(idev->sys_path)) {
+				usbi_debug(NULL, 1, "path of device %d too long",
+				           vdev->devnum);
+				free(idev->priv);
+				free(idev);
+				continue;
+			}
+			idev->priv->vdev = vdev;
+
+			if (vdev->hub) {
+				idev->nports = vbus->num_devices;
+				if (idev->nports) {
+					idev->children = calloc(idev->nports,
+					                        sizeof(idev->children[0]));
+				}
+			} else if (vbus->root->idev) {
+				idev->parent = vbus->root->idev;
+				idev->pport = vdev->devnum - 1;
+			}
+
+			idev->devnum = vdev->devnum;
+			idev->bus_addr = vdev->devnum;
+
+			pthread_mutex_lock(&virtual_lock);
+			vdev->idev = idev;
+			pthread_mutex_unlock(&virtual_lock);
+
+			usbi_add_device(ibus, idev);
+			if (vdev->hub) {
+				ibus->root = idev;
+			}
+		}
+
+		vdev->idev->found = 1;
+	}
+
+	list_for_each_entry_safe(idev, tidev, &ibus->devices.head, bus_list) {
+		if (!idev->found) {
+			usbi_debug(NULL, 2, "device %d removed", idev->devnum);
+			usbi_remove_device(idev);
+		}
+	}
+
+	usbi_mutex_unlock(&ibus->lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * virtual_free_device
+ *
+ *  Cleanup backend specific data in the usbi_device structure. The virtual
+ *  device stays, it may be enumerated again.
+ */
+static void virtual_free_device(struct usbi_device *idev)
+{
+	if (!idev->priv) {
+		return;
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+	if (idev->priv->vdev->idev == idev) {
+		idev->priv->vdev->idev = NULL;
+	}
+	pthread_mutex_unlock(&virtual_lock);
+
+	free(idev->priv);
+	idev->priv = NULL;
+}
+
+static int32_t virtual_open(struct usbi_dev_handle *hdev)
+{
+	struct virtual_device *vdev;
+	int32_t ret = OPENUSB_SUCCESS;
+
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+	vdev = hdev->idev->priv->vdev;
+
+	pthread_mutex_lock(&virtual_lock);
+	if (vdev->gone) {
+		ret = OPENUSB_UNKNOWN_DEVICE;
+	} else {
+		vdev->opened++;
+	}
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (ret);
+}
+
+static int32_t virtual_close(struct usbi_dev_handle *hdev)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+	hdev->idev->priv->vdev->opened--;
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_set_configuration(struct usbi_dev_handle *hdev,
+                                         uint8_t cfg)
+{
+	struct virtual_device *vdev = hdev->idev->priv->vdev;
+	int i;
+
+	if (cfg && virtual_config_index(vdev, cfg) < 0) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+	vdev->config = cfg;
+	memset(vdev->alt, 0, sizeof(vdev->alt));
+	for (i = 0; i < VIRTUAL_NUM_EPS; i++) {
+		vdev->ep[i].halted = 0;
+	}
+	pthread_mutex_unlock(&virtual_lock);
+
+	hdev->idev->cur_config_value = cfg;
+	hdev->idev->cur_config_index = cfg ? virtual_config_index(vdev, cfg) : 0;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_get_configuration(struct usbi_dev_handle *hdev,
+                                         uint8_t *cfg)
+{
+	struct virtual_device *vdev;
+	int index;
+
+	if (!hdev || !cfg) {
+		return (OPENUSB_BADARG);
+	}
+	vdev = hdev->idev->priv->vdev;
+
+	*cfg = vdev->config;
+	index = virtual_config_index(vdev, vdev->config);
+
+	hdev->idev->cur_config_value = vdev->config;
+	hdev->idev->cur_config_index = index < 0 ? 0 : index;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_claim_interface(struct usbi_dev_handle *hdev,
+                                       uint8_t ifc, openusb_init_flag_t flags)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	if (!virtual_has_altsetting(hdev->idev->priv->vdev, ifc, 0)) {
+		return (OPENUSB_BADARG);
+	}
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_release_interface(struct usbi_dev_handle *hdev,
+                                         uint8_t ifc)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	/* keep track of the fact that this interface was released */
+	hdev->claimed_ifs[ifc].clm = -1;
+	hdev->claimed_ifs[ifc].altsetting = -1;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_set_altsetting(struct usbi_dev_handle *hdev,
+                                      uint8_t ifc, uint8_t alt)
+{
+	struct virtual_device *vdev;
+
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+	vdev = hdev->idev->priv->vdev;
+
+	if (hdev->claimed_ifs[ifc].clm != USBI_IFC_CLAIMED) {
+		usbi_debug(hdev->lib_hdl, 1, "interface (%d) must be claimed before "
+		           "assigning an alternate setting", ifc);
+		return (OPENUSB_BADARG);
+	}
+
+	if (!virtual_has_altsetting(vdev, ifc, alt)) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+	vdev->alt[ifc] = alt;
+	pthread_mutex_unlock(&virtual_lock);
+
+	hdev->claimed_ifs[ifc].altsetting = alt;
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_get_altsetting(struct usbi_dev_handle *hdev,
+                                      uint8_t ifc, uint8_t *alt)
+{
+	if (!hdev || !alt) {
+		return (OPENUSB_BADARG);
+	}
+
+	*alt = hdev->claimed_ifs[ifc].altsetting;
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * virtual_reset
+ *
+ *  The device forgets its state: halts, buffered data and alternate settings
+ */
+static int32_t virtual_reset(struct usbi_dev_handle *hdev)
+{
+	struct virtual_device *vdev;
+	int i;
+
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+	vdev = hdev->idev->priv->vdev;
+
+	pthread_mutex_lock(&virtual_lock);
+	for (i = 0; i < VIRTUAL_NUM_EPS; i++) {
+		vdev->ep[i].halted = 0;
+	}
+	for (i = 0; i < 16; i++) {
+		vdev->loop[i].head = vdev->loop[i].len = 0;
+	}
+	memset(vdev->alt, 0, sizeof(vdev->alt));
+	vdev->ctrl_len = 0;
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_clear_halt(struct usbi_dev_handle *hdev, uint8_t ept)
+{
+	if (!hdev) {
+		return (OPENUSB_BADARG);
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+	virtual_endpoint(hdev->idev->priv->vdev, ept)->halted = 0;
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static int32_t virtual_get_raw_desc(struct usbi_device *idev, uint8_t type,
+                                    uint8_t descidx, uint16_t langid,
+                                    uint8_t **buffer, uint16_t *buflen)
+{
+	const uint8_t *desc;
+	uint8_t       strbuf[256];
+	int           len;
+
+	if (!idev || !idev->priv || !buffer || !buflen) {
+		return (OPENUSB_BADARG);
+	}
+
+	len = virtual_get_desc(idev->priv->vdev, type, descidx, strbuf, &desc);
+	if (len < 0) {
+		return (OPENUSB_PARSE_ERROR);
+	}
+
+	*buffer = malloc(len);
+	if (!*buffer) {
+		return (OPENUSB_NO_RESOURCES);
+	}
+	memcpy(*buffer, desc, len);
+	*buflen = len;
+
+	return (OPENUSB_SUCCESS);
+}
+
+
+
+/******************************************************************************
+ *                                IO Functions                                *
+ *****************************************************************************/
+
+/*
+ * virtual_control
+ *
+ *  Answer a control request. Standard requests are served from the
+ *  descriptors and the device state, vendor and class requests are looped
+ *  back. Called with virtual_lock held.
+ */
+static void virtual_control(struct virtual_device *vdev,
+                            struct usbi_io_private *p)
+{
+	openusb_ctrl_request_t  *ctrl = p->io->req->req.ctrl;
+	struct virtual_endpoint *ep;
+	const uint8_t           *desc;
+	uint8_t                 strbuf[256], status[2] = { 0, 0 };
+	uint8_t                 type, recip;
+	int                     in, len;
+	uint32_t                n = 0;
+
+	in = ctrl->setup.bmRequestType & USB_REQ_DEV_TO_HOST;
+	type = ctrl->setup.bmRequestType & USB_REQ_TYPE_MASK;
+	recip = ctrl->setup.bmRequestType & USB_REQ_RECIP_MASK;
+
+	p->state = VIRTUAL_IO_DONE;
+	p->status = OPENUSB_SUCCESS;
+
+	if (type != USB_REQ_TYPE_STANDARD) {
+		if (vdev->hub) {
+			goto stall;
+		}
+
+		if (in) {
+			n = ctrl->length < vdev->ctrl_len ? ctrl->length : vdev->ctrl_len;
+			memcpy(ctrl->payload, vdev->ctrl_buf, n);
+		} else {
+			n = ctrl->length < sizeof(vdev->ctrl_buf) ?
+			    ctrl->length : sizeof(vdev->ctrl_buf);
+			memcpy(vdev->ctrl_buf, ctrl->payload, n);
+			vdev->ctrl_len = n;
+		}
+		p->transferred = n;
+		return;
+	}
+
+	switch (ctrl->setup.bRequest) {
+		case USB_REQ_GET_DESCRIPTOR:
+			if (!in) {
+				goto stall;
+			}
+			len = virtual_get_desc(vdev, ctrl->setup.wValue >> 8,
+			                       ctrl->setup.wValue & 0xff, strbuf, &desc);
+			if (len < 0) {
+				goto stall;
+			}
+			n = ctrl->length < len ? ctrl->length : len;
+			memcpy(ctrl->payload, desc, n);
+			break;
+
+		case USB_REQ_GET_STATUS:
+			if (!in) {
+				goto stall;
+			}
+			if (recip == USB_REQ_RECIP_ENDPOINT) {
+				ep = virtual_endpoint(vdev, ctrl->setup.wIndex);
+				status[0] = ep->halted ? USB_ENDPOINT_STATUS_HALT : 0;
+			} else if (recip == USB_REQ_RECIP_DEVICE && vdev->hub) {
+				status[0] = 1;		/* self powered */
+			}
+			n = ctrl->length < 2 ? ctrl->length : 2;
+			memcpy(ctrl->payload, status, n);
+			break;
+
+		case USB_REQ_GET_CONFIGURATION:
+			if (!in) {
+				goto stall;
+			}
+			if (ctrl->length) {
+				ctrl->payload[0] = vdev->config;
+				n = 1;
+			}
+			break;
+
+		case USB_REQ_SET_CONFIGURATION:
+			if (ctrl->setup.wValue &&
+			    virtual_config_index(vdev, ctrl->setup.wValue) < 0) {
+				goto stall;
+			}
+			vdev->config = ctrl->setup.wValue;
+			memset(vdev->alt, 0, sizeof(vdev->alt));
+			break;
+
+		case USB_REQ_GET_INTERFACE:
+			if (!in || ctrl->setup.wIndex >= USBI_MAXINTERFACES) {
+				goto stall;
+			}
+			if (ctrl->length) {
+				ctrl->payload[0] = vdev->alt[ctrl->setup.wIndex];
+				n = 1;
+			}
+			break;
+
+		case USB_REQ_SET_INTERFACE:
+			if (ctrl->setup.wIndex >= USBI_MAXINTERFACES ||
+			    !virtual_has_altsetting(vdev, ctrl->setup.wIndex,
+			                            ctrl->setup.wValue)) {
+				goto stall;
+			}
+			vdev->alt[ctrl->setup.wIndex] = ctrl->setup.wValue;
+			break;
+
+		case USB_REQ_CLEAR_FEATURE:
+		case USB_REQ_SET_FEATURE:
+			/* ENDPOINT_HALT is the only feature we have */
+			if (recip != USB_REQ_RECIP_ENDPOINT || ctrl->setup.wValue != 0) {
+				goto stall;
+			}
+			ep = virtual_endpoint(vdev, ctrl->setup.wIndex);
+			if (!ep->present) {
+				goto stall;
+			}
+			ep->halted = ctrl->setup.bRequest == USB_REQ_SET_FEATURE;
+			break;
+
+		case USB_REQ_SET_ADDRESS:
+			break;
+
+		default:
+			goto stall;
+	}
+
+	p->transferred = n;
+	return;
+
+stall:
+	p->status = OPENUSB_IO_STALL;
+	p->transferred = 0;
+}
+
+/*
+ * virtual_submit
+ *
+ *  Submit a request of any type. The request is answered or modelled right
+ *  away and queued for the io thread to complete when it's due.
+ */
+static int32_t virtual_submit(struct usbi_dev_handle *hdev, struct usbi_io *io)
+{
+	struct virtual_device  *vdev;
+	struct usbi_io_private *p;
+	uint64_t               now, when;
+	int32_t                ret;
+
+	if (!hdev || !io) {
+		return (OPENUSB_BADARG);
+	}
+	vdev = hdev->idev->priv->vdev;
+
+	p = calloc(sizeof(*p), 1);
+	if (!p) {
+		return (OPENUSB_NO_RESOURCES);
+	}
+	p->io = io;
+	p->vdev = vdev;
+	p->heap_idx = -1;
+	p->deadline = (uint64_t)io->tvo.tv_sec * 1000000000ULL +
+	              (uint64_t)io->tvo.tv_usec * 1000ULL;
+	list_init(&p->wait_list);
+
+	now = virtual_now();
+
+	pthread_mutex_lock(&virtual_lock);
+
+	if (vdev->gone) {
+		pthread_mutex_unlock(&virtual_lock);
+		free(p);
+		return (OPENUSB_UNKNOWN_DEVICE);
+	}
+
+	if (io->req->type == USB_TYPE_CONTROL) {
+		virtual_control(vdev, p);
+		when = now + vdev->model.latency;
+	} else {
+		p->ep = virtual_endpoint(vdev, io->req->endpoint);
+		if (!p->ep->present) {
+			pthread_mutex_unlock(&virtual_lock);
+			free(p);
+			return (OPENUSB_BADARG);
+		}
+		when = virtual_model_xfer(p, now);
+	}
+
+	ret = virtual_schedule(p, when);
+	if (ret != OPENUSB_SUCCESS) {
+		pthread_mutex_unlock(&virtual_lock);
+		free(p);
+		return (ret);
+	}
+	io->priv = p;
+
+	/* control requests don't count, opening the device takes a few */
+	if (io->req->type != USB_TYPE_CONTROL && vdev->disconnect &&
+	    ++vdev->xfers >= vdev->disconnect) {
+		virtual_disconnect(vdev, now);
+	}
+
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+/*
+ * virtual_io_cancel
+ *
+ *  Take a request out of the queue. An aborted request still completes,
+ *  with OPENUSB_IO_CANCELED, one being freed by usbi_free_io() (it's no
+ *  longer on the handle's io list) just goes away.
+ */
+static int32_t virtual_io_cancel(struct usbi_io *io)
+{
+	struct usbi_io_private *p = io->priv;
+
+	if (!p) {
+		return (OPENUSB_SUCCESS);
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+
+	/* not queued any more, the io thread is completing it */
+	if (p->heap_idx >= 0) {
+		if (p->state == VIRTUAL_IO_WAITING) {
+			list_del(&p->wait_list);
+		}
+
+		if (!io->list.next) {
+			virtual_dequeue(p);
+		} else {
+			p->state = VIRTUAL_IO_DONE;
+			p->status = OPENUSB_IO_CANCELED;
+			p->transferred = 0;
+			virtual_schedule(p, 0);
+		}
+	}
+
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (OPENUSB_SUCCESS);
+}
+
+static void virtual_complete(struct usbi_io_private *p)
+{
+	struct usbi_io         *io = p->io;
+
+	/* the request may be freed as soon as it's complete */
+	usbi_io_complete(io, p->status, p->transferred);
+}
+
+/*
+ * virtual_run_due
+ *
+ *  Finish every request that is due and complete them without holding the
+ *  lock, so callbacks may submit new requests. Called and returns with the
+ *  lock held, returns the number of requests completed.
+ */
+static int virtual_run_due(void)
+{
+	struct usbi_io_private *p;
+	struct list_head       done;
+	uint64_t               now;
+	int                    n = 0;
+
+	list_init(&done);
+
+	now = virtual_now();
+	while (virtual_heap_len && virtual_heap[0]->when <= now) {
+		p = virtual_heap[0];
+		virtual_dequeue(p);
+		virtual_finish(p, now, &done);
+	}
+
+	if (list_empty(&done)) {
+		return (0);
+	}
+
+	pthread_mutex_unlock(&virtual_lock);
+
+	while (!list_empty(&done)) {
+		p = list_entry(done.next, struct usbi_io_private, wait_list);
+		list_del(&p->wait_list);
+		virtual_complete(p);
+		n++;
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+
+	return (n);
+}
+
+/*
+ * virtual_io_thread
+ *
+ *  Sleep until the first request in the queue is due and complete whatever
+ *  is.
+ */
+static void *virtual_io_thread(void *unused)
+{
+	struct timespec        ts;
+
+	pthread_mutex_lock(&virtual_lock);
+
+	while (!virtual_thread_exit) {
+		if (virtual_run_due()) {
+			continue;
+		}
+
+		if (virtual_heap_len) {
+			ts.tv_sec = virtual_heap[0]->when / 1000000000ULL;
+			ts.tv_nsec = virtual_heap[0]->when % 1000000000ULL;
+			pthread_cond_timedwait(&virtual_cond, &virtual_lock, &ts);
+		} else {
+			pthread_cond_wait(&virtual_cond, &virtual_lock);
+		}
+	}
+
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (NULL);
+}
+
+/*
+ * Without the io thread: our pipe only wakes the application's loop so it
+ * asks virtual_next_timeout() again, virtual_handle_timeouts() does the
+ * io thread's work.
+ */
+static void virtual_drain(int fd, short revents, void *arg)
+{
+	char buf[16];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static int32_t virtual_next_timeout(void)
+{
+	uint64_t now;
+	int32_t  ms = -1;
+
+	if (virtual_pipe[0] < 0) {
+		return (-1);
+	}
+
+	pthread_mutex_lock(&virtual_lock);
+	if (virtual_heap_len) {
+		now = virtual_now();
+		if (virtual_heap[0]->when <= now) {
+			ms = 0;
+		} else if (virtual_heap[0]->when - now >= (uint64_t)INT32_MAX * 1000000) {
+			ms = INT32_MAX;
+		} else {
+			ms = (virtual_heap[0]->when - now + 999999) / 1000000;
+		}
+	}
+	pthread_mutex_unlock(&virtual_lock);
+
+	return (ms);
+}
+
+static void virtual_handle_timeouts(void)
+{
+	if (virtual_pipe[0] < 0) {
+		return;
+	}
+
+	/* one pass, what falls due meanwhile waits for the next call */
+	pthread_mutex_lock(&virtual_lock);
+	virtual_run_due();
+	pthread_mutex_unlock(&virtual_lock);
+}
+
+
+
+struct usbi_backend_ops backend_ops = {
+	.backend_version          = 1,
+	.io_pattern               = PATTERN_ASYNC,
+	.init                     = virtual_init,
+	.fini                     = virtual_fini,
+	.find_buses               = virtual_find_buses,
+	.refresh_devices          = virtual_refresh_devices,
+	.free_device              = virtual_free_device,
+	.next_timeout             = virtual_next_timeout,
+	.handle_timeouts          = virtual_handle_timeouts,
+	.dev = {
+		.open                     = virtual_open,
+		.close                    = virtual_close,
+		.set_configuration        = virtual_set_configuration,
+		.get_configuration        = virtual_get_configuration,
+		.claim_interface          = virtual_claim_interface,
+		.release_interface        = virtual_release_interface,
+		.get_altsetting           = virtual_get_altsetting,
+		.set_altsetting           = virtual_set_altsetting,
+		.reset                    = virtual_reset,
+		.clear_halt               = virtual_clear_halt,
+		.ctrl_xfer_aio            = virtual_submit,
+		.intr_xfer_aio            = virtual_submit,
+		.bulk_xfer_aio            = virtual_submit,
+		.isoc_xfer_aio            = virtual_submit,
+		.ctrl_xfer_wait           = NULL,
+		.intr_xfer_wait           = NULL,
+		.bulk_xfer_wait           = NULL,
+		.isoc_xfer_wait           = NULL,
+		.io_cancel                = virtual_io_cancel,
+		.get_raw_desc             = virtual_get_raw_desc,
+	},
+};
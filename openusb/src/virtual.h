@@ -0,0 +1,155 @@
+/*
+ * Virtual USB device support
+ *
+ *	This library is covered by the LGPL, read LICENSE for details.
+ */
+
+#ifndef __VIRTUAL_H__
+#define __VIRTUAL_H__
+
+#include "openusb.h"
+#include "usbi.h"
+
+/* virtual bus numbers start here so they don't clash with the real ones */
+#define VIRTUAL_BUSNUM_BASE	1000
+
+/* devices per bus, address 1 is the bus' root hub */
+#define VIRTUAL_MAX_DEVICES	126
+
+#define VIRTUAL_MAX_CTRL_XFER	4096
+#define VIRTUAL_LOOP_SIZE	(1024 * 1024)	/* default loopback buffer */
+
+/* endpoint slots, OUT endpoints first, then IN endpoints */
+#define VIRTUAL_NUM_EPS		32
+#define VIRTUAL_EP_INDEX(addr) \
+	(((addr) & USB_ENDPOINT_NUM_MASK) + ((addr) & USB_ENDPOINT_IN ? 16 : 0))
+
+enum virtual_speed {
+	VIRTUAL_SPEED_LOW,
+	VIRTUAL_SPEED_FULL,
+	VIRTUAL_SPEED_HIGH,
+	VIRTUAL_SPEED_SUPER
+};
+
+/* which fields of a virtual_model were given in the configuration */
+#define VIRTUAL_MODEL_LATENCY	0x01
+#define VIRTUAL_MODEL_BANDWIDTH	0x02
+#define VIRTUAL_MODEL_STALL	0x04
+#define VIRTUAL_MODEL_TIMEOUT	0x08
+
+/*
+ * Timing and fault model of an endpoint. Devices carry one as well, it
+ * provides the defaults of their endpoints and the latency of ep0.
+ */
+struct virtual_model {
+	uint32_t	fields;		/* VIRTUAL_MODEL_* given explicitly */
+	uint64_t	latency;	/* ns from end of transfer to completion */
+	uint64_t	bandwidth;	/* bytes per second, 0 is unlimited */
+	uint32_t	stall;		/* every Nth transfer stalls, 0 never */
+	uint32_t	timeout;	/* every Nth transfer is lost, 0 never */
+};
+
+/* data written to an OUT endpoint, read back from the matching IN one */
+struct virtual_loop {
+	uint8_t			*buf;
+	size_t			size;
+	size_t			head;		/* offset of the oldest byte */
+	size_t			len;		/* bytes buffered */
+
+	struct list_head	readers;	/* IN requests waiting for data */
+	struct list_head	writers;	/* OUT requests waiting for room */
+};
+
+struct virtual_endpoint {
+	uint8_t			present;
+	uint8_t			addr;
+	uint8_t			type;		/* USB_ENDPOINT_TYPE_* */
+	uint8_t			bInterval;
+	uint16_t		maxpacket;
+	uint64_t		interval;	/* ns between service periods */
+
+	struct virtual_model	model;
+
+	uint64_t		busy_until;	/* ns, end of the last transfer */
+	uint32_t		count;		/* transfers submitted */
+	int			halted;
+};
+
+struct virtual_device {
+	struct list_head	list;		/* on the virtual bus */
+	struct virtual_bus	*vbus;
+	int			devnum;
+	int			hub;		/* the bus' root hub */
+	enum virtual_speed	speed;
+
+	/* device descriptor followed by the configuration descriptors */
+	uint8_t			*desc;
+	size_t			desc_len;
+	int			num_configs;
+	uint8_t			*configs[USBI_MAXCONFIG];
+
+	char			*manufacturer;
+	char			*product;
+	char			*serial;
+
+	struct virtual_model	model;
+	int			loopback;	/* IN returns what OUT wrote */
+	size_t			loop_size;
+	uint32_t		disconnect;	/* drop off after N transfers */
+	uint32_t		xfers;
+
+	int			gone;		/* disconnected */
+	int			opened;		/* open handles */
+
+	uint8_t			config;		/* bConfigurationValue */
+	uint8_t			alt[USBI_MAXINTERFACES];
+
+	uint8_t			ctrl_buf[VIRTUAL_MAX_CTRL_XFER];
+	uint32_t		ctrl_len;	/* vendor request loopback */
+
+	struct virtual_endpoint	ep[VIRTUAL_NUM_EPS];
+	struct virtual_loop	loop[16];	/* by endpoint number */
+
+	struct usbi_device	*idev;		/* NULL until enumerated */
+};
+
+struct virtual_bus {
+	struct list_head	list;
+	unsigned int		busnum;
+	int			num_devices;
+	struct list_head	devices;
+	struct virtual_device	*root;
+};
+
+/* backend specific data */
+struct usbi_bus_private {
+	struct virtual_bus	*vbus;
+};
+
+struct usbi_dev_private {
+	struct virtual_device	*vdev;
+};
+
+enum virtual_io_state {
+	VIRTUAL_IO_QUEUED,	/* scheduled, completes at 'when' */
+	VIRTUAL_IO_WAITING,	/* waiting on a loopback buffer until 'when' */
+	VIRTUAL_IO_DONE		/* result is final, completes at 'when' */
+};
+
+struct usbi_io_private {
+	struct usbi_io		*io;
+	struct virtual_device	*vdev;
+	struct virtual_endpoint	*ep;
+
+	enum virtual_io_state	state;
+	uint64_t		when;		/* ns, position in the queue */
+	uint64_t		deadline;	/* ns, request timeout */
+	uint64_t		start;		/* ns, isochronous, first packet */
+	int			heap_idx;	/* -1 when not queued */
+	struct list_head	wait_list;	/* loop waiters, done list */
+
+	int32_t			status;
+	uint32_t		transferred;
+};
+
+#endif /* __VIRTUAL_H__ */
@@ -0,0 +1,918 @@
+/*
+ * OpenUSB transfer throughput and latency benchmark
+ *
+ * Runs every combination of the given transfer types, modes, sizes, queue
+ * depths, device counts and thread counts as a scenario and prints one
+ * record per scenario: transfers and MB per second, p50/p99/p99.9 latency,
+ * CPU time and context switches per transfer. Works against real devices or, without any
+ * hardware, the virtual backend, e.g.
+ *
+ *   OPENUSB_VIRTUAL="device count=200 loopback=0" \
+ *	bench_openusb -t bulk,intr -m sync,async -s 8,4k,1M -q 1,16,256 -j 1,8
+ *
+ *   bench_openusb [options]
+ *	-t types	ctrl, bulk, intr, isoc (bulk)
+ *	-m modes	sync, async (sync)
+ *	-s sizes	bytes per transfer, k and M suffixes (512)
+ *	-q depths	async requests in flight per thread, 1-256 (1)
+ *	-D devices	devices to spread the transfers over, 1-200 (1)
+ *	-j threads	submitting threads, 1-32 (1)
+ *	-x dir		out, in or loop (out). loop alternates OUT and IN
+ *			transfers, for devices that loop data back
+ *	-n count	transfers per thread (1000)
+ *	-T seconds	run every scenario for this long instead
+ *	-k packets	packets per isochronous transfer (8)
+ *	-v vid -p pid	only use devices with this vendor / product id
+ *	-I ifc		interface to claim (0)
+ *	-o ept -i ept	OUT and IN endpoints, found in the descriptors
+ *			otherwise
+ *	-R request	bRequest of the vendor control requests (0)
+ *	-F format	csv or json (csv)
+ *	-U		have the Linux io thread wait on io_uring
+ *
+ * Lists are separated by commas. Latency is from submission to completion
+ * of a transfer, CPU is the user and system time of the whole process, the
+ * library's and backend's threads included, over the transfers done. So are
+ * the context switches, a rough count of the sleeps and wakeups it took.
+ *
+ * This library is covered by the LGPL, read LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <openusb.h>
+
+#define BENCH_MAX_LIST		16
+#define BENCH_MAX_DEPTH		256
+#define BENCH_MAX_DEVICES	200
+#define BENCH_MAX_THREADS	32
+#define BENCH_MAX_SIZE		(16 * 1024 * 1024)
+
+enum bench_dir { DIR_OUT, DIR_IN, DIR_LOOP };
+
+struct bench_list {
+	uint32_t	val[BENCH_MAX_LIST];
+	int		num;
+};
+
+/* a device and the endpoints to use on it */
+struct bench_target {
+	openusb_devid_t	devid;
+	uint8_t		out_ep;
+	uint8_t		in_ep;
+};
+
+struct bench_scenario {
+	openusb_transfer_type_t	type;
+	int			async;
+	uint32_t		size;
+	uint32_t		depth;
+	uint32_t		devices;
+	uint32_t		threads;
+};
+
+/* one request slot, async threads keep 'depth' of them in flight */
+struct bench_slot {
+	struct openusb_request_handle	req;
+	openusb_ctrl_request_t		ctrl;
+	openusb_intr_request_t		intr;
+	openusb_bulk_request_t		bulk;
+	openusb_isoc_request_t		isoc;
+	struct openusb_isoc_packet	*packets;
+	openusb_request_result_t	*isoc_results;
+	uint8_t				*buf;
+	int				dev;
+	int				in;
+	double				start;
+};
+
+struct bench_thread {
+	pthread_t		tid;
+	struct bench_scenario	*sc;
+
+	/* every thread has its own library handle and its own opens */
+	openusb_handle_t	lib;
+	int			num_devs;
+	openusb_dev_handle_t	devs[BENCH_MAX_DEVICES];
+	struct bench_target	*targets[BENCH_MAX_DEVICES];
+
+	struct bench_slot	*slots;
+	int			next_dev;
+	int			next_in;
+
+	uint64_t		ops;
+	uint64_t		errors;
+	uint64_t		bytes;
+	int32_t			last_error;
+
+	double			*lat;		/* us */
+	size_t			num_lat;
+	size_t			max_lat;
+};
+
+static struct bench_list types, modes, sizes, depths, devcounts, threadcounts;
+static enum bench_dir	direction = DIR_OUT;
+static uint64_t		count = 1000;
+static double		duration = 0;
+static uint32_t		num_packets = 8;
+static int32_t		vendor = -1, product = -1;
+static uint8_t		interface = 0;
+static int		out_ep = -1, in_ep = -1;
+static uint8_t		ctrl_request = 0;
+static int		json = 0;
+static uint32_t		init_flags = 0;
+
+static struct bench_target	targets[BENCH_MAX_DEVICES];
+static int			num_targets;
+
+static volatile int	stop;
+static double		deadline;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static double cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000.0 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static double csw(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (double)ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static const char *type_name(openusb_transfer_type_t type)
+{
+	switch (type) {
+	case USB_TYPE_CONTROL:
+		return "ctrl";
+	case USB_TYPE_INTERRUPT:
+		return "intr";
+	case USB_TYPE_ISOCHRONOUS:
+		return "isoc";
+	default:
+		return "bulk";
+	}
+}
+
+static const char *dir_name(enum bench_dir dir)
+{
+	return dir == DIR_OUT ? "out" : dir == DIR_IN ? "in" : "loop";
+}
+
+static int parse_size(const char *s, uint32_t *val)
+{
+	char *end;
+	unsigned long v;
+
+	v = strtoul(s, &end, 0);
+	if (end == s)
+		return -1;
+
+	if (*end == 'k' || *end == 'K') {
+		v *= 1024;
+		end++;
+	} else if (*end == 'M') {
+		v *= 1024 * 1024;
+		end++;
+	}
+
+	if (*end)
+		return -1;
+
+	*val = v;
+	return 0;
+}
+
+/* comma separated list of sizes, or of names if 'names' is given */
+static int parse_list(struct bench_list *list, char *arg, const char **names)
+{
+	char *tok, *save = NULL;
+	int i;
+
+	list->num = 0;
+	for (tok = strtok_r(arg, ",", &save); tok;
+	    tok = strtok_r(NULL, ",", &save)) {
+		if (list->num == BENCH_MAX_LIST)
+			return -1;
+
+		if (names) {
+			for (i = 0; names[i]; i++) {
+				if (strcmp(tok, names[i]) == 0)
+					break;
+			}
+			if (!names[i])
+				return -1;
+			list->val[list->num++] = i;
+		} else if (parse_size(tok, &list->val[list->num++]) < 0) {
+			return -1;
+		}
+	}
+
+	return list->num ? 0 : -1;
+}
+
+/*
+ * Find the first OUT and IN endpoints of the transfer type on the
+ * interface's first alternate setting.
+ */
+static int find_endpoints(openusb_handle_t lib, struct bench_target *t,
+	openusb_transfer_type_t type)
+{
+	static const uint8_t attrs[] = {
+		[USB_TYPE_INTERRUPT] = USB_ENDPOINT_TYPE_INTERRUPT,
+		[USB_TYPE_BULK] = USB_ENDPOINT_TYPE_BULK,
+		[USB_TYPE_ISOCHRONOUS] = USB_ENDPOINT_TYPE_ISOCHRONOUS,
+	};
+	usb_interface_desc_t ifc;
+	usb_endpoint_desc_t ep;
+	int i;
+
+	t->out_ep = out_ep >= 0 ? out_ep : 0;
+	t->in_ep = in_ep >= 0 ? in_ep : 0;
+
+	if (type == USB_TYPE_CONTROL)
+		return 0;
+
+	if (openusb_parse_interface_desc(lib, t->devid, NULL, 0, 0, interface,
+	    0, &ifc) != OPENUSB_SUCCESS)
+		return -1;
+
+	for (i = 0; i < ifc.bNumEndpoints; i++) {
+		if (openusb_parse_endpoint_desc(lib, t->devid, NULL, 0, 0,
+		    interface, 0, i, &ep) != OPENUSB_SUCCESS)
+			return -1;
+
+		if ((ep.bmAttributes & USB_ENDPOINT_TYPE_MASK) != attrs[type])
+			continue;
+
+		if (ep.bEndpointAddress & USB_ENDPOINT_IN) {
+			if (in_ep < 0 && !t->in_ep)
+				t->in_ep = ep.bEndpointAddress;
+		} else if (out_ep < 0 && !t->out_ep) {
+			t->out_ep = ep.bEndpointAddress;
+		}
+	}
+
+	if ((direction != DIR_IN && !t->out_ep) ||
+	    (direction != DIR_OUT && !t->in_ep))
+		return -1;
+
+	return 0;
+}
+
+/* the devices to run a transfer type against, hubs aren't candidates */
+static int find_targets(openusb_handle_t lib, openusb_transfer_type_t type)
+{
+	openusb_devid_t *devids = NULL;
+	usb_device_desc_t desc;
+	uint32_t num_devids, i;
+
+	num_targets = 0;
+
+	if (openusb_get_devids_by_vendor(lib, vendor, product, &devids,
+	    &num_devids) != OPENUSB_SUCCESS)
+		return 0;
+
+	for (i = 0; i < num_devids && num_targets < BENCH_MAX_DEVICES; i++) {
+		if (openusb_parse_device_desc(lib, devids[i], NULL, 0,
+		    &desc) != OPENUSB_SUCCESS ||
+		    desc.bDeviceClass == USB_CLASS_HUB)
+			continue;
+
+		targets[num_targets].devid = devids[i];
+		if (find_endpoints(lib, &targets[num_targets], type) == 0)
+			num_targets++;
+	}
+
+	openusb_free_devid_list(devids);
+
+	return num_targets;
+}
+
+static void add_latency(struct bench_thread *th, double us)
+{
+	if (th->num_lat == th->max_lat) {
+		size_t max = th->max_lat ? th->max_lat * 2 : 4096;
+		double *lat = realloc(th->lat, max * sizeof(*lat));
+
+		if (!lat)
+			return;
+		th->lat = lat;
+		th->max_lat = max;
+	}
+
+	th->lat[th->num_lat++] = us;
+}
+
+/* set a slot up for its next transfer, on the thread's next device */
+static void prepare_slot(struct bench_thread *th, struct bench_slot *slot)
+{
+	struct bench_scenario *sc = th->sc;
+	struct bench_target *t;
+	uint32_t i;
+
+	/* in loop mode a device gets an OUT and then the IN reading it back */
+	if (direction == DIR_LOOP) {
+		slot->in = th->next_in;
+		th->next_in = !th->next_in;
+	} else {
+		slot->in = direction == DIR_IN;
+	}
+
+	slot->dev = th->next_dev;
+	if (direction != DIR_LOOP || slot->in)
+		th->next_dev = (th->next_dev + 1) % th->num_devs;
+	t = th->targets[slot->dev];
+
+	memset(&slot->req, 0, sizeof(slot->req));
+	slot->req.dev = th->devs[slot->dev];
+	slot->req.interface = interface;
+	slot->req.endpoint = slot->in ? t->in_ep : t->out_ep;
+	slot->req.type = sc->type;
+
+	switch (sc->type) {
+	case USB_TYPE_CONTROL:
+		memset(&slot->ctrl, 0, sizeof(slot->ctrl));
+		slot->ctrl.setup.bmRequestType = USB_REQ_TYPE_VENDOR |
+			USB_REQ_RECIP_DEVICE | (slot->in ? USB_REQ_DEV_TO_HOST : 0);
+		slot->ctrl.setup.bRequest = ctrl_request;
+		slot->ctrl.payload = slot->buf;
+		slot->ctrl.length = sc->size;
+		slot->req.endpoint = 0;
+		slot->req.req.ctrl = &slot->ctrl;
+		break;
+
+	case USB_TYPE_INTERRUPT:
+		memset(&slot->intr, 0, sizeof(slot->intr));
+		slot->intr.payload = slot->buf;
+		slot->intr.length = sc->size;
+		slot->req.req.intr = &slot->intr;
+		break;
+
+	case USB_TYPE_ISOCHRONOUS:
+		memset(&slot->isoc, 0, sizeof(slot->isoc));
+		for (i = 0; i < num_packets; i++) {
+			slot->packets[i].payload = slot->buf +
+				i * (sc->size / num_packets);
+			slot->packets[i].length = sc->size / num_packets;
+		}
+		slot->isoc.pkts.num_packets = num_packets;
+		slot->isoc.pkts.packets = slot->packets;
+		slot->isoc.isoc_results = slot->isoc_results;
+		slot->req.req.isoc = &slot->isoc;
+		break;
+
+	default:
+		memset(&slot->bulk, 0, sizeof(slot->bulk));
+		slot->bulk.payload = slot->buf;
+		slot->bulk.length = sc->size;
+		slot->req.req.bulk = &slot->bulk;
+		break;
+	}
+}
+
+static void slot_result(struct bench_thread *th, struct bench_slot *slot,
+	int32_t ret)
+{
+	openusb_request_result_t *result;
+	uint32_t i, bytes = 0;
+
+	switch (th->sc->type) {
+	case USB_TYPE_CONTROL:
+		result = &slot->ctrl.result;
+		break;
+	case USB_TYPE_INTERRUPT:
+		result = &slot->intr.result;
+		break;
+	case USB_TYPE_ISOCHRONOUS:
+		result = &slot->isoc_results[0];
+		for (i = 0; i < num_packets; i++)
+			bytes += slot->isoc_results[i].transferred_bytes;
+		break;
+	default:
+		result = &slot->bulk.result;
+		break;
+	}
+
+	if (ret == OPENUSB_SUCCESS)
+		ret = result->status;
+
+	if (ret != OPENUSB_SUCCESS) {
+		th->errors++;
+		th->last_error = ret;
+		return;
+	}
+
+	if (th->sc->type != USB_TYPE_ISOCHRONOUS)
+		bytes = result->transferred_bytes;
+
+	th->ops++;
+	th->bytes += bytes;
+	add_latency(th, now_us() - slot->start);
+}
+
+static int keep_going(struct bench_thread *th, uint64_t submitted)
+{
+	if (stop)
+		return 0;
+	if (duration > 0)
+		return now_us() < deadline;
+	return submitted < count;
+}
+
+static void run_sync(struct bench_thread *th)
+{
+	struct bench_slot *slot = &th->slots[0];
+	uint64_t submitted = 0;
+	int32_t ret;
+
+	while (keep_going(th, submitted)) {
+		prepare_slot(th, slot);
+		slot->start = now_us();
+		ret = openusb_xfer_wait(&slot->req);
+		slot_result(th, slot, ret);
+		submitted++;
+	}
+}
+
+static void run_async(struct bench_thread *th)
+{
+	openusb_request_handle_t handles[BENCH_MAX_DEPTH], done;
+	struct bench_slot *slot;
+	uint64_t submitted = 0;
+	uint32_t inflight = 0, i, j;
+	int32_t ret;
+
+	for (i = 0; i < th->sc->depth && keep_going(th, submitted); i++) {
+		slot = &th->slots[i];
+		prepare_slot(th, slot);
+		slot->start = now_us();
+		ret = openusb_xfer_aio(&slot->req);
+		submitted++;
+		if (ret != OPENUSB_SUCCESS) {
+			slot_result(th, slot, ret);
+			continue;
+		}
+		handles[inflight++] = &slot->req;
+	}
+
+	while (inflight) {
+		ret = openusb_wait(inflight, handles, &done);
+		if (ret != OPENUSB_SUCCESS) {
+			th->last_error = ret;
+			stop = 1;
+			break;
+		}
+
+		for (i = 0; i < inflight && handles[i] != done; i++)
+			;
+		slot = (struct bench_slot *)done;
+		slot_result(th, slot, OPENUSB_SUCCESS);
+
+		/* resubmit the slot, or retire it */
+		for (;;) {
+			if (!keep_going(th, submitted)) {
+				for (j = i; j + 1 < inflight; j++)
+					handles[j] = handles[j + 1];
+				inflight--;
+				break;
+			}
+
+			prepare_slot(th, slot);
+			slot->start = now_us();
+			ret = openusb_xfer_aio(&slot->req);
+			submitted++;
+			if (ret == OPENUSB_SUCCESS)
+				break;
+			slot_result(th, slot, ret);
+		}
+	}
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *th = arg;
+
+	if (th->sc->async)
+		run_async(th);
+	else
+		run_sync(th);
+
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double *lat, size_t num, double p)
+{
+	size_t i;
+
+	if (!num)
+		return 0;
+
+	i = (size_t)(p * num);
+	return lat[i < num ? i : num - 1];
+}
+
+static void thread_cleanup(struct bench_thread *th)
+{
+	int i;
+
+	if (th->slots) {
+		for (i = 0; i < BENCH_MAX_DEPTH; i++) {
+			free(th->slots[i].buf);
+			free(th->slots[i].packets);
+			free(th->slots[i].isoc_results);
+		}
+		free(th->slots);
+	}
+
+	for (i = 0; i < th->num_devs; i++)
+		openusb_close_device(th->devs[i]);
+
+	if (th->lib)
+		openusb_fini(th->lib);
+
+	free(th->lat);
+}
+
+/*
+ * Devices are spread over the threads: with more devices than threads
+ * every thread gets its own, with fewer they're shared.
+ */
+static int thread_setup(struct bench_thread *th, int idx,
+	struct bench_scenario *sc)
+{
+	uint32_t i, d, nslots;
+	int32_t ret;
+
+	memset(th, 0, sizeof(*th));
+	th->sc = sc;
+
+	ret = openusb_init(init_flags, &th->lib);
+	if (ret != OPENUSB_SUCCESS) {
+		fprintf(stderr, "openusb_init failed: %s\n",
+			openusb_strerror(ret));
+		return -1;
+	}
+
+	for (d = idx % sc->devices; d < sc->devices; d += sc->threads) {
+		th->targets[th->num_devs] = &targets[d];
+		ret = openusb_open_device(th->lib, targets[d].devid,
+			USB_INIT_DEFAULT, &th->devs[th->num_devs]);
+		if (ret != OPENUSB_SUCCESS) {
+			fprintf(stderr, "device %llx: open failed: %s\n",
+				(unsigned long long)targets[d].devid,
+				openusb_strerror(ret));
+			return -1;
+		}
+		th->num_devs++;
+
+		ret = openusb_claim_interface(th->devs[th->num_devs - 1],
+			interface, USB_INIT_DEFAULT);
+		if (ret != OPENUSB_SUCCESS) {
+			fprintf(stderr, "device %llx: claim failed: %s\n",
+				(unsigned long long)targets[d].devid,
+				openusb_strerror(ret));
+			return -1;
+		}
+
+		if (sc->threads > sc->devices)
+			break;
+	}
+
+	th->slots = calloc(BENCH_MAX_DEPTH, sizeof(*th->slots));
+	if (!th->slots)
+		return -1;
+
+	nslots = sc->async ? sc->depth : 1;
+	for (i = 0; i < nslots; i++) {
+		th->slots[i].buf = malloc(sc->size ? sc->size : 1);
+		th->slots[i].packets = calloc(num_packets,
+			sizeof(*th->slots[i].packets));
+		th->slots[i].isoc_results = calloc(num_packets,
+			sizeof(*th->slots[i].isoc_results));
+		if (!th->slots[i].buf || !th->slots[i].packets ||
+		    !th->slots[i].isoc_results)
+			return -1;
+		memset(th->slots[i].buf, 0x5a, sc->size);
+	}
+
+	return 0;
+}
+
+static void print_result(struct bench_scenario *sc, struct bench_thread *th,
+	double elapsed, double cpu, double switches)
+{
+	static int header;
+	uint64_t ops = 0, errors = 0, bytes = 0;
+	size_t num_lat = 0;
+	double *lat, p50, p99, p999, max;
+	int32_t last_error = 0;
+	uint32_t i;
+
+	for (i = 0; i < sc->threads; i++) {
+		ops += th[i].ops;
+		errors += th[i].errors;
+		bytes += th[i].bytes;
+		num_lat += th[i].num_lat;
+		if (th[i].last_error)
+			last_error = th[i].last_error;
+	}
+
+	lat = malloc((num_lat ? num_lat : 1) * sizeof(*lat));
+	if (!lat)
+		return;
+	num_lat = 0;
+	for (i = 0; i < sc->threads; i++) {
+		/* a thread that completed nothing may not have an array */
+		if (!th[i].num_lat)
+			continue;
+		memcpy(lat + num_lat, th[i].lat, th[i].num_lat * sizeof(*lat));
+		num_lat += th[i].num_lat;
+	}
+	qsort(lat, num_lat, sizeof(*lat), compare_double);
+
+	p50 = percentile(lat, num_lat, 0.5);
+	p99 = percentile(lat, num_lat, 0.99);
+	p999 = percentile(lat, num_lat, 0.999);
+	max = num_lat ? lat[num_lat - 1] : 0;
+	free(lat);
+
+	elapsed /= 1000000.0;
+
+	if (json) {
+		printf("{\"type\":\"%s\",\"mode\":\"%s\",\"dir\":\"%s\","
+			"\"size\":%u,\"depth\":%u,\"devices\":%u,\"threads\":%u,"
+			"\"ops\":%llu,\"errors\":%llu,\"seconds\":%.6f,"
+			"\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f,"
+			"\"lat_p50_us\":%.1f,\"lat_p99_us\":%.1f,"
+			"\"lat_p999_us\":%.1f,\"lat_max_us\":%.1f,"
+			"\"cpu_us_per_op\":%.3f,\"csw_per_op\":%.3f,"
+			"\"last_error\":\"%s\"}\n",
+			type_name(sc->type), sc->async ? "async" : "sync",
+			dir_name(direction), sc->size, sc->depth, sc->devices,
+			sc->threads, (unsigned long long)ops,
+			(unsigned long long)errors, elapsed, ops / elapsed,
+			bytes / elapsed / 1000000.0, p50, p99, p999, max,
+			ops ? cpu / ops : 0, ops ? switches / ops : 0,
+			last_error ? openusb_strerror(last_error) : "");
+	} else {
+		if (!header++)
+			printf("type,mode,dir,size,depth,devices,threads,ops,"
+				"errors,seconds,ops_per_sec,mb_per_sec,"
+				"lat_p50_us,lat_p99_us,lat_p999_us,lat_max_us,"
+				"cpu_us_per_op,csw_per_op\n");
+		printf("%s,%s,%s,%u,%u,%u,%u,%llu,%llu,%.6f,%.1f,%.3f,"
+			"%.1f,%.1f,%.1f,%.1f,%.3f,%.3f\n",
+			type_name(sc->type), sc->async ? "async" : "sync",
+			dir_name(direction), sc->size, sc->depth, sc->devices,
+			sc->threads, (unsigned long long)ops,
+			(unsigned long long)errors, elapsed, ops / elapsed,
+			bytes / elapsed / 1000000.0, p50, p99, p999, max,
+			ops ? cpu / ops : 0, ops ? switches / ops : 0);
+	}
+	fflush(stdout);
+}
+
+static int run_scenario(struct bench_scenario *sc)
+{
+	struct bench_thread *th;
+	double start, cpu, switches;
+	uint32_t i;
+	int ret = 0;
+
+	th = calloc(sc->threads, sizeof(*th));
+	if (!th)
+		return -1;
+
+	for (i = 0; i < sc->threads; i++) {
+		if (thread_setup(&th[i], i, sc) < 0) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	stop = 0;
+	start = now_us();
+	deadline = start + duration * 1000000.0;
+	cpu = cpu_us();
+	switches = csw();
+
+	for (i = 0; i < sc->threads; i++)
+		pthread_create(&th[i].tid, NULL, bench_thread_main, &th[i]);
+	for (i = 0; i < sc->threads; i++)
+		pthread_join(th[i].tid, NULL);
+
+	print_result(sc, th, now_us() - start, cpu_us() - cpu,
+		csw() - switches);
+
+out:
+	for (i = 0; i < sc->threads; i++)
+		thread_cleanup(&th[i]);
+	free(th);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t ctrl,bulk,intr,isoc] [-m sync,async] "
+		"[-s sizes] [-q depths]\n"
+		"\t[-D devices] [-j threads] [-x out|in|loop] [-n count] "
+		"[-T seconds]\n"
+		"\t[-k packets] [-v vid] [-p pid] [-I ifc] [-o ept] [-i ept] "
+		"[-R request]\n"
+		"\t[-F csv|json] [-U]\n", prog);
+}
+
+static int check_list(struct bench_list *list, uint32_t min, uint32_t max,
+	const char *what)
+{
+	int i;
+
+	for (i = 0; i < list->num; i++) {
+		if (list->val[i] < min || list->val[i] > max) {
+			fprintf(stderr, "%s must be %u-%u\n", what, min, max);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *type_names[] = { "", "ctrl", "intr", "bulk", "isoc",
+		NULL };
+	static const char *mode_names[] = { "sync", "async", NULL };
+	static const char *dir_names[] = { "out", "in", "loop", NULL };
+	struct bench_list dirs;
+	struct bench_scenario sc;
+	openusb_handle_t libhandle;
+	int t, m, s, q, d, j, ret, c;
+
+	types.num = 1;
+	types.val[0] = USB_TYPE_BULK;
+	modes.num = 1;
+	sizes.num = 1;
+	sizes.val[0] = 512;
+	depths.num = 1;
+	depths.val[0] = 1;
+	devcounts.num = 1;
+	devcounts.val[0] = 1;
+	threadcounts.num = 1;
+	threadcounts.val[0] = 1;
+
+	while ((c = getopt(argc, argv, "t:m:s:q:D:j:x:n:T:k:v:p:I:o:i:R:F:U")) !=
+	    -1) {
+		ret = 0;
+		switch (c) {
+		case 't':
+			ret = parse_list(&types, optarg, type_names);
+			break;
+		case 'm':
+			ret = parse_list(&modes, optarg, mode_names);
+			break;
+		case 's':
+			ret = parse_list(&sizes, optarg, NULL);
+			break;
+		case 'q':
+			ret = parse_list(&depths, optarg, NULL);
+			break;
+		case 'D':
+			ret = parse_list(&devcounts, optarg, NULL);
+			break;
+		case 'j':
+			ret = parse_list(&threadcounts, optarg, NULL);
+			break;
+		case 'x':
+			ret = parse_list(&dirs, optarg, dir_names);
+			direction = dirs.val[0];
+			break;
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'T':
+			duration = atof(optarg);
+			break;
+		case 'k':
+			num_packets = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			vendor = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			product = strtol(optarg, NULL, 0);
+			break;
+		case 'I':
+			interface = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out_ep = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			in_ep = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			ctrl_request = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 'U':
+			init_flags |= OPENUSB_INIT_IO_URING;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+
+		if (ret < 0) {
+			fprintf(stderr, "bad -%c argument\n", c);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (check_list(&sizes, 0, BENCH_MAX_SIZE, "sizes") < 0 ||
+	    check_list(&depths, 1, BENCH_MAX_DEPTH, "depths") < 0 ||
+	    check_list(&devcounts, 1, BENCH_MAX_DEVICES, "devices") < 0 ||
+	    check_list(&threadcounts, 1, BENCH_MAX_THREADS, "threads") < 0)
+		return 1;
+
+	if (num_packets < 1 || (count == 0 && duration <= 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = openusb_init(init_flags, &libhandle);
+	if (ret != OPENUSB_SUCCESS) {
+		printf("openusb_init failed: %s\n", openusb_strerror(ret));
+		return 1;
+	}
+
+	for (t = 0; t < types.num; t++) {
+		memset(&sc, 0, sizeof(sc));
+		sc.type = types.val[t];
+
+		if (find_targets(libhandle, sc.type) == 0) {
+			fprintf(stderr, "no devices with %s endpoints\n",
+				type_name(sc.type));
+			continue;
+		}
+
+		for (m = 0; m < modes.num; m++)
+		for (s = 0; s < sizes.num; s++)
+		for (q = 0; q < depths.num; q++)
+		for (d = 0; d < devcounts.num; d++)
+		for (j = 0; j < threadcounts.num; j++) {
+			sc.async = modes.val[m];
+			sc.size = sizes.val[s];
+			sc.depth = sc.async ? depths.val[q] : 1;
+			sc.devices = devcounts.val[d];
+			sc.threads = threadcounts.val[j];
+
+			/* the queue depth means nothing to synchronous I/O */
+			if (!sc.async && q > 0)
+				continue;
+
+			if (sc.devices > num_targets) {
+				fprintf(stderr, "%u devices wanted, %d found\n",
+					sc.devices, num_targets);
+				continue;
+			}
+
+			run_scenario(&sc);
+		}
+	}
+
+	openusb_fini(libhandle);
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Bulk channel test
+ *
+ * Runs the buffered bulk channels, openusb_bulk_out_open() and
+ * openusb_bulk_in_open(), against a virtual device looping its bulk OUT
+ * endpoint back to its bulk IN endpoint and checks the data read back:
+ * a byte stream, messages ended by short packets and messages longer than
+ * the IN channel's ring.
+ *
+ *   OPENUSB_VIRTUAL="device" bulkchan [-n]
+ *
+ * -n runs the library without its event thread. Exits with 0 when every
+ * check passed.
+ *
+ * This library is covered by the LGPL, read LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openusb.h>
+
+#define VIRTUAL_VID	0x6666
+#define EP_OUT		0x01
+#define EP_IN		0x81
+
+static openusb_dev_handle_t dev;
+static int failures;
+
+#define check(cond, ...) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);	\
+		fprintf(stderr, __VA_ARGS__);				\
+		fprintf(stderr, "\n");					\
+		failures++;						\
+	}								\
+} while (0)
+
+/* one bulk OUT transfer of len bytes of pattern, seed counting up */
+static int32_t put(uint32_t len, uint8_t seed)
+{
+	openusb_bulk_request_t req;
+	uint8_t *buf;
+	uint32_t i;
+	int32_t ret;
+
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		return OPENUSB_NO_RESOURCES;
+	for (i = 0; i < len; i++)
+		buf[i] = seed + i;
+
+	memset(&req, 0, sizeof(req));
+	req.payload = buf;
+	req.length = len;
+	req.timeout = 1000;
+	ret = openusb_bulk_xfer(dev, 0, EP_OUT, &req);
+	free(buf);
+
+	return ret;
+}
+
+static int pattern_ok(const uint8_t *data, uint32_t len, uint8_t seed)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		if (data[i] != (uint8_t)(seed + i))
+			return 0;
+
+	return 1;
+}
+
+static void test_stream(void)
+{
+	openusb_bulk_in_t in;
+	openusb_bulk_out_t out;
+	uint8_t data[4096], buf[333];
+	uint32_t i, n, got;
+	int32_t ret;
+
+	ret = openusb_bulk_in_open(dev, 0, EP_IN, 1024, 8, 0, &in);
+	check(ret == OPENUSB_SUCCESS, "bulk_in_open %d", ret);
+	if (ret)
+		return;
+
+	ret = openusb_bulk_in_read(in, buf, sizeof(buf), 50, &n);
+	check(ret == OPENUSB_IO_TIMEOUT && n == 0, "empty read %d %u", ret, n);
+
+	ret = openusb_bulk_out_open(dev, 0, EP_OUT, 0, 0, 1000, 0, &out);
+	check(ret == OPENUSB_SUCCESS, "bulk_out_open %d", ret);
+	if (ret == OPENUSB_SUCCESS) {
+		for (i = 0; i < sizeof(data); i++)
+			data[i] = i;
+		for (i = 0; i < sizeof(data); i += 64) {
+			ret = openusb_bulk_out_write(out, data + i, 64);
+			check(ret == OPENUSB_SUCCESS, "bulk_out_write %d", ret);
+		}
+		ret = openusb_bulk_out_close(out);
+		check(ret == OPENUSB_SUCCESS, "bulk_out_close %d", ret);
+	}
+
+	for (got = 0; got < sizeof(data); got += n) {
+		ret = openusb_bulk_in_read(in, buf, sizeof(buf), 1000, &n);
+		if (ret != OPENUSB_SUCCESS) {
+			check(0, "stream read %d after %u bytes", ret, got);
+			break;
+		}
+		check(pattern_ok(buf, n, got), "stream data at %u", got);
+	}
+
+	ret = openusb_bulk_in_close(in);
+	check(ret == OPENUSB_SUCCESS, "bulk_in_close %d", ret);
+}
+
+/* messages of the given lengths, read with reads of len bytes */
+static void test_messages(uint32_t buf_size, uint32_t num_bufs,
+	const uint32_t *lens, uint32_t count)
+{
+	openusb_bulk_in_t in;
+	uint32_t ring = buf_size * num_bufs;
+	uint32_t i, n, got, len = 2 * 8192;
+	uint8_t *buf;
+	int32_t ret;
+
+	buf = malloc(len);
+	if (!buf)
+		return;
+
+	ret = openusb_bulk_in_open(dev, 0, EP_IN, buf_size, num_bufs,
+		OPENUSB_BULK_IN_MESSAGES, &in);
+	check(ret == OPENUSB_SUCCESS, "bulk_in_open %d", ret);
+	if (ret) {
+		free(buf);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = put(lens[i], i);
+		check(ret == OPENUSB_SUCCESS, "put %u: %d", lens[i], ret);
+
+		/* longer than the ring, comes a ring full at a time */
+		for (got = 0; got < lens[i]; got += n) {
+			ret = openusb_bulk_in_read(in, buf, len, 1000, &n);
+			if (ret != OPENUSB_SUCCESS) {
+				check(0, "message %u of %u: read %d after %u",
+					i, lens[i], ret, got);
+				break;
+			}
+			check(n == ring || got + n == lens[i],
+				"message %u of %u: read %u after %u", i,
+				lens[i], n, got);
+			check(pattern_ok(buf, n, i + got),
+				"message %u data at %u", i, got);
+		}
+	}
+
+	ret = openusb_bulk_in_close(in);
+	check(ret == OPENUSB_SUCCESS, "bulk_in_close %d", ret);
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	static const uint32_t lens[] = { 100, 1000, 50, 4000, 30 };
+	static const uint32_t long_lens[] = { 4096 + 100, 300, 1024 * 3 + 7 };
+	openusb_handle_t lib;
+	openusb_devid_t *devids = NULL;
+	uint32_t num_devids;
+	int32_t ret;
+
+	ret = openusb_init(argc > 1 && !strcmp(argv[1], "-n") ?
+		OPENUSB_INIT_NO_THREADS : 0, &lib);
+	if (ret) {
+		fprintf(stderr, "openusb_init: %s\n", openusb_strerror(ret));
+		return 1;
+	}
+
+	ret = openusb_get_devids_by_vendor(lib, VIRTUAL_VID, -1, &devids,
+		&num_devids);
+	if (ret || !num_devids) {
+		fprintf(stderr, "no virtual device, set OPENUSB_VIRTUAL\n");
+		openusb_fini(lib);
+		return 1;
+	}
+
+	ret = openusb_open_device(lib, devids[0], 0, &dev);
+	if (ret == OPENUSB_SUCCESS)
+		ret = openusb_claim_interface(dev, 0, 0);
+	if (ret) {
+		fprintf(stderr, "open: %s\n", openusb_strerror(ret));
+		openusb_free_devid_list(devids);
+		openusb_fini(lib);
+		return 1;
+	}
+
+	test_stream();
+	test_messages(1024, 4, lens, sizeof(lens) / sizeof(lens[0]));
+	test_messages(512, 2, long_lens,
+		sizeof(long_lens) / sizeof(long_lens[0]));
+
+	openusb_release_interface(dev, 0);
+	openusb_close_device(dev);
+	openusb_free_devid_list(devids);
+	openusb_fini(lib);
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Descriptor decoding microbenchmark
+ *
+ * Builds a large composite configuration descriptor and decodes every
+ * descriptor in it over and over, once with the openusb_parse_data() format
+ * interpreter and once with the fixed layout usbi_decode_*() decoders.
+ *
+ *   descbench [iterations]
+ *
+ * This library is covered by the LGPL, read LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "usbi.h"
+
+#define BENCH_INTERFACES	32
+#define BENCH_ALTSETTINGS	4
+#define BENCH_ENDPOINTS		8
+
+static uint8_t config[65535];
+static uint16_t config_len;
+
+static uint8_t *put_desc(uint8_t *p, uint8_t len, uint8_t type)
+{
+	memset(p, 0, len);
+	p[0] = len;
+	p[1] = type;
+	return p;
+}
+
+/* configuration, then IAD + interface + class specific + endpoints for each
+ * interface and altsetting */
+static void build_config(void)
+{
+	uint8_t *p = config, *d;
+	int i, a, e;
+
+	d = put_desc(p, USBI_CONFIG_DESC_SIZE, USB_DESC_TYPE_CONFIG);
+	d[4] = BENCH_INTERFACES;
+	d[5] = 1;
+	p += USBI_CONFIG_DESC_SIZE;
+
+	for (i = 0; i < BENCH_INTERFACES; i++) {
+		d = put_desc(p, USBI_IAD_DESC_SIZE,
+			USB_DESC_TYPE_INTERFACE_ASSOCIATION);
+		d[2] = i;
+		d[3] = 1;
+		p += USBI_IAD_DESC_SIZE;
+
+		for (a = 0; a < BENCH_ALTSETTINGS; a++) {
+			d = put_desc(p, USBI_INTERFACE_DESC_SIZE,
+				USB_DESC_TYPE_INTERFACE);
+			d[2] = i;
+			d[3] = a;
+			d[4] = BENCH_ENDPOINTS;
+			p += USBI_INTERFACE_DESC_SIZE;
+
+			/* a class specific descriptor */
+			put_desc(p, 5, 0x24);
+			p += 5;
+
+			for (e = 0; e < BENCH_ENDPOINTS; e++) {
+				d = put_desc(p, USBI_ENDPOINT_AUDIO_DESC_SIZE,
+					USB_DESC_TYPE_ENDPOINT);
+				d[2] = (e + 1) | (e & 1 ? USB_ENDPOINT_IN : 0);
+				d[3] = USB_ENDPOINT_TYPE_ISOCHRONOUS;
+				d[4] = 0x00;
+				d[5] = 0x04;
+				d[6] = 1;
+				p += USBI_ENDPOINT_AUDIO_DESC_SIZE;
+			}
+		}
+	}
+
+	config_len = p - config;
+	config[2] = config_len & 0xff;
+	config[3] = config_len >> 8;
+}
+
+static int decode_interpreted(void)
+{
+	usb_config_desc_t cfg;
+	usb_interface_desc_t ifc;
+	usb_endpoint_desc_t ep;
+	usb_interface_association_desc_t iad;
+	uint8_t *p = config;
+	uint32_t left = config_len, count;
+	int n = 0;
+
+	while (left >= 2 && p[0] >= 2 && p[0] <= left) {
+		switch (p[1]) {
+		case USB_DESC_TYPE_CONFIG:
+			openusb_parse_data("bbwbbbbb", p, left, &cfg,
+				sizeof(cfg), &count);
+			break;
+		case USB_DESC_TYPE_INTERFACE:
+			openusb_parse_data("bbbbbbbbb", p, left, &ifc,
+				sizeof(ifc), &count);
+			break;
+		case USB_DESC_TYPE_ENDPOINT:
+			openusb_parse_data("bbbbwbbb", p, left, &ep,
+				sizeof(ep), &count);
+			break;
+		case USB_DESC_TYPE_INTERFACE_ASSOCIATION:
+			openusb_parse_data("bbbbbbbb", p, left, &iad,
+				sizeof(iad), &count);
+			break;
+		}
+		n++;
+		left -= p[0];
+		p += p[0];
+	}
+
+	return n;
+}
+
+static int decode_fixed(void)
+{
+	usb_config_desc_t cfg;
+	usb_interface_desc_t ifc;
+	usb_endpoint_desc_t ep;
+	usb_interface_association_desc_t iad;
+	uint8_t *p = config;
+	uint32_t left = config_len;
+	int n = 0;
+
+	while (left >= 2 && p[0] >= 2 && p[0] <= left) {
+		switch (p[1]) {
+		case USB_DESC_TYPE_CONFIG:
+			usbi_decode_config_desc(p, left, &cfg);
+			break;
+		case USB_DESC_TYPE_INTERFACE:
+			usbi_decode_interface_desc(p, left, &ifc);
+			break;
+		case USB_DESC_TYPE_ENDPOINT:
+			usbi_decode_endpoint_desc(p, left, &ep);
+			break;
+		case USB_DESC_TYPE_INTERFACE_ASSOCIATION:
+			usbi_decode_iad_desc(p, left, &iad);
+			break;
+		}
+		n++;
+		left -= p[0];
+		p += p[0];
+	}
+
+	return n;
+}
+
+static double run(const char *name, int (*decode)(void), int iterations)
+{
+	struct timeval start, end;
+	double secs;
+	long total = 0;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++)
+		total += decode();
+	gettimeofday(&end, NULL);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%-12s %8.3f s  %12.0f descriptors/s\n", name, secs,
+		secs > 0 ? total / secs : 0);
+
+	return secs;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 10000;
+	double interp, fixed;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	build_config();
+	printf("config descriptor: %d bytes, %d descriptors, %d iterations\n",
+		config_len, decode_fixed(), iterations);
+
+	interp = run("interpreter", decode_interpreted, iterations);
+	fixed = run("fixed", decode_fixed, iterations);
+
+	if (fixed > 0)
+		printf("speedup: %.1fx\n", interp / fixed);
+
+	return 0;
+}
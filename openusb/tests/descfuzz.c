@@ -0,0 +1,650 @@
+/*
+ * Descriptor parser benchmark and fuzz harness
+ *
+ * Feeds raw configuration descriptors through every descriptor parsing path
+ * of the library: openusb_parse_data(), the usbi_decode_*() decoders,
+ * usbi_parse_configuration() and, when openusb_init() succeeds, the
+ * interface and endpoint lookups of openusb_parse_interface_desc() and
+ * openusb_parse_endpoint_desc(). It reports the throughput of each path in
+ * descriptors per second and, built with -DDESCFUZZ_COUNT_ALLOCS on glibc,
+ * how many allocations one parse costs.
+ *
+ *   descfuzz [-n iterations] [-w dir] [file...]
+ *
+ * Without files the built-in corpus is used: captures of common composite,
+ * video, audio, HID and hub devices plus hand made malformed ones. -w writes
+ * that corpus to dir, one file per entry, as seeds for a fuzzer.
+ *
+ * Built with -DDESCFUZZ_LIBFUZZER the program provides LLVMFuzzerTestOneInput()
+ * instead of main(), e.g. against a library configured with
+ * CFLAGS="-g -fsanitize=fuzzer-no-link,address":
+ *
+ *   clang -g -fsanitize=fuzzer,address -DDESCFUZZ_LIBFUZZER -I../src \
+ *	descfuzz.c ../src/.libs/libopenusb.so -o descfuzz-libfuzzer
+ *   ./descfuzz-libfuzzer corpus/
+ *
+ * This library is covered by the LGPL, read LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "usbi.h"
+
+/*
+ * Allocation accounting, opt-in with -DDESCFUZZ_COUNT_ALLOCS. With glibc the
+ * allocator entry points are wrapped so that every malloc/calloc/realloc
+ * made by the library while counting is enabled is seen, including the ones
+ * inside libopenusb. The wrappers bypass the allocator of a sanitizer, so
+ * they are left out of ASan and libFuzzer builds, where the harness is of
+ * most use.
+ */
+#if defined(__SANITIZE_ADDRESS__) || defined(DESCFUZZ_LIBFUZZER)
+#undef DESCFUZZ_COUNT_ALLOCS
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#undef DESCFUZZ_COUNT_ALLOCS
+#endif
+#endif
+
+#if defined(DESCFUZZ_COUNT_ALLOCS) && !defined(__GLIBC__)
+#undef DESCFUZZ_COUNT_ALLOCS
+#endif
+
+#ifdef DESCFUZZ_COUNT_ALLOCS
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile int alloc_counting;
+static unsigned long alloc_count;
+
+void *malloc(size_t size)
+{
+	if (alloc_counting)
+		__sync_fetch_and_add(&alloc_count, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (alloc_counting)
+		__sync_fetch_and_add(&alloc_count, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (alloc_counting)
+		__sync_fetch_and_add(&alloc_count, 1);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+/* wTotalLength is patched to the real length at startup */
+#define FIXLEN		0x00, 0x00
+
+/* USB 2.0 multi-TT hub, both altsettings */
+static uint8_t hub_desc[] = {
+	0x09, 0x02, FIXLEN, 0x01, 0x01, 0x00, 0xe0, 0x00,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x09, 0x00, 0x01, 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x01, 0x00, 0x0c,
+	0x09, 0x04, 0x00, 0x01, 0x01, 0x09, 0x00, 0x02, 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x01, 0x00, 0x0c,
+};
+
+/* keyboard and mouse in one receiver */
+static uint8_t hid_desc[] = {
+	0x09, 0x02, FIXLEN, 0x02, 0x01, 0x00, 0xa0, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x01, 0x00,
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x41, 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x08, 0x00, 0x0a,
+	0x09, 0x04, 0x01, 0x00, 0x01, 0x03, 0x01, 0x02, 0x00,
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x9c, 0x00,
+	0x07, 0x05, 0x82, 0x03, 0x08, 0x00, 0x02,
+};
+
+/* CDC ACM behind an IAD plus a mass storage interface */
+static uint8_t composite_desc[] = {
+	0x09, 0x02, FIXLEN, 0x03, 0x01, 0x00, 0x80, 0xfa,
+	0x08, 0x0b, 0x00, 0x02, 0x02, 0x02, 0x01, 0x00,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x02, 0x02, 0x01, 0x00,
+	0x05, 0x24, 0x00, 0x10, 0x01,
+	0x05, 0x24, 0x01, 0x00, 0x01,
+	0x04, 0x24, 0x02, 0x02,
+	0x05, 0x24, 0x06, 0x00, 0x01,
+	0x07, 0x05, 0x83, 0x03, 0x10, 0x00, 0x09,
+	0x09, 0x04, 0x01, 0x00, 0x02, 0x0a, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x02, 0x02, 0x00, 0x02, 0x00,
+	0x07, 0x05, 0x82, 0x02, 0x00, 0x02, 0x00,
+	0x09, 0x04, 0x02, 0x00, 0x02, 0x08, 0x06, 0x50, 0x00,
+	0x07, 0x05, 0x84, 0x02, 0x00, 0x02, 0x00,
+	0x07, 0x05, 0x05, 0x02, 0x00, 0x02, 0x00,
+};
+
+/* UVC webcam, one MJPEG format and three isochronous altsettings */
+static uint8_t uvc_desc[] = {
+	0x09, 0x02, FIXLEN, 0x02, 0x01, 0x00, 0x80, 0xfa,
+	0x08, 0x0b, 0x00, 0x02, 0x0e, 0x03, 0x00, 0x02,
+	/* video control */
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x0e, 0x01, 0x00, 0x02,
+	0x0d, 0x24, 0x01, 0x00, 0x01, 0x4d, 0x00, 0x80, 0xc3, 0xc9, 0x01,
+	0x01, 0x01,
+	0x12, 0x24, 0x02, 0x01, 0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x03, 0x0e, 0x00, 0x00,
+	0x0b, 0x24, 0x05, 0x02, 0x01, 0x00, 0x00, 0x02, 0x7f, 0x15, 0x00,
+	0x09, 0x24, 0x03, 0x03, 0x01, 0x01, 0x00, 0x02, 0x00,
+	0x07, 0x05, 0x83, 0x03, 0x10, 0x00, 0x06,
+	0x05, 0x25, 0x03, 0x10, 0x00,
+	/* video streaming */
+	0x09, 0x04, 0x01, 0x00, 0x00, 0x0e, 0x02, 0x00, 0x00,
+	0x0e, 0x24, 0x01, 0x01, 0x4f, 0x00, 0x81, 0x00, 0x03, 0x02, 0x01,
+	0x00, 0x01, 0x00,
+	0x0b, 0x24, 0x06, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x1e, 0x24, 0x07, 0x01, 0x00, 0x80, 0x02, 0xe0, 0x01, 0x00, 0x00,
+	0x77, 0x01, 0x00, 0x00, 0xca, 0x08, 0x00, 0x60, 0x09, 0x00, 0x15,
+	0x16, 0x05, 0x00, 0x01, 0x15, 0x16, 0x05, 0x00,
+	0x06, 0x24, 0x0d, 0x01, 0x01, 0x04,
+	0x09, 0x04, 0x01, 0x01, 0x01, 0x0e, 0x02, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x05, 0x80, 0x00, 0x01,
+	0x09, 0x04, 0x01, 0x02, 0x01, 0x0e, 0x02, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x05, 0x00, 0x0b, 0x01,
+	0x09, 0x04, 0x01, 0x03, 0x01, 0x0e, 0x02, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x05, 0x00, 0x14, 0x01,
+};
+
+/* USB audio class 1 speaker with 9 byte audio endpoints */
+static uint8_t audio_desc[] = {
+	0x09, 0x02, FIXLEN, 0x02, 0x01, 0x00, 0x80, 0x32,
+	/* audio control */
+	0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+	0x09, 0x24, 0x01, 0x00, 0x01, 0x27, 0x00, 0x01, 0x01,
+	0x0c, 0x24, 0x02, 0x01, 0x01, 0x01, 0x00, 0x02, 0x03, 0x00, 0x00,
+	0x00,
+	0x0a, 0x24, 0x06, 0x02, 0x01, 0x01, 0x01, 0x02, 0x02, 0x00,
+	0x09, 0x24, 0x03, 0x03, 0x01, 0x03, 0x00, 0x02, 0x00,
+	/* audio streaming */
+	0x09, 0x04, 0x01, 0x00, 0x00, 0x01, 0x02, 0x00, 0x00,
+	0x09, 0x04, 0x01, 0x01, 0x01, 0x01, 0x02, 0x00, 0x00,
+	0x07, 0x24, 0x01, 0x01, 0x01, 0x01, 0x00,
+	0x0b, 0x24, 0x02, 0x01, 0x02, 0x02, 0x10, 0x01, 0x44, 0xac, 0x00,
+	0x09, 0x05, 0x01, 0x09, 0xc8, 0x00, 0x01, 0x00, 0x00,
+	0x07, 0x25, 0x01, 0x01, 0x00, 0x00, 0x00,
+};
+
+/* zero length descriptor after the first interface */
+static uint8_t zero_len_desc[] = {
+	0x09, 0x02, FIXLEN, 0x02, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x00, 0x24, 0x01, 0x02,
+	0x07, 0x05, 0x81, 0x02, 0x00, 0x02, 0x00,
+};
+
+/* last descriptor claims more bytes than there are */
+static uint8_t overrun_desc[] = {
+	0x09, 0x02, FIXLEN, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x28, 0x24, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+};
+
+/* wTotalLength larger than the data that came back */
+static uint8_t short_total_desc[] = {
+	0x09, 0x02, 0x00, 0x04, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x02, 0x00, 0x02, 0x00,
+};
+
+/* more interfaces and endpoints announced than present */
+static uint8_t counts_desc[] = {
+	0x09, 0x02, FIXLEN, 0xff, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0xc8, 0xff, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x02, 0x00, 0x02, 0x00,
+	0x09, 0x04, 0x01, 0x00, 0x1f, 0xff, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x82, 0x02, 0x00, 0x02, 0x00,
+};
+
+/* interface and endpoint descriptors shorter than their layout */
+static uint8_t short_fields_desc[] = {
+	0x09, 0x02, FIXLEN, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x04, 0x04, 0x00, 0x00,
+	0x09, 0x04, 0x00, 0x01, 0x02, 0xff, 0x00, 0x00, 0x00,
+	0x02, 0x05,
+	0x05, 0x05, 0x81, 0x02, 0x00,
+	0x07, 0x05, 0x01, 0x02, 0x00, 0x02, 0x00,
+};
+
+/* altsettings of one interface split by another interface */
+static uint8_t split_alts_desc[] = {
+	0x09, 0x02, FIXLEN, 0x02, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00,
+	0x09, 0x04, 0x01, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00,
+	0x09, 0x04, 0x00, 0x01, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x01, 0x00, 0x01, 0x01,
+	0x09, 0x04, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00,
+	0x09, 0x04, 0x01, 0x01, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x02, 0x01, 0x00, 0x01, 0x01,
+};
+
+/* cut off in the middle of the configuration descriptor */
+static uint8_t truncated_desc[] = {
+	0x09, 0x02, 0x19, 0x00, 0x01,
+};
+
+struct corpus_entry {
+	const char *name;
+	uint8_t *data;
+	uint32_t len;
+	int fixlen;
+};
+
+#define ENTRY(name, data, fixlen) { name, data, sizeof(data), fixlen }
+
+static struct corpus_entry builtin_corpus[] = {
+	ENTRY("hub", hub_desc, 1),
+	ENTRY("hid", hid_desc, 1),
+	ENTRY("composite", composite_desc, 1),
+	ENTRY("uvc", uvc_desc, 1),
+	ENTRY("audio", audio_desc, 1),
+	ENTRY("zero-length", zero_len_desc, 1),
+	ENTRY("overrun", overrun_desc, 1),
+	ENTRY("short-total", short_total_desc, 0),
+	ENTRY("counts", counts_desc, 1),
+	ENTRY("short-fields", short_fields_desc, 1),
+	ENTRY("split-alts", split_alts_desc, 1),
+	ENTRY("truncated", truncated_desc, 0),
+};
+
+#define BUILTIN_CORPUS_SIZE \
+	(sizeof(builtin_corpus) / sizeof(builtin_corpus[0]))
+
+/* handle for the public parsers, 0 if openusb_init() failed */
+static openusb_handle_t libhandle;
+
+/* openusb_parse_data() over every descriptor, returns how many there were */
+static int parse_interpreted(uint8_t *buf, uint32_t len)
+{
+	usb_device_desc_t dev;
+	usb_config_desc_t cfg;
+	usb_interface_desc_t ifc;
+	usb_endpoint_desc_t ep;
+	usb_interface_association_desc_t iad;
+	uint32_t count;
+	int n = 0;
+
+	while (len >= USBI_DESC_HEADER_SIZE && buf[0] >= USBI_DESC_HEADER_SIZE &&
+		buf[0] <= len) {
+		switch (buf[1]) {
+		case USB_DESC_TYPE_DEVICE:
+			openusb_parse_data("bbwbbbbwwwbbbb", buf, len, &dev,
+				sizeof(dev), &count);
+			break;
+		case USB_DESC_TYPE_CONFIG:
+			openusb_parse_data("bbwbbbbb", buf, len, &cfg,
+				sizeof(cfg), &count);
+			break;
+		case USB_DESC_TYPE_INTERFACE:
+			openusb_parse_data("bbbbbbbbb", buf, len, &ifc,
+				sizeof(ifc), &count);
+			break;
+		case USB_DESC_TYPE_ENDPOINT:
+			openusb_parse_data("bbbbwbbb", buf, len, &ep,
+				sizeof(ep), &count);
+			break;
+		case USB_DESC_TYPE_INTERFACE_ASSOCIATION:
+			openusb_parse_data("bbbbbbbb", buf, len, &iad,
+				sizeof(iad), &count);
+			break;
+		}
+		n++;
+		len -= buf[0];
+		buf += buf[0];
+	}
+
+	return n;
+}
+
+/* the fixed layout decoders over every descriptor */
+static int parse_fixed(uint8_t *buf, uint32_t len)
+{
+	usb_device_desc_t dev;
+	usb_config_desc_t cfg;
+	usb_interface_desc_t ifc;
+	usb_endpoint_desc_t ep;
+	usb_interface_association_desc_t iad;
+	int n = 0;
+
+	while (len >= USBI_DESC_HEADER_SIZE && buf[0] >= USBI_DESC_HEADER_SIZE &&
+		buf[0] <= len) {
+		switch (buf[1]) {
+		case USB_DESC_TYPE_DEVICE:
+			usbi_decode_device_desc(buf, len, &dev);
+			break;
+		case USB_DESC_TYPE_CONFIG:
+			usbi_decode_config_desc(buf, len, &cfg);
+			break;
+		case USB_DESC_TYPE_INTERFACE:
+			usbi_decode_interface_desc(buf, len, &ifc);
+			break;
+		case USB_DESC_TYPE_ENDPOINT:
+			usbi_decode_endpoint_desc(buf, len, &ep);
+			break;
+		case USB_DESC_TYPE_INTERFACE_ASSOCIATION:
+			usbi_decode_iad_desc(buf, len, &iad);
+			break;
+		}
+		n++;
+		len -= buf[0];
+		buf += buf[0];
+	}
+
+	return n;
+}
+
+/* the configuration tree the library builds when it opens a device */
+static int parse_tree(uint8_t *buf, uint32_t len)
+{
+	struct usbi_config cfg;
+	int ret;
+
+	memset(&cfg, 0, sizeof(cfg));
+	ret = usbi_parse_configuration(&cfg, buf, len);
+	free(cfg.arena);
+
+	return ret;
+}
+
+/* look every interface and endpoint up through the public API */
+static int parse_lookup(uint8_t *buf, uint32_t len)
+{
+	usb_interface_desc_t ifc;
+	usb_endpoint_desc_t ep;
+	uint8_t *p = buf;
+	uint32_t left;
+	int e, n = 0;
+
+	if (!libhandle)
+		return 0;
+
+	if (len > 0xffff)
+		len = 0xffff;
+
+	left = len;
+	while (left >= USBI_INTERFACE_DESC_SIZE && p[0] >= USBI_DESC_HEADER_SIZE &&
+		p[0] <= left) {
+		if (p[1] == USB_DESC_TYPE_INTERFACE) {
+			if (openusb_parse_interface_desc(libhandle, 0, buf, len,
+				0, p[2], p[3], &ifc) == OPENUSB_SUCCESS)
+				n++;
+
+			for (e = 0; e < p[4]; e++) {
+				if (openusb_parse_endpoint_desc(libhandle, 0,
+					buf, len, 0, p[2], p[3], e, &ep) ==
+					OPENUSB_SUCCESS)
+					n++;
+			}
+		}
+		left -= p[0];
+		p += p[0];
+	}
+
+	return n;
+}
+
+#ifdef DESCFUZZ_LIBFUZZER
+
+static void parse_all(uint8_t *buf, uint32_t len)
+{
+	parse_interpreted(buf, len);
+	parse_fixed(buf, len);
+	parse_tree(buf, len);
+	parse_lookup(buf, len);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static int inited;
+	uint8_t *buf;
+
+	if (!inited) {
+		if (openusb_init(0, &libhandle) != OPENUSB_SUCCESS)
+			libhandle = 0;
+		inited = 1;
+	}
+
+	/* private copy so overreads show up right after the input */
+	buf = malloc(size ? size : 1);
+	if (!buf)
+		return 0;
+	memcpy(buf, data, size);
+
+	parse_all(buf, size);
+
+	free(buf);
+
+	return 0;
+}
+
+#else
+
+struct path {
+	const char *name;
+	int (*parse)(uint8_t *buf, uint32_t len);
+	double secs;
+	unsigned long descs;
+	unsigned long allocs;
+	unsigned long parses;
+};
+
+static struct path paths[] = {
+	{ "parse_data", parse_interpreted },
+	{ "decode", parse_fixed },
+	{ "config tree", parse_tree },
+	{ "lookup", parse_lookup },
+};
+
+#define NUM_PATHS	(sizeof(paths) / sizeof(paths[0]))
+
+static double elapsed(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void bench_entry(const char *name, uint8_t *buf, uint32_t len,
+	int iterations)
+{
+	struct timeval start, end;
+	unsigned long allocs;
+	int descs, ret, i, p;
+
+	descs = parse_fixed(buf, len);
+	ret = parse_tree(buf, len);
+
+	printf("%-16s %6u bytes %5d descriptors  config tree %s",
+		name, len, descs, ret < 0 ? "rejected" : "parsed");
+
+	for (p = 0; p < NUM_PATHS; p++) {
+		if (paths[p].parse == parse_lookup && !libhandle)
+			continue;
+
+		allocs = 0;
+#ifdef DESCFUZZ_COUNT_ALLOCS
+		alloc_count = 0;
+		alloc_counting = 1;
+#endif
+		gettimeofday(&start, NULL);
+		for (i = 0; i < iterations; i++)
+			paths[p].parse(buf, len);
+		gettimeofday(&end, NULL);
+#ifdef DESCFUZZ_COUNT_ALLOCS
+		alloc_counting = 0;
+		allocs = alloc_count;
+#endif
+
+		paths[p].secs += elapsed(&start, &end);
+		paths[p].descs += (unsigned long)descs * iterations;
+		paths[p].allocs += allocs;
+		paths[p].parses += iterations;
+
+#ifdef DESCFUZZ_COUNT_ALLOCS
+		if (paths[p].parse == parse_tree)
+			printf(", %.1f allocations",
+				(double)allocs / iterations);
+#endif
+	}
+	printf("\n");
+}
+
+static void report(void)
+{
+	int p;
+
+	printf("\n%-12s %14s %18s\n", "path", "descriptors/s",
+		"allocations/parse");
+	for (p = 0; p < NUM_PATHS; p++) {
+		if (!paths[p].parses)
+			continue;
+
+		printf("%-12s %14.0f", paths[p].name, paths[p].secs > 0 ?
+			paths[p].descs / paths[p].secs : 0);
+#ifdef DESCFUZZ_COUNT_ALLOCS
+		printf(" %18.2f\n", (double)paths[p].allocs / paths[p].parses);
+#else
+		printf(" %18s\n", "n/a");
+#endif
+	}
+}
+
+static int write_corpus(const char *dir)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < BUILTIN_CORPUS_SIZE; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir,
+			builtin_corpus[i].name);
+
+		fp = fopen(path, "wb");
+		if (!fp) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			return -1;
+		}
+
+		fwrite(builtin_corpus[i].data, 1, builtin_corpus[i].len, fp);
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+static uint8_t *read_file(const char *path, uint32_t *len)
+{
+	uint8_t *buf;
+	FILE *fp;
+	long size;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	buf = malloc(size > 0 ? size : 1);
+	if (buf && size > 0 && fread(buf, 1, size, fp) != size) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fp);
+
+	*len = size;
+
+	return buf;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *corpus_dir = NULL;
+	int iterations = 100000;
+	uint8_t *buf;
+	uint32_t len;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "n:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'w':
+			corpus_dir = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-w dir] "
+				"[file...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (iterations <= 0) {
+		fprintf(stderr, "iterations must be positive\n");
+		return 1;
+	}
+
+	for (i = 0; i < BUILTIN_CORPUS_SIZE; i++) {
+		if (builtin_corpus[i].fixlen) {
+			builtin_corpus[i].data[2] = builtin_corpus[i].len & 0xff;
+			builtin_corpus[i].data[3] = builtin_corpus[i].len >> 8;
+		}
+	}
+
+	if (corpus_dir)
+		return write_corpus(corpus_dir) ? 1 : 0;
+
+	if (openusb_init(0, &libhandle) != OPENUSB_SUCCESS) {
+		printf("openusb_init failed, skipping the public lookups\n");
+		libhandle = 0;
+	}
+
+	printf("%d iterations per entry\n", iterations);
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			buf = read_file(argv[i], &len);
+			if (!buf)
+				continue;
+
+			bench_entry(argv[i], buf, len, iterations);
+			free(buf);
+		}
+	} else {
+		for (i = 0; i < BUILTIN_CORPUS_SIZE; i++)
+			bench_entry(builtin_corpus[i].name,
+				builtin_corpus[i].data, builtin_corpus[i].len,
+				iterations);
+	}
+
+	report();
+
+	if (libhandle)
+		openusb_fini(libhandle);
+
+	return 0;
+}
+
+#endif
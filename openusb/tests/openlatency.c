@@ -0,0 +1,151 @@
+/*
+ * OpenUSB device open/close latency benchmark
+ *
+ * Opens and closes every device on the system (or the one given with -d) a
+ * number of times and reports how long openusb_open_device() and
+ * openusb_close_device() take. Run it before and after changes to the open
+ * path to compare.
+ *
+ *   openlatency [-n iterations] [-d devid]
+ *
+ * This library is covered by the LGPL, read LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <openusb.h>
+
+struct latency {
+	double total;
+	double min;
+	double max;
+	uint32_t count;
+};
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0 +
+		(end->tv_usec - start->tv_usec);
+}
+
+static void latency_add(struct latency *lat, double us)
+{
+	if (lat->count == 0 || us < lat->min)
+		lat->min = us;
+	if (us > lat->max)
+		lat->max = us;
+	lat->total += us;
+	lat->count++;
+}
+
+static void latency_print(const char *what, struct latency *lat)
+{
+	if (lat->count == 0) {
+		printf("  %-6s no samples\n", what);
+		return;
+	}
+
+	printf("  %-6s avg %10.1f us  min %10.1f us  max %10.1f us  (%u)\n",
+		what, lat->total / lat->count, lat->min, lat->max, lat->count);
+}
+
+static int bench_device(openusb_handle_t libhandle, openusb_devid_t devid,
+	int iterations)
+{
+	struct latency open_lat, close_lat;
+	struct timeval start, end;
+	openusb_dev_handle_t dev;
+	int i, ret;
+
+	memset(&open_lat, 0, sizeof(open_lat));
+	memset(&close_lat, 0, sizeof(close_lat));
+
+	for (i = 0; i < iterations; i++) {
+		gettimeofday(&start, NULL);
+		ret = openusb_open_device(libhandle, devid, USB_INIT_DEFAULT, &dev);
+		gettimeofday(&end, NULL);
+		if (ret != OPENUSB_SUCCESS) {
+			printf("device %llx: open failed: %s\n",
+				(unsigned long long)devid, openusb_strerror(ret));
+			return ret;
+		}
+		latency_add(&open_lat, elapsed_us(&start, &end));
+
+		gettimeofday(&start, NULL);
+		ret = openusb_close_device(dev);
+		gettimeofday(&end, NULL);
+		if (ret != OPENUSB_SUCCESS) {
+			printf("device %llx: close failed: %s\n",
+				(unsigned long long)devid, openusb_strerror(ret));
+			return ret;
+		}
+		latency_add(&close_lat, elapsed_us(&start, &end));
+	}
+
+	printf("device %llx:\n", (unsigned long long)devid);
+	latency_print("open", &open_lat);
+	latency_print("close", &close_lat);
+
+	return OPENUSB_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	openusb_handle_t libhandle;
+	openusb_devid_t *devids = NULL;
+	openusb_devid_t devid = 0;
+	uint32_t num_devids = 0, i;
+	int iterations = 1000;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "n:d:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'd':
+			devid = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-d devid]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (iterations <= 0) {
+		fprintf(stderr, "iterations must be positive\n");
+		return 1;
+	}
+
+	ret = openusb_init(0, &libhandle);
+	if (ret != OPENUSB_SUCCESS) {
+		printf("openusb_init failed: %s\n", openusb_strerror(ret));
+		return 1;
+	}
+
+	if (devid) {
+		bench_device(libhandle, devid, iterations);
+	} else {
+		ret = openusb_get_devids_by_bus(libhandle, 0, &devids, &num_devids);
+		if (ret != OPENUSB_SUCCESS) {
+			printf("no devices found: %s\n", openusb_strerror(ret));
+			openusb_fini(libhandle);
+			return 1;
+		}
+
+		for (i = 0; i < num_devids; i++) {
+			bench_device(libhandle, devids[i], iterations);
+		}
+
+		openusb_free_devid_list(devids);
+	}
+
+	openusb_fini(libhandle);
+
+	return 0;
+}